@@ -0,0 +1,333 @@
+/**********************************************************************
+  Module: aio.c
+  Author: Junseok Lee
+
+ Asynchronous I/O engines: io_uring through raw system calls, and a
+ thread pool doing pread and pwrite.
+
+**********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "aio.h"
+
+static uint32_t depthSetting = AIO_DEFAULT_DEPTH;
+
+static pthread_once_t threadKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t threadKey;
+
+void aioSetDepth(uint32_t depth){
+
+	if(depth < 1) depth = 1;
+	if(depth > AIO_MAX_DEPTH) depth = AIO_MAX_DEPTH;
+	depthSetting = depth;
+}
+
+uint32_t aioDepth(void){
+
+	return depthSetting;
+}
+
+/* Maps the rings of a new io_uring instance with room for a->depth
+   requests. Returns 0, or -1 if the kernel has no io_uring. */
+static int uringOpen(fat32Aio * a){
+
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	a->ringFd = (int) syscall(__NR_io_uring_setup, a->depth, &p);
+	if(a->ringFd < 0) return -1;
+
+	a->sqMapLen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	a->cqMapLen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+	/* newer kernels map both rings with one mmap */
+	if(p.features & IORING_FEAT_SINGLE_MMAP){
+		if(a->cqMapLen > a->sqMapLen) a->sqMapLen = a->cqMapLen;
+		a->cqMapLen = a->sqMapLen;
+	}
+
+	a->sqMap = mmap(NULL, a->sqMapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, a->ringFd, IORING_OFF_SQ_RING);
+	if(a->sqMap == MAP_FAILED){
+		close(a->ringFd);
+		return -1;
+	}
+
+	a->cqMap = a->sqMap;
+	if(!(p.features & IORING_FEAT_SINGLE_MMAP)){
+		a->cqMap = mmap(NULL, a->cqMapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, a->ringFd, IORING_OFF_CQ_RING);
+	}
+
+	a->sqesLen = p.sq_entries * sizeof(struct io_uring_sqe);
+	a->sqes = mmap(NULL, a->sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, a->ringFd, IORING_OFF_SQES);
+
+	if(a->cqMap == MAP_FAILED || a->sqes == MAP_FAILED){
+		perror("aioOpen mmap error");
+		exit(EXIT_FAILURE);
+	}
+
+	a->sqTail = (unsigned*) (a->sqMap + p.sq_off.tail);
+	a->sqMask = (unsigned*) (a->sqMap + p.sq_off.ring_mask);
+	a->sqArray = (unsigned*) (a->sqMap + p.sq_off.array);
+	a->cqHead = (unsigned*) (a->cqMap + p.cq_off.head);
+	a->cqTail = (unsigned*) (a->cqMap + p.cq_off.tail);
+	a->cqMask = (unsigned*) (a->cqMap + p.cq_off.ring_mask);
+	a->cqes = (struct io_uring_cqe*) (a->cqMap + p.cq_off.cqes);
+	return 0;
+}
+
+/* Puts what is left of request tag on the submission ring. Never
+   more than depth requests are in flight, so the ring has room. */
+static void uringQueue(fat32Aio * a, uint32_t tag){
+
+	fat32AioReq * req = &a->reqs[tag];
+	unsigned tail = *a->sqTail;
+	unsigned idx = tail & *a->sqMask;
+	struct io_uring_sqe * sqe = &a->sqes[idx];
+
+	/* READV and WRITEV go back to the first io_uring kernels */
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = req->fd;
+	sqe->addr = (uint64_t) (uintptr_t) &req->iov;
+	sqe->len = 1;
+	sqe->off = req->offset;
+	sqe->user_data = tag;
+
+	a->sqArray[idx] = idx;
+	__atomic_store_n(a->sqTail, tail + 1, __ATOMIC_RELEASE);
+	a->toSubmit++;
+}
+
+/* Accounts for res bytes transferred by request tag. Returns 1 once
+   the request is complete, 0 if the rest was queued again. */
+static int reqProgress(fat32AioReq * req, int64_t res){
+
+	if(res < 0){
+		if(res == -EINTR || res == -EAGAIN) return 0;
+		req->err = (int) -res;
+		return 1;
+	}
+
+	/* zero bytes is the end of the file */
+	if(res == 0) return 1;
+
+	req->done += res;
+	req->offset += res;
+	req->iov.iov_base = (char*) req->iov.iov_base + res;
+	req->iov.iov_len -= res;
+	return req->iov.iov_len == 0;
+}
+
+static uint32_t uringWait(fat32Aio * a){
+
+	for(;;){
+		unsigned head = *a->cqHead;
+
+		if(head != __atomic_load_n(a->cqTail, __ATOMIC_ACQUIRE)){
+			struct io_uring_cqe * cqe = &a->cqes[head & *a->cqMask];
+			uint32_t tag = (uint32_t) cqe->user_data;
+			int64_t res = cqe->res;
+
+			__atomic_store_n(a->cqHead, head + 1, __ATOMIC_RELEASE);
+
+			if(reqProgress(&a->reqs[tag], res)) return tag;
+			uringQueue(a, tag);
+			continue;
+		}
+
+		/* one system call hands over every queued request and waits */
+		int ret = (int) syscall(__NR_io_uring_enter, a->ringFd, a->toSubmit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if(ret < 0){
+			if(errno == EINTR) continue;
+			perror("aioWait io_uring_enter error");
+			exit(EXIT_FAILURE);
+		}
+		a->toSubmit -= (uint32_t) ret;
+	}
+}
+
+/* Pool thread, transfers queued requests with pread and pwrite */
+static void * poolThread(void * arg){
+
+	fat32Aio * a = (fat32Aio*) arg;
+
+	pthread_mutex_lock(&a->lock);
+	for(;;){
+		while(!a->stop && a->pendLen == 0) pthread_cond_wait(&a->work, &a->lock);
+		if(a->pendLen == 0) break;
+
+		uint32_t tag = a->pending[a->pendHead];
+		a->pendHead = (a->pendHead + 1) % a->depth;
+		a->pendLen--;
+		pthread_mutex_unlock(&a->lock);
+
+		fat32AioReq * req = &a->reqs[tag];
+		ssize_t res;
+		do{
+			if(req->write) res = pwrite(req->fd, req->iov.iov_base, req->iov.iov_len, req->offset);
+			else res = pread(req->fd, req->iov.iov_base, req->iov.iov_len, req->offset);
+		}while(!reqProgress(req, res < 0 ? -errno : res));
+
+		pthread_mutex_lock(&a->lock);
+		a->complete[(a->compHead + a->compLen) % a->depth] = tag;
+		a->compLen++;
+		pthread_cond_signal(&a->finished);
+	}
+	pthread_mutex_unlock(&a->lock);
+
+	return NULL;
+}
+
+static void poolOpen(fat32Aio * a){
+
+	uint32_t i;
+
+	a->numThreads = a->depth < AIO_POOL_MAX_THREADS ? a->depth : AIO_POOL_MAX_THREADS;
+	a->threads = (pthread_t*) calloc(a->numThreads, sizeof(pthread_t));
+	a->pending = (uint32_t*) calloc(a->depth, sizeof(uint32_t));
+	a->complete = (uint32_t*) calloc(a->depth, sizeof(uint32_t));
+	if(a->threads == NULL || a->pending == NULL || a->complete == NULL){
+		perror("aioOpen malloc error");
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_mutex_init(&a->lock, NULL);
+	pthread_cond_init(&a->work, NULL);
+	pthread_cond_init(&a->finished, NULL);
+
+	for(i = 0; i < a->numThreads; i++){
+		if(pthread_create(&a->threads[i], NULL, poolThread, a) != 0){
+			perror("aioOpen thread error");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static uint32_t poolWait(fat32Aio * a){
+
+	pthread_mutex_lock(&a->lock);
+	while(a->compLen == 0) pthread_cond_wait(&a->finished, &a->lock);
+
+	uint32_t tag = a->complete[a->compHead];
+	a->compHead = (a->compHead + 1) % a->depth;
+	a->compLen--;
+	pthread_mutex_unlock(&a->lock);
+
+	return tag;
+}
+
+fat32Aio * aioOpen(uint32_t depth, int engine){
+
+	fat32Aio * a = (fat32Aio*) calloc(1, sizeof(fat32Aio));
+
+	if(depth < 1) depth = 1;
+	if(depth > AIO_MAX_DEPTH) depth = AIO_MAX_DEPTH;
+
+	if(a == NULL || (a->reqs = (fat32AioReq*) calloc(depth, sizeof(fat32AioReq))) == NULL){
+		perror("aioOpen malloc error");
+		exit(EXIT_FAILURE);
+	}
+	a->depth = depth;
+	a->engine = engine;
+
+	/* kernels without io_uring, or sandboxes that block it */
+	if(engine == AIO_URING && uringOpen(a) != 0) a->engine = AIO_POOL;
+	if(a->engine == AIO_POOL) poolOpen(a);
+
+	return a;
+}
+
+/* Closes the engine of a thread that exits */
+static void threadEngineFree(void * a){
+
+	aioClose((fat32Aio*) a);
+}
+
+static void threadKeyInit(void){
+
+	pthread_key_create(&threadKey, threadEngineFree);
+}
+
+fat32Aio * aioThread(void){
+
+	pthread_once(&threadKeyOnce, threadKeyInit);
+
+	fat32Aio * a = (fat32Aio*) pthread_getspecific(threadKey);
+	if(a == NULL){
+		a = aioOpen(depthSetting, AIO_URING);
+		pthread_setspecific(threadKey, a);
+	}
+	return a;
+}
+
+void aioSubmit(fat32Aio * a, uint32_t tag, int fd, int write, void * buf, uint64_t len, uint64_t offset){
+
+	fat32AioReq * req = &a->reqs[tag];
+
+	req->fd = fd;
+	req->write = write;
+	req->iov.iov_base = buf;
+	req->iov.iov_len = len;
+	req->offset = offset;
+	req->done = 0;
+	req->err = 0;
+
+	if(a->engine == AIO_URING){
+		uringQueue(a, tag);
+		return;
+	}
+
+	pthread_mutex_lock(&a->lock);
+	a->pending[(a->pendHead + a->pendLen) % a->depth] = tag;
+	a->pendLen++;
+	pthread_cond_signal(&a->work);
+	pthread_mutex_unlock(&a->lock);
+}
+
+uint32_t aioWait(fat32Aio * a){
+
+	if(a->engine == AIO_URING) return uringWait(a);
+	return poolWait(a);
+}
+
+const char * aioEngineName(const fat32Aio * a){
+
+	return a->engine == AIO_URING ? "io_uring" : "thread pool";
+}
+
+void aioClose(fat32Aio * a){
+
+	uint32_t i;
+
+	if(a == NULL) return;
+
+	if(a->engine == AIO_URING){
+		if(a->cqMap != a->sqMap) munmap(a->cqMap, a->cqMapLen);
+		munmap(a->sqMap, a->sqMapLen);
+		munmap(a->sqes, a->sqesLen);
+		close(a->ringFd);
+	}
+	else{
+		pthread_mutex_lock(&a->lock);
+		a->stop = 1;
+		pthread_cond_broadcast(&a->work);
+		pthread_mutex_unlock(&a->lock);
+
+		for(i = 0; i < a->numThreads; i++) pthread_join(a->threads[i], NULL);
+
+		pthread_mutex_destroy(&a->lock);
+		pthread_cond_destroy(&a->work);
+		pthread_cond_destroy(&a->finished);
+		free(a->threads);
+		free(a->pending);
+		free(a->complete);
+	}
+
+	free(a->reqs);
+	free(a);
+}
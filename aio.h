@@ -0,0 +1,113 @@
+/**********************************************************************
+  Module: aio.h
+  Author: Junseok Lee
+
+  Purpose: Asynchronous reads and writes with many requests in
+  flight, so that GET and the FAT scan keep a queue of requests at
+  the device instead of waiting for one read at a time. Requests go
+  through io_uring, set up with raw system calls, and through a
+  small pool of threads doing pread and pwrite where io_uring is not
+  available. Every thread uses an engine of its own.
+
+**********************************************************************/
+#ifndef AIO_H
+#define AIO_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/* aio constants */
+#define AIO_MAX_DEPTH 256
+#define AIO_DEFAULT_DEPTH 32
+#define AIO_POOL_MAX_THREADS 16
+
+/* engines */
+#define AIO_URING 0
+#define AIO_POOL 1
+
+/* Async request struct,
+   one read or write, resubmitted until it is complete */
+struct fat32AioReq_struct {
+	int fd;
+	int write; //1 for a write, 0 for a read
+	struct iovec iov; //what is left to transfer
+	uint64_t offset; //file offset of the next byte
+	uint64_t done; //bytes transferred so far
+	int err; //errno of a failed request, 0 otherwise
+};
+typedef struct fat32AioReq_struct fat32AioReq;
+
+/* Async engine struct,
+   the queue of one thread, with up to depth requests in flight */
+struct fat32Aio_struct {
+	int engine; //AIO_URING or AIO_POOL
+	uint32_t depth;
+	fat32AioReq * reqs; //one per tag
+
+	/* io_uring rings, shared with the kernel */
+	int ringFd;
+	unsigned char * sqMap;
+	size_t sqMapLen;
+	unsigned char * cqMap; //same as sqMap if the kernel maps both rings at once
+	size_t cqMapLen;
+	struct io_uring_sqe * sqes;
+	size_t sqesLen;
+	unsigned * sqTail;
+	unsigned * sqMask;
+	unsigned * sqArray;
+	unsigned * cqHead;
+	unsigned * cqTail;
+	unsigned * cqMask;
+	struct io_uring_cqe * cqes;
+	uint32_t toSubmit; //entries queued since the last io_uring_enter
+
+	/* thread pool */
+	pthread_t * threads;
+	uint32_t numThreads;
+	pthread_mutex_t lock;
+	pthread_cond_t work; //signalled when a request is queued
+	pthread_cond_t finished; //signalled when a request completes
+	uint32_t * pending; //tags waiting for a thread, a ring of depth entries
+	uint32_t pendHead;
+	uint32_t pendLen;
+	uint32_t * complete; //tags completed, a ring of depth entries
+	uint32_t compHead;
+	uint32_t compLen;
+	int stop;
+};
+typedef struct fat32Aio_struct fat32Aio;
+
+/* Sets the queue depth of engines opened from now on, clamped
+   to 1..AIO_MAX_DEPTH */
+void aioSetDepth(uint32_t depth);
+
+/* Returns the configured queue depth */
+uint32_t aioDepth(void);
+
+/* Opens an engine with room for depth requests. AIO_URING falls
+   back to AIO_POOL if the kernel has no io_uring. Free with aioClose. */
+fat32Aio * aioOpen(uint32_t depth, int engine);
+
+/* Returns the calling thread's engine, opened with aioDepth() on
+   first use and closed when the thread exits */
+fat32Aio * aioThread(void);
+
+/* Queues a read (write 0) or write (write 1) of len bytes at offset
+   of fd into or from buf under tag, which must be below the depth and
+   not in flight. Requests are handed to the kernel by aioWait. */
+void aioSubmit(fat32Aio * a, uint32_t tag, int fd, int write, void * buf, uint64_t len, uint64_t offset);
+
+/* Waits for a request to finish and returns its tag. reqs[tag].done
+   is short only at the end of the file, reqs[tag].err is set if the
+   request failed. */
+uint32_t aioWait(fat32Aio * a);
+
+/* Returns the name of the engine, for reports */
+const char * aioEngineName(const fat32Aio * a);
+
+/* Closes an engine with no requests in flight */
+void aioClose(fat32Aio * a);
+
+#endif
@@ -0,0 +1,93 @@
+#!/bin/sh
+# make bench: puts a BENCH_MB file (2048 MB by default) of random data
+# into the sparse image of tests/mksparse and measures reading it back.
+# Figures depend on the machine; the page cache of the image is
+# dropped before each cold run with dd iflag=nocache.
+# Usage: bench/bench.sh [fat32 binary] [mksparse binary]
+
+fat32=$(realpath "${1:-./fat32}")
+mksparse=$(realpath "${2:-tests/mksparse}")
+benchdir=$(dirname "$(realpath "$0")")
+mb=${BENCH_MB:-2048}
+dir=$(mktemp -d "${TMPDIR:-/tmp}/fat32bench.XXXXXX") || exit 1
+trap 'rm -rf "$dir"' EXIT
+img="$dir/bench.img"
+
+"$mksparse" "$img" "$dir/expect" || exit 1
+head -c "${mb}M" /dev/urandom > "$dir/BIG.BIN" || exit 1
+"$fat32" -c "put $dir/BIG.BIN" "$img" > /dev/null || exit 1
+rm -f "$dir/BIG.BIN"
+
+# drops the image from the page cache
+cold(){
+	dd if="$img" iflag=nocache count=0 status=none
+}
+
+echo "== syscalls per FAT chain hop, $mb MB file =="
+cold
+"$benchdir/chainhops" "$img" BIG.BIN
+
+mkdir "$dir/out" || exit 1
+
+# GETs BIG.BIN with the fat32 options given after the label and
+# prints the time and rate
+getRate(){
+	label=$1
+	shift
+	rm -f "$dir/out/BIG.BIN"
+	start=$(date +%s%N)
+	(cd "$dir/out" && "$fat32" "$@" -c "get BIG.BIN" "$img" > /dev/null) || echo "$label: get failed"
+	end=$(date +%s%N)
+	awk -v mb="$mb" -v ns=$((end - start)) -v l="$label" \
+		'BEGIN { printf "%-24s %8.2f s %8.0f MB/s\n", l, ns / 1e9, mb * 1e9 / ns }'
+}
+
+echo "== GET throughput by transfer mode, $mb MB file =="
+for mode in copy sendfile read; do
+	cold
+	getRate "-x $mode, cold" -x $mode
+	getRate "-x $mode, warm" -x $mode
+done
+
+# a directory of BENCH_DIR_ENTS empty files with long names, made with
+# PUT. Each name starts with its own six digits, so its short name
+# takes the first ~1 tail.
+ents=${BENCH_DIR_ENTS:-10000}
+mkdir "$dir/many" || exit 1
+i=0
+while [ $i -lt "$ents" ]; do
+	: > "$dir/many/$(printf %06d $i) entry with a long name.txt"
+	i=$((i + 1))
+done
+{
+	echo "mkdir MANYFILES"
+	echo "cd MANYFILES"
+	for f in "$dir"/many/*; do echo "put $f"; done
+} > "$dir/put.txt"
+"$fat32" -f "$dir/put.txt" "$img" > /dev/null || exit 1
+
+# runs a DIR of MANYFILES in a new process with the fat32 options given
+# after the label and prints the time it took
+dirTime(){
+	label=$1
+	shift
+	start=$(date +%s%N)
+	"$fat32" "$@" -c "cd MANYFILES" -c "dir" "$img" > /dev/null || echo "$label: dir failed"
+	end=$(date +%s%N)
+	awk -v ns=$((end - start)) -v l="$label" 'BEGIN { printf "%-24s %8.1f ms\n", l, ns / 1e6 }'
+}
+
+echo "== DIR of a directory of $ents long names =="
+cold
+dirTime "dir, cold"
+dirTime "dir, warm"
+cold
+dirTime "dir -m, cold" -m
+dirTime "dir -m, warm" -m
+
+echo "== GET through the async engine, queue depth 1 and 32, $mb MB file =="
+for qd in 1 32; do
+	cold
+	getRate "-x uring -q $qd, cold" -x uring -q $qd
+	getRate "-x uring -q $qd, warm" -x uring -q $qd
+done
@@ -0,0 +1,126 @@
+/**********************************************************************
+  Module: chainhops.c
+  Author: Junseok Lee
+
+ Benchmark of make bench: follows the cluster chain of one file of an
+ image twice and prints the read syscalls and time per hop of each
+ walk. The first walk reads every FAT entry from the volume, as
+ getNextClus did before the FAT cache. The second goes through the
+ cache of a fresh head. Syscalls are counted from syscr in
+ /proc/self/io.
+
+ Usage: chainhops <image> <path of a file in the image>
+
+**********************************************************************/
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include "../fat32.h"
+#include "../shell.h"
+#include "../dirindex.h"
+#include "../extract.h"
+
+#define PROC_IO "/proc/self/io"
+#define PROC_SYSCR "syscr:"
+
+/* Returns the read syscalls the process has made so far */
+static uint64_t readCalls(void){
+
+	char line[128];
+	uint64_t n = 0;
+	FILE * f = fopen(PROC_IO, "r");
+
+	if(f == NULL){
+		perror("chainhops " PROC_IO);
+		exit(EXIT_FAILURE);
+	}
+	while(fgets(line, sizeof(line), f) != NULL){
+		if(strncmp(line, PROC_SYSCR, strlen(PROC_SYSCR)) == 0) n = strtoull(line + strlen(PROC_SYSCR), NULL, 10);
+	}
+	fclose(f);
+	return n;
+}
+
+static double now(void){
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / NSEC_PER_SEC;
+}
+
+/* Returns the next cluster read straight from the active FAT, one
+   read per entry, as getNextClus did before the FAT cache */
+static uint32_t uncachedNext(fat32Head *h, uint32_t clus){
+
+	uint32_t bps = h->bs->BPB_BytesPerSec;
+	uint64_t entOff = (uint64_t) clus * FAT_ENT_SZ;
+	uint32_t * buf = readFromOffset(h->fd, h, h->fatOffset / bps + entOff / bps, (uint32_t) (entOff % bps));
+	uint32_t next = buf[0] & CLUSENT_AND_OPERATOR;
+
+	free(buf);
+	return next;
+}
+
+/* Walks the chain from firstClus with the FAT cache if cached is set,
+   and prints the hops, read syscalls and time it took */
+static void walk(fat32Head *h, uint32_t firstClus, int cached, uint64_t probe){
+
+	uint64_t hops = 0;
+	uint32_t c = firstClus;
+	uint64_t calls = readCalls();
+	double start = now();
+
+	while(c >= ROOT_DIR_CLUS_NUM && c <= h->lastClus && hops <= h->lastClus){
+		c = cached ? getNextClus(h, c) : uncachedNext(h, c);
+		hops++;
+	}
+
+	double secs = now() - start;
+	calls = readCalls() - calls - probe;
+	printf("%-22s %10lu hops %10lu read calls %8.4f per hop %8.1f ns per hop\n",
+			cached ? "FAT cache:" : "read per entry:", hops, calls, hops ? (double) calls / hops : 0.0,
+			hops ? secs * NSEC_PER_SEC / hops : 0.0);
+}
+
+int main(int argc, char *argv[]){
+
+	fat32IndexEnt ent;
+	int pass;
+
+	if(argc != 3){
+		printf("Usage: %s <image> <path of a file in the image>\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	/* what reading the counter itself costs, taken off every walk */
+	uint64_t probe = readCalls();
+	probe = readCalls() - probe;
+
+	for(pass = 0; pass < 2; pass++){
+		int fd = open(argv[1], O_RDONLY);
+		const char * err = (fd == -1) ? "cannot open the image" : verifyVolume(fd);
+
+		if(err != NULL){
+			printf("Error: %s: %s\n", argv[1], err);
+			exit(EXIT_FAILURE);
+		}
+
+		/* a fresh head each pass, so the cached walk starts cold */
+		fat32Head * h = createHead(fd, 0);
+		if(!resolvePath(h, argv[2], &ent)){
+			printf("Error: %s not found\n", argv[2]);
+			exit(EXIT_FAILURE);
+		}
+		walk(h, ent.firstClus, pass, probe);
+
+		dirCacheFree(h);
+		cleanupHead(h);
+		close(fd);
+	}
+	return 0;
+}
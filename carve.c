@@ -0,0 +1,489 @@
+/**********************************************************************
+  Module: carve.c
+  Author: Junseok Lee
+
+ Signature based carving of the data region, in large sequential
+ reads split over threads by cluster range.
+
+**********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "carve.h"
+#include "shell.h"
+#include "freemap.h"
+#include "extract.h"
+
+#define BIT_TEST(bits, c) (((bits)[(c) / FREE_ENTS_PER_BYTE] >> ((c) % FREE_ENTS_PER_BYTE)) & 1)
+
+/* how a carved file ends */
+#define END_FOOTER 0 //at the first footer
+#define END_LAST_FOOTER 1 //at the last footer before the next header, files updated in place
+#define END_STRUCTURE 2 //length read from the file's own structure
+
+/* Carved type struct,
+   the header and footer of one file type */
+struct carveType_struct {
+	const char * ext;
+	const char * header;
+	uint8_t headerOff; //position of the header in the first cluster
+	uint8_t headerLen;
+	const char * footer; //NULL if the length comes from the structure
+	uint8_t footerLen;
+	uint8_t end; //END_FOOTER ...
+	uint64_t maxLen; //longest file accepted
+};
+typedef struct carveType_struct carveType;
+
+static const carveType types[CARVE_NUM_TYPES] = {
+	{ "jpg", "\xFF\xD8\xFF", 0, 3, "\xFF\xD9", 2, END_FOOTER, 128 << 20 },
+	{ "png", "\x89PNG\r\n\x1A\n", 0, 8, "IEND\xAE\x42\x60\x82", 8, END_FOOTER, 256 << 20 },
+	{ "pdf", "%PDF-", 0, 5, "%%EOF", 5, END_LAST_FOOTER, 1 << 30 },
+	{ "zip", "PK\x03\x04", 0, 4, "PK\x05\x06", 4, END_FOOTER, UINT32_MAX },
+	{ "mp4", "ftyp", 4, 4, NULL, 0, END_STRUCTURE, UINT32_MAX },
+};
+
+/* top level boxes of an MP4 file */
+static const char * mp4Boxes[] = { "ftyp", "moov", "mdat", "free", "skip", "wide", "uuid", "pdin", "moof",
+		"mfra", "meta", "styp", "sidx" };
+
+/* Returns the offset of the first occurrence of pat starting in the
+   first n bytes of buf, or n if there is none. The pattern may run
+   up to patLen - 1 bytes past n. Candidates come from memchr on the
+   first byte, which glibc vectorizes; footer bytes are rare in the
+   compressed data they end, so few candidates need a compare. */
+static size_t findFooter(const unsigned char * buf, size_t n, const unsigned char * pat, size_t patLen){
+
+	size_t i;
+
+	for(i = 0; i < n; i++){
+		const unsigned char * p = memchr(buf + i, pat[0], n - i);
+		if(p == NULL) return n;
+		i = p - buf;
+		if(memcmp(p + 1, pat + 1, patLen - 1) == 0) return i;
+	}
+	return n;
+}
+
+/* Open file struct,
+   the file a worker is inside of */
+struct carveOpen_struct {
+	int type; //-1 if no file is open
+	uint64_t start; //byte offset of the header
+	uint64_t searchFrom; //first byte the footer may start at
+	uint64_t end; //end of the file once known, 0 otherwise
+	uint64_t lastEnd; //end after the last footer seen, for END_LAST_FOOTER
+};
+typedef struct carveOpen_struct carveOpen;
+
+/* Scan worker struct,
+   one range of clusters and the files found starting in it */
+struct carveWorker_struct {
+	fat32Head * head;
+	const uint8_t * mask;
+	uint32_t firstClus; //range of clusters where files may start
+	uint32_t endClus;
+	uint32_t lastClus; //last cluster of the volume, files may run on to it
+	uint64_t volEnd; //end of the readable volume in bytes
+	fat32Carve list; //files found, only objs and numObjs are used
+	uint64_t bytesScanned;
+};
+typedef struct carveWorker_struct carveWorker;
+
+static void addObj(fat32Carve * list, uint64_t offset, uint64_t len, uint8_t type){
+
+	if(list->numObjs == list->cap){
+		list->cap = list->cap ? list->cap * 2 : CARVE_OBJS_INIT;
+		list->objs = (carveObj*) realloc(list->objs, list->cap * sizeof(carveObj));
+		if(list->objs == NULL){
+			perror("carveScan malloc error");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	carveObj * obj = &list->objs[list->numObjs++];
+	obj->offset = offset;
+	obj->len = len;
+	obj->type = type;
+}
+
+/* Returns the type whose header starts the cluster at p, or -1 */
+static int matchHeader(const unsigned char * p){
+
+	int t;
+
+	for(t = 0; t < CARVE_NUM_TYPES; t++){
+		if(memcmp(p + types[t].headerOff, types[t].header, types[t].headerLen) != 0) continue;
+
+		/* a JPEG marker follows the start of image */
+		if(t == CARVE_JPEG && p[3] < 0xC0) continue;
+		return t;
+	}
+	return -1;
+}
+
+/* Returns the offset of the JPEG scan data of the file at start, the
+   first place its end of image marker can be. The segments before
+   it, holding thumbnails with markers of their own, are skipped. */
+static uint64_t jpegScanStart(carveWorker * w, uint64_t start){
+
+	unsigned char seg[4];
+	uint64_t pos = start + 2;
+	int i;
+
+	for(i = 0; i < CARVE_JPEG_MAX_SEGS && pos + sizeof(seg) <= w->volEnd; i++){
+		readVolume(w->head, seg, sizeof(seg), pos);
+		if(seg[0] != 0xFF) break;
+
+		uint32_t len = ((uint32_t) seg[2] << 8) | seg[3];
+		pos += 2 + len;
+		if(seg[1] == 0xDA) return pos;
+	}
+	return start + 2;
+}
+
+/* Returns the length of the MP4 file at start from its top level
+   boxes, or 0 if it has no movie box */
+static uint64_t mp4Length(carveWorker * w, uint64_t start){
+
+	unsigned char box[16];
+	uint64_t pos = start;
+	int i, hasMovie = 0;
+
+	for(i = 0; i < CARVE_MP4_MAX_BOXES && pos + sizeof(box) <= w->volEnd; i++){
+		readVolume(w->head, box, sizeof(box), pos);
+
+		uint64_t size = ((uint32_t) box[0] << 24) | ((uint32_t) box[1] << 16) | ((uint32_t) box[2] << 8) | box[3];
+		size_t k, known = 0;
+
+		for(k = 0; k < sizeof(mp4Boxes) / sizeof(mp4Boxes[0]); k++) known |= memcmp(box + 4, mp4Boxes[k], 4) == 0;
+		if(!known) break;
+
+		/* size 1 means a 64 bit size follows, size 0 runs to the end of the file */
+		if(size == 1){
+			size = 0;
+			for(k = 8; k < 16; k++) size = (size << 8) | box[k];
+		}
+		if(size < 8 || pos + size > w->volEnd) break;
+		if(i == 0 && (size > CARVE_MP4_FTYP_MAX || memcmp(box + 4, "ftyp", 4) != 0)) return 0;
+
+		hasMovie |= memcmp(box + 4, "moov", 4) == 0 || memcmp(box + 4, "moof", 4) == 0;
+		pos += size;
+	}
+	return hasMovie ? pos - start : 0;
+}
+
+/* Opens the file whose header starts at byte offset start */
+static void openFile(carveWorker * w, carveOpen * o, int type, uint64_t start){
+
+	o->type = type;
+	o->start = start;
+	o->searchFrom = start + types[type].headerLen;
+	o->end = 0;
+	o->lastEnd = 0;
+
+	if(type == CARVE_JPEG) o->searchFrom = jpegScanStart(w, start);
+
+	if(type == CARVE_MP4){
+		uint64_t len = mp4Length(w, start);
+		if(len == 0 || len > types[type].maxLen){
+			w->list.dropped++;
+			o->type = -1;
+			return;
+		}
+		o->end = start + len;
+	}
+}
+
+/* Closes the open file, keeping it if its end is known */
+static void closeFile(carveWorker * w, carveOpen * o){
+
+	if(o->type < 0) return;
+
+	uint64_t end = o->end ? o->end : o->lastEnd;
+	if(end > o->start) addObj(&w->list, o->start, end - o->start, (uint8_t) o->type);
+	else w->list.dropped++;
+
+	o->type = -1;
+}
+
+/* Returns the end of a file whose footer starts at byte offset pos.
+   p points at the footer and holds avail bytes. */
+static uint64_t footerEnd(carveWorker * w, int type, uint64_t pos, const unsigned char * p, size_t avail){
+
+	uint64_t end = pos + types[type].footerLen;
+
+	/* the ZIP end record carries a comment of its own length */
+	if(type == CARVE_ZIP){
+		unsigned char rec[CARVE_ZIP_EOCD_SZ];
+		if(pos + sizeof(rec) > w->volEnd) return end;
+		if(avail >= sizeof(rec)) memcpy(rec, p, sizeof(rec));
+		else readVolume(w->head, rec, sizeof(rec), pos);
+		return pos + sizeof(rec) + (((uint32_t) rec[21] << 8) | rec[20]);
+	}
+
+	/* a PDF ends with the line end after its last %%EOF */
+	if(type == CARVE_PDF){
+		size_t k = types[type].footerLen;
+		while(k < avail && k < types[type].footerLen + 2 && (p[k] == '\r' || p[k] == '\n')) k++;
+		return pos + k;
+	}
+	return end;
+}
+
+/* Searches the len bytes at byte offset off, held in p, for the
+   footer of the open file. avail is the number of bytes readable
+   at p. Returns the end of the file if the footer closed it, 0
+   otherwise. */
+static uint64_t searchFooter(carveWorker * w, carveOpen * o, uint64_t off, const unsigned char * p, size_t len,
+		size_t avail){
+
+	const carveType * t = &types[o->type];
+	size_t from = o->searchFrom > off ? (size_t) (o->searchFrom - off) : 0;
+
+	/* footers must be complete within the bytes that were read */
+	if(avail < len + t->footerLen - 1) len = avail > t->footerLen ? avail - t->footerLen + 1 : 0;
+
+	while(from < len){
+		size_t pos = from + findFooter(p + from, len - from, (const unsigned char*) t->footer, t->footerLen);
+		if(pos >= len) return 0;
+
+		uint64_t end = footerEnd(w, o->type, off + pos, p + pos, avail - pos);
+		if(t->end == END_FOOTER){
+			o->end = end;
+			closeFile(w, o);
+			return end;
+		}
+		o->lastEnd = end;
+		from = pos + t->footerLen;
+	}
+	return 0;
+}
+
+/* Scan worker thread, streams its range of clusters in blocks and
+   matches headers at each cluster and footers inside open files */
+static void * carveWorkerRun(void * arg){
+
+	carveWorker * w = (carveWorker*) arg;
+	fat32Head * h = w->head;
+	uint32_t bpc = h->bytesPerClus;
+	uint32_t blockClus = CARVE_BLOCK / bpc;
+	unsigned char * buf = NULL;
+	carveOpen o;
+	uint32_t clus, k;
+
+	if(blockClus < 1) blockClus = 1;
+	o.type = -1;
+
+	if(h->map == NULL && posix_memalign((void**) &buf, CARVE_ALIGN, (size_t) blockClus * bpc + CARVE_OVERLAP) != 0){
+		perror("carveScan malloc error");
+		exit(EXIT_FAILURE);
+	}
+
+	/* past the end of the range, only the file still open is followed */
+	for(clus = w->firstClus; clus <= w->lastClus && (clus < w->endClus || o.type >= 0); clus += blockClus){
+
+		uint32_t n = w->lastClus - clus + 1 < blockClus ? w->lastClus - clus + 1 : blockClus;
+		uint64_t off = clusOffset(h, clus);
+
+		if(off >= w->volEnd) break;
+		if(off + (uint64_t) n * bpc > w->volEnd) n = (uint32_t) ((w->volEnd - off) / bpc);
+		if(n == 0) break;
+
+		size_t len = (size_t) n * bpc;
+		uint32_t inMask = n;
+
+		if(w->mask != NULL){
+			for(k = 0, inMask = 0; k < n; k++) inMask += BIT_TEST(w->mask, clus + k);
+		}
+
+		/* blocks without a cluster to scan, or all inside a file of
+		   known length, are not read */
+		if(inMask == 0 && o.type < 0) continue;
+		if(inMask == n && o.type >= 0 && o.end >= off + len) continue;
+
+		size_t readLen = off + len + CARVE_OVERLAP <= w->volEnd ? len + CARVE_OVERLAP : (size_t) (w->volEnd - off);
+		const unsigned char * block = (const unsigned char*) mapView(h, off, readLen);
+		if(block == NULL){
+			readVolume(h, buf, readLen, off);
+			block = buf;
+		}
+		w->bytesScanned += len;
+
+		for(k = 0; k < n; k++){
+
+			uint32_t c = clus + k;
+			uint64_t cOff = off + (uint64_t) k * bpc;
+			const unsigned char * p = block + (size_t) k * bpc;
+
+			if(c >= w->endClus && o.type < 0) break;
+
+			/* a file does not run through clusters outside the mask */
+			if(w->mask != NULL && !BIT_TEST(w->mask, c)){
+				closeFile(w, &o);
+				continue;
+			}
+
+			if(o.type >= 0 && o.end != 0){
+				if(o.end > cOff) continue; //inside a file of known length
+				closeFile(w, &o);
+			}
+
+			/* a new header ends the open file, files are contiguous */
+			int type = matchHeader(p);
+			if(type >= 0){
+				closeFile(w, &o);
+				if(c >= w->endClus) break;
+				openFile(w, &o, type, cOff);
+				if(o.type < 0 || o.end != 0) continue;
+			}
+
+			if(o.type < 0) continue;
+
+			/* one footer scan runs up to the next header in the block */
+			uint32_t j = k + 1;
+			while(j < n && (w->mask == NULL || BIT_TEST(w->mask, clus + j)) &&
+					off + (uint64_t) j * bpc - o.start <= types[o.type].maxLen && matchHeader(block + (size_t) j * bpc) < 0){
+				j++;
+			}
+
+			uint64_t closed = searchFooter(w, &o, cOff, p, (size_t) (j - k) * bpc, readLen - (size_t) k * bpc);
+
+			/* the next file starts on the cluster after the footer */
+			if(closed != 0){
+				uint32_t next = (uint32_t) ((closed - off + bpc - 1) / bpc);
+				if(next > j) next = j;
+				if(next > k + 1) k = next - 1;
+				continue;
+			}
+
+			k = j - 1;
+			if(off + (uint64_t) j * bpc - o.start > types[o.type].maxLen) closeFile(w, &o);
+		}
+	}
+
+	/* the end of the volume ends every file */
+	if(o.type >= 0 && o.end > w->volEnd) o.end = 0;
+	closeFile(w, &o);
+
+	free(buf);
+	return NULL;
+}
+
+fat32Carve * carveScan(fat32Head *h, const uint8_t * mask, int numThreads){
+
+	struct timespec start, end;
+	pthread_t threads[RGET_MAX_THREADS];
+	carveWorker workers[RGET_MAX_THREADS];
+	struct stat st;
+	uint32_t i;
+	int t;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	fat32Carve * c = (fat32Carve*) calloc(1, sizeof(fat32Carve));
+	if(c == NULL){
+		perror("carveScan malloc error");
+		exit(EXIT_FAILURE);
+	}
+
+	uint32_t numClus = dataClusters(h);
+	uint32_t lastClus = numClus + ROOT_DIR_CLUS_NUM - 1;
+
+	/* an image cut short ends the scan early */
+	uint64_t volEnd = clusOffset(h, lastClus) + h->bytesPerClus;
+	if(fstat(h->fd, &st) == 0 && S_ISREG(st.st_mode) && (uint64_t) st.st_size < volEnd) volEnd = st.st_size;
+
+	if(numThreads < 1) numThreads = 1;
+	if(numThreads > RGET_MAX_THREADS) numThreads = RGET_MAX_THREADS;
+	if((uint32_t) numThreads > numClus) numThreads = numClus > 0 ? (int) numClus : 1;
+
+	for(t = 0; t < numThreads; t++){
+		memset(&workers[t], 0, sizeof(workers[t]));
+		workers[t].head = h;
+		workers[t].mask = mask;
+		workers[t].firstClus = ROOT_DIR_CLUS_NUM + (uint32_t) ((uint64_t) numClus * t / numThreads);
+		workers[t].endClus = ROOT_DIR_CLUS_NUM + (uint32_t) ((uint64_t) numClus * (t + 1) / numThreads);
+		workers[t].lastClus = lastClus;
+		workers[t].volEnd = volEnd;
+
+		if(pthread_create(&threads[t], NULL, carveWorkerRun, &workers[t]) != 0){
+			perror("carveScan thread error");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* ranges are in volume order, so are the files */
+	for(t = 0; t < numThreads; t++){
+		pthread_join(threads[t], NULL);
+
+		for(i = 0; i < workers[t].list.numObjs; i++){
+			carveObj * obj = &workers[t].list.objs[i];
+			addObj(c, obj->offset, obj->len, obj->type);
+			c->counts[obj->type]++;
+		}
+		c->dropped += workers[t].list.dropped;
+		c->bytesScanned += workers[t].bytesScanned;
+		free(workers[t].list.objs);
+	}
+	c->numThreads = numThreads;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	c->secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / NSEC_PER_SEC;
+	return c;
+}
+
+int carveExtract(fat32Head *h, const fat32Carve * c, const char * dest){
+
+	char path[PATH_MAX];
+	uint32_t i;
+	int numFiles = 0;
+
+	if(mkdir(dest, DIR_PERMISSION) == -1 && errno != EEXIST){
+		perror("carveExtract mkdir error");
+		return -1;
+	}
+
+	for(i = 0; i < c->numObjs; i++){
+
+		const carveObj * obj = &c->objs[i];
+		fat32Extent ext;
+
+		snprintf(path, sizeof(path), "%s/%012" PRIx64 ".%s", dest, obj->offset, carveTypeName(obj->type));
+
+		int outFD = open(path, O_CREAT|O_WRONLY|O_TRUNC, FILE_PERMISSION);
+		if(outFD == -1){
+			fprintf(stderr, "%s: %s\n", path, strerror(errno));
+			continue;
+		}
+
+		/* carved files are contiguous, one extent from their first cluster */
+		ext.startClus = (uint32_t) ((obj->offset - h->dataOffset) / h->bytesPerClus) + ROOT_DIR_CLUS_NUM;
+		ext.numClus = (uint32_t) ((obj->len + h->bytesPerClus - 1) / h->bytesPerClus);
+
+		if(writeExtents(h, &ext, 1, outFD, (uint32_t) obj->len) != 0) fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		else numFiles++;
+		close(outFD);
+	}
+	return numFiles;
+}
+
+const char * carveTypeName(uint8_t type){
+
+	return type < CARVE_NUM_TYPES ? types[type].ext : "bin";
+}
+
+void carveFree(fat32Carve * c){
+
+	if(c == NULL) return;
+
+	free(c->objs);
+	free(c);
+}
@@ -0,0 +1,79 @@
+/**********************************************************************
+  Module: carve.h
+  Author: Junseok Lee
+
+  Purpose: Signature based carving of files out of the data region,
+  for volumes whose directories or FAT can no longer be trusted. The
+  data region is streamed in large aligned reads, split over several
+  threads by cluster range. A file always starts on a cluster, so
+  headers (JPEG, PNG, PDF, ZIP, MP4) are only matched at the start of
+  each cluster. Once a header opens a file, its footer is searched
+  for in the bytes that follow, up to the next header, or the length
+  is read from the file's own structure where it has one.
+
+**********************************************************************/
+#ifndef CARVE_H
+#define CARVE_H
+
+#include "fat32.h"
+
+/* carve constants */
+#define CARVE_BLOCK (4 << 20) //bytes per read of the data region
+#define CARVE_OVERLAP 64 //bytes read past each block, so footers across the end are seen
+#define CARVE_ALIGN 4096
+#define CARVE_OBJS_INIT 256
+#define CARVE_JPEG_MAX_SEGS 64 //segments walked looking for the start of scan
+#define CARVE_MP4_MAX_BOXES 4096 //top level boxes walked in an MP4
+#define CARVE_MP4_FTYP_MAX 4096 //largest plausible ftyp box
+#define CARVE_ZIP_EOCD_SZ 22 //end of central directory record, without the comment
+
+/* carved file types */
+#define CARVE_JPEG 0
+#define CARVE_PNG 1
+#define CARVE_PDF 2
+#define CARVE_ZIP 3
+#define CARVE_MP4 4
+#define CARVE_NUM_TYPES 5
+
+/* Carved file struct,
+   one file found in the data region */
+struct carveObj_struct {
+	uint64_t offset; //byte offset in the volume, always the start of a cluster
+	uint64_t len; //length in bytes
+	uint8_t type; //CARVE_JPEG ...
+};
+typedef struct carveObj_struct carveObj;
+
+/* Carve result struct,
+   every file found by carveScan, in volume order */
+struct fat32Carve_struct {
+	carveObj * objs;
+	uint32_t numObjs;
+	uint32_t cap;
+	uint32_t counts[CARVE_NUM_TYPES]; //files found of each type
+	uint32_t dropped; //headers whose footer or structure was not found
+	uint64_t bytesScanned;
+	int numThreads;
+	double secs; //time the scan took
+};
+typedef struct fat32Carve_struct fat32Carve;
+
+/* Scans the data region on numThreads threads and returns the
+   malloc'd list of files found. With mask set, only clusters whose
+   bit is set in mask are scanned, and a file ends at the first
+   cluster that is not. Free with carveFree. */
+fat32Carve * carveScan(fat32Head *h, const uint8_t * mask, int numThreads);
+
+/* Writes every file of c into the local directory dest, each named
+   by its byte offset in the volume and the extension of its type.
+   Returns the number of files written, or -1 if dest could not be
+   created. */
+int carveExtract(fat32Head *h, const fat32Carve * c, const char * dest);
+
+/* Returns the file extension of a carved type, for names and reports */
+const char * carveTypeName(uint8_t type);
+
+/* Deallocates the result of carveScan */
+void carveFree(fat32Carve * c);
+
+#endif
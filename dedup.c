@@ -0,0 +1,479 @@
+/**********************************************************************
+  Module: dedup.c
+  Author: Junseok Lee
+
+ Cluster fingerprints of one or several volumes, counted in a
+ bounded open addressed table that spills to partition files.
+
+**********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "dedup.h"
+#include "extent.h"
+#include "extract.h"
+#include "hash.h"
+#include "shell.h"
+
+#define TABLE_INIT_SLOTS (1 << 16) //slots of a new table, doubled up to the bound
+#define TABLE_MAX_SLOTS ((uint64_t) DEDUP_TABLE_MB * MB_BYTES / sizeof(dedupSlot))
+#define SPILL_SLOTS 4096 //slots read back from a partition at once
+
+/* Fingerprint worker struct,
+   one thread fingerprinting files of one image */
+struct dedupWorker_struct {
+	fat32Dedup * dedup;
+	fat32Head * head;
+	dedupFile * files; //records of the image's files
+	const uint64_t * order; //first cluster and record of each file, by first cluster
+	uint32_t numOrder;
+	uint32_t * nextFile; //next entry of order to take, shared
+	uint32_t image;
+	uint64_t batch[DEDUP_BATCH]; //fingerprints not yet in the table
+	uint32_t batchLen;
+	uint64_t numClus;
+	uint64_t bytesRead;
+};
+typedef struct dedupWorker_struct dedupWorker;
+
+static void * dedupAlloc(size_t len){
+
+	void * p = calloc(1, len);
+	if(p == NULL){
+		perror("dedup malloc error");
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+static void tableAlloc(dedupTable * t, uint64_t cap){
+
+	t->slots = (dedupSlot*) dedupAlloc(cap * sizeof(dedupSlot));
+	t->cap = cap;
+	t->used = 0;
+	t->maxUsed = cap / DEDUP_LOAD_DEN * DEDUP_LOAD_NUM;
+}
+
+/* Adds count sightings of fp in images, the table is known not
+   to be full. Fingerprints are already uniform, so their low bits
+   index the table directly. */
+static void tablePut(dedupTable * t, uint64_t fp, uint32_t count, uint32_t images){
+
+	uint64_t mask = t->cap - 1;
+	uint64_t i = fp & mask;
+
+	while(t->slots[i].count != 0 && t->slots[i].fp != fp) i = (i + 1) & mask;
+
+	dedupSlot * s = &t->slots[i];
+	if(s->count == 0){
+		s->fp = fp;
+		t->used++;
+	}
+	s->count += count;
+	s->images |= images;
+}
+
+/* Doubles the table, putting every slot again */
+static void tableGrow(dedupTable * t){
+
+	dedupSlot * old = t->slots;
+	uint64_t oldCap = t->cap, i;
+
+	tableAlloc(t, oldCap * 2);
+	for(i = 0; i < oldCap; i++){
+		if(old[i].count != 0) tablePut(t, old[i].fp, old[i].count, old[i].images);
+	}
+	free(old);
+}
+
+/* Appends every slot to the partition of its top byte and empties
+   the table. The same fingerprint may then be in several spills of
+   one partition, they are added up when the partition is merged. */
+static void tableSpill(dedupTable * t){
+
+	uint64_t i;
+
+	for(i = 0; i < t->cap; i++){
+		dedupSlot * s = &t->slots[i];
+		if(s->count == 0) continue;
+
+		FILE ** part = &t->parts[s->fp >> DEDUP_PART_SHIFT];
+		if(*part == NULL && (*part = tmpfile()) == NULL){
+			perror("dedup spill file error");
+			exit(EXIT_FAILURE);
+		}
+		if(fwrite(s, sizeof(*s), 1, *part) != 1){
+			perror("dedup spill write error");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	t->spilledSlots += t->used;
+	t->numSpills++;
+	memset(t->slots, 0, t->cap * sizeof(dedupSlot));
+	t->used = 0;
+}
+
+/* Adds one sighting of fp in image, growing the table up to its
+   bound and spilling it once it is full there */
+static void tableAdd(dedupTable * t, uint64_t fp, uint32_t image){
+
+	if(t->used >= t->maxUsed){
+		if(t->cap < TABLE_MAX_SLOTS) tableGrow(t);
+		else tableSpill(t);
+	}
+	tablePut(t, fp, 1, (uint32_t) 1 << image);
+}
+
+static void flushBatch(dedupWorker * w){
+
+	dedupTable * t = &w->dedup->table;
+	uint32_t i;
+
+	pthread_mutex_lock(&t->lock);
+	for(i = 0; i < w->batchLen; i++) tableAdd(t, w->batch[i], w->image);
+	pthread_mutex_unlock(&t->lock);
+
+	w->batchLen = 0;
+}
+
+/* Fingerprints every cluster of the file of ent into the batch and
+   returns the fingerprint of the whole file, 0 if its chain is
+   shorter than its size. buf holds DEDUP_READ_MAX bytes when the
+   volume is not mapped. */
+static uint64_t fingerprintFile(dedupWorker * w, const catalogEnt * ent, unsigned char * buf){
+
+	fat32Head * h = w->head;
+	uint32_t bpc = h->bytesPerClus;
+	uint32_t readClus = DEDUP_READ_MAX / bpc ? DEDUP_READ_MAX / bpc : 1;
+	uint32_t numClus = (uint32_t) (((uint64_t) ent->fileSize + bpc - 1) / bpc);
+	uint64_t left = ent->fileSize, fileFp = ent->fileSize;
+	fat32ExtentIter it;
+	fat32Extent ext;
+
+	extentIterInit(h, &it, ent->firstClus, numClus);
+
+	while(left > 0 && nextExtent(h, &it, &ext)){
+
+		uint32_t done = 0;
+
+		while(done < ext.numClus && left > 0){
+
+			uint32_t n = ext.numClus - done < readClus ? ext.numClus - done : readClus;
+			uint64_t off = clusOffset(h, ext.startClus + done);
+			size_t len = (uint64_t) n * bpc < left ? (size_t) n * bpc : (size_t) left;
+			uint32_t k;
+
+			const unsigned char * p = (const unsigned char*) mapView(h, off, len);
+			if(p == NULL){
+				readVolume(h, buf, len, off);
+				p = buf;
+			}
+			w->bytesRead += len;
+
+			/* the last cluster only counts the bytes of the file */
+			for(k = 0; k < n && left > 0; k++){
+				size_t clusLen = left < bpc ? (size_t) left : bpc;
+				uint64_t fp = hash64(p + (size_t) k * bpc, clusLen, 0);
+
+				fileFp = hash64(&fp, sizeof(fp), fileFp);
+				w->batch[w->batchLen++] = fp;
+				if(w->batchLen == DEDUP_BATCH) flushBatch(w);
+
+				left -= clusLen;
+				w->numClus++;
+			}
+			done += n;
+		}
+	}
+	return left == 0 ? fileFp : 0;
+}
+
+/* Fingerprint worker thread, takes files DEDUP_TAKE at a time in
+   order of their first cluster, so reads move forward on the volume */
+static void * dedupWorkerRun(void * arg){
+
+	dedupWorker * w = (dedupWorker*) arg;
+	fat32Dedup * d = w->dedup;
+	fat32Catalog * cat = d->images[w->image].cat;
+	unsigned char * buf = NULL;
+	uint32_t i, first;
+
+	if(w->head->map == NULL) buf = (unsigned char*) dedupAlloc(DEDUP_READ_MAX);
+
+	while((first = __atomic_fetch_add(w->nextFile, DEDUP_TAKE, __ATOMIC_RELAXED)) < w->numOrder){
+
+		for(i = first; i < first + DEDUP_TAKE && i < w->numOrder; i++){
+			dedupFile * f = &w->files[(uint32_t) w->order[i]];
+			uint64_t fp = fingerprintFile(w, catalogGet(cat, f->catIdx), buf);
+
+			/* a broken chain matches no other file */
+			if(fp == 0) f->fileSize = 0;
+			f->fp = fp;
+		}
+	}
+	flushBatch(w);
+
+	free(buf);
+	return NULL;
+}
+
+static int compareKeys(const void * a, const void * b){
+
+	uint64_t ka = *(const uint64_t*) a, kb = *(const uint64_t*) b;
+
+	return (ka > kb) - (ka < kb);
+}
+
+static int compareFiles(const void * a, const void * b){
+
+	const dedupFile * fa = (const dedupFile*) a;
+	const dedupFile * fb = (const dedupFile*) b;
+
+	if(fa->fileSize != fb->fileSize) return (fa->fileSize > fb->fileSize) - (fa->fileSize < fb->fileSize);
+	if(fa->fp != fb->fp) return (fa->fp > fb->fp) - (fa->fp < fb->fp);
+	if(fa->image != fb->image) return (fa->image > fb->image) - (fa->image < fb->image);
+	return (fa->catIdx > fb->catIdx) - (fa->catIdx < fb->catIdx);
+}
+
+static int compareGroups(const void * a, const void * b){
+
+	const dedupGroup * ga = (const dedupGroup*) a;
+	const dedupGroup * gb = (const dedupGroup*) b;
+
+	if(ga->wasted != gb->wasted) return (ga->wasted < gb->wasted) - (ga->wasted > gb->wasted);
+	return (ga->first > gb->first) - (ga->first < gb->first);
+}
+
+fat32Dedup * dedupNew(int numThreads){
+
+	fat32Dedup * d = (fat32Dedup*) dedupAlloc(sizeof(fat32Dedup));
+
+	if(numThreads < 1) numThreads = 1;
+	if(numThreads > RGET_MAX_THREADS) numThreads = RGET_MAX_THREADS;
+	d->numThreads = numThreads;
+
+	tableAlloc(&d->table, TABLE_INIT_SLOTS);
+	pthread_mutex_init(&d->table.lock, NULL);
+	return d;
+}
+
+int dedupAdd(fat32Dedup * d, fat32Head *h, const char * name){
+
+	struct timespec start, end;
+	pthread_t threads[RGET_MAX_THREADS];
+	dedupWorker * workers;
+	uint32_t i, numOrder = 0, nextFile = 0;
+	int t;
+
+	if(d->numImages == DEDUP_MAX_IMAGES) return DEDUP_TOO_MANY;
+	if(d->bytesPerClus != 0 && h->bytesPerClus != d->bytesPerClus) return DEDUP_CLUS_SIZE;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	uint32_t image = (uint32_t) d->numImages++;
+	dedupImage * img = &d->images[image];
+	img->name = strdup(name);
+	img->cat = walkTree(h, h->bs->BPB_RootClus, d->numThreads);
+	d->bytesPerClus = h->bytesPerClus;
+
+	/* a cluster of zeros, to name the most common duplicate */
+	unsigned char * zeros = (unsigned char*) dedupAlloc(h->bytesPerClus);
+	img->zeroFp = hash64(zeros, h->bytesPerClus, 0);
+	free(zeros);
+
+	/* every file with data gets a record, visited by first cluster */
+	fat32Catalog * cat = img->cat;
+	uint64_t base = d->numFiles;
+	uint64_t * order = (uint64_t*) dedupAlloc(((size_t) cat->numEnts + 1) * sizeof(uint64_t));
+
+	for(i = CATALOG_ROOT + 1; i < cat->numEnts; i++){
+		catalogEnt * ent = catalogGet(cat, i);
+		if((ent->attr & ATTR_DIRECTORY) || ent->fileSize == 0 || ent->firstClus < ROOT_DIR_CLUS_NUM) continue;
+
+		if(d->numFiles == d->filesCap){
+			d->filesCap = d->filesCap ? d->filesCap * 2 : WALK_DIR_ENTS_INIT;
+			d->files = (dedupFile*) realloc(d->files, d->filesCap * sizeof(dedupFile));
+			if(d->files == NULL){
+				perror("dedup malloc error");
+				exit(EXIT_FAILURE);
+			}
+		}
+		dedupFile * f = &d->files[d->numFiles];
+		f->fp = 0;
+		f->fileSize = ent->fileSize;
+		f->catIdx = i;
+		f->image = (uint8_t) image;
+		order[numOrder++] = ((uint64_t) ent->firstClus << 32) | (uint32_t) (d->numFiles - base);
+		d->numFiles++;
+	}
+	img->numFiles = numOrder;
+	qsort(order, numOrder, sizeof(uint64_t), compareKeys);
+
+	workers = (dedupWorker*) dedupAlloc(d->numThreads * sizeof(dedupWorker));
+	for(t = 0; t < d->numThreads; t++){
+		workers[t].dedup = d;
+		workers[t].head = h;
+		workers[t].files = d->files + base;
+		workers[t].order = order;
+		workers[t].numOrder = numOrder;
+		workers[t].nextFile = &nextFile;
+		workers[t].image = image;
+	}
+
+	for(t = 0; t < d->numThreads; t++){
+		if(pthread_create(&threads[t], NULL, dedupWorkerRun, &workers[t]) != 0){
+			perror("dedup thread error");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for(t = 0; t < d->numThreads; t++){
+		pthread_join(threads[t], NULL);
+		img->numClus += workers[t].numClus;
+		img->bytesRead += workers[t].bytesRead;
+	}
+	d->numClus += img->numClus;
+
+	free(workers);
+	free(order);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	img->secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / NSEC_PER_SEC;
+	return DEDUP_OK;
+}
+
+/* Counts the distinct contents of the table: repeats, contents
+   shared between images and the most repeated ones */
+static void tally(fat32Dedup * d){
+
+	dedupTable * t = &d->table;
+	uint64_t i;
+	int k, j;
+
+	for(i = 0; i < t->cap; i++){
+		dedupSlot * s = &t->slots[i];
+		if(s->count == 0) continue;
+
+		d->distinct++;
+		d->dupBytes += (uint64_t) (s->count - 1) * d->bytesPerClus;
+
+		int shared = (s->images & (s->images - 1)) != 0;
+		if(shared) d->sharedDistinct++;
+		for(k = 0; k < d->numImages; k++){
+			if(!(s->images & ((uint32_t) 1 << k))) continue;
+			if(shared) d->images[k].shared++;
+			else d->images[k].onlyHere++;
+		}
+
+		/* kept sorted, most repeated first, ties by fingerprint */
+		if(s->count < 2) continue;
+		for(k = d->numTop; k > 0 && (d->top[k - 1].count < s->count ||
+				(d->top[k - 1].count == s->count && d->top[k - 1].fp > s->fp)); k--);
+		if(k == DEDUP_TOP_CLUS) continue;
+		if(d->numTop < DEDUP_TOP_CLUS) d->numTop++;
+		for(j = d->numTop - 1; j > k; j--) d->top[j] = d->top[j - 1];
+		d->top[k] = *s;
+	}
+}
+
+/* Adds the spilled slots of partition p into the emptied table and
+   tallies them. A partition holds about 1 / DEDUP_PARTS of the
+   distinct contents, so it fits the bound unless the volumes hold
+   far more distinct clusters than the bound times DEDUP_PARTS. */
+static void mergePart(fat32Dedup * d, int p){
+
+	dedupTable * t = &d->table;
+	dedupSlot slots[SPILL_SLOTS];
+	size_t n, i;
+
+	rewind(t->parts[p]);
+	while((n = fread(slots, sizeof(dedupSlot), SPILL_SLOTS, t->parts[p])) > 0){
+		for(i = 0; i < n; i++){
+			if(t->used >= t->maxUsed) tableGrow(t);
+			tablePut(t, slots[i].fp, slots[i].count, slots[i].images);
+		}
+	}
+	if(ferror(t->parts[p])){
+		perror("dedup spill read error");
+		exit(EXIT_FAILURE);
+	}
+
+	tally(d);
+	memset(t->slots, 0, t->cap * sizeof(dedupSlot));
+	t->used = 0;
+}
+
+void dedupFinish(fat32Dedup * d){
+
+	struct timespec start, end;
+	dedupTable * t = &d->table;
+	uint64_t i, j;
+	int p;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/* once anything spilled, the rest follows and each partition
+	   is merged on its own */
+	if(t->numSpills == 0){
+		tally(d);
+	}
+	else{
+		tableSpill(t);
+		for(p = 0; p < DEDUP_PARTS; p++){
+			if(t->parts[p] != NULL) mergePart(d, p);
+		}
+	}
+
+	/* identical files are neighbours once sorted by size and fingerprint */
+	qsort(d->files, d->numFiles, sizeof(dedupFile), compareFiles);
+
+	uint64_t groupsCap = 0;
+	for(i = 0; i < d->numFiles; i = j){
+		for(j = i + 1; j < d->numFiles && d->files[j].fileSize == d->files[i].fileSize &&
+				d->files[j].fp == d->files[i].fp; j++);
+		if(j - i < 2 || d->files[i].fileSize == 0) continue;
+
+		if(d->numGroups == groupsCap){
+			groupsCap = groupsCap ? groupsCap * 2 : WALK_DIR_ENTS_INIT;
+			d->groups = (dedupGroup*) realloc(d->groups, groupsCap * sizeof(dedupGroup));
+			if(d->groups == NULL){
+				perror("dedup malloc error");
+				exit(EXIT_FAILURE);
+			}
+		}
+		dedupGroup * g = &d->groups[d->numGroups++];
+		g->first = i;
+		g->numFiles = (uint32_t) (j - i);
+		g->wasted = (uint64_t) (j - i - 1) * d->files[i].fileSize;
+
+		d->dupFiles += j - i - 1;
+		d->wastedBytes += g->wasted;
+	}
+	qsort(d->groups, d->numGroups, sizeof(dedupGroup), compareGroups);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	d->secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / NSEC_PER_SEC;
+	for(p = 0; p < d->numImages; p++) d->secs += d->images[p].secs;
+}
+
+void dedupFree(fat32Dedup * d){
+
+	int i;
+
+	if(d == NULL) return;
+
+	for(i = 0; i < d->numImages; i++){
+		free(d->images[i].name);
+		catalogFree(d->images[i].cat);
+	}
+	for(i = 0; i < DEDUP_PARTS; i++){
+		if(d->table.parts[i] != NULL) fclose(d->table.parts[i]);
+	}
+	pthread_mutex_destroy(&d->table.lock);
+	free(d->table.slots);
+	free(d->files);
+	free(d->groups);
+	free(d);
+}
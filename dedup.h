@@ -0,0 +1,139 @@
+/**********************************************************************
+  Module: dedup.h
+  Author: Junseok Lee
+
+  Purpose: Deduplication report of one or several volumes. Every
+  cluster of every file is read once, following the chains of the
+  files found by the tree walk, and fingerprinted with a 64-bit hash.
+  The fingerprints are counted in an open addressed table of bounded
+  size; once it fills, its entries are spilled to partition files by
+  the top byte of the fingerprint and the table starts over, and the
+  partitions are merged one at a time at the end. Files are matched
+  by their size and a fingerprint of their cluster fingerprints.
+
+**********************************************************************/
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include "fat32.h"
+#include "walk.h"
+
+/* dedup constants */
+#define DEDUP_MAX_IMAGES 32 //images compared at once, one bit each in the table
+#define DEDUP_TABLE_MB 256 //memory of the fingerprint table before it spills
+#define DEDUP_PARTS 256 //spill partitions, by the top byte of the fingerprint
+#define DEDUP_PART_SHIFT 56
+#define DEDUP_LOAD_NUM 3 //the table spills once it is 3/4 full
+#define DEDUP_LOAD_DEN 4
+#define DEDUP_BATCH 4096 //fingerprints a thread adds to the table at once
+#define DEDUP_TAKE 16 //files a thread takes from the list at once
+#define DEDUP_READ_MAX (4 << 20) //longest read of file data
+#define DEDUP_TOP_CLUS 5 //most repeated cluster contents reported
+#define DEDUP_REPORT_MAX 20 //groups of identical files listed
+#define DEDUP_CURRENT "current" //name of the volume open in the shell
+
+/* dedupAdd results */
+#define DEDUP_OK 0
+#define DEDUP_TOO_MANY -1
+#define DEDUP_CLUS_SIZE -2
+
+/* Table slot struct,
+   one distinct cluster content and where it was seen */
+struct dedupSlot_struct {
+	uint64_t fp; //fingerprint of the cluster
+	uint32_t count; //clusters seen with it, 0 for an empty slot
+	uint32_t images; //bit i set if image i holds it
+};
+typedef struct dedupSlot_struct dedupSlot;
+
+/* Fingerprint table struct,
+   bounded in memory, spilling to partition files when full */
+struct dedupTable_struct {
+	dedupSlot * slots;
+	uint64_t cap; //slots, a power of two
+	uint64_t used;
+	uint64_t maxUsed; //slots used before the table spills
+	FILE * parts[DEDUP_PARTS]; //spilled slots of each partition, NULL until used
+	uint64_t numSpills;
+	uint64_t spilledSlots;
+	pthread_mutex_t lock;
+};
+typedef struct dedupTable_struct dedupTable;
+
+/* Dedup image struct,
+   one of the volumes compared */
+struct dedupImage_struct {
+	char * name;
+	fat32Catalog * cat; //kept for the paths of the report
+	uint64_t zeroFp; //fingerprint of a cluster of zeros of this volume
+	uint64_t numFiles;
+	uint64_t numClus; //clusters fingerprinted
+	uint64_t bytesRead;
+	uint64_t onlyHere; //distinct contents found in no other image
+	uint64_t shared; //distinct contents also found in another image
+	double secs; //time the walk and the fingerprints took
+};
+typedef struct dedupImage_struct dedupImage;
+
+/* Dedup file struct,
+   the fingerprint of one file */
+struct dedupFile_struct {
+	uint64_t fp; //fingerprint of the cluster fingerprints, in file order
+	uint32_t fileSize;
+	uint32_t catIdx; //catalog entry of the file in its image
+	uint8_t image;
+};
+typedef struct dedupFile_struct dedupFile;
+
+/* Dedup group struct,
+   files with the same size and content */
+struct dedupGroup_struct {
+	uint64_t first; //index of the first file in the sorted files
+	uint32_t numFiles;
+	uint64_t wasted; //bytes of every copy but one
+};
+typedef struct dedupGroup_struct dedupGroup;
+
+/* Dedup report struct */
+struct fat32Dedup_struct {
+	dedupImage images[DEDUP_MAX_IMAGES];
+	int numImages;
+	dedupTable table;
+	dedupFile * files;
+	uint64_t numFiles;
+	uint64_t filesCap;
+	uint64_t numClus; //clusters fingerprinted in every image
+	uint64_t distinct; //distinct cluster contents
+	uint64_t sharedDistinct; //distinct contents found in more than one image
+	uint64_t dupBytes; //bytes of the clusters that repeat an earlier one
+	dedupSlot top[DEDUP_TOP_CLUS]; //most repeated contents, most first
+	int numTop;
+	dedupGroup * groups; //groups of identical files, most wasted bytes first
+	uint64_t numGroups;
+	uint64_t dupFiles; //files that copy another one
+	uint64_t wastedBytes; //bytes of those copies
+	uint32_t bytesPerClus; //cluster size of every image
+	int numThreads;
+	double secs; //time the whole report took
+};
+typedef struct fat32Dedup_struct fat32Dedup;
+
+/* Returns an empty report fingerprinting on numThreads threads.
+   Free with dedupFree. */
+fat32Dedup * dedupNew(int numThreads);
+
+/* Walks the volume of h and fingerprints every cluster of every
+   file into d, under name. Clusters are only compared between images
+   of one cluster size. Returns DEDUP_OK, DEDUP_TOO_MANY if d already
+   holds DEDUP_MAX_IMAGES images, or DEDUP_CLUS_SIZE if the clusters
+   of h differ in size from those of the images already added. */
+int dedupAdd(fat32Dedup * d, fat32Head *h, const char * name);
+
+/* Merges the spilled partitions, counts the distinct and shared
+   cluster contents and groups the identical files of d */
+void dedupFinish(fat32Dedup * d);
+
+/* Deallocates d, its catalogs and its partition files */
+void dedupFree(fat32Dedup * d);
+
+#endif
@@ -0,0 +1,283 @@
+/**********************************************************************
+  Module: dirindex.c
+  Author: Junseok Lee
+
+ Hash index of directory entry names, cached per fat32Head with
+ least recently used eviction.
+
+**********************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "dirindex.h"
+#include "shell.h"
+
+uint32_t nameHash(uint32_t seed, const char * name){
+
+	uint32_t hash = FNV_OFFSET ^ seed;
+
+	while(*name){
+		hash ^= (unsigned char) toupper((unsigned char) *name++);
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
+
+/* Calls realloc and exits on failure */
+static void * growArray(void * ptr, size_t size){
+
+	ptr = realloc(ptr, size);
+	if(ptr == NULL){
+		perror("dirindex realloc error");
+		exit(EXIT_FAILURE);
+	}
+	return ptr;
+}
+
+/* Returns the index of the entry named name, or DIR_INDEX_NO_ENT */
+static uint32_t findEnt(fat32DirIndex * idx, const char * name){
+
+	uint32_t i = idx->buckets[nameHash(0, name) & (idx->numBuckets - 1)];
+
+	while(i != DIR_INDEX_NO_ENT){
+		if(strcasecmp(idx->names + idx->ents[i].nameOff, name) == 0) return i;
+		i = idx->ents[i].next;
+	}
+	return DIR_INDEX_NO_ENT;
+}
+
+/* Adds an entry under name to the index. The first entry with a
+   given name wins, as it would in a directory scan. */
+static void addEnt(fat32DirIndex * idx, const char * name, const fat32Dir * dir){
+
+	if(findEnt(idx, name) != DIR_INDEX_NO_ENT) return;
+
+	size_t nameLen = strlen(name) + 1;
+
+	if(idx->numEnts == idx->capEnts){
+		idx->capEnts *= 2;
+		idx->ents = (fat32IndexEnt*) growArray(idx->ents, idx->capEnts * sizeof(fat32IndexEnt));
+	}
+	while(idx->namesLen + nameLen > idx->namesCap){
+		idx->namesCap *= 2;
+		idx->names = (char*) growArray(idx->names, idx->namesCap);
+	}
+
+	fat32IndexEnt * ent = &idx->ents[idx->numEnts];
+	ent->nameOff = idx->namesLen;
+	ent->firstClus = ((uint32_t) dir->DIR_FstClusHI << HEX_TEN) | dir->DIR_FstClusLO;
+	ent->fileSize = dir->DIR_FileSize;
+	ent->wrtDate = dir->DIR_WrtDate;
+	ent->wrtTime = dir->DIR_WrtTime;
+	ent->attr = dir->DIR_Attr;
+
+	memcpy(idx->names + idx->namesLen, name, nameLen);
+	idx->namesLen += nameLen;
+
+	uint32_t bucket = nameHash(0, name) & (idx->numBuckets - 1);
+	ent->next = idx->buckets[bucket];
+	idx->buckets[bucket] = idx->numEnts++;
+}
+
+/* Rebuilds the bucket array with twice as many buckets once the
+   table is more than half full, keeping chains short */
+static void growBuckets(fat32DirIndex * idx){
+
+	uint32_t i;
+
+	idx->numBuckets *= 2;
+	free(idx->buckets);
+	idx->buckets = (uint32_t*) malloc(idx->numBuckets * sizeof(uint32_t));
+	if(idx->buckets == NULL){
+		perror("growBuckets malloc error");
+		exit(EXIT_FAILURE);
+	}
+	memset(idx->buckets, 0xFF, idx->numBuckets * sizeof(uint32_t));
+
+	for(i = 0; i < idx->numEnts; i++){
+		uint32_t bucket = nameHash(0, idx->names + idx->ents[i].nameOff) & (idx->numBuckets - 1);
+		idx->ents[i].next = idx->buckets[bucket];
+		idx->buckets[bucket] = i;
+	}
+}
+
+/* Reads the directory starting at dirClus and indexes every
+   entry that is in use, under its formatted short name and its
+   long name if it has one */
+static fat32DirIndex * buildIndex(fat32Head *h, uint32_t dirClus){
+
+	fat32DirIndex * idx = (fat32DirIndex*) calloc(1, sizeof(fat32DirIndex));
+	if(idx == NULL){
+		perror("buildIndex malloc error");
+		exit(EXIT_FAILURE);
+	}
+
+	idx->dirClus = dirClus;
+	idx->capEnts = DIR_INDEX_INIT_CAP;
+	idx->ents = (fat32IndexEnt*) growArray(NULL, idx->capEnts * sizeof(fat32IndexEnt));
+	idx->namesCap = DIR_INDEX_NAMES_INIT;
+	idx->names = (char*) growArray(NULL, idx->namesCap);
+	/* allocates the first DIR_INDEX_INIT_CAP buckets */
+	idx->numBuckets = DIR_INDEX_INIT_CAP / 2;
+	growBuckets(idx);
+
+	fat32DirIter it;
+	const fat32Dir * dir;
+	dirIterInit(h, &it, dirClus);
+
+	while((dir = dirIterNext(&it)) != NULL){
+
+		/* skip deleted, long name and volume label entries */
+		if((unsigned char) dir->DIR_Name[0] == FREE_DIR || dir->DIR_Attr == INV_DIR ||
+				(dir->DIR_Attr & ATTR_VOLUME_ID)){
+			continue;
+		}
+
+		char name[FMT_NAME_LENGTH];
+		entryName(dir, name);
+
+		addEnt(idx, name, dir);
+
+		/* the long name is a second key for the same entry */
+		if(it.longName[0] != NULL_TERM) addEnt(idx, it.longName, dir);
+
+		if(idx->numEnts * 2 > idx->numBuckets) growBuckets(idx);
+	}
+
+	dirIterFree(&it);
+	return idx;
+}
+
+/* Unlinks an index from the cache list */
+static void unlinkIndex(fat32DirCache * cache, fat32DirIndex * idx){
+
+	if(idx->prev) idx->prev->next = idx->next;
+	else cache->head = idx->next;
+
+	if(idx->next) idx->next->prev = idx->prev;
+	else cache->tail = idx->prev;
+
+	idx->prev = idx->next = NULL;
+}
+
+/* Inserts an index at the most recently used end of the list */
+static void pushIndex(fat32DirCache * cache, fat32DirIndex * idx){
+
+	idx->prev = NULL;
+	idx->next = cache->head;
+	if(cache->head) cache->head->prev = idx;
+	cache->head = idx;
+	if(cache->tail == NULL) cache->tail = idx;
+}
+
+/* Deallocates an index and its arrays */
+static void freeIndex(fat32DirIndex * idx){
+
+	free(idx->ents);
+	free(idx->buckets);
+	free(idx->names);
+	free(idx);
+}
+
+/* Returns the head's directory cache, creating it on first use.
+   Threads racing to create it publish with compare and swap, the
+   losers free their copy. */
+static fat32DirCache * getCache(fat32Head *h){
+
+	fat32DirCache * cache = __atomic_load_n(&h->dirCache, __ATOMIC_ACQUIRE);
+	if(cache != NULL) return cache;
+
+	cache = (fat32DirCache*) calloc(1, sizeof(fat32DirCache));
+	if(cache == NULL){
+		perror("dirLookup malloc error");
+		exit(EXIT_FAILURE);
+	}
+	pthread_mutex_init(&cache->lock, NULL);
+
+	fat32DirCache * expected = NULL;
+	if(!__atomic_compare_exchange_n(&h->dirCache, &expected, cache, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+		pthread_mutex_destroy(&cache->lock);
+		free(cache);
+		cache = expected;
+	}
+	return cache;
+}
+
+/* Returns the cached index of the directory starting at dirClus,
+   marked as most recently used, or NULL. Called with the lock held. */
+static fat32DirIndex * findIndex(fat32DirCache * cache, uint32_t dirClus){
+
+	fat32DirIndex * idx;
+
+	for(idx = cache->head; idx != NULL; idx = idx->next){
+		if(idx->dirClus == dirClus) break;
+	}
+	if(idx != NULL){
+		unlinkIndex(cache, idx);
+		pushIndex(cache, idx);
+	}
+	return idx;
+}
+
+int dirLookup(fat32Head *h, uint32_t dirClus, const char * name, fat32IndexEnt * ent){
+
+	fat32DirCache * cache = getCache(h);
+
+	pthread_mutex_lock(&cache->lock);
+	fat32DirIndex * idx = findIndex(cache, dirClus);
+
+	if(idx == NULL){
+		/* the directory is read without the lock, so a miss does not
+		   hold up lookups in other directories */
+		pthread_mutex_unlock(&cache->lock);
+		fat32DirIndex * built = buildIndex(h, dirClus);
+		pthread_mutex_lock(&cache->lock);
+
+		/* another thread may have indexed the same directory meanwhile */
+		idx = findIndex(cache, dirClus);
+		if(idx != NULL){
+			freeIndex(built);
+		}
+		else{
+			idx = built;
+			pushIndex(cache, idx);
+			cache->numDirs++;
+			cache->numEnts += idx->numEnts;
+
+			/* evict least recently used directories until within bounds,
+			   the directory just indexed is always kept */
+			while(cache->tail != idx && (cache->numDirs > DIR_CACHE_MAX_DIRS || cache->numEnts > DIR_CACHE_MAX_ENTS)){
+				fat32DirIndex * old = cache->tail;
+				unlinkIndex(cache, old);
+				cache->numDirs--;
+				cache->numEnts -= old->numEnts;
+				freeIndex(old);
+			}
+		}
+	}
+
+	/* the entry is copied out before the index can be evicted */
+	uint32_t i = findEnt(idx, name);
+	if(i != DIR_INDEX_NO_ENT) *ent = idx->ents[i];
+	pthread_mutex_unlock(&cache->lock);
+
+	return i != DIR_INDEX_NO_ENT;
+}
+
+void dirCacheFree(fat32Head *h){
+
+	if(h->dirCache == NULL) return;
+
+	fat32DirIndex * idx = h->dirCache->head;
+	while(idx != NULL){
+		fat32DirIndex * next = idx->next;
+		freeIndex(idx);
+		idx = next;
+	}
+
+	pthread_mutex_destroy(&h->dirCache->lock);
+	free(h->dirCache);
+	h->dirCache = NULL;
+}
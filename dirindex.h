@@ -0,0 +1,88 @@
+/**********************************************************************
+  Module: dirindex.h
+  Author: Junseok Lee
+
+  Purpose: Keeps a hash index of directory entry names for the
+  directories visited by CD and GET. Each directory is indexed the
+  first time it is searched and the index is kept in a cache on the
+  fat32Head, bounded by an LRU policy, so later lookups in the same
+  directory cost one hash probe instead of a directory scan. Lookups
+  may run on many threads at once, the cache is guarded by a mutex
+  that is not held while a directory is read.
+
+**********************************************************************/
+#ifndef DIRINDEX_H
+#define DIRINDEX_H
+
+#include <pthread.h>
+#include "fat32.h"
+
+/* directory cache constants */
+#define DIR_CACHE_MAX_DIRS 64
+#define DIR_CACHE_MAX_ENTS (1 << 20)
+#define DIR_INDEX_INIT_CAP 64
+#define DIR_INDEX_NAMES_INIT 1024
+#define DIR_INDEX_NO_ENT 0xFFFFFFFF
+
+/* FNV-1a hash constants */
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+
+/* Index entry struct,
+   the fields of one directory entry needed by CD and GET */
+struct fat32IndexEnt_struct {
+	uint32_t nameOff; //offset of the short or long name in the index name pool
+	uint32_t firstClus; //first cluster of the file or directory
+	uint32_t fileSize; //size of the file in bytes
+	uint32_t next; //next entry in the same hash bucket, DIR_INDEX_NO_ENT ends the bucket
+	uint16_t wrtDate; //date of last write, 0 if not known
+	uint16_t wrtTime; //time of last write
+	uint8_t attr; //attribute byte of the entry
+};
+typedef struct fat32IndexEnt_struct fat32IndexEnt;
+
+/* Directory index struct,
+   hash table over the entries of one directory */
+struct fat32DirIndex_struct {
+	uint32_t dirClus; //first cluster of the indexed directory
+	fat32IndexEnt * ents; //entries in directory order
+	uint32_t numEnts;
+	uint32_t capEnts;
+	uint32_t * buckets; //first entry of every bucket
+	uint32_t numBuckets; //power of two
+	char * names; //pool of null terminated names
+	uint32_t namesLen;
+	uint32_t namesCap;
+	struct fat32DirIndex_struct * prev; //more recently used
+	struct fat32DirIndex_struct * next; //less recently used
+};
+typedef struct fat32DirIndex_struct fat32DirIndex;
+
+/* Directory cache struct,
+   the indexed directories in most recently used order */
+struct fat32DirCache_struct {
+	fat32DirIndex * head; //most recently used
+	fat32DirIndex * tail; //least recently used, evicted first
+	uint32_t numDirs;
+	uint32_t numEnts; //entries over all cached directories
+	pthread_mutex_t lock; //guards the list and the counts
+};
+typedef struct fat32DirCache_struct fat32DirCache;
+
+/* Finds the entry whose formatted short name (as produced by
+   formatDirectory) or long name is name, ignoring case, in the
+   directory starting at dirClus and copies it to ent. The directory
+   is indexed on first use and kept in the head's directory cache.
+   Returns 1 if the entry was found, 0 otherwise. */
+int dirLookup(fat32Head *h, uint32_t dirClus, const char * name, fat32IndexEnt * ent);
+
+/* Deallocates the head's directory cache and every index in it,
+   with no lookup running */
+void dirCacheFree(fat32Head *h);
+
+/* Hashes a null terminated name with FNV-1a, seeded with seed.
+   ASCII letters are folded to upper case, so that names differing
+   only in case hash alike, as FAT compares names. */
+uint32_t nameHash(uint32_t seed, const char * name);
+
+#endif
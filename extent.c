@@ -0,0 +1,229 @@
+/**********************************************************************
+  Module: extent.c
+  Author: Junseok Lee
+
+ Resolves FAT cluster chains into extents of consecutive clusters.
+
+**********************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include "extent.h"
+#include "shell.h"
+
+/* Appends an extent to the list, growing the array */
+static void addExtent(fat32ExtentList * list, fat32Extent ext){
+
+	if(list->count == list->capacity){
+		list->capacity *= 2;
+		list->ext = (fat32Extent*) realloc(list->ext, list->capacity * sizeof(fat32Extent));
+
+		if(list->ext == NULL){
+			perror("addExtent realloc error");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	list->ext[list->count++] = ext;
+}
+
+void extentIterInit(fat32Head *h, fat32ExtentIter * it, uint32_t startClus, uint32_t maxClus){
+
+	/* a chain can never be longer than the FAT, this also ends looping chains */
+	if(maxClus == 0 || maxClus > h->fatNumEnts){
+		maxClus = h->fatNumEnts;
+	}
+
+	it->nextClus = startClus;
+	it->remaining = maxClus;
+}
+
+int nextExtent(fat32Head *h, fat32ExtentIter * it, fat32Extent * ext){
+
+	uint32_t clusNum = it->nextClus;
+
+	if(it->remaining == 0 || clusNum < FIRST_DATA_CLUS || clusNum > h->lastClus){
+		return 0;
+	}
+
+	ext->startClus = clusNum;
+	ext->numClus = 0;
+
+	/* extend the run while each next cluster directly follows the last */
+	for(;;){
+		ext->numClus++;
+		it->remaining--;
+		if(it->remaining == 0) break;
+
+		clusNum = getNextClus(h, clusNum);
+		if(clusNum != ext->startClus + ext->numClus || clusNum > h->lastClus) break;
+	}
+
+	/* end of chain or invalid entries are rejected on the next call */
+	it->nextClus = clusNum;
+	return 1;
+}
+
+/* Returns a malloc'd empty extent list */
+static fat32ExtentList * newExtents(void){
+
+	fat32ExtentList * list = (fat32ExtentList*) malloc(sizeof(fat32ExtentList));
+	if(list == NULL){
+		perror("resolveExtents malloc error");
+		exit(EXIT_FAILURE);
+	}
+
+	list->count = 0;
+	list->capacity = EXT_LIST_INIT_CAP;
+	list->ext = (fat32Extent*) malloc(list->capacity * sizeof(fat32Extent));
+	if(list->ext == NULL){
+		perror("resolveExtents malloc error");
+		exit(EXIT_FAILURE);
+	}
+
+	return list;
+}
+
+fat32ExtentList * resolveExtents(fat32Head *h, uint32_t startClus, uint32_t maxClus){
+
+	fat32ExtentList * list = newExtents();
+	fat32ExtentIter it;
+	fat32Extent ext;
+
+	extentIterInit(h, &it, startClus, maxClus);
+
+	while(nextExtent(h, &it, &ext)){
+		addExtent(list, ext);
+	}
+
+	return list;
+}
+
+void freeExtents(fat32ExtentList * list){
+
+	if(list == NULL) return;
+	free(list->ext);
+	free(list);
+}
+
+fat32File * fat32FileOpen(fat32Head *h, uint32_t firstClus, uint32_t fileSize){
+
+	fat32File * f = (fat32File*) calloc(1, sizeof(fat32File));
+	if(f == NULL){
+		perror("fat32FileOpen malloc error");
+		exit(EXIT_FAILURE);
+	}
+
+	f->head = h;
+	f->fileSize = fileSize;
+
+	/* an empty list, filled as reads reach further into the file */
+	f->runs = newExtents();
+
+	uint32_t numClus = ((uint64_t) fileSize + h->bytesPerClus - 1) / h->bytesPerClus;
+	extentIterInit(h, &f->it, firstClus, numClus);
+	f->chainEnd = (numClus == 0);
+
+	return f;
+}
+
+/* Follows the chain until the run holding file cluster clus is
+   indexed or the chain ends. Returns 0 if the chain ends first. */
+static int mapCluster(fat32File * f, uint32_t clus){
+
+	fat32Extent ext;
+
+	while(f->mappedClus <= clus){
+
+		if(f->chainEnd || !nextExtent(f->head, &f->it, &ext)){
+			f->chainEnd = 1;
+			return 0;
+		}
+
+		addExtent(f->runs, ext);
+		if(f->runStartCap < f->runs->capacity){
+			f->runStartCap = f->runs->capacity;
+			f->runStart = (uint32_t*) realloc(f->runStart, f->runStartCap * sizeof(uint32_t));
+			if(f->runStart == NULL){
+				perror("mapCluster realloc error");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		f->runStart[f->runs->count - 1] = f->mappedClus;
+		f->mappedClus += ext.numClus;
+	}
+	return 1;
+}
+
+/* Returns the index of the run holding file cluster clus, which
+   must be mapped, with a binary search over the run starts */
+static uint32_t findRun(fat32File * f, uint32_t clus){
+
+	uint32_t lo = 0, hi = f->runs->count - 1;
+
+	while(lo < hi){
+		uint32_t mid = lo + (hi - lo + 1) / 2;
+		if(f->runStart[mid] <= clus) lo = mid;
+		else hi = mid - 1;
+	}
+	return lo;
+}
+
+uint64_t fat32Pread(fat32File * f, void * buf, uint64_t len, uint64_t offset){
+
+	fat32Head * h = f->head;
+	char * pos = (char*) buf;
+	uint64_t done = 0;
+
+	if(offset >= f->fileSize) return 0;
+	if(len > f->fileSize - offset) len = f->fileSize - offset;
+
+	uint32_t clus = offset / h->bytesPerClus;
+	if(len == 0 || !mapCluster(f, clus)) return 0;
+
+	uint32_t r = findRun(f, clus);
+
+	/* one read per run the range touches */
+	while(done < len){
+
+		const fat32Extent * run = &f->runs->ext[r];
+		uint64_t runOff = offset - (uint64_t) f->runStart[r] * h->bytesPerClus;
+		uint64_t chunk = (uint64_t) run->numClus * h->bytesPerClus - runOff;
+
+		if(chunk > len - done) chunk = len - done;
+
+		if(tryReadVolume(h, pos, chunk, getFirstSectorOfClus(h, run->startClus) + runOff) != 0) break;
+		pos += chunk;
+		offset += chunk;
+		done += chunk;
+
+		/* the next run starts right where this one ended */
+		if(done < len && !mapCluster(f, f->runStart[r] + run->numClus)) break;
+		r++;
+	}
+
+	return done;
+}
+
+uint64_t fat32FileReadable(fat32File * f, uint64_t len, uint64_t offset){
+
+	uint32_t bytesPerClus = f->head->bytesPerClus;
+
+	if(offset >= f->fileSize) return 0;
+	if(len > f->fileSize - offset) len = f->fileSize - offset;
+	if(len == 0) return 0;
+
+	/* map the chain as far as the last cluster of the range */
+	if(mapCluster(f, (offset + len - 1) / bytesPerClus)) return len;
+
+	uint64_t mappedBytes = (uint64_t) f->mappedClus * bytesPerClus;
+	return (mappedBytes > offset) ? mappedBytes - offset : 0;
+}
+
+void fat32FileClose(fat32File * f){
+
+	if(f == NULL) return;
+	freeExtents(f->runs);
+	free(f->runStart);
+	free(f);
+}
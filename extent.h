@@ -0,0 +1,100 @@
+/**********************************************************************
+  Module: extent.h
+  Author: Junseok Lee
+
+  Purpose: Resolves FAT cluster chains into extents, runs of
+  consecutive clusters, so that contiguous file data can be read
+  with one large read per run instead of one read per cluster.
+
+**********************************************************************/
+#ifndef EXTENT_H
+#define EXTENT_H
+
+#include "fat32.h"
+
+/* extent list constants */
+#define EXT_LIST_INIT_CAP 16
+#define FIRST_DATA_CLUS 2
+
+/* Extent struct,
+   a run of numClus consecutive clusters starting at startClus */
+struct fat32Extent_struct {
+	uint32_t startClus; //first cluster of the run
+	uint32_t numClus; //number of clusters in the run
+};
+typedef struct fat32Extent_struct fat32Extent;
+
+/* Extent list struct,
+   the extents of one cluster chain in chain order */
+struct fat32ExtentList_struct {
+	fat32Extent * ext; //array of extents
+	uint32_t count; //number of extents in use
+	uint32_t capacity; //number of extents allocated
+};
+typedef struct fat32ExtentList_struct fat32ExtentList;
+
+/* Extent iterator struct,
+   walks a cluster chain one extent at a time without
+   holding the whole extent list in memory */
+struct fat32ExtentIter_struct {
+	uint32_t nextClus; //first cluster not yet returned
+	uint32_t remaining; //clusters left before maxClus is reached
+};
+typedef struct fat32ExtentIter_struct fat32ExtentIter;
+
+/* File struct,
+   a file opened for ranged reads. The extents of its chain are found
+   lazily, only as far as reads have reached, and each is indexed by
+   the file cluster it starts at, so that finding the cluster of an
+   offset is a binary search over the runs instead of a walk of the
+   chain from its first cluster. */
+struct fat32File_struct {
+	fat32Head * head;
+	uint32_t fileSize; //size of the file in bytes
+	fat32ExtentList * runs; //extents found so far, in chain order
+	uint32_t * runStart; //file cluster index of the first cluster of each run
+	uint32_t runStartCap; //number of runStart entries allocated
+	uint32_t mappedClus; //file clusters covered by runs
+	fat32ExtentIter it; //continues the chain where runs end
+	int chainEnd; //set once the chain has no more extents
+};
+typedef struct fat32File_struct fat32File;
+
+/* Starts an extent iterator at startClus. maxClus bounds the
+   number of clusters returned as in resolveExtents. */
+void extentIterInit(fat32Head *h, fat32ExtentIter * it, uint32_t startClus, uint32_t maxClus);
+
+/* Stores the next extent of the chain in ext. Returns 1 if an
+   extent was returned, 0 once the chain is exhausted. */
+int nextExtent(fat32Head *h, fat32ExtentIter * it, fat32Extent * ext);
+
+/* Follows the cluster chain starting at startClus and coalesces
+   consecutive clusters into extents. Stops at the end of the chain,
+   at an invalid cluster number, or once maxClus clusters have been
+   collected (0 means the chain length is only bounded by the number
+   of FAT entries). Returns a malloc'd list, free with freeExtents. */
+fat32ExtentList * resolveExtents(fat32Head *h, uint32_t startClus, uint32_t maxClus);
+
+/* Deallocates an extent list and its array */
+void freeExtents(fat32ExtentList * list);
+
+/* Opens the file whose chain starts at firstClus for ranged reads.
+   Nothing is read until the first fat32Pread. Returns a malloc'd
+   file, free with fat32FileClose. */
+fat32File * fat32FileOpen(fat32Head *h, uint32_t firstClus, uint32_t fileSize);
+
+/* Reads up to len bytes of the file at offset into buf, like pread.
+   Returns the number of bytes read, short at the end of the file or
+   if the chain ends early, and 0 at or past the end of the file. A
+   read of the volume that fails also ends it short, with errno set. */
+uint64_t fat32Pread(fat32File * f, void * buf, uint64_t len, uint64_t offset);
+
+/* Returns how many of the len bytes at offset of the file its chain
+   holds, which is less than asked for past the end of the file or
+   if the chain ends early */
+uint64_t fat32FileReadable(fat32File * f, uint64_t len, uint64_t offset);
+
+/* Deallocates a file opened with fat32FileOpen */
+void fat32FileClose(fat32File * f);
+
+#endif
@@ -0,0 +1,356 @@
+/**********************************************************************
+  Module: extract.c
+  Author: Junseok Lee
+
+ Recursive extraction and hashing of a directory tree on a pool of
+ worker threads.
+
+**********************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "extract.h"
+#include "shell.h"
+#include "hash.h"
+
+/* Extraction struct,
+   the job queue shared by the walking thread and the workers */
+struct extractCtx_struct {
+	fat32Head * head;
+	const char * root; //local directory the tree goes to, "." if only hashed
+	size_t rootLen;
+	int write; //set if the files are written, or else only hashed
+	hashManifest * manifest; //digests of the files, NULL if not hashed
+	pthread_mutex_t lock;
+	pthread_cond_t notEmpty; //signalled when a job is queued or the walk ends
+	pthread_cond_t notFull; //signalled when a job is taken
+	extractJob * first; //next job to copy
+	extractJob * last;
+	uint32_t queued; //jobs in the queue
+	int walkDone; //set once every file has been queued
+	uint64_t numFiles; //files copied
+	uint64_t numDirs; //directories created
+	uint64_t numBytes; //bytes copied
+	uint64_t numErrors; //files or directories that could not be created
+	int numThreads;
+	double secs; //time the whole tree took
+};
+typedef struct extractCtx_struct extractCtx;
+
+/* number of worker threads, 0 means one per online CPU */
+static int numThreads = 0;
+
+void extractSetThreads(int n){
+
+	if(n < 0) n = 0;
+	if(n > RGET_MAX_THREADS) n = RGET_MAX_THREADS;
+	numThreads = n;
+}
+
+int extractThreads(void){
+
+	if(numThreads > 0) return numThreads;
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return (cpus < 1) ? 1 : (cpus > RGET_MAX_THREADS ? RGET_MAX_THREADS : (int) cpus);
+}
+
+/* Adds a file to the job queue, waiting while the queue is full */
+static void pushJob(extractCtx * ctx, const char * path, uint32_t firstClus, uint32_t fileSize){
+
+	extractJob * job = (extractJob*) malloc(sizeof(extractJob));
+	if(job == NULL || (job->path = strdup(path)) == NULL){
+		perror("pushJob malloc error");
+		exit(EXIT_FAILURE);
+	}
+	job->firstClus = firstClus;
+	job->fileSize = fileSize;
+	job->next = NULL;
+
+	pthread_mutex_lock(&ctx->lock);
+	while(ctx->queued >= RGET_QUEUE_MAX){
+		pthread_cond_wait(&ctx->notFull, &ctx->lock);
+	}
+
+	if(ctx->last) ctx->last->next = job;
+	else ctx->first = job;
+	ctx->last = job;
+	ctx->queued++;
+
+	pthread_cond_signal(&ctx->notEmpty);
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+/* Takes the next job off the queue, waiting for one to be queued.
+   Returns NULL once the walk is done and the queue is empty. */
+static extractJob * popJob(extractCtx * ctx){
+
+	extractJob * job;
+
+	pthread_mutex_lock(&ctx->lock);
+	while(ctx->first == NULL && !ctx->walkDone){
+		pthread_cond_wait(&ctx->notEmpty, &ctx->lock);
+	}
+
+	job = ctx->first;
+	if(job != NULL){
+		ctx->first = job->next;
+		if(ctx->first == NULL) ctx->last = NULL;
+		ctx->queued--;
+		pthread_cond_signal(&ctx->notFull);
+	}
+	pthread_mutex_unlock(&ctx->lock);
+
+	return job;
+}
+
+/* Worker thread, copies queued files through its own transfer buffer,
+   hashing them on the way when the context has a manifest */
+static void * extractWorker(void * arg){
+
+	extractCtx * ctx = (extractCtx*) arg;
+	extractJob * job;
+	char * buf = NULL;
+	size_t bufSz = xferSize();
+
+	if(posix_memalign((void**) &buf, XFER_ALIGN, bufSz) != 0){
+		printf("extractWorker: could not allocate a %zu byte transfer buffer\n", bufSz);
+		exit(EXIT_FAILURE);
+	}
+
+	while((job = popJob(ctx)) != NULL){
+
+		fat32Hash hs;
+		fat32Hash * hsp = NULL;
+		int outFD = -1;
+
+		if(ctx->manifest != NULL){
+			hashInit(&hs, ctx->manifest->algo);
+			hsp = &hs;
+		}
+
+		if(ctx->write && (outFD = open(job->path, O_CREAT|O_WRONLY|O_TRUNC, FILE_PERMISSION)) == -1){
+			fprintf(stderr, "%s: %s\n", job->path, strerror(errno));
+			__atomic_add_fetch(&ctx->numErrors, 1, __ATOMIC_RELAXED);
+		}
+		else if(writeFileHash(ctx->head, job->firstClus, outFD, job->fileSize, buf, bufSz, hsp) != 0){
+			fprintf(stderr, "%s: %s\n", job->path, strerror(errno));
+			__atomic_add_fetch(&ctx->numErrors, 1, __ATOMIC_RELAXED);
+			if(outFD != -1) close(outFD);
+		}
+		else{
+			if(outFD != -1) close(outFD);
+
+			/* the manifest names files relative to the root of the tree */
+			if(hsp != NULL){
+				char digest[HASH_HEX_SZ];
+				hashFinal(hsp, digest);
+
+				pthread_mutex_lock(&ctx->lock);
+				manifestAdd(ctx->manifest, job->path + ctx->rootLen + 1, job->fileSize, digest);
+				pthread_mutex_unlock(&ctx->lock);
+			}
+
+			__atomic_add_fetch(&ctx->numFiles, 1, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&ctx->numBytes, job->fileSize, __ATOMIC_RELAXED);
+		}
+
+		free(job->path);
+		free(job);
+	}
+
+	free(buf);
+	return NULL;
+}
+
+/* Walks the directory starting at dirClus, creating a local directory
+   for every subdirectory, unless the tree is only hashed, and queuing
+   every file below path */
+static void walkDir(extractCtx * ctx, uint32_t dirClus, const char * path, int depth){
+
+	fat32DirIter it;
+	const fat32Dir * dir;
+	char name[FMT_NAME_LENGTH];
+	char childPath[PATH_MAX];
+
+	if(depth > RGET_MAX_DEPTH){
+		printf("Warning: %s is nested too deep, skipped\n", path);
+		return;
+	}
+
+	dirIterInit(ctx->head, &it, dirClus);
+
+	while((dir = dirIterNext(&it)) != NULL){
+
+		/* skip deleted, long name and volume label entries */
+		if((unsigned char) dir->DIR_Name[0] == FREE_DIR || dir->DIR_Attr == INV_DIR ||
+				(dir->DIR_Attr & ATTR_VOLUME_ID)){
+			continue;
+		}
+
+		entryName(dir, name);
+
+		if(name[0] == NULL_TERM || strcmp(name, DOT) == 0 || strcmp(name, DOTDOT) == 0 || !checkName(name)){
+			continue;
+		}
+
+		/* local files take the long name when there is one, and never leave the folder */
+		const char * localName = (it.longName[0] != NULL_TERM) ? it.longName : name;
+
+		if(!localNameOk(localName)){
+			printf("Warning: unsafe name %s below %s, skipped\n", localName, path);
+			continue;
+		}
+
+		if(snprintf(childPath, sizeof(childPath), "%s/%s", path, localName) >= (int) sizeof(childPath)){
+			printf("Warning: path too long below %s, skipped\n", path);
+			continue;
+		}
+
+		uint32_t firstClus = ((uint32_t) dir->DIR_FstClusHI << HEX_TEN) | dir->DIR_FstClusLO;
+
+		if(dir->DIR_Attr & ATTR_DIRECTORY){
+
+			if(ctx->write && mkdir(childPath, DIR_PERMISSION) == -1 && errno != EEXIST){
+				fprintf(stderr, "%s: %s\n", childPath, strerror(errno));
+				__atomic_add_fetch(&ctx->numErrors, 1, __ATOMIC_RELAXED);
+				continue;
+			}
+			ctx->numDirs++;
+
+			walkDir(ctx, firstClus, childPath, depth + 1);
+		}
+		else{
+			pushJob(ctx, childPath, firstClus, dir->DIR_FileSize);
+		}
+	}
+
+	dirIterFree(&it);
+}
+
+/* Runs the walk on this thread and the workers on ctx->numThreads
+   others until every file below dirClus is done, timing the whole */
+static void runTree(extractCtx * ctx, uint32_t dirClus){
+
+	pthread_t workers[RGET_MAX_THREADS];
+	struct timespec start, end;
+	int i;
+
+	ctx->numThreads = extractThreads();
+	ctx->rootLen = strlen(ctx->root);
+	pthread_mutex_init(&ctx->lock, NULL);
+	pthread_cond_init(&ctx->notEmpty, NULL);
+	pthread_cond_init(&ctx->notFull, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for(i = 0; i < ctx->numThreads; i++){
+		if(pthread_create(&workers[i], NULL, extractWorker, ctx) != 0){
+			perror("runTree thread error");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* walk on this thread while the workers copy */
+	walkDir(ctx, dirClus, ctx->root, 0);
+
+	pthread_mutex_lock(&ctx->lock);
+	ctx->walkDone = 1;
+	pthread_cond_broadcast(&ctx->notEmpty);
+	pthread_mutex_unlock(&ctx->lock);
+
+	for(i = 0; i < ctx->numThreads; i++){
+		pthread_join(workers[i], NULL);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ctx->secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / NSEC_PER_SEC;
+
+	pthread_cond_destroy(&ctx->notFull);
+	pthread_cond_destroy(&ctx->notEmpty);
+	pthread_mutex_destroy(&ctx->lock);
+
+	if(ctx->manifest != NULL) manifestSort(ctx->manifest);
+}
+
+/* Writes the manifest of the tree extracted to dest next to it,
+   in dest.<algorithm> */
+static void writeManifest(const char * dest, const hashManifest * m){
+
+	char path[PATH_MAX];
+	size_t len = strlen(dest);
+
+	/* "out/" names the same directory as "out" */
+	while(len > 1 && dest[len - 1] == '/') len--;
+
+	if(snprintf(path, sizeof(path), "%.*s.%s", (int) len, dest, hashAlgoName(m->algo)) >= (int) sizeof(path)){
+		printf("Error: manifest path too long\n");
+		return;
+	}
+
+	FILE * out = fopen(path, "w");
+	if(out == NULL){
+		perror("writeManifest fopen error");
+		return;
+	}
+	manifestPrint(out, m);
+	fclose(out);
+
+	printf("%s manifest of %" PRIu64 " files written to %s\n", hashAlgoName(m->algo), m->numEnts, path);
+}
+
+void extractTree(fat32Head *h, uint32_t dirClus, const char * dest){
+
+	extractCtx ctx;
+
+	if(mkdir(dest, DIR_PERMISSION) == -1 && errno != EEXIST){
+		perror("extractTree mkdir error");
+		return;
+	}
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.head = h;
+	ctx.root = dest;
+	ctx.write = 1;
+	if(hashAlgo() != HASH_NONE) ctx.manifest = manifestNew(hashAlgo());
+
+	runTree(&ctx, dirClus);
+
+	double mbPerSec = ctx.secs > 0 ? ctx.numBytes / (double) M_UNIT / ctx.secs : 0;
+
+	printf("%" PRIu64 " files, %" PRIu64 " directories, %" PRIu64 " bytes in %.3f s (%.1f MB/s, %d threads)\n",
+			ctx.numFiles, ctx.numDirs, ctx.numBytes, ctx.secs, mbPerSec, ctx.numThreads);
+	if(ctx.numErrors > 0){
+		printf("%" PRIu64 " entries could not be extracted\n", ctx.numErrors);
+	}
+
+	if(ctx.manifest != NULL){
+		writeManifest(dest, ctx.manifest);
+		manifestFree(ctx.manifest);
+	}
+}
+
+hashManifest * hashTree(fat32Head *h, uint32_t dirClus, int algo){
+
+	extractCtx ctx;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.head = h;
+	ctx.root = DOT;
+	ctx.manifest = manifestNew(algo);
+
+	runTree(&ctx, dirClus);
+
+	ctx.manifest->numBytes = ctx.numBytes;
+	ctx.manifest->numErrors = ctx.numErrors;
+	ctx.manifest->numThreads = ctx.numThreads;
+	ctx.manifest->secs = ctx.secs;
+	return ctx.manifest;
+}
@@ -0,0 +1,58 @@
+/**********************************************************************
+  Module: extract.h
+  Author: Junseok Lee
+
+  Purpose: Recursive extraction of a whole directory tree. The tree
+  is walked from a directory cluster, the directory hierarchy is
+  recreated locally and the files are copied by a pool of worker
+  threads, each reading the volume with pread through its own
+  transfer buffer. The same pool hashes a tree straight from the
+  volume, without writing anything, for a manifest of its files.
+
+**********************************************************************/
+#ifndef EXTRACT_H
+#define EXTRACT_H
+
+#include "fat32.h"
+#include "hash.h"
+
+/* extraction constants */
+#define RGET_MAX_THREADS 64
+#define RGET_MAX_DEPTH 128
+#define RGET_QUEUE_MAX 4096
+#define DIR_PERMISSION 0755
+#define NSEC_PER_SEC 1000000000.0
+
+/* File job struct,
+   one file waiting to be copied by a worker */
+struct extractJob_struct {
+	char * path; //local output path
+	uint32_t firstClus; //first cluster of the file
+	uint32_t fileSize; //size of the file in bytes
+	struct extractJob_struct * next;
+};
+typedef struct extractJob_struct extractJob;
+
+/* Sets the number of extraction threads,
+   0 selects one thread per online CPU */
+void extractSetThreads(int n);
+
+/* Returns the number of worker threads to use, resolving
+   the default to the number of online CPUs */
+int extractThreads(void);
+
+/* Extracts every file and directory below the directory starting at
+   dirClus into the local directory dest, recreating the directory tree.
+   Prints the number of files and bytes copied and the aggregate
+   throughput when done. If an algorithm was selected with
+   hashSetAlgo, the files are hashed as they are copied and the
+   manifest is written to dest.<algorithm>. */
+void extractTree(fat32Head *h, uint32_t dirClus, const char * dest);
+
+/* Hashes every file below the directory starting at dirClus in algo
+   on the extraction threads, reading the volume only. Returns the
+   malloc'd manifest sorted by path, with the paths relative to the
+   directory. Free with manifestFree. */
+hashManifest * hashTree(fat32Head *h, uint32_t dirClus, int algo);
+
+#endif
@@ -10,12 +10,66 @@
 #include "fat32.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-fat32Head* createHead(int fd)
+const char * verifyVolume(int fd){
+
+    fat32BS bs;
+    struct stat st;
+
+    if(pread(fd, &bs, sizeof(bs), 0) != sizeof(bs) || fstat(fd, &st) != 0){
+        return "cannot read the boot sector";
+    }
+    if(bs.BS_BootSig != BS_Ext_BOOT_SIG || bs.BS_SigA != BS_SIG_A_VAL || bs.BS_SigB != BS_SIG_B_VAL){
+        return "boot sector signature error";
+    }
+    if(bs.BPB_FATSz16 != FAT32_DEFAULT || bs.BPB_TotSec16 != FAT32_DEFAULT || bs.BPB_RootEntCnt != FAT32_DEFAULT ||
+            bs.BPB_BytesPerSec == 0 || bs.BPB_SecPerClus == 0){
+        return "not a FAT32 volume";
+    }
+    if((uint64_t) st.st_size < (uint64_t) bs.BPB_TotSec32 * bs.BPB_BytesPerSec){
+        return "image is smaller than the volume";
+    }
+
+    /* everything createHead and the FAT cache read must lie inside the image */
+    uint64_t bps = bs.BPB_BytesPerSec;
+    uint64_t metaSec = bs.BPB_RsvdSecCnt + (uint64_t) bs.BPB_NumFATs * bs.BPB_FATSz32;
+    uint32_t activeFat = (bs.BPB_ExtFlags & FAT_MIRROR_DISABLED) ? (bs.BPB_ExtFlags & FAT_ACTIVE_MASK) : 0;
+
+    if(bs.BPB_NumFATs == 0 || bs.BPB_FATSz32 == 0 || activeFat >= bs.BPB_NumFATs || bs.BPB_TotSec32 <= metaSec){
+        return "bad FAT geometry";
+    }
+    uint64_t numClus = (bs.BPB_TotSec32 - metaSec) / bs.BPB_SecPerClus;
+    if(bs.BPB_RootClus < ROOT_DIR_CLUS_NUM || bs.BPB_RootClus > numClus + 1 ||
+            bs.BPB_RootClus >= (uint64_t) bs.BPB_FATSz32 * bps / FAT_ENT_SZ){
+        return "root cluster out of range";
+    }
+
+    FSInfo fsi;
+    if(((uint64_t) bs.BPB_FSInfo + 1) * bps > (uint64_t) st.st_size ||
+            pread(fd, &fsi, sizeof(fsi), (off_t) bs.BPB_FSInfo * bps) != sizeof(fsi)){
+        return "cannot read FSInfo";
+    }
+    if(fsi.FSI_LeadSig != FSI_LEADSIG || fsi.FSI_TrailSig != FSI_TRAILSIG){
+        return "FSInfo signature error";
+    }
+
+    fat32Dir root;
+    uint64_t rootOff = (metaSec + (uint64_t) (bs.BPB_RootClus - ROOT_DIR_CLUS_NUM) * bs.BPB_SecPerClus) * bps;
+    if(pread(fd, &root, sizeof(root), rootOff) != sizeof(root) || (root.DIR_Attr & ~ATTR_VALID_MASK)){
+        return "cannot read the root directory";
+    }
+    return NULL;
+}
+
+fat32Head* createHead(int fd, int flags)
 {
     /* Allocating head values */
-    fat32Head * head = (fat32Head*) malloc(sizeof(fat32Head));
+    fat32Head * head = (fat32Head*) calloc(1, sizeof(fat32Head));
     head->bs = (fat32BS*) malloc(sizeof(fat32BS));
     head->fsi = (FSInfo*) malloc(sizeof(FSInfo));
     head->dir = (fat32Dir*) malloc(sizeof(fat32Dir));
@@ -23,6 +77,12 @@ fat32Head* createHead(int fd)
         perror("createHead malloc error:");
         exit(EXIT_FAILURE);
     }
+    head->fd = fd;
+
+    /* map the volume before the first read, so every read can use it */
+    if((flags & HEAD_MMAP) && mapVolume(fd, head) != 0){
+        printf("Could not map the volume, using pread instead.\n");
+    }
 
     /* BOOT SECTOR init */
     bootSectorInit(fd, head);
@@ -38,14 +98,23 @@ fat32Head* createHead(int fd)
         exit(EXIT_FAILURE);
     }
 
+    /* cluster geometry, all byte addresses are 64-bit */
+    uint64_t rootDirSectors = ((head->bs->BPB_RootEntCnt * sizeof(fat32Dir)) + (head->bs->BPB_BytesPerSec - 1)) / head->bs->BPB_BytesPerSec;
+    uint64_t firstDataSector = head->bs->BPB_RsvdSecCnt + ((uint64_t) head->bs->BPB_NumFATs * head->bs->BPB_FATSz32) + rootDirSectors;
+    head->dataOffset = firstDataSector * head->bs->BPB_BytesPerSec;
+    head->bytesPerClus = (uint32_t) head->bs->BPB_SecPerClus * head->bs->BPB_BytesPerSec;
+
     /* Directory init with the root directory cluster */ 
-    dirInit(fd,head,head->bs->BPB_RootClus);
+    dirInit(fd,head,clusOffset(head, head->bs->BPB_RootClus));
 
     /* FSInfo init */
     fsiInit(fd, head, head->bs->BPB_FSInfo);
 
-    /* verify directory entry */
-    if(head->dir->DIR_Attr > 0x20){
+    /* FAT cache init, pages are read on demand */
+    fatCacheInit(fd, head);
+
+    /* verify directory entry, only the low 6 attribute bits are defined */
+    if(head->dir->DIR_Attr & ~ATTR_VALID_MASK){
         printf("Error in reading Directory...");
         exit(EXIT_FAILURE);
     }    
@@ -55,36 +124,17 @@ fat32Head* createHead(int fd)
 void bootSectorInit(int fd, fat32Head * head){
     
         /* Read boot sector */
-        int length = read(fd,(void*)head->bs,sizeof(fat32BS));
-
-		if(length < sizeof(fat32BS)){
-			perror("bootSectorInit read error");
-			exit(EXIT_FAILURE);
-		}      
+        readVolume(head, (void*)head->bs, sizeof(fat32BS), 0);
 
         /* null terminate strings */
         head->bs->BS_VolLab[BS_VolLab_LENGTH-1] = '\0'; 
         head->bs->BS_FilSysType[BS_FilSysType_LENGTH-1] = '\0';
 }
 
-void dirInit(int fd, fat32Head * head, uint32_t dirClusAddr){ 
-
-    int error;
-
-    /* Seek to directory sector */
-    error = lseek(fd, dirClusAddr, SEEK_SET);
-
-    if(error == SEEK_ERR){
-		perror("bootSectorInit seek error");
-		exit(EXIT_FAILURE);
-	}   
+void dirInit(int fd, fat32Head * head, uint64_t dirClusAddr){ 
 
     /* Read directory sector */
-    error = read(fd, (void*)head->dir,sizeof(fat32Dir));
-    if(error < sizeof(fat32Dir)){
-		perror("bootSectorInit read error");
-		exit(EXIT_FAILURE);
-	}   
+    readVolume(head, (void*)head->dir, sizeof(fat32Dir), dirClusAddr);
 
     /* null terminate strings */
     head->dir->DIR_Name[DIR_NAME_LENGTH-1] = '\0';
@@ -92,23 +142,8 @@ void dirInit(int fd, fat32Head * head, uint32_t dirClusAddr){
 }
 void fsiInit(int fd, fat32Head * head, uint32_t fsiSecNum){
     
-    int error;
-
-    /* Seek to FSInfo sector */
-    error = lseek(fd, fsiSecNum*head->bs->BPB_BytesPerSec, SEEK_SET);
-
-    if(error == SEEK_ERR){
-		perror("fsiInit seek error");
-		exit(EXIT_FAILURE);
-	}   
-
     /* Read FSInfo sector */
-    error = read(fd, (void*)head->fsi,sizeof(FSInfo));
-    
-    if(error < sizeof(FSInfo)){
-		perror("fsiInit read error");
-		exit(EXIT_FAILURE);
-	}   
+    readVolume(head, (void*)head->fsi, sizeof(FSInfo), (off_t) fsiSecNum*head->bs->BPB_BytesPerSec);
 
     /* Verifying the read was indeed in the FSInfo sector */
     if(head->fsi->FSI_LeadSig != FSI_LEADSIG || head->fsi->FSI_TrailSig != FSI_TRAILSIG)
@@ -119,9 +154,91 @@ void fsiInit(int fd, fat32Head * head, uint32_t fsiSecNum){
     }
 }
 
-fat32Dir *readDir(int fd, fat32Head * head, uint32_t secNum, uint32_t dirNum){
+void fatCacheInit(int fd, fat32Head * head){
+
+    uint32_t activeFat = 0;
+
+    /* with mirroring disabled, only the FAT numbered in the low bits is active */
+    if(head->bs->BPB_ExtFlags & FAT_MIRROR_DISABLED){
+        activeFat = head->bs->BPB_ExtFlags & FAT_ACTIVE_MASK;
+    }
+
+    uint64_t fatBytes = (uint64_t) head->bs->BPB_FATSz32 * head->bs->BPB_BytesPerSec;
+
+    head->fatOffset = ((uint64_t) head->bs->BPB_RsvdSecCnt + (uint64_t) activeFat * head->bs->BPB_FATSz32)
+                        * head->bs->BPB_BytesPerSec;
+    head->fatNumEnts = fatBytes / FAT_ENT_SZ;
+    head->fatNumPages = (fatBytes + FAT_PAGE_SZ - 1) / FAT_PAGE_SZ;
+
+    /* the FAT may have more entries than the volume has clusters */
+    uint64_t metaSec = head->bs->BPB_RsvdSecCnt + (uint64_t) head->bs->BPB_NumFATs * head->bs->BPB_FATSz32;
+    uint64_t lastClus = (head->bs->BPB_TotSec32 - metaSec) / head->bs->BPB_SecPerClus + ROOT_DIR_CLUS_NUM - 1;
+    head->lastClus = (lastClus < head->fatNumEnts) ? (uint32_t) lastClus : head->fatNumEnts - 1;
+
+    head->fatPages = (uint32_t**) calloc(head->fatNumPages, sizeof(uint32_t*));
+    if(head->fatPages == NULL) {
+        perror("fatCacheInit malloc error:");
+        exit(EXIT_FAILURE);
+    }
+
+    /* a mapped volume needs no FAT pages, entries are read in place */
+    head->fatMap = (const uint32_t*) mapView(head, head->fatOffset, fatBytes);
+}
+
+/* Reads FAT page pageNum into the FAT cache. The last page
+   may be short, the remainder is left zeroed (free clusters) */
+static uint32_t * fatPageLoad(fat32Head * head, uint32_t pageNum){
+
+    uint32_t * page = (uint32_t*) calloc(FAT_PAGE_ENTS, FAT_ENT_SZ);
+
+    if(page == NULL) {
+        perror("fatPageLoad malloc error:");
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t pageOffset = (uint64_t) pageNum * FAT_PAGE_SZ;
+    uint64_t pageBytes = (uint64_t) head->fatNumEnts * FAT_ENT_SZ - pageOffset;
+    if(pageBytes > FAT_PAGE_SZ) pageBytes = FAT_PAGE_SZ;
+
+    /* Read the whole page with a single call */
+    readVolume(head, page, pageBytes, head->fatOffset + pageOffset);
+
+    /* another thread may have loaded the same page meanwhile, the first one is kept */
+    uint32_t * expected = NULL;
+    if(!__atomic_compare_exchange_n(&head->fatPages[pageNum], &expected, page, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+        free(page);
+        page = expected;
+    }
+    return page;
+}
+
+uint32_t fatEntry(fat32Head * head, uint32_t clusNum){
+
+    if(clusNum >= head->fatNumEnts){
+        return CLUSENT_AND_OPERATOR;
+    }
+
+    if(head->fatMap != NULL){
+        return head->fatMap[clusNum] & CLUSENT_AND_OPERATOR;
+    }
+
+    uint32_t pageNum = clusNum / FAT_PAGE_ENTS;
+    uint32_t * page = __atomic_load_n(&head->fatPages[pageNum], __ATOMIC_ACQUIRE);
+
+    if(page == NULL){
+        page = fatPageLoad(head, pageNum);
+    }
+
+    return page[clusNum % FAT_PAGE_ENTS] & CLUSENT_AND_OPERATOR;
+}
+
+uint64_t clusOffset(fat32Head * head, uint32_t clusNum){
+
+    return head->dataOffset + (uint64_t) (clusNum - 2) * head->bytesPerClus;
+}
+
+fat32Dir *readDir(int fd, fat32Head * head, uint64_t secNum, uint32_t dirNum){
 
-    int error;
     fat32Dir *currentDir = (fat32Dir*) malloc(sizeof(fat32Dir));
 
     if(currentDir == NULL) {
@@ -129,54 +246,309 @@ fat32Dir *readDir(int fd, fat32Head * head, uint32_t secNum, uint32_t dirNum){
         exit(EXIT_FAILURE);
     }
 
-    /* Seek to specified directory sector */
-    error = lseek(fd, secNum + dirNum, SEEK_SET);
-    
-    if(error == SEEK_ERR){
-		perror("readDir seek error");
-		exit(EXIT_FAILURE);
-	} 
-
     /* Read specified directory sector */
-    error = read(fd,(void*)currentDir, sizeof(fat32Dir)); 
-        
-    if(error < sizeof(fat32Dir)){
-		perror("readDir read error");
-		exit(EXIT_FAILURE);
-	}   
+    readVolume(head, (void*)currentDir, sizeof(fat32Dir), (off_t) secNum + dirNum);
 
     return currentDir;
 }
 
-uint32_t * readFromOffset(int fd, fat32Head * head, uint32_t secNum, uint32_t offset){
+uint32_t * readFromOffset(int fd, fat32Head * head, uint64_t secNum, uint32_t offset){
 
-    int error;
-    uint32_t * buffer = (uint32_t*) malloc(secNum* sizeof(uint32_t));
+    uint32_t * buffer = (uint32_t*) malloc(OFF_READ_SZ);
     if(buffer == NULL) {
         perror("readFromOffset malloc error:");
         exit(EXIT_FAILURE);
     }
 
-    /* Seek to specified sector using sector number and offset */
-    error = lseek(fd, secNum*head->bs->BPB_BytesPerSec + offset, SEEK_SET);
-        
-    if(error == SEEK_ERR){
-		perror("readFromOffset seek error");
-		exit(EXIT_FAILURE);
-	} 
-
     /* Read specified sector and offset */
-    error = read(fd, buffer, OFF_READ_SZ);
-            
-    if(error < OFF_READ_SZ){
-		perror("readFromOffset read error");
-		exit(EXIT_FAILURE);
-	}  
+    readVolume(head, buffer, OFF_READ_SZ, (off_t) (secNum*head->bs->BPB_BytesPerSec + offset));
 
     return buffer;
 }
 
+/* Returns the entries of cluster clus of the directory, straight
+   from the mapping of a mapped volume, otherwise read into it->buf,
+   which is allocated on first use */
+static const unsigned char * dirIterLoad(fat32DirIter * it, uint32_t clus){
+
+    fat32Head * head = it->head;
+    const unsigned char * ents = mapView(head, clusOffset(head, clus), head->bytesPerClus);
+    if(ents != NULL) return ents;
+
+    if(it->buf == NULL){
+        it->buf = (unsigned char*) malloc(head->bytesPerClus);
+        if(it->buf == NULL) {
+            perror("dirIterInit malloc error:");
+            exit(EXIT_FAILURE);
+        }
+    }
+    readVolume(head, it->buf, head->bytesPerClus, clusOffset(head, clus));
+    return it->buf;
+}
+
+void dirIterInit(fat32Head * head, fat32DirIter * it, uint32_t dirClus){
+
+    it->head = head;
+    it->clus = dirClus;
+    it->index = 0;
+    it->entsPerClus = head->bytesPerClus / sizeof(fat32Dir);
+    it->clusLeft = head->fatNumEnts;
+    it->done = (dirClus < ROOT_DIR_CLUS_NUM || dirClus > head->lastClus);
+    it->lfnSlots = 0;
+    it->lfnNextOrd = 0;
+    it->longName[0] = '\0';
+    it->buf = NULL;
+    it->ents = NULL;
+
+    /* read in the first cluster */
+    if(!it->done){
+        it->ents = dirIterLoad(it, dirClus);
+        it->clusLeft--;
+    }
+}
+
+/* Appends code point cp to the UTF-8 string at out, which has room
+   for len bytes. Returns the number of bytes written, 0 if it did not fit. */
+static size_t putUtf8(char * out, size_t len, uint32_t cp){
+
+    if(cp < 0x80 && len >= 1){
+        out[0] = cp;
+        return 1;
+    }
+    if(cp < 0x800 && len >= 2){
+        out[0] = 0xC0 | (cp >> 6);
+        out[1] = 0x80 | (cp & 0x3F);
+        return 2;
+    }
+    if(cp < 0x10000 && len >= 3){
+        out[0] = 0xE0 | (cp >> 12);
+        out[1] = 0x80 | ((cp >> 6) & 0x3F);
+        out[2] = 0x80 | (cp & 0x3F);
+        return 3;
+    }
+    if(cp >= 0x10000 && len >= 4){
+        out[0] = 0xF0 | (cp >> 18);
+        out[1] = 0x80 | ((cp >> 12) & 0x3F);
+        out[2] = 0x80 | ((cp >> 6) & 0x3F);
+        out[3] = 0x80 | (cp & 0x3F);
+        return 4;
+    }
+    return 0;
+}
+
+void lfnDecode(const uint16_t * chars, size_t numChars, char out[LFN_NAME_SZ]){
+
+    size_t pos = 0, i;
+
+    for(i = 0; i < numChars && chars[i] != LFN_CHAR_END; i++){
+
+        uint32_t cp = chars[i];
+
+        /* join surrogate pairs, lone surrogates become U+FFFD */
+        if(cp >= UTF16_HIGH_FIRST && cp < UTF16_LOW_FIRST && i + 1 < numChars &&
+                chars[i + 1] >= UTF16_LOW_FIRST && chars[i + 1] <= UTF16_LOW_LAST){
+            cp = UTF16_SURR_BASE + ((cp - UTF16_HIGH_FIRST) << UTF16_SURR_SHIFT) + (chars[++i] - UTF16_LOW_FIRST);
+        }
+        else if(cp >= UTF16_HIGH_FIRST && cp <= UTF16_LOW_LAST){
+            cp = UTF8_REPLACEMENT;
+        }
+
+        size_t n = (cp < ' ' || cp == '/') ? 0 : putUtf8(out + pos, LFN_NAME_SZ - 1 - pos, cp);
+
+        if(n == 0){
+            pos = 0;
+            break;
+        }
+        pos += n;
+    }
+
+    out[pos] = '\0';
+
+    if(strcmp(out, ".") == 0 || strcmp(out, "..") == 0){
+        out[0] = '\0';
+    }
+}
+
+/* Converts the assembled long name to UTF-8 in it->longName */
+static void lfnToUtf8(fat32DirIter * it){
+
+    lfnDecode(it->lfnChars, (size_t) it->lfnSlots * LFN_SLOT_CHARS, it->longName);
+}
+
+/* Feeds the entry just returned to the long name assembler. Slots
+   must arrive in descending order with the same checksum, and the
+   short entry that follows must match that checksum, otherwise the
+   slots are dropped as orphans. */
+static void lfnParse(fat32DirIter * it, const fat32Dir * dir){
+
+    unsigned char first = (unsigned char) dir->DIR_Name[0];
+
+    it->longName[0] = '\0';
+
+    if(dir->DIR_Attr != INV_DIR){
+
+        /* a short entry ends the pending sequence */
+        if(it->lfnSlots > 0 && it->lfnNextOrd == 0 && first != FREE_DIR &&
+                shortNameChecksum(dir->DIR_Name) == it->lfnChecksum){
+            lfnToUtf8(it);
+        }
+        it->lfnSlots = 0;
+        return;
+    }
+
+    const fat32LongDir * slot = (const fat32LongDir*) dir;
+    uint8_t ord = slot->LDIR_Ord & LFN_ORD_MASK;
+
+    if(first == FREE_DIR || ord == 0 || ord > LFN_MAX_SLOTS){
+        it->lfnSlots = 0;
+        return;
+    }
+
+    /* the last slot comes first and starts a new sequence */
+    if(slot->LDIR_Ord & LFN_LAST_ENTRY){
+        it->lfnSlots = ord;
+        it->lfnNextOrd = ord;
+        it->lfnChecksum = slot->LDIR_Chksum;
+    }
+
+    if(it->lfnSlots == 0 || ord != it->lfnNextOrd || slot->LDIR_Chksum != it->lfnChecksum){
+        it->lfnSlots = 0;
+        return;
+    }
+
+    uint16_t * chars = it->lfnChars + (size_t) (ord - 1) * LFN_SLOT_CHARS;
+    memcpy(chars, slot->LDIR_Name1, sizeof(slot->LDIR_Name1));
+    chars += sizeof(slot->LDIR_Name1) / sizeof(uint16_t);
+    memcpy(chars, slot->LDIR_Name2, sizeof(slot->LDIR_Name2));
+    chars += sizeof(slot->LDIR_Name2) / sizeof(uint16_t);
+    memcpy(chars, slot->LDIR_Name3, sizeof(slot->LDIR_Name3));
+    it->lfnNextOrd--;
+}
+
+const fat32Dir * dirIterNext(fat32DirIter * it){
+
+    if(it->done) return NULL;
+
+    /* cluster used up, move on to the next cluster of the chain */
+    if(it->index == it->entsPerClus){
+
+        uint32_t nextClus = fatEntry(it->head, it->clus);
+
+        if(nextClus >= EOC || nextClus < ROOT_DIR_CLUS_NUM || nextClus > it->head->lastClus || it->clusLeft == 0){
+            it->done = 1;
+            return NULL;
+        }
+
+        it->ents = dirIterLoad(it, nextClus);
+        it->clus = nextClus;
+        it->index = 0;
+        it->clusLeft--;
+    }
+
+    const fat32Dir * dir = (const fat32Dir*) (it->ents + (size_t) it->index * sizeof(fat32Dir));
+
+    /* a zero first byte marks the end of the directory */
+    if((unsigned char) dir->DIR_Name[0] == 0x00){
+        it->done = 1;
+        return NULL;
+    }
+
+    it->index++;
+    lfnParse(it, dir);
+    return dir;
+}
+
+uint8_t shortNameChecksum(const char name[DIR_NAME_LENGTH]){
+
+    uint8_t sum = 0;
+    int i;
+
+    for(i = 0; i < DIR_NAME_LENGTH; i++){
+        sum = ((sum & 1) << 7) + (sum >> 1) + (uint8_t) name[i];
+    }
+    return sum;
+}
+
+void dirIterFree(fat32DirIter * it){
+
+    free(it->buf);
+    it->buf = NULL;
+}
+
+int mapVolume(int fd, fat32Head * head){
+
+    struct stat st;
+
+    if(fstat(fd, &st) == -1 || st.st_size <= 0){
+        perror("mapVolume stat error");
+        return -1;
+    }
+
+    void * map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+    if(map == MAP_FAILED){
+        perror("mapVolume mmap error");
+        return -1;
+    }
+
+    head->map = (unsigned char*) map;
+    head->mapLen = st.st_size;
+    return 0;
+}
+
+const void * mapView(fat32Head * head, off_t offset, size_t len){
+
+    if(head->map == NULL || offset < 0 || (uint64_t) offset + len > head->mapLen){
+        return NULL;
+    }
+
+    return head->map + offset;
+}
+
+int tryReadVolume(fat32Head * head, void * buf, size_t len, off_t offset){
+
+    /* served straight from the mapping, no system call */
+    const void * src = mapView(head, offset, len);
+    if(src != NULL){
+        memcpy(buf, src, len);
+        return 0;
+    }
+
+    ssize_t error = pread(head->fd, buf, len, offset);
+
+    if(error == READ_ERR){
+        return -1;
+    }
+    if((size_t) error < len){
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+void readVolume(fat32Head * head, void * buf, size_t len, off_t offset){
+
+    if(tryReadVolume(head, buf, len, offset) == 0) return;
+
+    if(errno == EIO){
+        printf("readVolume read error: short read at offset %" PRIu64 "\n", (uint64_t) offset);
+    }
+    else{
+        perror("readVolume read error");
+    }
+    exit(EXIT_FAILURE);
+}
+
 void cleanupHead(fat32Head *h){
+    uint32_t i;
+
+    for(i = 0; i < h->fatNumPages; i++){
+        free(h->fatPages[i]);
+    }
+    free(h->fatPages);
+    if(h->map != NULL){
+        munmap(h->map, h->mapLen);
+    }
 	free(h->bs);
     free(h->dir);
     free(h->fsi);
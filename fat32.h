@@ -12,6 +12,7 @@
 
 #include <inttypes.h>
 #include <stdio.h>
+#include <sys/types.h>
 
 /* boot sector constants */
 #define BS_OEMName_LENGTH 8
@@ -34,6 +35,7 @@
 #define V_ARCHIVE      0x4C
 #define INV_DIR	       0xF
 #define INV_ARCHIVE    0x22
+#define ATTR_VALID_MASK 0x3F
 
 /* FSInfo sector constants */
 #define FSI_Reserved1_LENGTH 480
@@ -45,6 +47,20 @@
 #define DIR_NAME_LENGTH 11
 #define ROOT_DIR_CLUS_NUM 2
 
+/* long name (VFAT) constants */
+#define LFN_ORD_MASK 0x1F
+#define LFN_LAST_ENTRY 0x40
+#define LFN_MAX_SLOTS 20
+#define LFN_SLOT_CHARS 13
+#define LFN_NAME_SZ 1024
+#define LFN_CHAR_END 0x0000
+#define UTF16_HIGH_FIRST 0xD800
+#define UTF16_LOW_FIRST 0xDC00
+#define UTF16_LOW_LAST 0xDFFF
+#define UTF16_SURR_BASE 0x10000
+#define UTF16_SURR_SHIFT 10
+#define UTF8_REPLACEMENT 0xFFFD
+
 /* Cluster constants */
 #define EOC 0x0FFFFFF8
 #define CLUSENT_AND_OPERATOR 0x0FFFFFFF
@@ -54,6 +70,16 @@
 /* Offset constants */
 #define OFF_READ_SZ 32
 
+/* FAT cache constants */
+#define FAT_ENT_SZ 4
+#define FAT_PAGE_SZ 65536
+#define FAT_PAGE_ENTS (FAT_PAGE_SZ / FAT_ENT_SZ)
+#define FAT_MIRROR_DISABLED 0x80
+#define FAT_ACTIVE_MASK 0x0F
+
+/* createHead flags */
+#define HEAD_MMAP 0x01
+
 /* Seek/Read error constants */
 #define SEEK_ERR -1
 #define READ_ERR -1
@@ -106,13 +132,33 @@ typedef struct fat32BS_struct fat32BS;
 
 /* FAT32 Head struct, contains a pointer 
    to the boot sector struct, FSinfo sector
-   struct and the directory struct. */
+   struct and the directory struct. Also owns
+   the cache of the active FAT, which is filled
+   one page at a time as chains are followed. */
 struct fat32Head {
 
 	struct fat32BS_struct * bs;
 	struct FSInfo_struct * fsi;
 	struct fat32Dir_struct * dir;
 
+	int fd; //file descriptor of the opened volume
+	uint32_t bytesPerClus; //cluster size in bytes
+	uint64_t dataOffset; //byte offset of the data region (cluster 2)
+	uint32_t ** fatPages; //cached FAT pages, NULL until first used
+	uint32_t fatNumPages; //number of pages spanning one FAT
+	uint32_t fatNumEnts; //number of entries in one FAT
+	uint32_t lastClus; //last data cluster, chains are cut at entries past it
+	uint64_t fatOffset; //byte offset of the active FAT
+
+	unsigned char * map; //read-only mapping of the whole volume, NULL if not mapped
+	uint64_t mapLen; //length of the mapping in bytes
+	const uint32_t * fatMap; //active FAT inside the mapping, NULL if not mapped
+
+	struct fat32DirCache_struct * dirCache; //indexed directories, see dirindex.h
+	struct fat32Sidecar_struct * sidecar; //mapped sidecar catalog, see sidecar.h
+	struct fat32FreeMap_struct * freeMap; //free clusters found in the FAT, see freemap.h
+	struct fat32Writer_struct * writer; //free runs and pending FAT updates, see fatwrite.h
+
 };
 #pragma pack(pop)
 typedef struct fat32Head fat32Head;
@@ -159,30 +205,139 @@ struct fat32Dir_struct {
 #pragma pack(pop)
 typedef struct fat32Dir_struct fat32Dir;
 
+/* Long name directory entry struct,
+   one slot of a VFAT long name, stored in front of the short entry
+   it belongs to, last slot first */
+#pragma pack(push)
+#pragma pack(1)
+struct fat32LongDir_struct {
+	uint8_t LDIR_Ord; //slot number, LFN_LAST_ENTRY set on the last slot
+	uint16_t LDIR_Name1[5]; //characters 1-5 of the slot (UCS-2)
+	uint8_t LDIR_Attr; //always INV_DIR
+	uint8_t LDIR_Type; //zero for name slots
+	uint8_t LDIR_Chksum; //checksum of the short name the slot belongs to
+	uint16_t LDIR_Name2[6]; //characters 6-11 of the slot
+	uint16_t LDIR_FstClusLO; //always zero
+	uint16_t LDIR_Name3[2]; //characters 12-13 of the slot
+};
+#pragma pack(pop)
+typedef struct fat32LongDir_struct fat32LongDir;
+
+/* Directory iterator struct,
+   reads a directory one whole cluster at a time into a
+   reusable buffer and hands out the entries in place. Long name
+   slots are assembled as they stream past, so the long name of a
+   short entry is ready when the short entry is returned. */
+struct fat32DirIter_struct {
+	fat32Head * head;
+	const unsigned char * ents; //entries of the current cluster, in the mapping or buf
+	unsigned char * buf; //one cluster read from the volume, NULL until the first read
+	uint32_t clus; //cluster currently held in ents
+	uint32_t index; //index of the next entry in ents
+	uint32_t entsPerClus; //number of entries in one cluster
+	uint32_t clusLeft; //clusters that may still be read, guards against looping chains
+	int done; //set once the end of the directory is reached
+	uint16_t lfnChars[LFN_MAX_SLOTS * LFN_SLOT_CHARS]; //characters of the pending long name
+	uint8_t lfnSlots; //slots in the pending long name, 0 if none is pending
+	uint8_t lfnNextOrd; //ordinal of the next slot expected, 0 once all slots were seen
+	uint8_t lfnChecksum; //short name checksum carried by the pending slots
+	char longName[LFN_NAME_SZ]; //UTF-8 long name of the last entry returned, empty if it has none
+};
+typedef struct fat32DirIter_struct fat32DirIter;
+
+/* Returns NULL if the volume open in fd has a FAT32 boot sector, a
+   valid FSInfo sector and root cluster, and holds its FATs and data
+   region, or else the reason it cannot be opened. These are all the
+   checks createHead exits on, so callers that must not exit check
+   first. */
+const char * verifyVolume(int fd);
+
 /* Initializes a fat32 head using the given file
    descriptor. Allocates the head and initializes its boot
    sector, FSInfo sector and Directory sctor. Verifies that
-   each initialization was successful and returns the head. */
-fat32Head* createHead(int fd);
+   each initialization was successful and returns the head.
+   With HEAD_MMAP set in flags, the volume is mapped once and
+   every read is served from the mapping; if the volume cannot
+   be mapped, reads fall back to pread. */
+fat32Head* createHead(int fd, int flags);
+
+/* Maps the whole volume read-only into the head. Returns 0
+   on success, -1 if the volume could not be mapped. */
+int mapVolume(int fd, fat32Head * head);
+
+/* Reads len bytes at byte offset into buf, copying from the
+   volume mapping when there is one and using pread otherwise.
+   Exits if the volume cannot be read. */
+void readVolume(fat32Head * head, void * buf, size_t len, off_t offset);
+
+/* readVolume for callers that must not exit, such as the server and
+   the FUSE mount. Returns 0, or -1 with errno set, EIO on a short read. */
+int tryReadVolume(fat32Head * head, void * buf, size_t len, off_t offset);
+
+/* Returns a pointer to len bytes at byte offset inside the
+   volume mapping, or NULL if the volume is not mapped or the
+   range lies outside of it. No data is copied. */
+const void * mapView(fat32Head * head, off_t offset, size_t len);
 
 /* Reads and initializes the boot sector. */
 void bootSectorInit(int fd, fat32Head * head);
 
-/* Reads and initializes the directory sector */
-void dirInit(int fd, fat32Head * head, uint32_t dirClusAddr);
+/* Reads and initializes the directory sector at byte offset dirClusAddr */
+void dirInit(int fd, fat32Head * head, uint64_t dirClusAddr);
 
 /* Reads and initializes the FSInfo sector */
 void fsiInit(int fd, fat32Head * head, uint32_t fsiSecNum);
 
-/* Reads a directory using the given sector number (sectorNum),
-   and a directory number (dirNum). Returns a malloc'd 
-   fat32Dir pointer */
-fat32Dir *readDir(int fd, fat32Head * head, uint32_t sectorNum, uint32_t dirNum);
+/* Sets up the FAT cache for the active FAT. No FAT data 
+   is read until an entry is requested from fatEntry */
+void fatCacheInit(int fd, fat32Head * head);
+
+/* Returns the FAT entry of cluster clusNum from the FAT cache,
+   with the reserved high 4 bits masked off. Reads in the FAT 
+   page holding the entry on first use. Clusters past the
+   end of the FAT are reported as end of chain. Safe to call
+   from several threads at once. */
+uint32_t fatEntry(fat32Head * head, uint32_t clusNum);
+
+/* Returns the 64-bit byte offset of the first sector of
+   cluster clusNum in the volume */
+uint64_t clusOffset(fat32Head * head, uint32_t clusNum);
+
+/* Reads a directory using the given byte address of the sector
+   (sectorNum), and a byte offset into it (dirNum). Returns a 
+   malloc'd fat32Dir pointer */
+fat32Dir *readDir(int fd, fat32Head * head, uint64_t sectorNum, uint32_t dirNum);
 
 /* Reads a directory using the given sector number (sectorNum),
    and an offseet number (offset). Returns a malloc'd 
    uint32_t pointer */
-uint32_t * readFromOffset(int fd, fat32Head * head, uint32_t secNum, uint32_t offset);
+uint32_t * readFromOffset(int fd, fat32Head * head, uint64_t secNum, uint32_t offset);
+
+/* Starts iterating the directory whose first cluster is dirClus.
+   Release the iterator with dirIterFree. */
+void dirIterInit(fat32Head * head, fat32DirIter * it, uint32_t dirClus);
+
+/* Returns the next 32-byte entry of the directory, including free
+   and long name entries, or NULL once the end of directory marker
+   or the end of the cluster chain is reached. On a mapped volume the
+   entry points into the mapping, otherwise into the iterator's
+   buffer, and is valid until the next call. Each cluster of an
+   unmapped volume is read with a single read. After a short entry is returned, it->longName holds its long name
+   if a complete slot sequence with a matching checksum preceded it. */
+const fat32Dir * dirIterNext(fat32DirIter * it);
+
+/* Returns the checksum of an 8.3 short name, as stored in the
+   long name slots that belong to it */
+uint8_t shortNameChecksum(const char name[DIR_NAME_LENGTH]);
+
+/* Converts numChars UTF-16 characters of a long name, ending early
+   at a null character, to UTF-8 in out. Names holding control
+   characters or '/', and the names "." and "..", are not valid file
+   names and leave out empty. */
+void lfnDecode(const uint16_t * chars, size_t numChars, char out[LFN_NAME_SZ]);
+
+/* Releases the iterator's cluster buffer, if it has one */
+void dirIterFree(fat32DirIter * it);
 
 /* Deallocates head and all its pointers  */
 void cleanupHead(fat32Head *h);
@@ -0,0 +1,1169 @@
+/**********************************************************************
+  Module: fatwrite.c
+  Author: Junseok Lee
+
+ PUT, MKDIR and RM, on a free run allocator with FAT updates
+ written once per sector before the entries that use them.
+
+**********************************************************************/
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "fatwrite.h"
+#include "freemap.h"
+#include "dirindex.h"
+#include "sidecar.h"
+#include "shell.h"
+
+#define DIR_NO_SLOT 0xFFFFFFFF
+#define LFN_PAD 0xFFFF //characters of the last slot after the terminator
+#define SHORT_INVALID "\"*+,/:;<=>?[\\]|" //characters that become '_' in a short name
+#define LONG_INVALID "\"*/:<>?\\|" //characters not allowed in a long name
+
+/* Directory slots struct,
+   one scan of a directory: its clusters, where new entries fit and
+   the entry found by name */
+struct dirSlots_struct {
+	uint32_t * chain; //clusters of the directory in chain order
+	uint32_t numClus;
+	uint32_t entsPerClus;
+	uint32_t endIdx; //index of the end marker, or of the first entry past the chain
+	uint32_t need; //entries the new name takes
+	uint32_t freeIdx; //first of need free entries in a row, DIR_NO_SLOT if the directory must grow
+	uint32_t foundIdx; //short entry of the name looked for, DIR_NO_SLOT if there is none
+	uint32_t foundSlots; //long name slots in front of it
+	fat32Dir found;
+	char (*shortNames)[DIR_NAME_LENGTH]; //short names in use, for numeric tails
+	uint32_t numShort;
+};
+typedef struct dirSlots_struct dirSlots;
+
+/* New entry struct,
+   the long name slots and short entry of one name */
+struct newEnt_struct {
+	fat32Dir ents[LFN_MAX_SLOTS + 1]; //slots, last slot first, then the short entry
+	uint32_t numEnts;
+	uint16_t chars[LFN_MAX_SLOTS * LFN_SLOT_CHARS];
+	uint32_t numChars;
+	char basis[DIR_NAME_LENGTH]; //short name before a numeric tail
+	int needTail; //the basis lost characters, so it gets a tail
+	int needLong; //the short name does not spell the name exactly
+};
+typedef struct newEnt_struct newEnt;
+
+static void * writeGrow(void * ptr, size_t size){
+
+	ptr = realloc(ptr, size);
+	if(ptr == NULL){
+		perror("fatwrite malloc error");
+		exit(EXIT_FAILURE);
+	}
+	return ptr;
+}
+
+/* Sets or clears the free bits of numClus clusters in the free map */
+static void markFree(fat32Head *h, uint32_t startClus, uint32_t numClus, int isFree){
+
+	fat32FreeMap * map = h->freeMap;
+	uint32_t c;
+
+	if(map == NULL) return;
+
+	for(c = startClus; c < startClus + numClus; c++){
+		uint8_t bit = 1 << (c % FREE_ENTS_PER_BYTE);
+		if(isFree) map->bits[c / FREE_ENTS_PER_BYTE] |= bit;
+		else map->bits[c / FREE_ENTS_PER_BYTE] &= ~bit;
+	}
+	if(isFree) map->freeCount += numClus;
+	else map->freeCount -= numClus;
+}
+
+/* Returns the writer of h for a new command, building the free runs
+   from the free map on first use. Returns NULL with errno set if the
+   volume is not open for writing. */
+static fat32Writer * writerOpen(fat32Head *h){
+
+	if(h->writer != NULL){
+		h->writer->fatWrites = 0;
+		h->writer->fatSectors = 0;
+		return h->writer;
+	}
+
+	int mode = fcntl(h->fd, F_GETFL);
+	if(mode == -1) return NULL;
+	if((mode & O_ACCMODE) == O_RDONLY){
+		errno = EROFS;
+		return NULL;
+	}
+
+	const fat32FreeMap * map = freeMapGet(h);
+	uint32_t last = h->lastClus;
+	uint32_t c = ROOT_DIR_CLUS_NUM;
+
+	fat32Writer * w = (fat32Writer*) calloc(1, sizeof(fat32Writer));
+	if(w == NULL){
+		perror("fatwrite malloc error");
+		exit(EXIT_FAILURE);
+	}
+
+	/* whole bytes of used clusters are skipped at once */
+	while(c <= last){
+		if(c % FREE_ENTS_PER_BYTE == 0 && map->bits[c / FREE_ENTS_PER_BYTE] == 0){
+			c += FREE_ENTS_PER_BYTE;
+			continue;
+		}
+		if(!FREE_MAP_TEST(map, c)){
+			c++;
+			continue;
+		}
+
+		uint32_t start = c;
+		while(c <= last && FREE_MAP_TEST(map, c)) c++;
+
+		if(w->numRuns == w->capRuns){
+			w->capRuns = w->capRuns ? w->capRuns * 2 : WRITE_RUNS_INIT;
+			w->runs = (allocRun*) writeGrow(w->runs, w->capRuns * sizeof(allocRun));
+		}
+		w->runs[w->numRuns].startClus = start;
+		w->runs[w->numRuns].numClus = c - start;
+		w->numRuns++;
+		w->freeCount += c - start;
+	}
+
+	/* FSInfo says where the last allocation ended */
+	uint32_t hint = h->fsi->FSI_Nxt_Free;
+	w->nextFree = (hint >= ROOT_DIR_CLUS_NUM && hint <= last) ? hint : ROOT_DIR_CLUS_NUM;
+
+	h->writer = w;
+	return w;
+}
+
+const fat32Writer * writerGet(fat32Head *h){
+
+	return h->writer;
+}
+
+void writerFree(fat32Head *h){
+
+	fat32Writer * w = h->writer;
+
+	if(w == NULL) return;
+
+	free(w->runs);
+	free(w->updates);
+	free(w);
+	h->writer = NULL;
+}
+
+/* Queues a new value for the FAT entry of clus */
+static void fatSet(fat32Writer * w, uint32_t clus, uint32_t value){
+
+	if(w->numUpdates == w->capUpdates){
+		w->capUpdates = w->capUpdates ? w->capUpdates * 2 : WRITE_UPDATES_INIT;
+		w->updates = (fatUpdate*) writeGrow(w->updates, w->capUpdates * sizeof(fatUpdate));
+	}
+	w->updates[w->numUpdates].clus = clus;
+	w->updates[w->numUpdates].value = value;
+	w->updates[w->numUpdates].seq = w->numUpdates;
+	w->numUpdates++;
+}
+
+/* Removes run r from the list */
+static void dropRun(fat32Writer * w, uint32_t r){
+
+	memmove(&w->runs[r], &w->runs[r + 1], (w->numRuns - r - 1) * sizeof(allocRun));
+	w->numRuns--;
+}
+
+/* Takes n clusters from the start of run r into ext */
+static void takeRun(fat32Head *h, fat32Writer * w, uint32_t r, uint32_t n, fat32Extent * ext){
+
+	ext->startClus = w->runs[r].startClus;
+	ext->numClus = n;
+
+	w->runs[r].startClus += n;
+	w->runs[r].numClus -= n;
+	w->freeCount -= n;
+	markFree(h, ext->startClus, n, 0);
+}
+
+static int compareRunSize(const void * a, const void * b, void * arg){
+
+	const allocRun * runs = (const allocRun*) arg;
+	uint32_t na = runs[*(const uint32_t*) a].numClus;
+	uint32_t nb = runs[*(const uint32_t*) b].numClus;
+
+	if(na != nb) return (na < nb) - (na > nb);
+	return (*(const uint32_t*) a > *(const uint32_t*) b) - (*(const uint32_t*) a < *(const uint32_t*) b);
+}
+
+static int compareExtents(const void * a, const void * b){
+
+	uint32_t ca = ((const fat32Extent*) a)->startClus;
+	uint32_t cb = ((const fat32Extent*) b)->startClus;
+
+	return (ca > cb) - (ca < cb);
+}
+
+/* Allocates numClus clusters and stores their extents, in chain
+   order, in the malloc'd *exts. The first run from nextFree on that
+   holds them all is used; if none does, the largest runs are, so the
+   file is split as little as it can be. Returns the number of
+   extents, 0 if there are not enough free clusters. */
+static uint32_t allocClusters(fat32Head *h, fat32Writer * w, uint32_t numClus, fat32Extent ** exts){
+
+	uint32_t lo = 0, hi = w->numRuns, i, n;
+
+	if(numClus == 0 || numClus > w->freeCount) return 0;
+
+	/* first run ending past the hint */
+	while(lo < hi){
+		uint32_t mid = lo + (hi - lo) / 2;
+		if(w->runs[mid].startClus + w->runs[mid].numClus <= w->nextFree) lo = mid + 1;
+		else hi = mid;
+	}
+
+	for(n = 0; n < w->numRuns; n++){
+		i = (lo + n) % w->numRuns;
+		if(w->runs[i].numClus >= numClus) break;
+	}
+
+	if(n < w->numRuns){
+		*exts = (fat32Extent*) writeGrow(NULL, sizeof(fat32Extent));
+		takeRun(h, w, i, numClus, *exts);
+		if(w->runs[i].numClus == 0) dropRun(w, i);
+		n = 1;
+	}
+	else{
+		/* largest runs first, then back in cluster order for reading */
+		uint32_t * order = (uint32_t*) writeGrow(NULL, w->numRuns * sizeof(uint32_t));
+		uint32_t left = numClus;
+
+		for(i = 0; i < w->numRuns; i++) order[i] = i;
+		qsort_r(order, w->numRuns, sizeof(uint32_t), compareRunSize, w->runs);
+
+		*exts = NULL;
+		for(n = 0; left > 0; n++){
+			uint32_t take = w->runs[order[n]].numClus < left ? w->runs[order[n]].numClus : left;
+			*exts = (fat32Extent*) writeGrow(*exts, (n + 1) * sizeof(fat32Extent));
+			takeRun(h, w, order[n], take, &(*exts)[n]);
+			left -= take;
+		}
+		free(order);
+
+		for(i = w->numRuns; i > 0; i--){
+			if(w->runs[i - 1].numClus == 0) dropRun(w, i - 1);
+		}
+		qsort(*exts, n, sizeof(fat32Extent), compareExtents);
+	}
+
+	/* the search goes on from the first free cluster past this one */
+	uint32_t end = (*exts)[n - 1].startClus + (*exts)[n - 1].numClus;
+	for(lo = 0, hi = w->numRuns; lo < hi;){
+		uint32_t mid = lo + (hi - lo) / 2;
+		if(w->runs[mid].startClus + w->runs[mid].numClus <= end) lo = mid + 1;
+		else hi = mid;
+	}
+	if(w->numRuns == 0) w->nextFree = ROOT_DIR_CLUS_NUM;
+	else if(lo == w->numRuns) w->nextFree = w->runs[0].startClus;
+	else w->nextFree = w->runs[lo].startClus > end ? w->runs[lo].startClus : end;
+	return n;
+}
+
+/* Returns startClus..startClus + numClus - 1 to the free runs,
+   merging it with the runs next to it */
+static void releaseRun(fat32Head *h, fat32Writer * w, uint32_t startClus, uint32_t numClus){
+
+	uint32_t lo = 0, hi = w->numRuns;
+
+	while(lo < hi){
+		uint32_t mid = lo + (hi - lo) / 2;
+		if(w->runs[mid].startClus < startClus) lo = mid + 1;
+		else hi = mid;
+	}
+
+	int joinPrev = lo > 0 && w->runs[lo - 1].startClus + w->runs[lo - 1].numClus == startClus;
+	int joinNext = lo < w->numRuns && startClus + numClus == w->runs[lo].startClus;
+
+	if(joinPrev && joinNext){
+		w->runs[lo - 1].numClus += numClus + w->runs[lo].numClus;
+		dropRun(w, lo);
+	}
+	else if(joinPrev){
+		w->runs[lo - 1].numClus += numClus;
+	}
+	else if(joinNext){
+		w->runs[lo].startClus = startClus;
+		w->runs[lo].numClus += numClus;
+	}
+	else{
+		if(w->numRuns == w->capRuns){
+			w->capRuns = w->capRuns ? w->capRuns * 2 : WRITE_RUNS_INIT;
+			w->runs = (allocRun*) writeGrow(w->runs, w->capRuns * sizeof(allocRun));
+		}
+		memmove(&w->runs[lo + 1], &w->runs[lo], (w->numRuns - lo) * sizeof(allocRun));
+		w->runs[lo].startClus = startClus;
+		w->runs[lo].numClus = numClus;
+		w->numRuns++;
+	}
+
+	w->freeCount += numClus;
+	markFree(h, startClus, numClus, 1);
+}
+
+/* Queues the FAT entries chaining exts one after the other, from
+   prevClus if it is not 0, ending the chain after the last one */
+static void linkChain(fat32Writer * w, const fat32Extent * exts, uint32_t numExt, uint32_t prevClus){
+
+	uint32_t e, c;
+
+	for(e = 0; e < numExt; e++){
+		if(prevClus != 0) fatSet(w, prevClus, exts[e].startClus);
+		for(c = exts[e].startClus; c + 1 < exts[e].startClus + exts[e].numClus; c++) fatSet(w, c, c + 1);
+		prevClus = exts[e].startClus + exts[e].numClus - 1;
+	}
+	fatSet(w, prevClus, FAT_EOC_MARK);
+}
+
+/* Queues the chain starting at firstClus to be freed and returns
+   its clusters to the free runs. Clusters already free, reached
+   through a broken chain, are left alone. Returns the number of
+   clusters freed. */
+static uint32_t freeChain(fat32Head *h, fat32Writer * w, uint32_t firstClus){
+
+	const fat32FreeMap * map = freeMapGet(h);
+	fat32ExtentIter it;
+	fat32Extent ext;
+	uint32_t freed = 0, c;
+
+	if(firstClus < ROOT_DIR_CLUS_NUM) return 0;
+
+	extentIterInit(h, &it, firstClus, 0);
+	while(nextExtent(h, &it, &ext)){
+		uint32_t start = ext.startClus;
+
+		for(c = ext.startClus; c <= ext.startClus + ext.numClus; c++){
+			int endRun = c == ext.startClus + ext.numClus || FREE_MAP_TEST(map, c);
+			if(endRun){
+				if(c > start) releaseRun(h, w, start, c - start);
+				freed += c - start;
+				start = c + 1;
+				continue;
+			}
+			fatSet(w, c, FAT_FREE);
+		}
+	}
+	return freed;
+}
+
+static int compareUpdates(const void * a, const void * b){
+
+	const fatUpdate * ua = (const fatUpdate*) a;
+	const fatUpdate * ub = (const fatUpdate*) b;
+
+	if(ua->clus != ub->clus) return (ua->clus > ub->clus) - (ua->clus < ub->clus);
+	return (ua->seq > ub->seq) - (ua->seq < ub->seq);
+}
+
+/* Writes the queued FAT updates, each run of neighbouring sectors
+   read once from the active FAT and written once to every FAT
+   copy, then FSInfo, and drops what was cached from the old
+   directories. Returns 0, or -1 with errno set. */
+static int writerCommit(fat32Head *h, fat32Writer * w){
+
+	uint32_t bps = h->bs->BPB_BytesPerSec;
+	uint64_t fatBytes = (uint64_t) h->bs->BPB_FATSz32 * bps;
+	uint64_t firstFat = (uint64_t) h->bs->BPB_RsvdSecCnt * bps;
+	uint32_t maxSecs = WRITE_FAT_SPAN / bps;
+	uint32_t * buf = (uint32_t*) writeGrow(NULL, WRITE_FAT_SPAN);
+	uint32_t i = 0, j, k;
+	int res = 0;
+
+	qsort(w->updates, w->numUpdates, sizeof(fatUpdate), compareUpdates);
+
+	while(i < w->numUpdates && res == 0){
+
+		uint32_t firstSec = (uint32_t) ((uint64_t) w->updates[i].clus * FAT_ENT_SZ / bps);
+		uint32_t lastSec = firstSec;
+
+		for(j = i; j < w->numUpdates; j++){
+			uint32_t sec = (uint32_t) ((uint64_t) w->updates[j].clus * FAT_ENT_SZ / bps);
+			if(sec > lastSec + 1 || sec - firstSec >= maxSecs) break;
+			lastSec = sec;
+		}
+
+		uint64_t spanOff = (uint64_t) firstSec * bps;
+		size_t spanLen = (size_t) (lastSec - firstSec + 1) * bps;
+
+		readVolume(h, buf, spanLen, h->fatOffset + spanOff);
+
+		/* the reserved high bits of each entry are kept */
+		for(; i < j; i++){
+			uint32_t e = w->updates[i].clus - (uint32_t) (spanOff / FAT_ENT_SZ);
+			buf[e] = (buf[e] & FETCH_AND_OPERATOR) | (w->updates[i].value & CLUSENT_AND_OPERATOR);
+
+			uint32_t * page = h->fatPages[w->updates[i].clus / FAT_PAGE_ENTS];
+			if(page != NULL) page[w->updates[i].clus % FAT_PAGE_ENTS] = buf[e];
+		}
+
+		/* with mirroring disabled only the active FAT is kept up to date */
+		for(k = 0; k < h->bs->BPB_NumFATs; k++){
+			uint64_t off = firstFat + k * fatBytes;
+			if((h->bs->BPB_ExtFlags & FAT_MIRROR_DISABLED) && off != h->fatOffset) continue;
+
+			if(pwrite(h->fd, buf, spanLen, off + spanOff) != (ssize_t) spanLen){
+				if(errno == 0) errno = EIO;
+				res = -1;
+				break;
+			}
+		}
+		w->fatWrites++;
+		w->fatSectors += lastSec - firstSec + 1;
+	}
+	free(buf);
+	w->numUpdates = 0;
+
+	if(res == 0){
+		h->fsi->FSI_Free_Count = w->freeCount;
+		h->fsi->FSI_Nxt_Free = w->nextFree;
+
+		off_t fsiOff = (off_t) h->bs->BPB_FSInfo * bps;
+		if(pwrite(h->fd, h->fsi, sizeof(FSInfo), fsiOff) != (ssize_t) sizeof(FSInfo)){
+			if(errno == 0) errno = EIO;
+			res = -1;
+		}
+	}
+
+	/* indexes and the sidecar describe the directories before the write */
+	dirCacheFree(h);
+	sidecarClose(h);
+	return res;
+}
+
+/* Gives up a write that failed part way. The runs and free map no
+   longer match the volume, so both are built again from the FAT on
+   the next write. Returns WRITE_IO_ERR with errno kept. */
+static int writeFailed(fat32Head *h){
+
+	int err = errno;
+
+	writerFree(h);
+	freeMapFree(h);
+	dirCacheFree(h);
+	sidecarClose(h);
+
+	errno = err;
+	return WRITE_IO_ERR;
+}
+
+/* Writes len bytes of buf at offset of the volume. Returns 0, or -1
+   with errno set. */
+static int writeVolume(fat32Head *h, const void * buf, size_t len, off_t offset){
+
+	const char * p = (const char*) buf;
+
+	while(len > 0){
+		ssize_t n = pwrite(h->fd, p, len, offset);
+		if(n <= 0){
+			if(n == 0) errno = EIO;
+			if(errno == EINTR) continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+		offset += n;
+	}
+	return 0;
+}
+
+/* Fills numClus clusters from startClus with zeros */
+static int zeroClusters(fat32Head *h, uint32_t startClus, uint32_t numClus){
+
+	void * zeros = calloc(1, h->bytesPerClus);
+	uint32_t c;
+	int res = 0;
+
+	if(zeros == NULL){
+		perror("fatwrite malloc error");
+		exit(EXIT_FAILURE);
+	}
+	for(c = startClus; c < startClus + numClus && res == 0; c++){
+		res = writeVolume(h, zeros, h->bytesPerClus, clusOffset(h, c));
+	}
+	free(zeros);
+	return res;
+}
+
+/* Copies size bytes of the local file srcFD into exts, inside the
+   kernel where it can, and zeros the rest of the last cluster.
+   Returns 0, or -1 with errno set. */
+static int copyIn(fat32Head *h, int srcFD, const fat32Extent * exts, uint32_t numExt, uint64_t size){
+
+	char * buf = NULL;
+	loff_t inOff = 0;
+	uint32_t e;
+	int kernel = 1;
+
+	for(e = 0; e < numExt && (uint64_t) inOff < size; e++){
+
+		loff_t outOff = clusOffset(h, exts[e].startClus);
+		uint64_t left = (uint64_t) exts[e].numClus * h->bytesPerClus;
+		if(left > size - inOff) left = size - inOff;
+
+		while(left > 0 && kernel){
+			ssize_t n = copy_file_range(srcFD, &inOff, h->fd, &outOff, left, 0);
+			if(n > 0){
+				left -= n;
+				continue;
+			}
+			if(n == 0){
+				errno = EIO;
+				free(buf);
+				return -1;
+			}
+			if(errno == EINTR) continue;
+			if(errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP){
+				free(buf);
+				return -1;
+			}
+			kernel = 0;
+		}
+
+		/* the rest goes through a buffer */
+		while(left > 0){
+			size_t len = left < WRITE_BLOCK ? (size_t) left : WRITE_BLOCK;
+			if(buf == NULL) buf = (char*) writeGrow(NULL, WRITE_BLOCK);
+
+			ssize_t n = pread(srcFD, buf, len, inOff);
+			if(n <= 0){
+				if(n == 0) errno = EIO;
+				if(errno == EINTR) continue;
+				free(buf);
+				return -1;
+			}
+			if(writeVolume(h, buf, n, outOff) != 0){
+				free(buf);
+				return -1;
+			}
+			inOff += n;
+			outOff += n;
+			left -= n;
+		}
+	}
+	free(buf);
+
+	/* no old data is left behind the end of the file */
+	uint32_t tail = (uint32_t) (size % h->bytesPerClus);
+	if(tail != 0){
+		const fat32Extent * last = &exts[numExt - 1];
+		uint64_t end = clusOffset(h, last->startClus + last->numClus - 1) + tail;
+		char * zeros = (char*) calloc(1, h->bytesPerClus - tail);
+		if(zeros == NULL){
+			perror("fatwrite malloc error");
+			exit(EXIT_FAILURE);
+		}
+		int res = writeVolume(h, zeros, h->bytesPerClus - tail, end);
+		free(zeros);
+		return res;
+	}
+	return 0;
+}
+
+/* Returns the byte offset of entry idx of the directory in s */
+static uint64_t entOffset(fat32Head *h, const dirSlots * s, uint32_t idx){
+
+	return clusOffset(h, s->chain[idx / s->entsPerClus]) + (uint64_t) (idx % s->entsPerClus) * sizeof(fat32Dir);
+}
+
+/* Scans the directory starting at dirClus: its clusters, the short
+   names in use, the entry named name if name is not NULL, and the
+   first need free entries in a row */
+static void dirScan(fat32Head *h, uint32_t dirClus, const char * name, uint32_t need, dirSlots * s){
+
+	fat32DirIter it;
+	const fat32Dir * dir;
+	char fmt[FMT_NAME_LENGTH];
+	uint32_t maxClus, capShort = 0, idx = 0, freeRun = 0, lfnRun = 0;
+	uint8_t lfnSum = 0;
+	uint32_t c = dirClus;
+
+	memset(s, 0, sizeof(*s));
+	s->need = need;
+	s->entsPerClus = h->bytesPerClus / sizeof(fat32Dir);
+	s->freeIdx = DIR_NO_SLOT;
+	s->foundIdx = DIR_NO_SLOT;
+
+	/* the clusters, bounded by the size a directory may have */
+	maxClus = DIR_MAX_ENTS / s->entsPerClus + 1;
+	s->chain = (uint32_t*) writeGrow(NULL, maxClus * sizeof(uint32_t));
+	while(c >= ROOT_DIR_CLUS_NUM && c <= h->lastClus && s->numClus < maxClus){
+		s->chain[s->numClus++] = c;
+		c = fatEntry(h, c);
+	}
+
+	dirIterInit(h, &it, dirClus);
+	if(s->numClus > 0) it.clusLeft = s->numClus - 1;
+
+	for(; (dir = dirIterNext(&it)) != NULL; idx++){
+
+		unsigned char first = (unsigned char) dir->DIR_Name[0];
+
+		if(first == FREE_DIR){
+			lfnRun = 0;
+			if(++freeRun == need && s->freeIdx == DIR_NO_SLOT) s->freeIdx = idx + 1 - need;
+			continue;
+		}
+		freeRun = 0;
+
+		/* consecutive slots of one long name, for RM */
+		if(dir->DIR_Attr == INV_DIR){
+			uint8_t sum = ((fat32LongDir*) dir)->LDIR_Chksum;
+			lfnRun = (lfnRun > 0 && sum == lfnSum) ? lfnRun + 1 : 1;
+			lfnSum = sum;
+			continue;
+		}
+
+		if(s->numShort == capShort){
+			capShort = capShort ? capShort * 2 : DIR_INDEX_NAMES_INIT;
+			s->shortNames = (char (*)[DIR_NAME_LENGTH]) writeGrow(s->shortNames, capShort * DIR_NAME_LENGTH);
+		}
+		memcpy(s->shortNames[s->numShort++], dir->DIR_Name, DIR_NAME_LENGTH);
+
+		if(name != NULL && s->foundIdx == DIR_NO_SLOT && !(dir->DIR_Attr & ATTR_VOLUME_ID)){
+			entryName(dir, fmt);
+			if(strcasecmp(fmt, name) == 0 || (it.longName[0] != NULL_TERM && strcasecmp(it.longName, name) == 0)){
+				s->foundIdx = idx;
+				s->foundSlots = (lfnRun > 0 && lfnSum == shortNameChecksum(dir->DIR_Name)) ? lfnRun : 0;
+				s->found = *dir;
+			}
+		}
+		lfnRun = 0;
+	}
+	dirIterFree(&it);
+
+	/* every entry from the end marker on is free */
+	s->endIdx = idx;
+	if(s->freeIdx == DIR_NO_SLOT && freeRun + s->numClus * s->entsPerClus - idx >= need){
+		s->freeIdx = idx - freeRun;
+	}
+}
+
+static void dirSlotsFree(dirSlots * s){
+
+	free(s->chain);
+	free(s->shortNames);
+}
+
+/* Writes n entries from index idx of the directory in s, one write
+   per cluster */
+static int writeEnts(fat32Head *h, const dirSlots * s, uint32_t idx, const fat32Dir * ents, uint32_t n){
+
+	while(n > 0){
+		uint32_t inClus = s->entsPerClus - idx % s->entsPerClus;
+		if(inClus > n) inClus = n;
+
+		if(writeVolume(h, ents, inClus * sizeof(fat32Dir), entOffset(h, s, idx)) != 0) return -1;
+		ents += inClus;
+		idx += inClus;
+		n -= inClus;
+	}
+	return 0;
+}
+
+/* Decodes the next UTF-8 character of *p, moving *p past it.
+   Returns the code point, or -1 if the bytes are not UTF-8. */
+static int32_t utf8Next(const unsigned char ** p){
+
+	const unsigned char * s = *p;
+	int32_t cp;
+	int n, i;
+
+	if(s[0] < 0x80){ cp = s[0]; n = 1; }
+	else if((s[0] & 0xE0) == 0xC0){ cp = s[0] & 0x1F; n = 2; }
+	else if((s[0] & 0xF0) == 0xE0){ cp = s[0] & 0x0F; n = 3; }
+	else if((s[0] & 0xF8) == 0xF0){ cp = s[0] & 0x07; n = 4; }
+	else return -1;
+
+	for(i = 1; i < n; i++){
+		if((s[i] & 0xC0) != 0x80) return -1;
+		cp = (cp << 6) | (s[i] & 0x3F);
+	}
+	*p = s + n;
+	return cp;
+}
+
+/* Fills in ne from name: its UTF-16 characters, the basis of its
+   short name and whether it needs long name slots. Returns 0, or -1
+   if name is not a valid file name. */
+static int nameInit(const char * name, newEnt * ne){
+
+	const unsigned char * p = (const unsigned char*) name;
+	const char * dot = strrchr(name, '.');
+	size_t i, len = strlen(name);
+	int b = 0, e = 0;
+
+	memset(ne, 0, sizeof(*ne));
+
+	if(len == 0 || strcmp(name, DOT) == 0 || strcmp(name, DOTDOT) == 0) return -1;
+	if(name[len - 1] == '.' || name[len - 1] == ' ') return -1;
+
+	while(*p){
+		int32_t cp = utf8Next(&p);
+		if(cp < 0 || cp < ' ' || (cp < 0x80 && strchr(LONG_INVALID, cp) != NULL)) return -1;
+
+		if(cp >= UTF16_SURR_BASE){
+			if(ne->numChars + 2 > LFN_MAX_CHARS) return -1;
+			cp -= UTF16_SURR_BASE;
+			ne->chars[ne->numChars++] = UTF16_HIGH_FIRST + (cp >> UTF16_SURR_SHIFT);
+			ne->chars[ne->numChars++] = UTF16_LOW_FIRST + (cp & ((1 << UTF16_SURR_SHIFT) - 1));
+		}
+		else{
+			if(ne->numChars + 1 > LFN_MAX_CHARS) return -1;
+			ne->chars[ne->numChars++] = (uint16_t) cp;
+		}
+	}
+
+	/* the basis keeps what a short name can hold, upper cased; a
+	   leading dot is not an extension */
+	memset(ne->basis, SHORT_PAD, DIR_NAME_LENGTH);
+	if(dot == name) dot = NULL;
+
+	for(i = 0; i < len; i++){
+		unsigned char ch = (unsigned char) name[i];
+		char out;
+
+		if(name + i == dot) continue;
+		if(ch == ' ' || ch == '.'){
+			ne->needTail = 1;
+			continue;
+		}
+		if(ch >= 0x80){
+			/* one '_' per character, not per byte */
+			if((ch & 0xC0) == 0x80) continue;
+			out = '_';
+			ne->needTail = 1;
+		}
+		else if(strchr(SHORT_INVALID, ch) != NULL){
+			out = '_';
+			ne->needTail = 1;
+		}
+		else{
+			out = (char) toupper(ch);
+			if(out != (char) ch) ne->needLong = 1;
+		}
+
+		if(dot == NULL || name + i < dot){
+			if(b < SHORT_BASE_LEN) ne->basis[b++] = out;
+			else ne->needTail = 1;
+		}
+		else{
+			if(e < SHORT_EXT_LEN) ne->basis[SHORT_BASE_LEN + e++] = out;
+			else ne->needTail = 1;
+		}
+	}
+	if(b == 0) ne->needTail = 1;
+	if(ne->needTail) ne->needLong = 1;
+	return 0;
+}
+
+static void setFirstClus(fat32Dir * dir, uint32_t clus){
+
+	dir->DIR_FstClusHI = clus >> HEX_TEN;
+	dir->DIR_FstClusLO = clus & 0xFFFF;
+}
+
+/* Returns the entries name of ne takes. A name that needs no long
+   name and whose short name is taken is already in the directory, so
+   it never gets a tail and slots it was not counted for. */
+static uint32_t nameEntries(const newEnt * ne){
+
+	return ne->needLong ? (ne->numChars + LFN_SLOT_CHARS - 1) / LFN_SLOT_CHARS + 1 : 1;
+}
+
+/* Returns 1 if short name sn is in use in the directory of s */
+static int shortTaken(const dirSlots * s, const char sn[DIR_NAME_LENGTH]){
+
+	uint32_t i;
+
+	for(i = 0; i < s->numShort; i++){
+		if(memcmp(s->shortNames[i], sn, DIR_NAME_LENGTH) == 0) return 1;
+	}
+	return 0;
+}
+
+/* Stores the local time in the date and time form of directory entries */
+static void fatTime(uint16_t * date, uint16_t * clock, uint8_t * tenth){
+
+	time_t now = time(NULL);
+	struct tm tm;
+
+	localtime_r(&now, &tm);
+	*date = ((tm.tm_year + 1900 - FAT_YEAR_BASE) << FAT_YEAR_SHIFT) | ((tm.tm_mon + 1) << FAT_MONTH_SHIFT) | tm.tm_mday;
+	*clock = (tm.tm_hour << FAT_HOUR_SHIFT) | (tm.tm_min << FAT_MIN_SHIFT) | (tm.tm_sec / 2);
+	*tenth = (tm.tm_sec % 2) * 100;
+}
+
+/* Picks the short name of ne, adding a numeric tail ~n when the basis
+   lost characters or is taken, and builds the long name slots and
+   the short entry. Returns 0, or -1 if every tail is taken. */
+static int entriesInit(const dirSlots * s, newEnt * ne, uint8_t attr, uint32_t firstClus, uint32_t fileSize){
+
+	char sn[DIR_NAME_LENGTH];
+	char tail[SHORT_BASE_LEN + 1];
+	uint32_t n, i, k;
+
+	memcpy(sn, ne->basis, DIR_NAME_LENGTH);
+
+	if(ne->needTail || shortTaken(s, sn)){
+		uint32_t baseLen = 0;
+		while(baseLen < SHORT_BASE_LEN && ne->basis[baseLen] != SHORT_PAD) baseLen++;
+
+		for(n = 1; n <= SHORT_TAIL_MAX; n++){
+			int tailLen = snprintf(tail, sizeof(tail), "~%u", n);
+			uint32_t keep = baseLen < SHORT_BASE_LEN - tailLen ? baseLen : SHORT_BASE_LEN - tailLen;
+
+			memcpy(sn, ne->basis, DIR_NAME_LENGTH);
+			memset(sn + keep, SHORT_PAD, SHORT_BASE_LEN - keep);
+			memcpy(sn + keep, tail, tailLen);
+			if(!shortTaken(s, sn)) break;
+		}
+		if(n > SHORT_TAIL_MAX) return -1;
+		ne->needLong = 1;
+	}
+
+	/* a short name starting with 0xE5 is stored as 0x05 */
+	if((unsigned char) sn[0] == FREE_DIR) sn[0] = KANJI_DIR;
+
+	memset(ne->ents, 0, sizeof(ne->ents));
+	ne->numEnts = 0;
+
+	if(ne->needLong){
+		uint32_t numSlots = (ne->numChars + LFN_SLOT_CHARS - 1) / LFN_SLOT_CHARS;
+		uint8_t sum = shortNameChecksum(sn);
+
+		for(k = numSlots; k > 0; k--){
+			fat32LongDir * slot = (fat32LongDir*) &ne->ents[ne->numEnts++];
+			uint16_t chars[LFN_SLOT_CHARS];
+
+			for(i = 0; i < LFN_SLOT_CHARS; i++){
+				uint32_t c = (k - 1) * LFN_SLOT_CHARS + i;
+				chars[i] = c < ne->numChars ? ne->chars[c] : c == ne->numChars ? LFN_CHAR_END : LFN_PAD;
+			}
+
+			slot->LDIR_Ord = k | (k == numSlots ? LFN_LAST_ENTRY : 0);
+			memcpy(slot->LDIR_Name1, chars, sizeof(slot->LDIR_Name1));
+			memcpy(slot->LDIR_Name2, chars + 5, sizeof(slot->LDIR_Name2));
+			memcpy(slot->LDIR_Name3, chars + 11, sizeof(slot->LDIR_Name3));
+			slot->LDIR_Attr = INV_DIR;
+			slot->LDIR_Chksum = sum;
+		}
+	}
+
+	/* the short entry, stamped with the local time */
+	fat32Dir * dir = &ne->ents[ne->numEnts++];
+	uint16_t date, clock;
+
+	fatTime(&date, &clock, &dir->DIR_CrtTimeTenth);
+	memcpy(dir->DIR_Name, sn, DIR_NAME_LENGTH);
+	dir->DIR_Attr = attr;
+	dir->DIR_CrtTime = clock;
+	dir->DIR_CrtDate = date;
+	dir->DIR_LstAccDate = date;
+	dir->DIR_WrtTime = clock;
+	dir->DIR_WrtDate = date;
+	dir->DIR_FileSize = fileSize;
+	setFirstClus(dir, firstClus);
+	return 0;
+}
+
+/* Returns the clusters the directory of s must grow by to hold the
+   entries of the new name */
+static uint32_t growClusters(const dirSlots * s){
+
+	if(s->freeIdx != DIR_NO_SLOT) return 0;
+
+	uint32_t have = s->numClus * s->entsPerClus - s->endIdx;
+	return (s->need - have + s->entsPerClus - 1) / s->entsPerClus;
+}
+
+/* Grows the directory of s by grow zeroed clusters, queueing the
+   links to them. Returns 0, or -1 with errno set. */
+static int growDir(fat32Head *h, fat32Writer * w, dirSlots * s, uint32_t grow){
+
+	fat32Extent * exts;
+	uint32_t numExt, e, c;
+
+	if(grow == 0) return 0;
+
+	numExt = allocClusters(h, w, grow, &exts);
+	for(e = 0; e < numExt; e++){
+		if(zeroClusters(h, exts[e].startClus, exts[e].numClus) != 0){
+			free(exts);
+			return -1;
+		}
+		for(c = 0; c < exts[e].numClus; c++) s->chain[s->numClus++] = exts[e].startClus + c;
+	}
+	linkChain(w, exts, numExt, s->chain[s->numClus - grow - 1]);
+	free(exts);
+
+	/* the free entries at the end of the old clusters are used first */
+	s->freeIdx = s->endIdx;
+	return 0;
+}
+
+/* Writes the entries of ne into the directory of s, growing it by
+   grow clusters if it is full. The FAT is written first, so the
+   entries never point at clusters it still marks free. Returns 0,
+   or -1 with errno set. */
+static int addEntries(fat32Head *h, fat32Writer * w, dirSlots * s, newEnt * ne, uint32_t grow){
+
+	if(growDir(h, w, s, grow) != 0 || writerCommit(h, w) != 0) return -1;
+	return writeEnts(h, s, s->freeIdx, ne->ents, ne->numEnts);
+}
+
+/* Points the entry found in s at the chain starting at firstClus,
+   fileSize bytes long, and frees the chain it had. The FAT holding
+   the new chain is written first and the short entry is rewritten in
+   place with one write, so a crash leaves the old file or the new
+   one whole, with lost clusters at worst. Returns 0, or -1 with
+   errno set. */
+static int replaceEntry(fat32Head *h, fat32Writer * w, const dirSlots * s, uint32_t firstClus, uint32_t fileSize){
+
+	fat32Dir dir = s->found;
+	uint32_t oldClus = ((uint32_t) dir.DIR_FstClusHI << HEX_TEN) | dir.DIR_FstClusLO;
+	uint8_t tenth;
+
+	if(writerCommit(h, w) != 0) return -1;
+
+	/* the names and creation time stay, the long name slots still match */
+	fatTime(&dir.DIR_WrtDate, &dir.DIR_WrtTime, &tenth);
+	dir.DIR_LstAccDate = dir.DIR_WrtDate;
+	dir.DIR_Attr |= ATTR_ARCHIVE;
+	dir.DIR_FileSize = fileSize;
+	setFirstClus(&dir, firstClus);
+	if(writeEnts(h, s, s->foundIdx, &dir, 1) != 0) return -1;
+
+	freeChain(h, w, oldClus);
+	return writerCommit(h, w);
+}
+
+/* Marks the entry found in s and its long name slots deleted */
+static int deleteEntries(fat32Head *h, const dirSlots * s){
+
+	const char mark = (char) FREE_DIR;
+	uint32_t i;
+
+	for(i = s->foundIdx - s->foundSlots; i <= s->foundIdx; i++){
+		if(writeVolume(h, &mark, 1, entOffset(h, s, i)) != 0) return -1;
+	}
+	return 0;
+}
+
+int putFile(fat32Head *h, uint32_t dirClus, const char * src, const char * name, uint32_t * fileSize){
+
+	fat32Writer * w = writerOpen(h);
+	newEnt ne;
+	dirSlots s;
+	struct stat st;
+	fat32Extent * exts = NULL;
+	uint32_t numExt = 0;
+
+	if(w == NULL) return WRITE_IO_ERR;
+	if(nameInit(name, &ne) != 0) return WRITE_BAD_NAME;
+
+	int srcFD = open(src, O_RDONLY);
+	if(srcFD == -1) return WRITE_NOT_FOUND;
+	if(fstat(srcFD, &st) == -1 || !S_ISREG(st.st_mode)){
+		close(srcFD);
+		errno = EINVAL;
+		return WRITE_IO_ERR;
+	}
+	if((uint64_t) st.st_size > UINT32_MAX){
+		close(srcFD);
+		return WRITE_TOO_LARGE;
+	}
+
+	uint32_t need = nameEntries(&ne);
+	uint32_t numClus = (uint32_t) (((uint64_t) st.st_size + h->bytesPerClus - 1) / h->bytesPerClus);
+
+	dirScan(h, dirClus, name, need, &s);
+
+	if(s.foundIdx != DIR_NO_SLOT && (s.found.DIR_Attr & (ATTR_DIRECTORY | ATTR_VOLUME_ID))){
+		dirSlotsFree(&s);
+		close(srcFD);
+		return WRITE_EXISTS;
+	}
+
+	/* nothing is written unless everything fits. The file replaced keeps
+	   its entry and clusters until the new data is in place, so its
+	   clusters cannot be reused. */
+	uint32_t grow = (s.foundIdx == DIR_NO_SLOT) ? growClusters(&s) : 0;
+	if(s.numClus + grow > DIR_MAX_ENTS / s.entsPerClus){
+		dirSlotsFree(&s);
+		close(srcFD);
+		return WRITE_DIR_FULL;
+	}
+	if((uint64_t) numClus + grow > w->freeCount){
+		dirSlotsFree(&s);
+		close(srcFD);
+		return WRITE_NO_SPACE;
+	}
+
+	/* all ~n tails taken cannot happen below DIR_MAX_ENTS, checked anyway */
+	if(s.foundIdx == DIR_NO_SLOT && entriesInit(&s, &ne, ATTR_ARCHIVE, 0, (uint32_t) st.st_size) != 0){
+		dirSlotsFree(&s);
+		close(srcFD);
+		return WRITE_DIR_FULL;
+	}
+
+	uint32_t firstClus = 0;
+	if(numClus > 0){
+		numExt = allocClusters(h, w, numClus, &exts);
+		if(copyIn(h, srcFD, exts, numExt, st.st_size) != 0){
+			free(exts);
+			dirSlotsFree(&s);
+			close(srcFD);
+			return writeFailed(h);
+		}
+		linkChain(w, exts, numExt, 0);
+		firstClus = exts[0].startClus;
+		free(exts);
+	}
+	close(srcFD);
+
+	int res;
+	if(s.foundIdx != DIR_NO_SLOT){
+		res = replaceEntry(h, w, &s, firstClus, (uint32_t) st.st_size);
+	}
+	else{
+		setFirstClus(&ne.ents[ne.numEnts - 1], firstClus);
+		res = addEntries(h, w, &s, &ne, grow);
+	}
+	dirSlotsFree(&s);
+	if(res != 0) return writeFailed(h);
+
+	*fileSize = (uint32_t) st.st_size;
+	return WRITE_OK;
+}
+
+int makeDir(fat32Head *h, uint32_t dirClus, const char * name){
+
+	fat32Writer * w = writerOpen(h);
+	newEnt ne, dots;
+	dirSlots s;
+	fat32Extent * exts;
+
+	if(w == NULL) return WRITE_IO_ERR;
+	if(nameInit(name, &ne) != 0) return WRITE_BAD_NAME;
+
+	dirScan(h, dirClus, name, nameEntries(&ne), &s);
+
+	if(s.foundIdx != DIR_NO_SLOT){
+		dirSlotsFree(&s);
+		return WRITE_EXISTS;
+	}
+	if(entriesInit(&s, &ne, ATTR_DIRECTORY, 0, 0) != 0){
+		dirSlotsFree(&s);
+		return WRITE_DIR_FULL;
+	}
+
+	uint32_t grow = growClusters(&s);
+	if(s.numClus + grow > DIR_MAX_ENTS / s.entsPerClus){
+		dirSlotsFree(&s);
+		return WRITE_DIR_FULL;
+	}
+	if(1 + grow > w->freeCount){
+		dirSlotsFree(&s);
+		return WRITE_NO_SPACE;
+	}
+
+	allocClusters(h, w, 1, &exts);
+	uint32_t newClus = exts[0].startClus;
+	free(exts);
+	setFirstClus(&ne.ents[ne.numEnts - 1], newClus);
+
+	/* the new directory holds "." and "..", zero in ".." means the root */
+	uint32_t numShort = s.numShort;
+	memset(&dots, 0, sizeof(dots));
+	memset(dots.basis, SHORT_PAD, DIR_NAME_LENGTH);
+	dots.basis[0] = '.';
+	s.numShort = 0;
+	entriesInit(&s, &dots, ATTR_DIRECTORY, newClus, 0);
+	s.numShort = numShort;
+
+	fat32Dir dotEnts[2];
+	dotEnts[0] = dots.ents[0];
+	dotEnts[1] = dots.ents[0];
+	dotEnts[1].DIR_Name[1] = '.';
+	setFirstClus(&dotEnts[1], dirClus == h->bs->BPB_RootClus ? 0 : dirClus);
+
+	if(zeroClusters(h, newClus, 1) != 0 || writeVolume(h, dotEnts, sizeof(dotEnts), clusOffset(h, newClus)) != 0){
+		dirSlotsFree(&s);
+		return writeFailed(h);
+	}
+	fatSet(w, newClus, FAT_EOC_MARK);
+
+	int res = addEntries(h, w, &s, &ne, grow);
+	dirSlotsFree(&s);
+	if(res != 0) return writeFailed(h);
+	return WRITE_OK;
+}
+
+/* Returns 1 if the directory starting at dirClus holds nothing but
+   "." and ".." */
+static int dirEmpty(fat32Head *h, uint32_t dirClus){
+
+	fat32DirIter it;
+	const fat32Dir * dir;
+	int empty = 1;
+
+	dirIterInit(h, &it, dirClus);
+	while(empty && (dir = dirIterNext(&it)) != NULL){
+		if((unsigned char) dir->DIR_Name[0] == FREE_DIR || dir->DIR_Attr == INV_DIR) continue;
+		if(dir->DIR_Name[0] == '.') continue;
+		empty = 0;
+	}
+	dirIterFree(&it);
+	return empty;
+}
+
+int removeEntry(fat32Head *h, uint32_t dirClus, const char * name){
+
+	fat32Writer * w = writerOpen(h);
+	dirSlots s;
+
+	if(w == NULL) return WRITE_IO_ERR;
+	if(strcmp(name, DOT) == 0 || strcmp(name, DOTDOT) == 0) return WRITE_BAD_NAME;
+
+	dirScan(h, dirClus, name, 1, &s);
+
+	if(s.foundIdx == DIR_NO_SLOT){
+		dirSlotsFree(&s);
+		return WRITE_NOT_FOUND;
+	}
+
+	uint32_t firstClus = ((uint32_t) s.found.DIR_FstClusHI << HEX_TEN) | s.found.DIR_FstClusLO;
+	if((s.found.DIR_Attr & ATTR_DIRECTORY) && !dirEmpty(h, firstClus)){
+		dirSlotsFree(&s);
+		return WRITE_NOT_EMPTY;
+	}
+
+	/* the entries go first, a crash then leaves lost clusters, not a
+	   file pointing at free ones */
+	int res = deleteEntries(h, &s);
+	dirSlotsFree(&s);
+	if(res != 0) return writeFailed(h);
+
+	freeChain(h, w, firstClus);
+	if(writerCommit(h, w) != 0) return writeFailed(h);
+	return WRITE_OK;
+}
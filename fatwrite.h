@@ -0,0 +1,108 @@
+/**********************************************************************
+  Module: fatwrite.h
+  Author: Junseok Lee
+
+  Purpose: Writes to the volume: PUT, MKDIR and RM. Free clusters
+  come from a list of free runs built once from the free map and
+  searched from FSI_Nxt_Free, so a file gets one run whenever one is
+  large enough and the fewest runs otherwise. Changes to the FAT are
+  queued, and every FAT sector touched is written once, to each FAT
+  copy, before the directory entry that refers to the new clusters.
+  A crash in between leaves lost clusters, never an entry pointing at
+  free ones.
+
+**********************************************************************/
+#ifndef FATWRITE_H
+#define FATWRITE_H
+
+#include "fat32.h"
+#include "extent.h"
+
+/* write constants */
+#define WRITE_BLOCK (4 << 20) //bytes per read of a local file the kernel cannot copy
+#define WRITE_RUNS_INIT 256
+#define WRITE_UPDATES_INIT 1024
+#define WRITE_FAT_SPAN 65536 //longest FAT range written at once
+#define DIR_MAX_ENTS 65536 //entries a directory may hold
+#define LFN_MAX_CHARS 255 //UTF-16 characters of a long name
+#define SHORT_BASE_LEN 8
+#define SHORT_EXT_LEN 3
+#define SHORT_TAIL_MAX 999999 //largest ~n of a generated short name
+#define SHORT_PAD ' '
+#define FAT_EOC_MARK 0x0FFFFFFF //end of chain written to new chains
+#define FAT_FREE 0x00000000
+
+/* date and time fields of directory entries */
+#define FAT_YEAR_BASE 1980
+#define FAT_YEAR_SHIFT 9
+#define FAT_MONTH_SHIFT 5
+#define FAT_HOUR_SHIFT 11
+#define FAT_MIN_SHIFT 5
+
+/* write results */
+#define WRITE_OK 0
+#define WRITE_NOT_FOUND -1
+#define WRITE_EXISTS -2
+#define WRITE_BAD_NAME -3
+#define WRITE_NO_SPACE -4
+#define WRITE_TOO_LARGE -5
+#define WRITE_DIR_FULL -6
+#define WRITE_NOT_EMPTY -7
+#define WRITE_IO_ERR -8 //errno is set
+
+/* Free run struct,
+   numClus free clusters starting at startClus */
+struct allocRun_struct {
+	uint32_t startClus;
+	uint32_t numClus;
+};
+typedef struct allocRun_struct allocRun;
+
+/* FAT update struct,
+   a new value for one FAT entry, not yet written */
+struct fatUpdate_struct {
+	uint32_t clus;
+	uint32_t value;
+	uint32_t seq; //order queued, the last update of an entry wins
+};
+typedef struct fatUpdate_struct fatUpdate;
+
+/* Writer struct,
+   the free runs of the volume and the FAT updates of the command
+   running, kept on the head between commands */
+struct fat32Writer_struct {
+	allocRun * runs; //free runs in cluster order
+	uint32_t numRuns;
+	uint32_t capRuns;
+	uint32_t freeCount; //free clusters in the runs
+	uint32_t nextFree; //cluster the next search starts at
+	fatUpdate * updates;
+	uint32_t numUpdates;
+	uint32_t capUpdates;
+	uint32_t fatWrites; //writes the last command made to the FATs
+	uint32_t fatSectors; //FAT sectors written to each copy by the last command
+};
+typedef struct fat32Writer_struct fat32Writer;
+
+/* Copies the local file src into the directory starting at dirClus
+   under name, replacing a file already there once the new data is
+   in place. The file replaced keeps its name. Returns WRITE_OK or
+   one of the errors above; *fileSize gets the bytes written. */
+int putFile(fat32Head *h, uint32_t dirClus, const char * src, const char * name, uint32_t * fileSize);
+
+/* Creates the empty directory name in the directory starting at
+   dirClus. Returns WRITE_OK or one of the errors above. */
+int makeDir(fat32Head *h, uint32_t dirClus, const char * name);
+
+/* Removes the file or empty directory name from the directory
+   starting at dirClus and frees its clusters. Returns WRITE_OK or
+   one of the errors above. */
+int removeEntry(fat32Head *h, uint32_t dirClus, const char * name);
+
+/* Returns the writer of h, NULL before the first write */
+const fat32Writer * writerGet(fat32Head *h);
+
+/* Deallocates the writer kept on the head */
+void writerFree(fat32Head *h);
+
+#endif
@@ -0,0 +1,281 @@
+/**********************************************************************
+  Module: freemap.c
+  Author: Junseok Lee
+
+ Free cluster scan of the active FAT, with vectorized zero entry
+ counting picked at run time.
+
+**********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "freemap.h"
+#include "extract.h"
+#include "aio.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FREE_SCAN_X86 1
+#endif
+
+/* Counting loop, marks the free entries among the first n entries
+   of ents in bits, one bit per entry, and returns their number.
+   n is a multiple of FREE_ENTS_PER_BYTE. */
+typedef uint32_t (*freeScanFn)(const uint32_t * ents, size_t n, uint8_t * bits);
+
+static uint32_t scanScalar(const uint32_t * ents, size_t n, uint8_t * bits){
+
+	uint32_t count = 0;
+	size_t i;
+	int k;
+
+	for(i = 0; i < n; i += FREE_ENTS_PER_BYTE){
+		uint8_t byte = 0;
+		for(k = 0; k < FREE_ENTS_PER_BYTE; k++){
+			byte |= ((ents[i + k] & CLUSENT_AND_OPERATOR) == 0) << k;
+		}
+		bits[i / FREE_ENTS_PER_BYTE] = byte;
+		count += __builtin_popcount(byte);
+	}
+	return count;
+}
+
+#ifdef FREE_SCAN_X86
+
+/* four entries per compare, two compares per bitmap byte */
+__attribute__((target("sse2,popcnt")))
+static uint32_t scanSse2(const uint32_t * ents, size_t n, uint8_t * bits){
+
+	const __m128i mask = _mm_set1_epi32(CLUSENT_AND_OPERATOR);
+	const __m128i zero = _mm_setzero_si128();
+	uint32_t count = 0;
+	size_t i;
+
+	for(i = 0; i < n; i += FREE_ENTS_PER_BYTE){
+		__m128i lo = _mm_loadu_si128((const __m128i*) (ents + i));
+		__m128i hi = _mm_loadu_si128((const __m128i*) (ents + i + 4));
+		int mLo = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(lo, mask), zero)));
+		int mHi = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(hi, mask), zero)));
+		uint8_t byte = mLo | (mHi << 4);
+
+		bits[i / FREE_ENTS_PER_BYTE] = byte;
+		count += __builtin_popcount(byte);
+	}
+	return count;
+}
+
+/* eight entries per compare, one compare per bitmap byte,
+   four bytes per round to keep several loads in flight */
+__attribute__((target("avx2,popcnt")))
+static uint32_t scanAvx2(const uint32_t * ents, size_t n, uint8_t * bits){
+
+	const __m256i mask = _mm256_set1_epi32(CLUSENT_AND_OPERATOR);
+	const __m256i zero = _mm256_setzero_si256();
+	uint32_t count = 0;
+	size_t i = 0;
+
+	for(; i + 4 * FREE_ENTS_PER_BYTE <= n; i += 4 * FREE_ENTS_PER_BYTE){
+		__m256i a = _mm256_loadu_si256((const __m256i*) (ents + i));
+		__m256i b = _mm256_loadu_si256((const __m256i*) (ents + i + 8));
+		__m256i c = _mm256_loadu_si256((const __m256i*) (ents + i + 16));
+		__m256i d = _mm256_loadu_si256((const __m256i*) (ents + i + 24));
+		uint32_t m = (uint32_t) _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(a, mask), zero)))
+			| (uint32_t) _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(b, mask), zero))) << 8
+			| (uint32_t) _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(c, mask), zero))) << 16
+			| (uint32_t) _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(d, mask), zero))) << 24;
+
+		memcpy(bits + i / FREE_ENTS_PER_BYTE, &m, sizeof(m));
+		count += __builtin_popcount(m);
+	}
+
+	for(; i < n; i += FREE_ENTS_PER_BYTE){
+		__m256i a = _mm256_loadu_si256((const __m256i*) (ents + i));
+		uint8_t byte = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(a, mask), zero)));
+
+		bits[i / FREE_ENTS_PER_BYTE] = byte;
+		count += __builtin_popcount(byte);
+	}
+	return count;
+}
+
+#endif
+
+/* Picks the widest counting loop the CPU supports */
+static freeScanFn pickScan(const char ** engine){
+
+#ifdef FREE_SCAN_X86
+	__builtin_cpu_init();
+
+	if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")){
+		*engine = "avx2";
+		return scanAvx2;
+	}
+	if(__builtin_cpu_supports("sse2") && __builtin_cpu_supports("popcnt")){
+		*engine = "sse2";
+		return scanSse2;
+	}
+#endif
+
+	*engine = "scalar";
+	return scanScalar;
+}
+
+uint32_t dataClusters(fat32Head *h){
+
+	uint64_t metaSec = h->bs->BPB_RsvdSecCnt + (uint64_t) h->bs->BPB_NumFATs * h->bs->BPB_FATSz32;
+
+	if(h->bs->BPB_TotSec32 <= metaSec || h->bs->BPB_SecPerClus == 0) return 0;
+
+	return (h->bs->BPB_TotSec32 - metaSec) / h->bs->BPB_SecPerClus;
+}
+
+/* Reads the first scanEnts entries of the active FAT in blocks of
+   FREE_SCAN_AIO_BLOCK bytes, with up to FREE_SCAN_AIO_SLOTS reads in
+   flight, and scans each block as its read completes, in any order.
+   Returns the number of free entries. */
+static uint32_t scanAsync(fat32Head *h, freeScanFn scan, uint8_t * bits, uint64_t scanEnts){
+
+	fat32Aio * aio = aioThread();
+	uint32_t slots = aio->depth < FREE_SCAN_AIO_SLOTS ? aio->depth : FREE_SCAN_AIO_SLOTS;
+	uint64_t blockEnts = FREE_SCAN_AIO_BLOCK / FAT_ENT_SZ;
+	uint64_t slotPos[FREE_SCAN_AIO_SLOTS];
+	uint32_t freeSlots[FREE_SCAN_AIO_SLOTS];
+	uint32_t numFree = slots, freeCount = 0, i;
+	uint64_t pos = 0;
+	unsigned char * buf;
+
+	if(posix_memalign((void**) &buf, FREE_SCAN_ALIGN, (size_t) slots * FREE_SCAN_AIO_BLOCK) != 0){
+		perror("freeMapScan malloc error");
+		exit(EXIT_FAILURE);
+	}
+	for(i = 0; i < slots; i++) freeSlots[i] = i;
+
+	while(pos < scanEnts || numFree < slots){
+
+		while(numFree > 0 && pos < scanEnts){
+			uint64_t n = scanEnts - pos < blockEnts ? scanEnts - pos : blockEnts;
+			uint32_t s = freeSlots[--numFree];
+
+			slotPos[s] = pos;
+			aioSubmit(aio, s, h->fd, 0, buf + (size_t) s * FREE_SCAN_AIO_BLOCK, n * FAT_ENT_SZ,
+					h->fatOffset + pos * FAT_ENT_SZ);
+			pos += n;
+		}
+
+		uint32_t s = aioWait(aio);
+		fat32AioReq * req = &aio->reqs[s];
+		uint64_t n = scanEnts - slotPos[s] < blockEnts ? scanEnts - slotPos[s] : blockEnts;
+
+		if(req->err != 0 || req->done != n * FAT_ENT_SZ){
+			errno = req->err != 0 ? req->err : EIO;
+			perror("freeMapScan read error");
+			exit(EXIT_FAILURE);
+		}
+
+		freeCount += scan((const uint32_t*) (buf + (size_t) s * FREE_SCAN_AIO_BLOCK), n, bits + slotPos[s] / FREE_ENTS_PER_BYTE);
+		freeSlots[numFree++] = s;
+	}
+
+	free(buf);
+	return freeCount;
+}
+
+/* Scans the active FAT and returns a malloc'd free map */
+static fat32FreeMap * freeMapScan(fat32Head *h){
+
+	struct timespec start, end;
+	fat32FreeMap * map = (fat32FreeMap*) calloc(1, sizeof(fat32FreeMap));
+	if(map == NULL){
+		perror("freeMapScan malloc error");
+		exit(EXIT_FAILURE);
+	}
+
+	freeScanFn scan = pickScan(&map->engine);
+
+	/* entries past the last data cluster are not clusters */
+	map->numClus = dataClusters(h);
+	uint64_t numEnts = (uint64_t) map->numClus + ROOT_DIR_CLUS_NUM;
+	if(numEnts > h->fatNumEnts) numEnts = h->fatNumEnts;
+
+	/* whole bitmap bytes are scanned in blocks, the last few entries one by one */
+	uint64_t scanEnts = numEnts / FREE_ENTS_PER_BYTE * FREE_ENTS_PER_BYTE;
+
+	map->bits = (uint8_t*) calloc(numEnts / FREE_ENTS_PER_BYTE + 1, 1);
+	if(map->bits == NULL){
+		perror("freeMapScan malloc error");
+		exit(EXIT_FAILURE);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/* a mapped FAT is scanned in place, one block at a time */
+	uint64_t pos = 0;
+	if(h->fatMap == NULL){
+		map->freeCount = scanAsync(h, scan, map->bits, scanEnts);
+		pos = scanEnts;
+	}
+	while(pos < scanEnts){
+
+		uint64_t blockEnts = scanEnts - pos;
+		if(blockEnts > FREE_SCAN_BLOCK / FAT_ENT_SZ) blockEnts = FREE_SCAN_BLOCK / FAT_ENT_SZ;
+
+		map->freeCount += scan(h->fatMap + pos, blockEnts, map->bits + pos / FREE_ENTS_PER_BYTE);
+		pos += blockEnts;
+	}
+
+	for(; pos < numEnts; pos++){
+		if(fatEntry(h, pos) == 0){
+			map->bits[pos / FREE_ENTS_PER_BYTE] |= 1 << (pos % FREE_ENTS_PER_BYTE);
+			map->freeCount++;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	map->secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / NSEC_PER_SEC;
+
+	/* reserved entries 0 and 1 are not clusters */
+	uint32_t c;
+	for(c = 0; c < ROOT_DIR_CLUS_NUM && c < numEnts; c++){
+		if(FREE_MAP_TEST(map, c)){
+			map->bits[c / FREE_ENTS_PER_BYTE] &= ~(1 << (c % FREE_ENTS_PER_BYTE));
+			map->freeCount--;
+		}
+	}
+
+	return map;
+}
+
+const fat32FreeMap * freeMapGet(fat32Head *h){
+
+	fat32FreeMap * map = __atomic_load_n(&h->freeMap, __ATOMIC_ACQUIRE);
+	if(map != NULL) return map;
+
+	/* threads racing on the first scan publish with compare and
+	   swap, as FAT pages are, the losers free their map */
+	map = freeMapScan(h);
+
+	fat32FreeMap * expected = NULL;
+	if(!__atomic_compare_exchange_n(&h->freeMap, &expected, map, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+		free(map->bits);
+		free(map);
+		map = expected;
+	}
+	return map;
+}
+
+void freeMapFree(fat32Head *h){
+
+	if(h->freeMap == NULL) return;
+
+	free(h->freeMap->bits);
+	free(h->freeMap);
+	h->freeMap = NULL;
+}
+
+const fat32FreeMap * freeMapRescan(fat32Head *h){
+
+	freeMapFree(h);
+	return freeMapGet(h);
+}
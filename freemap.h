@@ -0,0 +1,56 @@
+/**********************************************************************
+  Module: freemap.h
+  Author: Junseok Lee
+
+  Purpose: Scans the active FAT for free clusters. The FAT is
+  streamed in large blocks and the zero entries of each block are
+  counted with AVX2 or SSE2 when the CPU supports them, with a
+  scalar loop otherwise. The result is a bitmap with one bit per
+  cluster, set for free clusters, and the exact free count.
+
+**********************************************************************/
+#ifndef FREEMAP_H
+#define FREEMAP_H
+
+#include "fat32.h"
+
+/* free scan constants */
+#define FREE_SCAN_BLOCK (4 << 20)
+#define FREE_SCAN_AIO_BLOCK (1 << 20) //bytes per read of an unmapped FAT
+#define FREE_SCAN_AIO_SLOTS 8 //reads in flight at most
+#define FREE_SCAN_ALIGN 64
+#define FREE_ENTS_PER_BYTE 8
+
+/* Free map struct,
+   the free clusters of a volume as found in the FAT */
+struct fat32FreeMap_struct {
+	uint8_t * bits; //bit c set if cluster c is free, bits 0 and 1 are never set
+	uint32_t numClus; //number of data clusters, clusters 2 to numClus + 1
+	uint32_t freeCount; //number of free clusters
+	double secs; //time the scan took
+	const char * engine; //name of the counting loop used
+};
+typedef struct fat32FreeMap_struct fat32FreeMap;
+
+/* Returns 1 if cluster clus is free in map */
+#define FREE_MAP_TEST(map, clus) (((map)->bits[(clus) / FREE_ENTS_PER_BYTE] >> ((clus) % FREE_ENTS_PER_BYTE)) & 1)
+
+/* Returns the number of data clusters of the volume */
+uint32_t dataClusters(fat32Head *h);
+
+/* Returns the free map of the volume, scanning the FAT on first
+   use. The map is kept on the head until freeMapFree. Safe to call
+   from many threads, freeMapFree is not. */
+const fat32FreeMap * freeMapGet(fat32Head *h);
+
+/* Deallocates the free map kept on the head, so that the next
+   freeMapGet scans the FAT again */
+void freeMapFree(fat32Head *h);
+
+/* Drops the free map kept on the head and returns a fresh scan, for
+   commands that report the FAT as it is now. The kept map may be
+   stale, as the image can change under it. Not safe while other
+   threads use the map. */
+const fat32FreeMap * freeMapRescan(fat32Head *h);
+
+#endif
@@ -0,0 +1,324 @@
+/**********************************************************************
+  Module: fsck.c
+  Author: Junseok Lee
+
+ Consistency check of a volume, built on the catalog walk, the
+ free map and a cluster ownership bitmap.
+
+**********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include "fsck.h"
+#include "shell.h"
+#include "walk.h"
+#include "freemap.h"
+#include "extract.h"
+
+#define BIT_TEST(bits, c) (((bits)[(c) / FREE_ENTS_PER_BYTE] >> ((c) % FREE_ENTS_PER_BYTE)) & 1)
+#define BIT_SET(bits, c) ((bits)[(c) / FREE_ENTS_PER_BYTE] |= 1 << ((c) % FREE_ENTS_PER_BYTE))
+
+/* Check context struct,
+   state shared by the passes of one check */
+struct fsckCtx_struct {
+	fat32Head * head;
+	fat32Catalog * cat;
+	fat32Check * res;
+	uint8_t * owned; //bit c set once cluster c belongs to a chain
+	uint32_t lastClus; //last data cluster of the volume
+	uint32_t reports; //problem lines printed so far
+	uint32_t hidden; //problem lines not printed
+};
+typedef struct fsckCtx_struct fsckCtx;
+
+/* Prints one problem line for catalog entry i, fmt formatting a
+   and b, unless FSCK_MAX_REPORTS lines were printed already */
+static void report(fsckCtx * ctx, uint32_t i, const char * fmt, uint32_t a, uint32_t b){
+
+	char path[PATH_MAX];
+
+	if(ctx->reports == FSCK_MAX_REPORTS){
+		ctx->hidden++;
+		return;
+	}
+	ctx->reports++;
+
+	if(i == CATALOG_ROOT) strcpy(path, "/");
+	else if(catalogPath(ctx->cat, i, path, sizeof(path)) != 0) strcpy(path, "(path too long)");
+
+	printf("%s: ", path);
+	printf(fmt, a, b);
+	printf("\n");
+}
+
+/* Returns 1 if clus is among the first len clusters of the chain
+   starting at first. Only called once per chain, on the prefix the
+   chain marked itself, so the total work stays linear. */
+static int inPrefix(fat32Head *h, uint32_t first, uint32_t len, uint32_t clus){
+
+	while(len-- > 0){
+		if(first == clus) return 1;
+		first = getNextClus(h, first);
+	}
+	return 0;
+}
+
+/* Follows the chain of catalog entry i, marking each cluster as
+   owned, and stops at the end of the chain or at the first cluster
+   that is invalid or owned already. Stores the number of clusters
+   marked in *len. Returns 1 if the chain ended with an end of chain
+   mark, 0 if a problem was reported. */
+static int checkChain(fsckCtx * ctx, uint32_t i, uint32_t first, uint32_t * len){
+
+	fat32Head * h = ctx->head;
+	uint32_t clus = first;
+
+	*len = 0;
+	for(;;){
+
+		if(clus < ROOT_DIR_CLUS_NUM || clus > ctx->lastClus){
+			report(ctx, i, "chain points outside the volume, to cluster %u", clus, 0);
+			ctx->res->badChains++;
+			return 0;
+		}
+
+		if(BIT_TEST(ctx->owned, clus)){
+			if(inPrefix(h, first, *len, clus)){
+				report(ctx, i, "chain loops back to cluster %u after %u clusters", clus, *len);
+				ctx->res->loops++;
+			}
+			else{
+				report(ctx, i, "chain is cross-linked with another chain at cluster %u", clus, 0);
+				ctx->res->crossLinks++;
+			}
+			return 0;
+		}
+
+		BIT_SET(ctx->owned, clus);
+		(*len)++;
+
+		uint32_t next = getNextClus(h, clus);
+
+		if(next >= EOC) return 1;
+
+		if(next == 0){
+			report(ctx, i, "chain reaches cluster %u, which is marked free", clus, 0);
+			ctx->res->badChains++;
+			return 0;
+		}
+		if(next == FSCK_BAD_CLUS){
+			report(ctx, i, "chain reaches cluster %u, which is marked bad", clus, 0);
+			ctx->res->badChains++;
+			return 0;
+		}
+		clus = next;
+	}
+}
+
+/* Follows every chain of the catalog and checks file sizes */
+static void checkChains(fsckCtx * ctx){
+
+	uint32_t i;
+
+	for(i = CATALOG_ROOT; i < ctx->cat->numEnts; i++){
+
+		catalogEnt * ent = catalogGet(ctx->cat, i);
+		uint32_t len;
+
+		if(ent->firstClus == 0){
+			/* an empty file has no chain, anything else needs one */
+			if(ent->attr & ATTR_DIRECTORY){
+				report(ctx, i, "directory has no clusters", 0, 0);
+				ctx->res->badChains++;
+			}
+			else if(ent->fileSize > 0){
+				report(ctx, i, "file of %u bytes has no clusters", ent->fileSize, 0);
+				ctx->res->sizeErrors++;
+			}
+			continue;
+		}
+
+		if(!checkChain(ctx, i, ent->firstClus, &len)) continue;
+
+		/* directories have no size, files need exactly enough clusters */
+		uint32_t need = (uint32_t) (((uint64_t) ent->fileSize + ctx->head->bytesPerClus - 1) / ctx->head->bytesPerClus);
+		if(!(ent->attr & ATTR_DIRECTORY) && len != need){
+			report(ctx, i, "size needs %u clusters, chain has %u", need, len);
+			ctx->res->sizeErrors++;
+		}
+	}
+}
+
+/* Counts the allocated clusters that no chain owns, and the chains
+   they form, counted by the lost clusters no other lost cluster
+   points to */
+static void checkLost(fsckCtx * ctx, const fat32FreeMap * map){
+
+	fat32Head * h = ctx->head;
+	uint32_t numBytes = ctx->lastClus / FREE_ENTS_PER_BYTE + 1;
+	uint8_t * target = (uint8_t*) calloc(numBytes, 1);
+	uint32_t b, c;
+
+	if(target == NULL){
+		perror("checkLost malloc error");
+		exit(EXIT_FAILURE);
+	}
+
+	/* whole bytes of used and unowned clusters, so only the lost
+	   and bad clusters reach the FAT */
+	for(b = 0; b < numBytes; b++){
+		uint8_t lost = ~(map->bits[b] | ctx->owned[b]);
+
+		for(; lost != 0; lost &= lost - 1){
+			c = b * FREE_ENTS_PER_BYTE + __builtin_ctz(lost);
+			if(c < ROOT_DIR_CLUS_NUM || c > ctx->lastClus) continue;
+
+			uint32_t next = getNextClus(h, c);
+
+			if(next == FSCK_BAD_CLUS){
+				ctx->res->badClus++;
+				continue;
+			}
+			ctx->res->lostClus++;
+			if(next >= ROOT_DIR_CLUS_NUM && next <= ctx->lastClus) BIT_SET(target, next);
+		}
+	}
+
+	if(ctx->res->lostClus > 0){
+		for(c = ROOT_DIR_CLUS_NUM; c <= ctx->lastClus; c++){
+			if(!FREE_MAP_TEST(map, c) && !BIT_TEST(ctx->owned, c) && !BIT_TEST(target, c) &&
+					getNextClus(h, c) != FSCK_BAD_CLUS){
+				ctx->res->lostChains++;
+			}
+		}
+		printf("Lost clusters: %u in %u chains\n", ctx->res->lostClus, ctx->res->lostChains);
+	}
+
+	free(target);
+}
+
+/* Compares every FAT copy with the active FAT, one block at a time */
+static void checkMirrors(fsckCtx * ctx){
+
+	fat32Head * h = ctx->head;
+	uint32_t numFATs = h->bs->BPB_NumFATs;
+	uint64_t fatBytes = (uint64_t) h->bs->BPB_FATSz32 * h->bs->BPB_BytesPerSec;
+	uint64_t firstFat = (uint64_t) h->bs->BPB_RsvdSecCnt * h->bs->BPB_BytesPerSec;
+	uint64_t numEnts = (uint64_t) ctx->lastClus + 1;
+	uint32_t * act = NULL;
+	uint32_t * copy = NULL;
+	uint32_t k;
+
+	if(numEnts > h->fatNumEnts) numEnts = h->fatNumEnts;
+
+	if(h->map == NULL && (posix_memalign((void**) &act, FREE_SCAN_ALIGN, FSCK_BLOCK) != 0 ||
+			posix_memalign((void**) &copy, FREE_SCAN_ALIGN, FSCK_BLOCK) != 0)){
+		perror("checkMirrors malloc error");
+		exit(EXIT_FAILURE);
+	}
+
+	for(k = 0; k < numFATs; k++){
+
+		uint64_t off = firstFat + k * fatBytes;
+		uint64_t diffs = 0;
+		uint32_t firstDiff = 0;
+		uint64_t pos;
+
+		if(off == h->fatOffset) continue;
+
+		for(pos = 0; pos < numEnts; ){
+
+			uint64_t blockEnts = numEnts - pos;
+			if(blockEnts > FSCK_BLOCK / FAT_ENT_SZ) blockEnts = FSCK_BLOCK / FAT_ENT_SZ;
+
+			const uint32_t * a = act;
+			const uint32_t * b = copy;
+
+			if(h->map != NULL){
+				a = (const uint32_t*) (h->map + h->fatOffset) + pos;
+				b = (const uint32_t*) (h->map + off) + pos;
+			}
+			else{
+				readVolume(h, act, blockEnts * FAT_ENT_SZ, h->fatOffset + pos * FAT_ENT_SZ);
+				readVolume(h, copy, blockEnts * FAT_ENT_SZ, off + pos * FAT_ENT_SZ);
+			}
+
+			/* equal blocks are skipped with one memcmp */
+			if(memcmp(a, b, blockEnts * FAT_ENT_SZ) != 0){
+				uint64_t e;
+				for(e = 0; e < blockEnts; e++){
+					/* entries 0 and 1 hold the media byte and dirty flags */
+					if(pos + e < ROOT_DIR_CLUS_NUM) continue;
+					if(((a[e] ^ b[e]) & CLUSENT_AND_OPERATOR) != 0){
+						if(diffs++ == 0) firstDiff = pos + e;
+					}
+				}
+			}
+			pos += blockEnts;
+		}
+
+		if(diffs == 0) continue;
+
+		if(h->bs->BPB_ExtFlags & FAT_MIRROR_DISABLED){
+			printf("FAT %u differs from the active FAT in %lu entries, mirroring is disabled\n", k, diffs);
+		}
+		else{
+			printf("FAT %u differs from the active FAT in %lu entries, first at cluster %u\n", k, diffs, firstDiff);
+			ctx->res->mirrorErrors++;
+		}
+	}
+
+	free(act);
+	free(copy);
+}
+
+uint32_t checkVolume(fat32Head *h, fat32Check * res){
+
+	struct timespec start, end;
+	fsckCtx ctx;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	memset(res, 0, sizeof(*res));
+
+	const fat32FreeMap * map = freeMapRescan(h);
+
+	ctx.head = h;
+	ctx.res = res;
+	ctx.reports = 0;
+	ctx.hidden = 0;
+	ctx.lastClus = map->numClus + ROOT_DIR_CLUS_NUM - 1;
+	if(ctx.lastClus >= h->fatNumEnts) ctx.lastClus = h->fatNumEnts - 1;
+
+	/* one bit per cluster, 32 MiB for the largest FAT32 volume */
+	ctx.owned = (uint8_t*) calloc(ctx.lastClus / FREE_ENTS_PER_BYTE + 1, 1);
+	if(ctx.owned == NULL){
+		perror("checkVolume malloc error");
+		exit(EXIT_FAILURE);
+	}
+
+	ctx.cat = walkTree(h, h->bs->BPB_RootClus, extractThreads());
+
+	checkChains(&ctx);
+	if(ctx.hidden > 0) printf("... %u more problems not shown\n", ctx.hidden);
+
+	checkLost(&ctx, map);
+	checkMirrors(&ctx);
+
+	/* the free count kept in FSInfo should match the FAT */
+	uint32_t fsiFree = h->fsi->FSI_Free_Count;
+	if(fsiFree != FREE_CLUS_UNKNOWN && fsiFree != map->freeCount){
+		printf("FSInfo free count: %u, the FAT has %u free clusters\n", fsiFree, map->freeCount);
+		res->fsiErrors++;
+	}
+
+	catalogFree(ctx.cat);
+	free(ctx.owned);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	res->secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / NSEC_PER_SEC;
+
+	return res->crossLinks + res->loops + res->badChains + res->sizeErrors + (res->lostClus > 0) +
+			res->mirrorErrors + res->fsiErrors;
+}
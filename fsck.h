@@ -0,0 +1,44 @@
+/**********************************************************************
+  Module: fsck.h
+  Author: Junseok Lee
+
+  Purpose: Consistency check of a volume. Every file and directory
+  chain is followed once and its clusters are marked in a bitmap
+  with one bit per cluster, so the check runs in time linear in the
+  size of the FAT and needs one bit of memory per cluster. Finds
+  cross-linked clusters, loops in chains, lost clusters, files whose
+  size does not match their chain and FAT copies that differ.
+
+**********************************************************************/
+#ifndef FSCK_H
+#define FSCK_H
+
+#include "fat32.h"
+
+/* fsck constants */
+#define FSCK_BAD_CLUS 0x0FFFFFF7
+#define FSCK_BLOCK (4 << 20)
+#define FSCK_MAX_REPORTS 50
+
+/* Check result struct,
+   the number of problems of each kind found by checkVolume */
+struct fat32Check_struct {
+	uint32_t crossLinks; //chains running into a cluster owned by another chain
+	uint32_t loops; //chains running back into themselves
+	uint32_t badChains; //chains reaching a free, bad or out of range cluster
+	uint32_t sizeErrors; //files whose size does not match their chain length
+	uint32_t lostClus; //allocated clusters owned by no chain
+	uint32_t lostChains; //chains of lost clusters, counted by their first cluster
+	uint32_t badClus; //clusters marked bad in the FAT, not a problem
+	uint32_t mirrorErrors; //FAT copies that differ from the active FAT
+	uint32_t fsiErrors; //FSInfo free count differing from the FAT
+	double secs; //time the check took
+};
+typedef struct fat32Check_struct fat32Check;
+
+/* Checks the volume opened in h, printing one line per problem up
+   to FSCK_MAX_REPORTS, and stores the counts in res. Returns the
+   total number of problems found. */
+uint32_t checkVolume(fat32Head *h, fat32Check * res);
+
+#endif
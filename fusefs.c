@@ -0,0 +1,288 @@
+/**********************************************************************
+  Module: fusefs.c
+  Author: Junseok Lee
+
+ Read-only FUSE file system over a FAT32 image, built on the
+ directory cache, the directory iterator and fat32Pread.
+
+**********************************************************************/
+#define FUSE_USE_VERSION 31
+
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include "fusefs.h"
+#include "shell.h"
+#include "dirindex.h"
+#include "freemap.h"
+
+/* Command line options struct */
+struct fusefsOpts_struct {
+	const char * image; //first argument that is not an option
+	int mmap; //-m, read the volume through a memory mapping
+	int help;
+};
+typedef struct fusefsOpts_struct fusefsOpts;
+
+static const struct fuse_opt optSpec[] = {
+	{ "-m", offsetof(fusefsOpts, mmap), 1 },
+	{ "-h", offsetof(fusefsOpts, help), 1 },
+	{ "--help", offsetof(fusefsOpts, help), 1 },
+	FUSE_OPT_END
+};
+
+/* Returns the image mounted by the calling request */
+static fusefsImage * getImage(void){
+
+	return (fusefsImage*) fuse_get_context()->private_data;
+}
+
+/* Converts the DOS date and time of a directory entry, in local
+   time as FAT keeps them, or returns fallback if there is no date */
+static time_t dosTime(uint16_t date, uint16_t time, time_t fallback){
+
+	struct tm tm;
+
+	if(date == 0) return fallback;
+
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_year = (date >> DOS_YEAR_SHIFT) + DOS_YEAR_BASE;
+	tm.tm_mon = ((date >> DOS_MONTH_SHIFT) & DOS_MONTH_MASK) - 1;
+	tm.tm_mday = date & DOS_DAY_MASK;
+	tm.tm_hour = time >> DOS_HOUR_SHIFT;
+	tm.tm_min = (time >> DOS_MIN_SHIFT) & DOS_MIN_MASK;
+	tm.tm_sec = (time & DOS_SEC_MASK) * 2;
+	tm.tm_isdst = -1;
+
+	time_t t = mktime(&tm);
+	return t == (time_t) -1 ? fallback : t;
+}
+
+/* Fills st with the attributes of the entry ent */
+static void entryStat(fusefsImage * img, const fat32IndexEnt * ent, struct stat * st){
+
+	memset(st, 0, sizeof(*st));
+
+	if(ent->attr & ATTR_DIRECTORY){
+		st->st_mode = S_IFDIR | FUSEFS_DIR_MODE;
+		st->st_nlink = 2;
+	}
+	else{
+		st->st_mode = S_IFREG | FUSEFS_FILE_MODE;
+		st->st_nlink = 1;
+		st->st_size = ent->fileSize;
+		st->st_blocks = ((uint64_t) ent->fileSize + FUSEFS_SECTOR - 1) / FUSEFS_SECTOR;
+	}
+
+	st->st_uid = getuid();
+	st->st_gid = getgid();
+	st->st_blksize = img->head->bytesPerClus;
+	st->st_mtime = dosTime(ent->wrtDate, ent->wrtTime, img->mtime);
+	st->st_atime = st->st_mtime;
+	st->st_ctime = st->st_mtime;
+}
+
+static void * fusefsInit(struct fuse_conn_info * conn, struct fuse_config * cfg){
+
+	/* the image does not change under the mount, so names, attributes
+	   and file pages can stay in the kernel */
+	cfg->kernel_cache = 1;
+	cfg->entry_timeout = FUSEFS_TIMEOUT;
+	cfg->attr_timeout = FUSEFS_TIMEOUT;
+	cfg->negative_timeout = FUSEFS_TIMEOUT;
+
+	return getImage();
+}
+
+static int fusefsGetattr(const char * path, struct stat * st, struct fuse_file_info * fi){
+
+	fusefsImage * img = getImage();
+	fat32IndexEnt ent;
+
+	if(!resolvePath(img->head, path, &ent)) return -ENOENT;
+
+	entryStat(img, &ent, st);
+	return 0;
+}
+
+static int fusefsReaddir(const char * path, void * buf, fuse_fill_dir_t filler, off_t offset,
+		struct fuse_file_info * fi, enum fuse_readdir_flags flags){
+
+	fusefsImage * img = getImage();
+	fat32IndexEnt ent;
+	fat32DirIter it;
+	const fat32Dir * dir;
+	char name[FMT_NAME_LENGTH];
+	struct stat st;
+
+	if(!resolvePath(img->head, path, &ent)) return -ENOENT;
+	if(!(ent.attr & ATTR_DIRECTORY)) return -ENOTDIR;
+
+	filler(buf, DOT, NULL, 0, 0);
+	filler(buf, DOTDOT, NULL, 0, 0);
+
+	/* every live entry except long name slots, the volume label and
+	   the dot entries, under its long name if it has one */
+	dirIterInit(img->head, &it, ent.firstClus);
+	while((dir = dirIterNext(&it)) != NULL){
+
+		if((unsigned char) dir->DIR_Name[0] == FREE_DIR || dir->DIR_Attr == INV_DIR ||
+				(dir->DIR_Attr & ATTR_VOLUME_ID)){
+			continue;
+		}
+
+		entryName(dir, name);
+		if(name[0] == NULL_TERM || strcmp(name, DOT) == 0 || strcmp(name, DOTDOT) == 0) continue;
+
+		fat32IndexEnt child;
+		memset(&child, 0, sizeof(child));
+		child.fileSize = dir->DIR_FileSize;
+		child.wrtDate = dir->DIR_WrtDate;
+		child.wrtTime = dir->DIR_WrtTime;
+		child.attr = dir->DIR_Attr;
+		entryStat(img, &child, &st);
+
+		if(filler(buf, it.longName[0] != NULL_TERM ? it.longName : name, &st, 0, FUSE_FILL_DIR_PLUS) != 0) break;
+	}
+	dirIterFree(&it);
+
+	return 0;
+}
+
+static int fusefsOpen(const char * path, struct fuse_file_info * fi){
+
+	fusefsImage * img = getImage();
+	fat32IndexEnt ent;
+
+	if((fi->flags & O_ACCMODE) != O_RDONLY) return -EROFS;
+	if(!resolvePath(img->head, path, &ent)) return -ENOENT;
+	if(ent.attr & ATTR_DIRECTORY) return -EISDIR;
+
+	fusefsFile * f = (fusefsFile*) malloc(sizeof(fusefsFile));
+	if(f == NULL) return -ENOMEM;
+
+	f->file = fat32FileOpen(img->head, ent.firstClus, ent.fileSize);
+	pthread_mutex_init(&f->lock, NULL);
+
+	fi->fh = (uint64_t) (uintptr_t) f;
+	fi->keep_cache = 1;
+	return 0;
+}
+
+static int fusefsRead(const char * path, char * buf, size_t size, off_t offset, struct fuse_file_info * fi){
+
+	fusefsFile * f = (fusefsFile*) (uintptr_t) fi->fh;
+
+	if(offset < 0) return -EINVAL;
+
+	/* reads of other files run in parallel, the run index of one
+	   file is extended by one read at a time */
+	pthread_mutex_lock(&f->lock);
+	errno = 0;
+	uint64_t done = fat32Pread(f->file, buf, size, (uint64_t) offset);
+	int err = errno;
+	pthread_mutex_unlock(&f->lock);
+
+	/* a volume that cannot be read is an error, not the end of the file */
+	if(done == 0 && err != 0) return -err;
+	return (int) done;
+}
+
+static int fusefsRelease(const char * path, struct fuse_file_info * fi){
+
+	fusefsFile * f = (fusefsFile*) (uintptr_t) fi->fh;
+
+	fat32FileClose(f->file);
+	pthread_mutex_destroy(&f->lock);
+	free(f);
+	return 0;
+}
+
+static int fusefsStatfs(const char * path, struct statvfs * sv){
+
+	fusefsImage * img = getImage();
+	const fat32FreeMap * map = freeMapGet(img->head);
+
+	memset(sv, 0, sizeof(*sv));
+	sv->f_bsize = img->head->bytesPerClus;
+	sv->f_frsize = img->head->bytesPerClus;
+	sv->f_blocks = map->numClus;
+	sv->f_bfree = map->freeCount;
+	sv->f_bavail = map->freeCount;
+	sv->f_namemax = FUSEFS_NAME_MAX;
+	sv->f_flag = ST_RDONLY;
+	return 0;
+}
+
+static const struct fuse_operations fusefsOps = {
+	.init = fusefsInit,
+	.getattr = fusefsGetattr,
+	.readdir = fusefsReaddir,
+	.open = fusefsOpen,
+	.read = fusefsRead,
+	.release = fusefsRelease,
+	.statfs = fusefsStatfs,
+};
+
+/* Keeps the first argument that is not an option as the image,
+   passes everything else on to FUSE */
+static int optProc(void * data, const char * arg, int key, struct fuse_args * outargs){
+
+	fusefsOpts * opts = (fusefsOpts*) data;
+
+	if(key == FUSE_OPT_KEY_NONOPT && opts->image == NULL){
+		opts->image = arg;
+		return 0;
+	}
+	return 1;
+}
+
+int main(int argc, char *argv[]){
+
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	fusefsOpts opts;
+	fusefsImage img;
+	struct stat st;
+
+	memset(&opts, 0, sizeof(opts));
+	if(fuse_opt_parse(&args, &opts, optSpec, optProc) == -1) exit(EXIT_FAILURE);
+
+	if(opts.help || opts.image == NULL){
+		printf("Usage: %s [-m] <file> <mountpoint> [FUSE options]\n", argv[0]);
+		if(opts.help){
+			fuse_opt_add_arg(&args, "--help");
+			fuse_main(args.argc, args.argv, &fusefsOps, NULL);
+		}
+		fuse_opt_free_args(&args);
+		exit(opts.help ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	img.path = opts.image;
+	img.fd = open(opts.image, O_RDONLY);
+	if(img.fd == -1 || fstat(img.fd, &st) == -1){
+		perror("opening file: ");
+		exit(EXIT_FAILURE);
+	}
+	img.mtime = st.st_mtime;
+	img.head = createHead(img.fd, opts.mmap ? HEAD_MMAP : 0);
+
+	/* nothing is ever written, the kernel may refuse writes itself */
+	fuse_opt_add_arg(&args, "-oro");
+
+	int res = fuse_main(args.argc, args.argv, &fusefsOps, &img);
+
+	fuse_opt_free_args(&args);
+	dirCacheFree(img.head);
+	freeMapFree(img.head);
+	cleanupHead(img.head);
+	close(img.fd);
+	return res;
+}
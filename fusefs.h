@@ -0,0 +1,61 @@
+/**********************************************************************
+  Module: fusefs.h
+  Author: Junseok Lee
+
+  Purpose: Read-only FUSE file system over a FAT32 image, so that
+  ordinary tools can read the files of an image without mounting
+  it as root. Attributes come from the directory entries, listings
+  from the directory's cluster chain, and file data from ranged
+  reads through the cluster run index of each open file.
+
+  Requests are dispatched on many threads. The head's FAT cache,
+  directory cache and free map are shared by all of them, only
+  reads on the same open file are serialized, by a lock on it.
+
+    ./fat32fs [-m] <fat32_volume> <mountpoint> [FUSE options]
+
+**********************************************************************/
+#ifndef FUSEFS_H
+#define FUSEFS_H
+
+#include <pthread.h>
+#include "fat32.h"
+#include "extent.h"
+
+/* fuse constants */
+#define FUSEFS_TIMEOUT 3600.0 //seconds the kernel keeps names and attributes, the image does not change
+#define FUSEFS_NAME_MAX 255 //longest long name in characters
+#define FUSEFS_DIR_MODE 0555
+#define FUSEFS_FILE_MODE 0444
+#define FUSEFS_SECTOR 512 //unit of st_blocks
+
+/* DOS date and time fields */
+#define DOS_YEAR_SHIFT 9
+#define DOS_YEAR_BASE 80 //years from 1900 to 1980
+#define DOS_MONTH_SHIFT 5
+#define DOS_MONTH_MASK 0xF
+#define DOS_DAY_MASK 0x1F
+#define DOS_HOUR_SHIFT 11
+#define DOS_MIN_SHIFT 5
+#define DOS_MIN_MASK 0x3F
+#define DOS_SEC_MASK 0x1F
+
+/* Open file struct,
+   one file opened through the mount */
+struct fusefsFile_struct {
+	fat32File * file;
+	pthread_mutex_t lock; //held for a read, the run index grows as the file is read
+};
+typedef struct fusefsFile_struct fusefsFile;
+
+/* Mounted image struct,
+   shared by every request */
+struct fusefsImage_struct {
+	const char * path; //path of the image as given
+	int fd;
+	fat32Head * head;
+	time_t mtime; //modification time of the image, for entries without one
+};
+typedef struct fusefsImage_struct fusefsImage;
+
+#endif
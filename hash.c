@@ -0,0 +1,635 @@
+/**********************************************************************
+  Module: hash.c
+  Author: Junseok Lee
+
+ Streaming SHA-256, BLAKE3 and CRC32C, with the SHA extensions and
+ the crc32 instruction picked at run time, and digest manifests.
+
+**********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include "hash.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HASH_X86 1
+#endif
+
+#define BLAKE3_CHUNK_START 1
+#define BLAKE3_CHUNK_END 2
+#define BLAKE3_PARENT 4
+#define BLAKE3_ROOT 8
+#define BLAKE3_ROUNDS 7
+#define CRC32C_POLY 0x82F63B78 //Castagnoli, bit reflected
+#define XXH_P1 0x9E3779B185EBCA87ULL
+#define XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define XXH_P3 0x165667B19E3779F9ULL
+#define XXH_P4 0x85EBCA77C2B2AE63ULL
+#define XXH_P5 0x27D4EB2F165667C5ULL
+
+/* algorithm GET and RGET hash with */
+static int algoSel = HASH_NONE;
+
+static const uint32_t sha256K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/* the SHA-256 initial hash is also the BLAKE3 key of unkeyed hashing */
+static const uint32_t hashIV[SHA256_WORDS] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+/* message word order of each BLAKE3 round, the permutation applied
+   again and again to the words of the block */
+static const uint8_t blake3Sched[BLAKE3_ROUNDS][16] = {
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+	{ 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 },
+	{ 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1 },
+	{ 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6 },
+	{ 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4 },
+	{ 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7 },
+	{ 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13 }
+};
+
+static uint32_t crc32cTable[256];
+static pthread_once_t crc32cOnce = PTHREAD_ONCE_INIT;
+
+void hashSetAlgo(int algo){
+
+	if(algo < HASH_NONE || algo > HASH_CRC32C) algo = HASH_NONE;
+	algoSel = algo;
+}
+
+int hashAlgo(void){
+
+	return algoSel;
+}
+
+int hashParseAlgo(const char * name){
+
+	if(strcasecmp(name, "sha256") == 0) return HASH_SHA256;
+	if(strcasecmp(name, "blake3") == 0) return HASH_BLAKE3;
+	if(strcasecmp(name, "crc32c") == 0) return HASH_CRC32C;
+	return HASH_NONE;
+}
+
+const char * hashAlgoName(int algo){
+
+	switch(algo){
+	case HASH_SHA256: return "sha256";
+	case HASH_BLAKE3: return "blake3";
+	case HASH_CRC32C: return "crc32c";
+	}
+	return "none";
+}
+
+static uint32_t rotr32(uint32_t x, int n){
+
+	return (x >> n) | (x << (32 - n));
+}
+
+static uint32_t loadBe32(const uint8_t * p){
+
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static uint32_t loadLe32(const uint8_t * p){
+
+	return p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+/* Prints the n words of w to out in hex, each most significant
+   byte first if bigEndian is set, or else least significant first */
+static void wordsToHex(const uint32_t * w, int n, int bigEndian, char * out){
+
+	static const char digits[] = "0123456789abcdef";
+	int i, b;
+
+	for(i = 0; i < n; i++){
+		for(b = 0; b < 4; b++){
+			uint8_t byte = w[i] >> (bigEndian ? 24 - 8 * b : 8 * b);
+			*out++ = digits[byte >> 4];
+			*out++ = digits[byte & 0xF];
+		}
+	}
+	*out = '\0';
+}
+
+/* SHA-256 compression of n whole blocks, FIPS 180-4 */
+static void sha256Scalar(uint32_t * h, const uint8_t * p, size_t n){
+
+	uint32_t w[64];
+	int t;
+
+	for(; n > 0; n--, p += HASH_BLOCK){
+
+		for(t = 0; t < 16; t++) w[t] = loadBe32(p + 4 * t);
+		for(t = 16; t < 64; t++){
+			uint32_t s0 = rotr32(w[t - 15], 7) ^ rotr32(w[t - 15], 18) ^ (w[t - 15] >> 3);
+			uint32_t s1 = rotr32(w[t - 2], 17) ^ rotr32(w[t - 2], 19) ^ (w[t - 2] >> 10);
+			w[t] = w[t - 16] + s0 + w[t - 7] + s1;
+		}
+
+		uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+
+		for(t = 0; t < 64; t++){
+			uint32_t t1 = k + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) + ((e & f) ^ (~e & g)) + sha256K[t] + w[t];
+			uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+			k = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + t2;
+		}
+
+		h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+		h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+	}
+}
+
+#ifdef HASH_X86
+
+/* SHA-256 on the SHA extensions, four rounds per pair of sha256rnds2.
+   The state is kept as ABEF and CDGH, the order the instructions
+   take it in. */
+__attribute__((target("sha,sse4.1")))
+static void sha256Ni(uint32_t * h, const uint8_t * p, size_t n){
+
+	const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	int g;
+
+	__m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) h), 0xB1); //CDAB
+	__m128i st1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) (h + 4)), 0x1B); //EFGH
+	__m128i st0 = _mm_alignr_epi8(tmp, st1, 8); //ABEF
+	st1 = _mm_blend_epi16(st1, tmp, 0xF0); //CDGH
+
+	for(; n > 0; n--, p += HASH_BLOCK){
+
+		__m128i save0 = st0, save1 = st1;
+
+		/* the last four groups of message words, in registers */
+		__m128i m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) p), bswap);
+		__m128i m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (p + 16)), bswap);
+		__m128i m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (p + 32)), bswap);
+		__m128i m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (p + 48)), bswap);
+
+		for(g = 0; g < 16; g++){
+
+			__m128i k = _mm_add_epi32(m0, _mm_loadu_si128((const __m128i*) (sha256K + 4 * g)));
+			st1 = _mm_sha256rnds2_epu32(st1, st0, k);
+			st0 = _mm_sha256rnds2_epu32(st0, st1, _mm_shuffle_epi32(k, 0x0E));
+
+			/* words 16 on are expanded four at a time from the ones before */
+			__m128i next = _mm_sha256msg1_epu32(m0, m1);
+			next = _mm_add_epi32(next, _mm_alignr_epi8(m3, m2, 4));
+			next = _mm_sha256msg2_epu32(next, m3);
+			m0 = m1;
+			m1 = m2;
+			m2 = m3;
+			m3 = next;
+		}
+
+		st0 = _mm_add_epi32(st0, save0);
+		st1 = _mm_add_epi32(st1, save1);
+	}
+
+	tmp = _mm_shuffle_epi32(st0, 0x1B); //FEBA
+	st1 = _mm_shuffle_epi32(st1, 0xB1); //DCHG
+	_mm_storeu_si128((__m128i*) h, _mm_blend_epi16(tmp, st1, 0xF0)); //DCBA
+	_mm_storeu_si128((__m128i*) (h + 4), _mm_alignr_epi8(st1, tmp, 8)); //HGFE
+}
+
+/* CRC32C on the crc32 instruction, eight bytes at a time */
+__attribute__((target("sse4.2")))
+static uint32_t crc32cHw(uint32_t crc, const uint8_t * p, size_t n){
+
+#ifdef __x86_64__
+	uint64_t c = crc;
+
+	for(; n >= 8; n -= 8, p += 8){
+		uint64_t v;
+		memcpy(&v, p, sizeof(v));
+		c = _mm_crc32_u64(c, v);
+	}
+	crc = (uint32_t) c;
+#endif
+	for(; n > 0; n--, p++) crc = _mm_crc32_u8(crc, *p);
+	return crc;
+}
+
+#endif
+
+static void crc32cTableInit(void){
+
+	uint32_t i;
+	int b;
+
+	for(i = 0; i < 256; i++){
+		uint32_t c = i;
+		for(b = 0; b < 8; b++) c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+		crc32cTable[i] = c;
+	}
+}
+
+/* CRC32C one byte at a time through a table */
+static uint32_t crc32cTableUpdate(uint32_t crc, const uint8_t * p, size_t n){
+
+	pthread_once(&crc32cOnce, crc32cTableInit);
+
+	for(; n > 0; n--, p++) crc = crc32cTable[(crc ^ *p) & 0xFF] ^ (crc >> 8);
+	return crc;
+}
+
+const char * hashEngine(int algo){
+
+#ifdef HASH_X86
+	__builtin_cpu_init();
+
+	if(algo == HASH_SHA256 && __builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1")) return "sha-ni";
+	if(algo == HASH_CRC32C && __builtin_cpu_supports("sse4.2")) return "sse4.2";
+#endif
+	return algo == HASH_CRC32C ? "table" : "portable";
+}
+
+/* BLAKE3 quarter round on four state words */
+#define BLAKE3_G(a, b, c, d, mx, my) do { \
+	a = a + b + (mx); d = rotr32(d ^ a, 16); \
+	c = c + d; b = rotr32(b ^ c, 12); \
+	a = a + b + (my); d = rotr32(d ^ a, 8); \
+	c = c + d; b = rotr32(b ^ c, 7); \
+} while(0)
+
+/* BLAKE3 compression of one block, storing the 16 output words.
+   The state lives in locals so that it stays in registers. */
+static void blake3Compress(const uint32_t cv[SHA256_WORDS], const uint8_t block[HASH_BLOCK], uint64_t counter,
+		uint32_t blockLen, uint32_t flags, uint32_t out[16]){
+
+	uint32_t m[16];
+	int i, r;
+
+	for(i = 0; i < 16; i++) m[i] = loadLe32(block + 4 * i);
+
+	uint32_t s0 = cv[0], s1 = cv[1], s2 = cv[2], s3 = cv[3], s4 = cv[4], s5 = cv[5], s6 = cv[6], s7 = cv[7];
+	uint32_t s8 = hashIV[0], s9 = hashIV[1], s10 = hashIV[2], s11 = hashIV[3];
+	uint32_t s12 = (uint32_t) counter, s13 = (uint32_t) (counter >> 32), s14 = blockLen, s15 = flags;
+
+	for(r = 0; r < BLAKE3_ROUNDS; r++){
+		const uint8_t * x = blake3Sched[r];
+
+		BLAKE3_G(s0, s4, s8, s12, m[x[0]], m[x[1]]);
+		BLAKE3_G(s1, s5, s9, s13, m[x[2]], m[x[3]]);
+		BLAKE3_G(s2, s6, s10, s14, m[x[4]], m[x[5]]);
+		BLAKE3_G(s3, s7, s11, s15, m[x[6]], m[x[7]]);
+		BLAKE3_G(s0, s5, s10, s15, m[x[8]], m[x[9]]);
+		BLAKE3_G(s1, s6, s11, s12, m[x[10]], m[x[11]]);
+		BLAKE3_G(s2, s7, s8, s13, m[x[12]], m[x[13]]);
+		BLAKE3_G(s3, s4, s9, s14, m[x[14]], m[x[15]]);
+	}
+
+	out[0] = s0 ^ s8; out[1] = s1 ^ s9; out[2] = s2 ^ s10; out[3] = s3 ^ s11;
+	out[4] = s4 ^ s12; out[5] = s5 ^ s13; out[6] = s6 ^ s14; out[7] = s7 ^ s15;
+	out[8] = s8 ^ cv[0]; out[9] = s9 ^ cv[1]; out[10] = s10 ^ cv[2]; out[11] = s11 ^ cv[3];
+	out[12] = s12 ^ cv[4]; out[13] = s13 ^ cv[5]; out[14] = s14 ^ cv[6]; out[15] = s15 ^ cv[7];
+}
+
+/* Compresses the parent of two subtrees, storing the output in out */
+static void blake3Parent(const uint32_t left[SHA256_WORDS], const uint32_t right[SHA256_WORDS], uint32_t flags,
+		uint32_t out[16]){
+
+	uint8_t block[HASH_BLOCK];
+	int i;
+
+	for(i = 0; i < 8; i++){
+		memcpy(block + 4 * i, &left[i], 4);
+		memcpy(block + 32 + 4 * i, &right[i], 4);
+	}
+	blake3Compress(hashIV, block, 0, HASH_BLOCK, BLAKE3_PARENT | flags, out);
+}
+
+static uint32_t blake3StartFlag(const blake3State * b){
+
+	return b->blocksCompressed == 0 ? BLAKE3_CHUNK_START : 0;
+}
+
+/* Pushes the chaining value of a finished chunk, merging the
+   subtrees it completes. totalChunks counts the chunks so far. */
+static void blake3AddChunk(blake3State * b, uint32_t cv[SHA256_WORDS], uint64_t totalChunks){
+
+	uint32_t out[16];
+
+	while((totalChunks & 1) == 0){
+		blake3Parent(b->stack[--b->stackLen], cv, 0, out);
+		memcpy(cv, out, SHA256_WORDS * sizeof(uint32_t));
+		totalChunks >>= 1;
+	}
+	memcpy(b->stack[b->stackLen++], cv, SHA256_WORDS * sizeof(uint32_t));
+}
+
+static void blake3Update(blake3State * b, const uint8_t * p, size_t n){
+
+	uint32_t out[16];
+
+	while(n > 0){
+
+		/* a full chunk is only closed once more data follows,
+		   the last chunk is finished by blake3Final as the root */
+		if(b->blocksCompressed * HASH_BLOCK + b->blockLen == BLAKE3_CHUNK){
+			blake3Compress(b->cv, b->block, b->chunkCounter, b->blockLen,
+					blake3StartFlag(b) | BLAKE3_CHUNK_END, out);
+			b->chunkCounter++;
+			blake3AddChunk(b, out, b->chunkCounter);
+			memcpy(b->cv, hashIV, sizeof(b->cv));
+			b->blocksCompressed = 0;
+			b->blockLen = 0;
+		}
+
+		/* likewise a full block waits for more data */
+		if(b->blockLen == HASH_BLOCK){
+			blake3Compress(b->cv, b->block, b->chunkCounter, HASH_BLOCK, blake3StartFlag(b), out);
+			memcpy(b->cv, out, sizeof(b->cv));
+			b->blocksCompressed++;
+			b->blockLen = 0;
+		}
+
+		size_t take = HASH_BLOCK - b->blockLen;
+		if(take > n) take = n;
+		memcpy(b->block + b->blockLen, p, take);
+		b->blockLen += take;
+		p += take;
+		n -= take;
+	}
+}
+
+static void blake3Final(blake3State * b, uint32_t out[16]){
+
+	uint32_t flags = blake3StartFlag(b) | BLAKE3_CHUNK_END;
+	uint32_t cv[SHA256_WORDS];
+
+	memset(b->block + b->blockLen, 0, HASH_BLOCK - b->blockLen);
+
+	if(b->stackLen == 0){
+		blake3Compress(b->cv, b->block, b->chunkCounter, b->blockLen, flags | BLAKE3_ROOT, out);
+		return;
+	}
+
+	/* fold the last chunk into the stacked subtrees, right to left */
+	blake3Compress(b->cv, b->block, b->chunkCounter, b->blockLen, flags, out);
+	memcpy(cv, out, sizeof(cv));
+
+	while(b->stackLen > 1){
+		blake3Parent(b->stack[--b->stackLen], cv, 0, out);
+		memcpy(cv, out, sizeof(cv));
+	}
+	blake3Parent(b->stack[0], cv, BLAKE3_ROOT, out);
+}
+
+void hashInit(fat32Hash * hs, int algo){
+
+	memset(hs, 0, sizeof(*hs));
+	hs->algo = algo;
+
+	switch(algo){
+	case HASH_SHA256:
+		memcpy(hs->u.sha256.h, hashIV, sizeof(hashIV));
+		hs->u.sha256.blocks = sha256Scalar;
+#ifdef HASH_X86
+		if(strcmp(hashEngine(algo), "sha-ni") == 0) hs->u.sha256.blocks = sha256Ni;
+#endif
+		break;
+	case HASH_BLAKE3:
+		memcpy(hs->u.blake3.cv, hashIV, sizeof(hashIV));
+		break;
+	case HASH_CRC32C:
+		hs->u.crc32c.crc = 0xFFFFFFFF;
+		hs->u.crc32c.update = crc32cTableUpdate;
+#ifdef HASH_X86
+		if(strcmp(hashEngine(algo), "sse4.2") == 0) hs->u.crc32c.update = crc32cHw;
+#endif
+		break;
+	}
+}
+
+void hashUpdate(fat32Hash * hs, const void * data, size_t len){
+
+	const uint8_t * p = (const uint8_t*) data;
+
+	if(hs->algo == HASH_BLAKE3){
+		blake3Update(&hs->u.blake3, p, len);
+	}
+	else if(hs->algo == HASH_CRC32C){
+		hs->u.crc32c.crc = hs->u.crc32c.update(hs->u.crc32c.crc, p, len);
+	}
+	else if(hs->algo == HASH_SHA256){
+		sha256State * s = &hs->u.sha256;
+		s->len += len;
+
+		/* top up a partial block first, then whole blocks straight from the data */
+		if(s->blockLen > 0){
+			size_t take = HASH_BLOCK - s->blockLen;
+			if(take > len) take = len;
+			memcpy(s->block + s->blockLen, p, take);
+			s->blockLen += take;
+			p += take;
+			len -= take;
+
+			if(s->blockLen < HASH_BLOCK) return;
+			s->blocks(s->h, s->block, 1);
+			s->blockLen = 0;
+		}
+
+		s->blocks(s->h, p, len / HASH_BLOCK);
+		p += len / HASH_BLOCK * HASH_BLOCK;
+		len %= HASH_BLOCK;
+
+		memcpy(s->block, p, len);
+		s->blockLen = len;
+	}
+}
+
+void hashFinal(fat32Hash * hs, char out[HASH_HEX_SZ]){
+
+	uint32_t words[16];
+
+	if(hs->algo == HASH_BLAKE3){
+		blake3Final(&hs->u.blake3, words);
+		wordsToHex(words, SHA256_WORDS, 0, out);
+	}
+	else if(hs->algo == HASH_CRC32C){
+		words[0] = ~hs->u.crc32c.crc;
+		wordsToHex(words, 1, 1, out);
+	}
+	else if(hs->algo == HASH_SHA256){
+		sha256State * s = &hs->u.sha256;
+		uint64_t bits = s->len * 8;
+		int i;
+
+		/* the padding and length take one or two more blocks */
+		s->block[s->blockLen++] = 0x80;
+		if(s->blockLen > HASH_BLOCK - 8){
+			memset(s->block + s->blockLen, 0, HASH_BLOCK - s->blockLen);
+			s->blocks(s->h, s->block, 1);
+			s->blockLen = 0;
+		}
+		memset(s->block + s->blockLen, 0, HASH_BLOCK - 8 - s->blockLen);
+		for(i = 0; i < 8; i++) s->block[HASH_BLOCK - 1 - i] = bits >> (8 * i);
+		s->blocks(s->h, s->block, 1);
+
+		wordsToHex(s->h, SHA256_WORDS, 1, out);
+	}
+	else{
+		out[0] = '\0';
+	}
+}
+
+static uint64_t rotl64(uint64_t x, int n){
+
+	return (x << n) | (x >> (64 - n));
+}
+
+static uint64_t load64(const uint8_t * p){
+
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint64_t xxhRound(uint64_t acc, uint64_t input){
+
+	acc += input * XXH_P2;
+	return rotl64(acc, 31) * XXH_P1;
+}
+
+static uint64_t xxhMerge(uint64_t acc, uint64_t v){
+
+	acc ^= xxhRound(0, v);
+	return acc * XXH_P1 + XXH_P4;
+}
+
+uint64_t hash64(const void * data, size_t len, uint64_t seed){
+
+	const uint8_t * p = (const uint8_t*) data;
+	const uint8_t * end = p + len;
+	uint64_t h;
+
+	/* four independent lanes over 32 byte stripes */
+	if(len >= 32){
+		uint64_t v1 = seed + XXH_P1 + XXH_P2, v2 = seed + XXH_P2, v3 = seed, v4 = seed - XXH_P1;
+
+		for(; p + 32 <= end; p += 32){
+			v1 = xxhRound(v1, load64(p));
+			v2 = xxhRound(v2, load64(p + 8));
+			v3 = xxhRound(v3, load64(p + 16));
+			v4 = xxhRound(v4, load64(p + 24));
+		}
+
+		h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+		h = xxhMerge(h, v1);
+		h = xxhMerge(h, v2);
+		h = xxhMerge(h, v3);
+		h = xxhMerge(h, v4);
+	}
+	else{
+		h = seed + XXH_P5;
+	}
+
+	h += len;
+
+	for(; p + 8 <= end; p += 8){
+		h ^= xxhRound(0, load64(p));
+		h = rotl64(h, 27) * XXH_P1 + XXH_P4;
+	}
+	if(p + 4 <= end){
+		uint32_t v;
+		memcpy(&v, p, sizeof(v));
+		h ^= (uint64_t) v * XXH_P1;
+		h = rotl64(h, 23) * XXH_P2 + XXH_P3;
+		p += 4;
+	}
+	for(; p < end; p++){
+		h ^= *p * XXH_P5;
+		h = rotl64(h, 11) * XXH_P1;
+	}
+
+	h ^= h >> 33;
+	h *= XXH_P2;
+	h ^= h >> 29;
+	h *= XXH_P3;
+	h ^= h >> 32;
+	return h;
+}
+
+hashManifest * manifestNew(int algo){
+
+	hashManifest * m = (hashManifest*) calloc(1, sizeof(hashManifest));
+
+	if(m == NULL){
+		perror("manifestNew malloc error");
+		exit(EXIT_FAILURE);
+	}
+	m->algo = algo;
+	return m;
+}
+
+void manifestAdd(hashManifest * m, const char * path, uint32_t fileSize, const char digest[HASH_HEX_SZ]){
+
+	if(m->numEnts == m->cap){
+		m->cap = m->cap ? m->cap * 2 : HASH_MANIFEST_INIT;
+		m->ents = (hashManifestEnt*) realloc(m->ents, m->cap * sizeof(hashManifestEnt));
+		if(m->ents == NULL){
+			perror("manifestAdd realloc error");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	hashManifestEnt * e = &m->ents[m->numEnts++];
+	e->path = strdup(path);
+	if(e->path == NULL){
+		perror("manifestAdd strdup error");
+		exit(EXIT_FAILURE);
+	}
+	e->fileSize = fileSize;
+	memcpy(e->digest, digest, HASH_HEX_SZ);
+}
+
+static int cmpManifestEnt(const void * a, const void * b){
+
+	return strcmp(((const hashManifestEnt*) a)->path, ((const hashManifestEnt*) b)->path);
+}
+
+void manifestSort(hashManifest * m){
+
+	if(m->numEnts > 1) qsort(m->ents, m->numEnts, sizeof(hashManifestEnt), cmpManifestEnt);
+}
+
+void manifestPrint(FILE * out, const hashManifest * m){
+
+	uint64_t i;
+
+	for(i = 0; i < m->numEnts; i++){
+		fprintf(out, "%s  %s\n", m->ents[i].digest, m->ents[i].path);
+	}
+}
+
+void manifestFree(hashManifest * m){
+
+	uint64_t i;
+
+	if(m == NULL) return;
+
+	for(i = 0; i < m->numEnts; i++) free(m->ents[i].path);
+	free(m->ents);
+	free(m);
+}
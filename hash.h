@@ -0,0 +1,140 @@
+/**********************************************************************
+  Module: hash.h
+  Author: Junseok Lee
+
+  Purpose: Streaming content hashes of file data, fed one buffer at a
+  time as the data is copied out of the volume, so a digest costs no
+  second read. SHA-256 uses the SHA extensions and CRC32C the SSE4.2
+  crc32 instruction when the CPU has them, picked at run time. The
+  digests of many files are collected in a manifest, printed in the
+  format sha256sum and b3sum read back with -c.
+
+**********************************************************************/
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/* hash algorithms */
+#define HASH_NONE 0
+#define HASH_SHA256 1
+#define HASH_BLAKE3 2
+#define HASH_CRC32C 3
+
+/* hash constants */
+#define HASH_HEX_SZ 65 //longest digest in hex, with the terminator
+#define HASH_BLOCK 64 //block size of SHA-256 and BLAKE3
+#define SHA256_WORDS 8
+#define BLAKE3_CHUNK 1024 //bytes per leaf of the BLAKE3 tree
+#define BLAKE3_MAX_DEPTH 54 //chaining values stacked at most, enough for 2^64 bytes
+#define HASH_MANIFEST_INIT 256
+
+/* SHA-256 state struct */
+struct sha256State_struct {
+	uint32_t h[SHA256_WORDS];
+	uint64_t len; //bytes hashed
+	uint8_t block[HASH_BLOCK]; //partial block
+	uint32_t blockLen;
+	void (*blocks)(uint32_t * h, const uint8_t * p, size_t n); //compression of n whole blocks
+};
+typedef struct sha256State_struct sha256State;
+
+/* BLAKE3 state struct */
+struct blake3State_struct {
+	uint32_t cv[SHA256_WORDS]; //chaining value of the current chunk
+	uint64_t chunkCounter;
+	uint8_t block[HASH_BLOCK]; //partial block of the current chunk
+	uint32_t blockLen;
+	uint32_t blocksCompressed; //blocks of the current chunk already compressed
+	uint32_t stack[BLAKE3_MAX_DEPTH][SHA256_WORDS]; //chaining values of complete subtrees
+	uint32_t stackLen;
+};
+typedef struct blake3State_struct blake3State;
+
+/* Hash struct,
+   the running state of one digest */
+struct fat32Hash_struct {
+	int algo; //HASH_SHA256 ...
+	union {
+		sha256State sha256;
+		blake3State blake3;
+		struct {
+			uint32_t crc;
+			uint32_t (*update)(uint32_t crc, const uint8_t * p, size_t n);
+		} crc32c;
+	} u;
+};
+typedef struct fat32Hash_struct fat32Hash;
+
+/* Manifest entry struct,
+   the digest of one file */
+struct hashManifestEnt_struct {
+	char * path; //path relative to the directory hashed
+	uint32_t fileSize;
+	char digest[HASH_HEX_SZ];
+};
+typedef struct hashManifestEnt_struct hashManifestEnt;
+
+/* Manifest struct,
+   the digests of every file of a tree */
+struct hashManifest_struct {
+	hashManifestEnt * ents;
+	uint64_t numEnts;
+	uint64_t cap;
+	int algo;
+	uint64_t numBytes; //bytes hashed
+	uint64_t numErrors; //files that could not be read or written
+	int numThreads;
+	double secs; //time the files took
+};
+typedef struct hashManifest_struct hashManifest;
+
+/* Selects the algorithm GET and RGET hash the files they copy with,
+   HASH_NONE (the default) copies without hashing */
+void hashSetAlgo(int algo);
+
+/* Returns the algorithm selected with hashSetAlgo */
+int hashAlgo(void);
+
+/* Returns the algorithm called name (sha256, blake3 or crc32c),
+   or HASH_NONE if there is none */
+int hashParseAlgo(const char * name);
+
+/* Returns the name of an algorithm, also used as the extension
+   of manifest files */
+const char * hashAlgoName(int algo);
+
+/* Returns the name of the code path algo runs on this CPU */
+const char * hashEngine(int algo);
+
+/* Starts a digest of algo in hs */
+void hashInit(fat32Hash * hs, int algo);
+
+/* Feeds the next len bytes of the data to hs */
+void hashUpdate(fat32Hash * hs, const void * data, size_t len);
+
+/* Ends the digest of hs and stores it in hex, lower case, in out */
+void hashFinal(fat32Hash * hs, char out[HASH_HEX_SZ]);
+
+/* Returns the 64-bit XXH64 fingerprint of len bytes of data.
+   Fast, not cryptographic: for spotting identical data. */
+uint64_t hash64(const void * data, size_t len, uint64_t seed);
+
+/* Returns an empty manifest of digests of algo */
+hashManifest * manifestNew(int algo);
+
+/* Adds the digest of the file at path, copying path */
+void manifestAdd(hashManifest * m, const char * path, uint32_t fileSize, const char digest[HASH_HEX_SZ]);
+
+/* Sorts the entries of m by path */
+void manifestSort(hashManifest * m);
+
+/* Prints one "<digest>  <path>" line per entry of m to out */
+void manifestPrint(FILE * out, const hashManifest * m);
+
+/* Deallocates m */
+void manifestFree(hashManifest * m);
+
+#endif
@@ -0,0 +1,255 @@
+/**********************************************************************
+  Module: json.c
+  Author: Junseok Lee
+
+ JSON Lines output of the INFO, DIR, CD, GET and FREE commands.
+
+**********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include "json.h"
+#include "shell.h"
+#include "freemap.h"
+#include "hash.h"
+
+/* Returns the length of the valid UTF-8 sequence at s, at most n
+   bytes long, or 0 if s does not start with one */
+static size_t utf8Len(const unsigned char * s, size_t n){
+
+	size_t len, i;
+	unsigned char lo = 0x80, hi = 0xBF;
+
+	if(s[0] < 0x80) return 1;
+	else if(s[0] >= 0xC2 && s[0] <= 0xDF) len = 2;
+	else if(s[0] >= 0xE0 && s[0] <= 0xEF) len = 3;
+	else if(s[0] >= 0xF0 && s[0] <= 0xF4) len = 4;
+	else return 0;
+
+	/* no overlong forms, surrogates or code points past U+10FFFF */
+	if(s[0] == 0xE0) lo = 0xA0;
+	else if(s[0] == 0xED) hi = 0x9F;
+	else if(s[0] == 0xF0) lo = 0x90;
+	else if(s[0] == 0xF4) hi = 0x8F;
+
+	if(len > n || s[1] < lo || s[1] > hi) return 0;
+	for(i = 2; i < len; i++){
+		if(s[i] < 0x80 || s[i] > 0xBF) return 0;
+	}
+	return len;
+}
+
+void jsonString(FILE * out, const char * s, size_t maxLen){
+
+	const unsigned char * p = (const unsigned char*) s;
+	size_t n = strnlen(s, maxLen);
+
+	putc('"', out);
+	while(n > 0){
+		size_t len = utf8Len(p, n);
+
+		if(len == 0){
+			fputs("\\ufffd", out);
+			len = 1;
+		}
+		else if(*p == '"' || *p == '\\'){
+			putc('\\', out);
+			putc(*p, out);
+		}
+		else if(*p < ' '){
+			fprintf(out, "\\u%04x", *p);
+		}
+		else{
+			fwrite(p, 1, len, out);
+		}
+		p += len;
+		n -= len;
+	}
+	putc('"', out);
+}
+
+/* Prints the start of the object of a command line, up to "ok" */
+static void jsonBegin(const char * line, int ok){
+
+	fputs("{\"cmd\":", stdout);
+	jsonString(stdout, line, BUF_SIZE);
+	printf(",\"ok\":%s", ok ? "true" : "false");
+}
+
+void jsonError(const char * line, const char * msg){
+
+	jsonBegin(line, 0);
+	fputs(",\"error\":", stdout);
+	jsonString(stdout, msg, BUF_SIZE);
+	fputs("}\n", stdout);
+}
+
+/* Prints a fixed length boot sector field without its padding */
+static void jsonField(const char * key, const char * field, size_t len){
+
+	len = strnlen(field, len);
+	while(len > 0 && field[len - 1] == ' ') len--;
+
+	printf(",\"%s\":", key);
+	jsonString(stdout, field, len);
+}
+
+int jsonInfo(fat32Head *h, uint32_t *curDirClus, char *line){
+
+	fat32BS * bs = h->bs;
+
+	jsonBegin(line, 1);
+	jsonField("oem_name", bs->BS_OEMName, BS_OEMName_LENGTH);
+	jsonField("label", bs->BS_VolLab, BS_VolLab_LENGTH);
+	jsonField("fs_type", bs->BS_FilSysType, BS_FilSysType_LENGTH);
+	jsonField("volume_id", getVolumeID(h), DIR_NAME_LENGTH);
+
+	printf(",\"media\":%u,\"size\":%" PRIu64 ",\"bytes_per_sector\":%u,\"sectors_per_cluster\":%u"
+			",\"total_sectors\":%u,\"hidden_sectors\":%u,\"reserved_sectors\":%u,\"fats\":%u"
+			",\"fat_size\":%u,\"mirrored\":%s,\"root_cluster\":%u,\"free_bytes\":%" PRIu64 "}\n",
+			bs->BPB_Media, (uint64_t) bs->BPB_TotSec32 * bs->BPB_BytesPerSec, bs->BPB_BytesPerSec,
+			bs->BPB_SecPerClus, bs->BPB_TotSec32, bs->BPB_HiddSec, bs->BPB_RsvdSecCnt, bs->BPB_NumFATs,
+			bs->BPB_FATSz32, (bs->BPB_ExtFlags & FAT_MIRROR_DISABLED) ? "false" : "true", bs->BPB_RootClus,
+			getFreeSpace(h));
+	return 0;
+}
+
+void jsonDirEntries(FILE * out, fat32Head *h, uint32_t dirClus){
+
+	fat32DirIter it;
+	const fat32Dir * dir;
+	char name[FMT_NAME_LENGTH];
+	int first = 1;
+
+	fputs(",\"entries\":[", out);
+
+	/* every live entry except long name slots, the volume label and the dot entries */
+	dirIterInit(h, &it, dirClus);
+	while((dir = dirIterNext(&it)) != NULL){
+
+		if((unsigned char) dir->DIR_Name[0] == FREE_DIR || dir->DIR_Attr == INV_DIR ||
+				(dir->DIR_Attr & ATTR_VOLUME_ID)){
+			continue;
+		}
+
+		entryName(dir, name);
+		if(name[0] == NULL_TERM || strcmp(name, DOT) == 0 || strcmp(name, DOTDOT) == 0) continue;
+
+		fputs(first ? "{\"name\":" : ",{\"name\":", out);
+		jsonString(out, it.longName[0] != NULL_TERM ? it.longName : name, LFN_NAME_SZ);
+		fputs(",\"short\":", out);
+		jsonString(out, name, FMT_NAME_LENGTH);
+		fprintf(out, ",\"dir\":%s,\"attr\":%u,\"size\":%u,\"cluster\":%u}", (dir->DIR_Attr & ATTR_DIRECTORY) ? "true" : "false",
+				dir->DIR_Attr, dir->DIR_FileSize, ((uint32_t) dir->DIR_FstClusHI << HEX_TEN) | dir->DIR_FstClusLO);
+		first = 0;
+	}
+	dirIterFree(&it);
+
+	fputs("]", out);
+}
+
+int jsonDir(fat32Head *h, uint32_t *curDirClus, char *line){
+
+	jsonBegin(line, 1);
+	printf(",\"cluster\":%u", *curDirClus);
+	jsonDirEntries(stdout, h, *curDirClus);
+	printf("}\n");
+	return 0;
+}
+
+int jsonCD(fat32Head *h, uint32_t *curDirClus, char *line){
+
+	char buf[BUF_SIZE];
+	strcpy(buf, line);
+
+	char * arg = nameArg(buf);
+
+	if(arg == NULL || !changeDir(h, *curDirClus, arg, curDirClus)){
+		jsonError(line, "folder not found");
+		return -1;
+	}
+
+	jsonBegin(line, 1);
+	printf(",\"cluster\":%u}\n", *curDirClus);
+	return 0;
+}
+
+int jsonGet(fat32Head *h, uint32_t *curDirClus, char *line){
+
+	char buf[BUF_SIZE];
+	char digest[HASH_HEX_SZ];
+	uint32_t fileSize = 0;
+	int res = GET_NOT_FOUND;
+
+	strcpy(buf, line);
+
+	/* the destination file keeps the name as typed */
+	char * arg = nameArg(buf);
+	if(arg != NULL) res = getFile(h, *curDirClus, arg, arg, &fileSize, digest);
+
+	if(res == GET_NOT_FOUND){
+		jsonError(line, "file not found");
+		return -1;
+	}
+	if(res == GET_OPEN_ERR || res == GET_WRITE_ERR){
+		jsonError(line, strerror(errno));
+		return -1;
+	}
+	if(res == GET_SHORT){
+		jsonError(line, "cluster chain ended before the end of the file");
+		return -1;
+	}
+
+	jsonBegin(line, 1);
+	fputs(",\"dest\":", stdout);
+	jsonString(stdout, arg, BUF_SIZE);
+	printf(",\"size\":%u", fileSize);
+	if(digest[0] != NULL_TERM) printf(",\"%s\":\"%s\"", hashAlgoName(hashAlgo()), digest);
+	printf("}\n");
+	return 0;
+}
+
+int jsonFree(fat32Head *h, uint32_t *curDirClus, char *line){
+
+	const fat32FreeMap * map = freeMapRescan(h);
+
+	jsonBegin(line, 1);
+	printf(",\"free_clusters\":%u,\"clusters\":%u,\"free_bytes\":%" PRIu64 ",\"fsinfo_free\":", map->freeCount,
+			map->numClus, (uint64_t) map->freeCount * h->bytesPerClus);
+
+	if(h->fsi->FSI_Free_Count == FREE_CLUS_UNKNOWN) fputs("null", stdout);
+	else printf("%u", h->fsi->FSI_Free_Count);
+
+	printf(",\"secs\":%.6f,\"engine\":\"%s\"}\n", map->secs, map->engine);
+	return 0;
+}
+
+int jsonHash(fat32Head *h, uint32_t *curDirClus, char *line){
+
+	char buf[BUF_SIZE];
+	int algo = (hashAlgo() != HASH_NONE) ? hashAlgo() : HASH_SHA256;
+	uint64_t i;
+
+	strcpy(buf, line);
+
+	hashManifest * m = hashPath(h, *curDirClus, nameArg(buf), algo);
+
+	if(m == NULL){
+		jsonError(line, "file not found");
+		return -1;
+	}
+
+	jsonBegin(line, 1);
+	printf(",\"algo\":\"%s\",\"engine\":\"%s\",\"files\":[", hashAlgoName(algo), hashEngine(algo));
+	for(i = 0; i < m->numEnts; i++){
+		fputs(i ? ",{\"path\":" : "{\"path\":", stdout);
+		jsonString(stdout, m->ents[i].path, PATH_MAX);
+		printf(",\"size\":%u,\"digest\":\"%s\"}", m->ents[i].fileSize, m->ents[i].digest);
+	}
+	printf("],\"bytes\":%" PRIu64 ",\"errors\":%" PRIu64 ",\"secs\":%.6f}\n", m->numBytes, m->numErrors, m->secs);
+
+	manifestFree(m);
+	return 0;
+}
@@ -0,0 +1,37 @@
+/**********************************************************************
+  Module: json.h
+  Author: Junseok Lee
+
+  Purpose: JSON Lines output of the shell for batch mode. Every
+  command prints exactly one JSON object on a line of its own, with
+  the command line in "cmd" and the result in "ok", so that a script
+  can drive thousands of commands through one process and parse the
+  results line by line.
+
+**********************************************************************/
+#ifndef JSON_H
+#define JSON_H
+
+#include <stdio.h>
+#include "fat32.h"
+
+/* Prints s, at most maxLen bytes of it, as a quoted JSON string to
+   out. Bytes that are not valid UTF-8 are printed as U+FFFD. */
+void jsonString(FILE * out, const char * s, size_t maxLen);
+
+/* Prints the "entries" member listing the directory starting at
+   dirClus to out, one object per file or directory */
+void jsonDirEntries(FILE * out, fat32Head *h, uint32_t dirClus);
+
+/* Prints the failure of command line with message msg */
+void jsonError(const char * line, const char * msg);
+
+/* JSON handlers of the command table, see shellCmd in shell.h */
+int jsonInfo(fat32Head *h, uint32_t *curDirClus, char *line);
+int jsonDir(fat32Head *h, uint32_t *curDirClus, char *line);
+int jsonCD(fat32Head *h, uint32_t *curDirClus, char *line);
+int jsonGet(fat32Head *h, uint32_t *curDirClus, char *line);
+int jsonFree(fat32Head *h, uint32_t *curDirClus, char *line);
+int jsonHash(fat32Head *h, uint32_t *curDirClus, char *line);
+
+#endif
@@ -3,29 +3,137 @@
    Author: Junseok Lee
 
    Reads and opens the FAT32 volume image. Executes the shell loop.
-   Usage: ./fat32 <fat32_volume>
+   Usage: ./fat32 [-m] [-b MB] [-x MODE] [-q N] [-j N] [-H ALGO] [-i] [-c CMD]...
+                  [-f FILE] [-J] <fat32_volume>
+          ./fat32 [-m] [-b MB] -s SOCKET [fat32_volume]...
+     -m       read the volume through a memory mapping
+     -b MB    size of the GET transfer buffer in MB (1-16)
+     -x MODE  GET copy mode: copy (copy_file_range, default),
+              sendfile, read (read/write loop) or uring (queued
+              reads and writes through io_uring, or a thread pool)
+     -q N     number of reads and writes in flight (1-256, default 32)
+     -j N     number of RGET worker threads (default: one per CPU)
+     -H ALGO  hash files as GET and RGET copy them, in sha256, blake3
+              or crc32c, and the algorithm of HASH (default sha256)
+     -i       keep a sidecar catalog in <fat32_volume>.idx and answer
+              dir, cd and get from it
+     -c CMD   run CMD without prompting, may be given several times
+     -f FILE  run every line of FILE without prompting, - for stdin
+     -J       print one JSON object per command (JSON Lines), reads
+              commands from stdin unless -c or -f is given
+     -s SOCKET  serve requests on the Unix domain socket SOCKET,
+              keeping the volumes given, and any requested, open
 
 **********************************************************************/
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 
 #include "shell.h"
+#include "extract.h"
+#include "sidecar.h"
+#include "server.h"
+#include "aio.h"
+#include "hash.h"
 
 int main(int argc, char *argv[]) 
 {
-	int fd;
+	int fd, opt;
+	int flags = 0;
+	int useSidecar = 0;
+	int json = 0;
+	int numCmds = 0;
+	char *script = NULL;
+	char *sockPath = NULL;
+	char **cmds = calloc(argc, sizeof(char*));
 
-	if (argc != 2) 
+	if (cmds == NULL)
 	{
-		printf("Usage: %s <file>\n", argv[0]);
+		perror("main malloc error");
 		exit(EXIT_FAILURE);
 	}
 
-	char *file = argv[1];
+	while ((opt = getopt(argc, argv, "mb:x:q:j:H:ic:f:Js:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'm':
+			flags |= HEAD_MMAP;
+			break;
+		case 'b':
+			xferInit((size_t) atoi(optarg) * MB_BYTES);
+			break;
+		case 'x':
+			if (strcmp(optarg, "copy") == 0)
+				xferSetMode(XFER_COPY_RANGE);
+			else if (strcmp(optarg, "sendfile") == 0)
+				xferSetMode(XFER_SENDFILE);
+			else if (strcmp(optarg, "uring") == 0)
+				xferSetMode(XFER_ASYNC);
+			else if (strcmp(optarg, "read") == 0)
+				xferSetMode(XFER_READ_WRITE);
+			else
+			{
+				printf("Error: unknown copy mode %s, use copy, sendfile, read or uring\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'q':
+			aioSetDepth((uint32_t) atoi(optarg));
+			break;
+		case 'j':
+			extractSetThreads(atoi(optarg));
+			break;
+		case 'H':
+			if (hashParseAlgo(optarg) == HASH_NONE)
+			{
+				printf("Error: unknown hash %s, use sha256, blake3 or crc32c\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			hashSetAlgo(hashParseAlgo(optarg));
+			break;
+		case 'i':
+			useSidecar = 1;
+			break;
+		case 'c':
+			cmds[numCmds++] = optarg;
+			break;
+		case 'f':
+			script = optarg;
+			break;
+		case 'J':
+			json = 1;
+			break;
+		case 's':
+			sockPath = optarg;
+			break;
+		default:
+			printf("Usage: %s [-m] [-b MB] [-x MODE] [-q N] [-j N] [-H ALGO] [-i] [-c CMD]... [-f FILE] [-J] <file>\n"
+			       "       %s [-m] [-b MB] -s SOCKET [file]...\n", argv[0], argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* server mode opens its own volumes and never returns */
+	if (sockPath != NULL)
+	{
+		serverRun(sockPath, argv + optind, argc - optind, flags);
+		free(cmds);
+		exit(EXIT_FAILURE);
+	}
+
+	if (argc - optind != 1) 
+	{
+		printf("Usage: %s [-m] [-b MB] [-x MODE] [-q N] [-j N] [-H ALGO] [-i] [-c CMD]... [-f FILE] [-J] <file>\n"
+			       "       %s [-m] [-b MB] -s SOCKET [file]...\n", argv[0], argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	char *file = argv[optind];
  	fd = open(file, O_RDWR);
 	 
 	if (-1 == fd) 
@@ -34,7 +142,21 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
-	shellLoop(fd);
+	if (useSidecar)
+		sidecarSetPath(file);
+
+	/* batch mode runs every command against the one opened volume */
+	int failed = 0;
+	if (numCmds > 0 || script != NULL || json)
+	{
+		if (json && numCmds == 0 && script == NULL)
+			script = "-";
+		failed = shellBatch(fd, flags, cmds, numCmds, script, json);
+	}
+	else
+		shellLoop(fd, flags);
 
 	close(fd);
+	free(cmds);
+	return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
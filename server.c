@@ -0,0 +1,496 @@
+/**********************************************************************
+  Module: server.c
+  Author: Junseok Lee
+
+ Unix domain socket server keeping many images open, see server.h
+ for the protocol.
+
+**********************************************************************/
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "server.h"
+#include "shell.h"
+#include "extent.h"
+#include "dirindex.h"
+#include "freemap.h"
+#include "json.h"
+
+/* Open images, searched by canonical path */
+static serverImage * imageList = NULL;
+static uint32_t numOpen = 0;
+static pthread_mutex_t tableLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* createHead flags of every image */
+static int headFlags = 0;
+
+/* Deallocates an image once nothing uses it, with tableLock held */
+static void imageFree(serverImage * img){
+
+	int i;
+	for(i = 0; i < SERVER_FILE_CACHE; i++){
+		fat32FileClose(img->files[i]);
+		pthread_mutex_destroy(&img->fileLock[i]);
+	}
+
+	dirCacheFree(img->head);
+	freeMapFree(img->head);
+	cleanupHead(img->head);
+	close(img->fd);
+	pthread_mutex_destroy(&img->lock);
+	free(img->path);
+	free(img);
+}
+
+/* Returns the open image at path, opening it first if create is set,
+   with a reference the caller drops with imageRelease. Returns NULL
+   with the reason in *err if the image is not open or cannot be. */
+static serverImage * imageGet(const char * path, int create, const char ** err){
+
+	char canon[PATH_MAX];
+	serverImage * img;
+
+	if(realpath(path, canon) == NULL){
+		*err = strerror(errno);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&tableLock);
+
+	for(img = imageList; img != NULL; img = img->next){
+		if(strcmp(img->path, canon) == 0){
+			img->refs++;
+			pthread_mutex_unlock(&tableLock);
+			return img;
+		}
+	}
+
+	if(!create){
+		*err = "image is not open";
+	}
+	else if(numOpen == SERVER_MAX_IMAGES){
+		*err = "too many open images";
+	}
+	else{
+		int fd = open(canon, O_RDONLY);
+
+		if(fd == -1){
+			*err = strerror(errno);
+		}
+		else if((*err = verifyVolume(fd)) != NULL){
+			close(fd);
+		}
+		else{
+			img = (serverImage*) calloc(1, sizeof(serverImage));
+			if(img == NULL || (img->path = strdup(canon)) == NULL){
+				perror("imageGet malloc error");
+				exit(EXIT_FAILURE);
+			}
+			img->fd = fd;
+			img->head = createHead(fd, headFlags);
+			pthread_mutex_init(&img->lock, NULL);
+			for(int i = 0; i < SERVER_FILE_CACHE; i++) pthread_mutex_init(&img->fileLock[i], NULL);
+
+			/* one reference for the table, one for the caller */
+			img->refs = 2;
+			img->next = imageList;
+			imageList = img;
+			numOpen++;
+		}
+	}
+
+	pthread_mutex_unlock(&tableLock);
+	return img;
+}
+
+/* Drops a reference taken by imageGet */
+static void imageRelease(serverImage * img){
+
+	pthread_mutex_lock(&tableLock);
+	if(--img->refs == 0) imageFree(img);
+	pthread_mutex_unlock(&tableLock);
+}
+
+/* Takes the image at path out of the table, it is freed once the
+   requests using it are done. Returns 0, or -1 with the reason in *err. */
+static int imageClose(const char * path, const char ** err){
+
+	serverImage * img = imageGet(path, 0, err);
+	serverImage ** link;
+
+	if(img == NULL) return -1;
+
+	pthread_mutex_lock(&tableLock);
+	for(link = &imageList; *link != NULL; link = &(*link)->next){
+		if(*link == img){
+			*link = img->next;
+			numOpen--;
+			img->refs--;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&tableLock);
+
+	imageRelease(img);
+	return 0;
+}
+
+/* Returns the slot of the open file of ent in img with a reference
+   taken, opening it in place of the least recently read file nobody
+   is streaming if it is not open, with the image lock held. Returns
+   -1 if every slot is in use, the caller then opens a file of its own. */
+static int imageFile(serverImage * img, const fat32IndexEnt * ent, uint64_t now){
+
+	int i, slot = -1;
+
+	for(i = 0; i < SERVER_FILE_CACHE; i++){
+		if(img->files[i] != NULL && img->fileClus[i] == ent->firstClus && img->files[i]->fileSize == ent->fileSize){
+			img->fileUsed[i] = now;
+			img->fileRefs[i]++;
+			return i;
+		}
+		if(img->fileRefs[i] == 0 && (slot == -1 || img->files[i] == NULL || img->fileUsed[i] < img->fileUsed[slot])){
+			slot = i;
+		}
+	}
+
+	if(slot == -1) return -1;
+
+	fat32FileClose(img->files[slot]);
+	img->files[slot] = fat32FileOpen(img->head, ent->firstClus, ent->fileSize);
+	img->fileClus[slot] = ent->firstClus;
+	img->fileUsed[slot] = now;
+	img->fileRefs[slot] = 1;
+	return slot;
+}
+
+/* Writes len bytes of f at offset to outFD through buf. Returns 0,
+   or -1 if the connection failed. */
+static int streamRange(fat32File * f, int outFD, uint64_t len, uint64_t offset, char * buf, size_t bufSz){
+
+	while(len > 0){
+		uint64_t chunk = (len < bufSz) ? len : bufSz;
+		uint64_t got = fat32Pread(f, buf, chunk, offset);
+
+		if(got == 0 || writeAll(outFD, buf, got) != 0) return -1;
+		offset += got;
+		len -= got;
+	}
+	return 0;
+}
+
+static void replyError(FILE * out, const char * msg){
+
+	fputs("{\"ok\":false,\"error\":", out);
+	jsonString(out, msg, PATH_MAX);
+	fputs("}\n", out);
+}
+
+/* Serves LIST, STAT or READ of path in img. READ sends the len
+   bytes at offset, len is UINT64_MAX for the rest of the file.
+   Returns -1 if the connection failed while streaming data, 0
+   otherwise. */
+static int serveImage(serverImage * img, const char * verb, const char * path, uint64_t offset, uint64_t len,
+		FILE * out, int outFD, char * buf, size_t bufSz){
+
+	fat32Head * h = img->head;
+	fat32IndexEnt ent;
+	fat32File * f = NULL;
+	int slot = -1, res = 0;
+
+	/* the reply is built in memory, so nothing waits on the client with the image held */
+	char * reply = NULL;
+	size_t replyLen = 0;
+	FILE * msg = open_memstream(&reply, &replyLen);
+	if(msg == NULL){
+		perror("serveImage error");
+		exit(EXIT_FAILURE);
+	}
+
+	/* the head's directory cache is not shared between threads */
+	pthread_mutex_lock(&img->lock);
+	uint64_t now = __atomic_add_fetch(&img->requests, 1, __ATOMIC_RELAXED);
+
+	if(!resolvePath(h, path, &ent)){
+		replyError(msg, "no such file or directory");
+	}
+	else if(strcasecmp(verb, "STAT") == 0){
+		fprintf(msg, "{\"ok\":true,\"dir\":%s,\"attr\":%u,\"size\":%u,\"cluster\":%u}\n",
+				(ent.attr & ATTR_DIRECTORY) ? "true" : "false", ent.attr, ent.fileSize, ent.firstClus);
+	}
+	else if(strcasecmp(verb, "LIST") == 0){
+		if(!(ent.attr & ATTR_DIRECTORY)){
+			replyError(msg, "not a directory");
+		}
+		else{
+			fprintf(msg, "{\"ok\":true,\"cluster\":%u", ent.firstClus);
+			jsonDirEntries(msg, h, ent.firstClus);
+			fputs("}\n", msg);
+		}
+	}
+	else if(ent.attr & ATTR_DIRECTORY){
+		replyError(msg, "is a directory");
+	}
+	else{
+		slot = imageFile(img, &ent, now);
+		f = (slot != -1) ? img->files[slot] : fat32FileOpen(h, ent.firstClus, ent.fileSize);
+	}
+
+	pthread_mutex_unlock(&img->lock);
+	fclose(msg);
+
+	if(f == NULL){
+		if(fwrite(reply, 1, replyLen, out) != replyLen) res = -1;
+		free(reply);
+		return res;
+	}
+	free(reply);
+
+	/* readers of the same file take turns, its run index grows as it is read */
+	if(slot != -1) pthread_mutex_lock(&img->fileLock[slot]);
+
+	/* only what the chain holds is announced, so the stream never falls short */
+	uint64_t size = fat32FileReadable(f, len, offset);
+
+	/* the header goes out before the data, which is written to the socket directly.
+	   Whole files are copied with sendfile, ranges seek through the file's index. */
+	fprintf(out, "{\"ok\":true,\"size\":%lu}\n", size);
+	if(fflush(out) != 0){
+		res = -1;
+	}
+	else if(offset == 0 && size == ent.fileSize){
+		if(slot != -1) pthread_mutex_unlock(&img->fileLock[slot]);
+		res = writeFileBuf(h, ent.firstClus, outFD, size, buf, bufSz);
+		if(slot != -1) pthread_mutex_lock(&img->fileLock[slot]);
+	}
+	else{
+		res = streamRange(f, outFD, size, offset, buf, bufSz);
+	}
+
+	if(slot == -1){
+		fat32FileClose(f);
+		return res;
+	}
+	pthread_mutex_unlock(&img->fileLock[slot]);
+
+	pthread_mutex_lock(&img->lock);
+	img->fileRefs[slot]--;
+	pthread_mutex_unlock(&img->lock);
+	return res;
+}
+
+/* Connection thread, answers requests until the client hangs up */
+static void * serveClient(void * arg){
+
+	int fd = (int) (intptr_t) arg;
+	FILE * in = fdopen(fd, "r");
+	FILE * out = fdopen(dup(fd), "w");
+	char * line = NULL;
+	size_t cap = 0;
+	char * buf = NULL;
+	size_t bufSz = xferSize();
+
+	if(in == NULL || out == NULL || posix_memalign((void**) &buf, XFER_ALIGN, bufSz) != 0){
+		perror("serveClient error");
+		exit(EXIT_FAILURE);
+	}
+
+	while(getline(&line, &cap, in) > 0){
+
+		char * field[SERVER_MAX_FIELDS] = { NULL };
+		char * rest = line;
+		const char * err = NULL;
+		int i, res = 0;
+
+		rest[strcspn(rest, "\r\n")] = NULL_TERM;
+		for(i = 0; i < SERVER_MAX_FIELDS && rest != NULL; i++){
+			field[i] = strsep(&rest, SERVER_SEP);
+		}
+
+		const char * verb = field[0];
+
+		if(verb[0] == NULL_TERM){
+			continue;
+		}
+		else if(strcasecmp(verb, "IMAGES") == 0){
+			serverImage * img;
+			int first = 1;
+
+			pthread_mutex_lock(&tableLock);
+			fputs("{\"ok\":true,\"images\":[", out);
+			for(img = imageList; img != NULL; img = img->next){
+				fputs(first ? "{\"path\":" : ",{\"path\":", out);
+				jsonString(out, img->path, PATH_MAX);
+				fprintf(out, ",\"requests\":%lu}", __atomic_load_n(&img->requests, __ATOMIC_RELAXED));
+				first = 0;
+			}
+			fputs("]}\n", out);
+			pthread_mutex_unlock(&tableLock);
+		}
+		else if(field[1] == NULL){
+			replyError(out, "missing image");
+		}
+		else if(strcasecmp(verb, "OPEN") == 0){
+			serverImage * img = imageGet(field[1], 1, &err);
+
+			if(img == NULL){
+				replyError(out, err);
+			}
+			else{
+				fputs("{\"ok\":true,\"path\":", out);
+				jsonString(out, img->path, PATH_MAX);
+				fputs("}\n", out);
+				imageRelease(img);
+			}
+		}
+		else if(strcasecmp(verb, "CLOSE") == 0){
+			if(imageClose(field[1], &err) != 0) replyError(out, err);
+			else fputs("{\"ok\":true}\n", out);
+		}
+		else if(strcasecmp(verb, "LIST") == 0 || strcasecmp(verb, "STAT") == 0 || strcasecmp(verb, "READ") == 0){
+			serverImage * img = imageGet(field[1], 1, &err);
+
+			char * end;
+			uint64_t offset = (field[3] != NULL) ? strtoull(field[3], &end, 10) : 0;
+			uint64_t len = (field[4] != NULL) ? strtoull(field[4], &end, 10) : UINT64_MAX;
+
+			if(img == NULL){
+				replyError(out, err);
+			}
+			else{
+				res = serveImage(img, verb, field[2] ? field[2] : "/", offset, len, out, fd, buf, bufSz);
+				imageRelease(img);
+			}
+		}
+		else{
+			replyError(out, "unknown request");
+		}
+
+		if(res != 0 || fflush(out) != 0) break;
+	}
+
+	free(line);
+	free(buf);
+	fclose(out);
+	fclose(in);
+	return NULL;
+}
+
+/* Removes the socket at sockPath if no server answers on it. Returns
+   0 if the path is free to bind, -1 after printing why it is not. */
+static int staleSocket(const char * sockPath, const struct sockaddr_un * addr){
+
+	struct stat st;
+
+	if(lstat(sockPath, &st) != 0){
+		if(errno == ENOENT) return 0;
+		printf("Error: %s: %s\n", sockPath, strerror(errno));
+		return -1;
+	}
+	if(!S_ISSOCK(st.st_mode)){
+		printf("Error: %s exists and is not a socket\n", sockPath);
+		return -1;
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd == -1){
+		perror("server socket error");
+		return -1;
+	}
+	int res = connect(fd, (const struct sockaddr*) addr, sizeof(*addr));
+	int err = errno;
+	close(fd);
+
+	if(res == 0){
+		printf("Error: a server is already listening on %s\n", sockPath);
+		return -1;
+	}
+	if(err != ECONNREFUSED){
+		printf("Error: %s: %s\n", sockPath, strerror(err));
+		return -1;
+	}
+	if(unlink(sockPath) != 0){
+		printf("Error: %s: %s\n", sockPath, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+int serverRun(const char * sockPath, char ** images, int numImages, int flags){
+
+	struct sockaddr_un addr;
+	const char * err;
+	int i;
+
+	headFlags = flags;
+
+	/* a client hanging up must not end the server, and file data
+	   goes to the sockets with sendfile */
+	signal(SIGPIPE, SIG_IGN);
+	xferSetMode(XFER_SENDFILE);
+
+	for(i = 0; i < numImages; i++){
+		serverImage * img = imageGet(images[i], 1, &err);
+
+		if(img == NULL) printf("Error: %s: %s\n", images[i], err);
+		else imageRelease(img);
+	}
+
+	if(strlen(sockPath) >= sizeof(addr.sun_path)){
+		printf("Error: socket path too long\n");
+		return -1;
+	}
+
+	int listenFD = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(listenFD == -1){
+		perror("server socket error");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, sockPath);
+
+	/* a socket left by an earlier run is replaced, nothing else is */
+	if(staleSocket(sockPath, &addr) != 0){
+		close(listenFD);
+		return -1;
+	}
+	if(bind(listenFD, (struct sockaddr*) &addr, sizeof(addr)) != 0 || listen(listenFD, SERVER_BACKLOG) != 0){
+		perror("server bind error");
+		close(listenFD);
+		return -1;
+	}
+
+	printf("Listening on %s with %u images open\n", sockPath, numOpen);
+	fflush(stdout);
+
+	for(;;){
+		int fd = accept(listenFD, NULL, NULL);
+		pthread_t thread;
+
+		if(fd == -1){
+			if(errno != EINTR) perror("server accept error");
+			continue;
+		}
+
+		if(pthread_create(&thread, NULL, serveClient, (void*) (intptr_t) fd) != 0){
+			perror("server thread error");
+			close(fd);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+}
@@ -0,0 +1,69 @@
+/**********************************************************************
+  Module: server.h
+  Author: Junseok Lee
+
+  Purpose: Long-running server mode. Listens on a Unix domain socket
+  and keeps any number of images open, each with its own head, FAT
+  cache and directory cache, so that repeated requests are answered
+  from warm caches. Every connection is served by a thread of its
+  own. Requests on the same image take turns only while they look up
+  their path; data is sent without holding the image, so a slow
+  client holds up no one but readers of the same file.
+
+  Requests are single lines of tab separated fields, the answer to
+  each is one JSON line, followed by the file data for READ:
+
+    OPEN  <image>          open an image and keep it open
+    CLOSE <image>          close an image
+    IMAGES                 list the open images
+    LIST  <image> <path>   list a directory
+    STAT  <image> <path>   describe a file or directory
+    READ  <image> <path> [<offset> [<length>]]
+                           {"ok":true,"size":N} then N bytes of data
+
+  Paths inside an image start at the root and are separated by '/',
+  each component matches a long or short name ignoring case. LIST,
+  STAT and READ open an image on first use. The last files read from
+  each image stay open with their cluster index, so ranged reads of
+  the same file seek without walking its chain again.
+
+**********************************************************************/
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <pthread.h>
+#include "fat32.h"
+#include "extent.h"
+
+/* server constants */
+#define SERVER_BACKLOG 64
+#define SERVER_MAX_IMAGES 256
+#define SERVER_SEP "\t"
+#define SERVER_MAX_FIELDS 5
+#define SERVER_FILE_CACHE 8
+
+/* Open image struct,
+   one image kept open by the server */
+struct serverImage_struct {
+	char * path; //canonical path of the image
+	int fd;
+	fat32Head * head;
+	pthread_mutex_t lock; //held while a request looks up its path, the directory cache is not shared
+	uint32_t refs; //requests using the image, plus one while it is in the table
+	uint64_t requests; //requests served
+	fat32File * files[SERVER_FILE_CACHE]; //files last read, NULL if unused
+	uint64_t fileUsed[SERVER_FILE_CACHE]; //request number of the last read of each file
+	uint32_t fileClus[SERVER_FILE_CACHE]; //first cluster of each file
+	uint32_t fileRefs[SERVER_FILE_CACHE]; //requests streaming each file, it is not replaced while in use
+	pthread_mutex_t fileLock[SERVER_FILE_CACHE]; //held while a file's run index is extended or read
+	struct serverImage_struct * next;
+};
+typedef struct serverImage_struct serverImage;
+
+/* Serves requests on the Unix domain socket at sockPath until the
+   process is killed, with the numImages images in images opened up
+   front. flags are passed on to createHead. Returns only if the
+   socket could not be set up, with -1. */
+int serverRun(const char * sockPath, char ** images, int numImages, int flags);
+
+#endif
@@ -3,20 +3,43 @@
    Author: Junseok Lee
 
    Manages the shell command line. Supports commands INFO,
-   DIR, CD and GET. The shell terminates when EOF signal 
+   DIR, CD and GET, and PUT, MKDIR and RM to change the volume. The shell terminates when EOF signal 
    (CTRL + D) is received.
 
 **********************************************************************/
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <strings.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <pthread.h>
 #include <unistd.h>
+#include <limits.h>
+#include <time.h>
 #include "shell.h"
 #include "fat32.h"
+#include "extent.h"
+#include "dirindex.h"
+#include "extract.h"
+#include "walk.h"
+#include "sidecar.h"
+#include "freemap.h"
+#include "fsck.h"
+#include "json.h"
+#include "aio.h"
+#include "undelete.h"
+#include "carve.h"
+#include "hash.h"
+#include "dedup.h"
+#include "fatwrite.h"
 #include <stdbool.h>
 
 #define CMD_INFO "INFO"
@@ -24,63 +47,282 @@
 #define CMD_CD "CD"
 #define CMD_GET "GET"
 #define CMD_PUT "PUT"
+#define CMD_RGET "RGET"
+#define CMD_CATALOG "CATALOG"
+#define CMD_FREE "FREE"
+#define CMD_CHECK "CHECK"
+#define CMD_UNDELETE "UNDELETE"
+#define CMD_CARVE "CARVE"
+#define CMD_HASH "HASH"
+#define CMD_DEDUP "DEDUP"
+#define CMD_MKDIR "MKDIR"
+#define CMD_RM "RM"
+
+/* File descriptor to the opened volume */
+int fileDesc;
+
+/* Transfer buffer shared by every GET, allocated by xferInit */
+static char * xferBuf = NULL;
+static size_t xferBufSz = 0;
+
+/* How GET moves data, downgraded when the kernel refuses a mode */
+static int xferMode = XFER_COPY_RANGE;
+
+
+/* Text handlers of the command table, each runs one command line
+   and returns 0 on success, -1 on failure */
+static int runInfo(fat32Head *h, uint32_t *curDirClus, char *line){
+	printInfo(h);
+	return 0;
+}
 
+static int runDir(fat32Head *h, uint32_t *curDirClus, char *line){
+	doDir(h, *curDirClus, DODIR_FIRSTRUN);
+	return 0;
+}
 
-void shellLoop(int fd) 
-{
-	int running = true;
-	uint32_t curDirClus;
-	char buffer[BUF_SIZE];
-	char bufferRaw[BUF_SIZE];
+static int runCD(fat32Head *h, uint32_t *curDirClus, char *line){
+
+	/* the argument is the rest of the line, long names hold spaces */
+	char * arg = nameArg(line);
+
+	if(arg == NULL){
+		printf("Error: folder not found\n");
+		return -1;
+	}
+	if(!changeDir(h, *curDirClus, arg, curDirClus)){
+		if(strcmp(arg, DOT) == 0) printf("Error: Folder not found.\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int runGet(fat32Head *h, uint32_t *curDirClus, char *line){
+	return doDownload(h, *curDirClus, line);
+}
+
+static int runRget(fat32Head *h, uint32_t *curDirClus, char *line){
+	doRecursiveGet(h, *curDirClus, line);
+	return 0;
+}
+
+static int runCatalog(fat32Head *h, uint32_t *curDirClus, char *line){
+	doCatalog(h, line);
+	return 0;
+}
+
+static int runFree(fat32Head *h, uint32_t *curDirClus, char *line){
+	doFree(h);
+	return 0;
+}
+
+static int runCheck(fat32Head *h, uint32_t *curDirClus, char *line){
+	doCheck(h);
+	return 0;
+}
+
+static int runUndelete(fat32Head *h, uint32_t *curDirClus, char *line){
+	doUndelete(h, line);
+	return 0;
+}
+
+static int runCarve(fat32Head *h, uint32_t *curDirClus, char *line){
+	doCarve(h, line);
+	return 0;
+}
+
+static int runHash(fat32Head *h, uint32_t *curDirClus, char *line){
+	return doHash(h, *curDirClus, line);
+}
+
+static int runDedup(fat32Head *h, uint32_t *curDirClus, char *line){
+	return doDedup(h, line);
+}
+
+static int runPut(fat32Head *h, uint32_t *curDirClus, char *line){
+	return doPut(h, *curDirClus, line);
+}
+
+static int runMkdir(fat32Head *h, uint32_t *curDirClus, char *line){
+	return doMkdir(h, *curDirClus, line);
+}
+
+static int runRemove(fat32Head *h, uint32_t *curDirClus, char *line){
+	return doRemove(h, *curDirClus, line);
+}
+
+/* Command table, matched in order on a case-insensitive prefix of
+   the line like the original if chain. The JSON handler is NULL for
+   commands without a JSON Lines form. Handlers get the raw line, so
+   names keep the case they were typed in. */
+static const shellCmd shellCmds[] = {
+	{ CMD_INFO, runInfo, jsonInfo },
+	{ CMD_DIR, runDir, jsonDir },
+	{ CMD_CD, runCD, jsonCD },
+	{ CMD_GET, runGet, jsonGet },
+	{ CMD_RGET, runRget, NULL },
+	{ CMD_CATALOG, runCatalog, NULL },
+	{ CMD_FREE, runFree, jsonFree },
+	{ CMD_CHECK, runCheck, NULL },
+	{ CMD_UNDELETE, runUndelete, NULL },
+	{ CMD_CARVE, runCarve, NULL },
+	{ CMD_HASH, runHash, jsonHash },
+	{ CMD_DEDUP, runDedup, NULL },
+	{ CMD_PUT, runPut, NULL },
+	{ CMD_MKDIR, runMkdir, NULL },
+	{ CMD_RM, runRemove, NULL },
+};
+
+int runCommand(fat32Head *h, uint32_t *curDirClus, char line[BUF_SIZE], int json){
+
+	size_t i;
+
+	for(i = 0; i < sizeof(shellCmds) / sizeof(shellCmds[0]); i++){
+
+		if(strncasecmp(line, shellCmds[i].name, strlen(shellCmds[i].name)) != 0) continue;
+
+		if(!json) return shellCmds[i].run(h, curDirClus, line);
+
+		if(shellCmds[i].json == NULL){
+			jsonError(line, "command has no JSON output");
+			return -1;
+		}
+		return shellCmds[i].json(h, curDirClus, line);
+	}
+
+	if(json) jsonError(line, "command not found");
+	else printf("\nCommand not found\n");
+	return -1;
+}
+
+/* Opens the volume for the shell, or returns NULL */
+static fat32Head * shellOpen(int fd, int flags){
 
 	fileDesc = fd;
 
-	fat32Head *h = createHead(fd);
+	fat32Head *h = createHead(fd, flags);
+	if (h == NULL) return NULL;
+
+	/* map the sidecar catalog, building it on the first run */
+	sidecarOpen(h);
+
+	return h;
+}
 
-	if (h == NULL)
-		running = false;
+/* Releases the volume and everything cached for it */
+static void shellClose(fat32Head *h){
 
-	curDirClus = h->bs->BPB_RootClus;
+	free(xferBuf);
+	xferBuf = NULL;
+	dirCacheFree(h);
+	freeMapFree(h);
+	sidecarClose(h);
+	writerFree(h);
+	cleanupHead(h);
+}
 
-	while(running) 
+void shellLoop(int fd, int flags) 
+{
+	char bufferRaw[BUF_SIZE];
+
+	fat32Head *h = shellOpen(fd, flags);
+	if (h == NULL) return;
+
+	uint32_t curDirClus = h->bs->BPB_RootClus;
+
+	while(true) 
 	{
 		printf(">");
-		if (fgets(bufferRaw, BUF_SIZE, stdin) == NULL) 
+		if (fgets(bufferRaw, BUF_SIZE, stdin) == NULL) break;
+
+		bufferRaw[strcspn(bufferRaw, "\n")] = '\0'; /* cut new line */
+		runCommand(h, &curDirClus, bufferRaw, false);
+	}
+	printf("\nExited...\n");
+	
+	shellClose(h);
+}
+
+/* Reads the next command line of script into line, without the new
+   line. Lines too long for line are skipped with an error. Returns 0
+   at the end of the script. */
+static int scriptLine(FILE * script, char line[BUF_SIZE], int json){
+
+	while (fgets(line, BUF_SIZE, script) != NULL)
+	{
+		size_t len = strcspn(line, "\n");
+
+		if (line[len] == '\0' && !feof(script))
 		{
-			running = false;
+			/* drop the rest of the long line */
+			int c;
+			while ((c = fgetc(script)) != EOF && c != '\n');
+
+			if (json) jsonError(line, "command line too long");
+			else printf("Error: command line too long\n");
 			continue;
 		}
-		bufferRaw[strlen(bufferRaw)-1] = '\0'; /* cut new line */
-		for (int i=0; i < strlen(bufferRaw)+1; i++)
-			buffer[i] = toupper(bufferRaw[i]);
-	
-		//INFO
-		if (strncmp(buffer, CMD_INFO, strlen(CMD_INFO)) == 0)
-			printInfo(h);	
 
-		//DIR
-		else if (strncmp(buffer, CMD_DIR, strlen(CMD_DIR)) == 0)
-			doDir(h, curDirClus, DODIR_FIRSTRUN);	
+		line[len] = '\0';
+		if (len > 0 && line[len - 1] == '\r') line[--len] = '\0';
+		return 1;
+	}
+	return 0;
+}
+
+int shellBatch(int fd, int flags, char ** cmds, int numCmds, const char * scriptPath, int json)
+{
+	char line[BUF_SIZE];
+	int failed = 0;
+	int i;
+
+	fat32Head *h = shellOpen(fd, flags);
+	if (h == NULL) return -1;
+
+	uint32_t curDirClus = h->bs->BPB_RootClus;
+
+	/* -c commands first, in order */
+	for (i = 0; i < numCmds; i++)
+	{
+		if (strlen(cmds[i]) >= BUF_SIZE)
+		{
+			if (json) jsonError(cmds[i], "command line too long");
+			else printf("Error: command line too long\n");
+			failed++;
+			continue;
+		}
+		strcpy(line, cmds[i]);
+		failed += (runCommand(h, &curDirClus, line, json) != 0);
+	}
+
+	/* then the script, "-" reads commands from stdin */
+	if (scriptPath != NULL)
+	{
+		FILE * script = (strcmp(scriptPath, "-") == 0) ? stdin : fopen(scriptPath, "r");
 
+		if (script == NULL)
+		{
+			perror("opening command file");
+			shellClose(h);
+			return -1;
+		}
 
-		//CD
-		else if (strncmp(buffer, CMD_CD, strlen(CMD_CD)) == 0) 
-			curDirClus = doCD(h, curDirClus, buffer);
+		while (scriptLine(script, line, json))
+		{
+			/* blank lines and # comments are skipped */
+			if (line[strspn(line, SPACE_CHAR)] == '\0' || line[0] == '#') continue;
 
-		//GET
-		else if (strncmp(buffer, CMD_GET, strlen(CMD_GET)) == 0) 
-			doDownload(h, curDirClus, buffer);
+			failed += (runCommand(h, &curDirClus, line, json) != 0);
 
-		//PUT (BONUS, IGNORE)
-		else if (strncmp(buffer, CMD_PUT, strlen(CMD_PUT)) == 0)			
-			printf("Bonus marks!\n");
+			/* a reader on the other end of a pipe sees each result at once */
+			if (json) fflush(stdout);
+		}
 
-		else 
-			printf("\nCommand not found\n");
+		if (script != stdin) fclose(script);
 	}
-	printf("\nExited...\n");
-	
-	cleanupHead(h);
+
+	shellClose(h);
+	return failed;
 }
 
 void printInfo(fat32Head *h){
@@ -185,8 +427,14 @@ void printInfo(fat32Head *h){
 }
 
 char * getVolumeID(fat32Head *h){
-	uint32_t firstSecOfClus = getFirstSectorOfClus(h,h->bs->BPB_RootClus);
-	fat32Dir * firstDir =readDir(fileDesc,h,firstSecOfClus,FIRST_DIR_INDEX);
+
+	/* the sidecar keeps the name, the root cluster is not read */
+	if(h->sidecar != NULL){
+		return (char*) h->sidecar->hdr->volLabel;
+	}
+
+	uint64_t firstSecOfClus = getFirstSectorOfClus(h,h->bs->BPB_RootClus);
+	fat32Dir * firstDir =readDir(h->fd,h,firstSecOfClus,FIRST_DIR_INDEX);
 	char * volID = h->dir->DIR_Name;
 
 	if(firstDir != NULL){
@@ -201,410 +449,1332 @@ char * getVolumeID(fat32Head *h){
 
 void doDir(fat32Head *h, uint32_t curDirClus, int firstRun){
 
-	int i, j;
-	int initial = firstRun;
+	fat32DirIter it;
+	const fat32Dir * curDir;
+	char name[FMT_NAME_LENGTH];
 
 	if(firstRun) {
 		printf("DIRECTORY LISTING\n");
+		printf("VOL_ID: %s\n", getVolumeID(h));
 	}
-	/* Get first data sector address of cluster*/
-	uint32_t firstSecOfClus = getFirstSectorOfClus(h,curDirClus);	
 
-	/* Traversing each directory in every cluster*/
-	for(i=0; i < h->bs->BPB_SecPerClus; i+= h->bs->BPB_BytesPerSec){
+	/* answered from the sidecar when the directory is in it */
+	if(h->sidecar == NULL || !sidecarDir(h, curDirClus)){
 
-		for(j=0; j< h->bs->BPB_BytesPerSec; j+=sizeof(fat32Dir)){ 
+		/* Traversing each directory in every cluster, one read per cluster */
+		dirIterInit(h, &it, curDirClus);
 
-			/* Get current directory in current sector */
-			fat32Dir * curDir;
-			curDir = readDir(fileDesc,h,firstSecOfClus+i,j);
+		while((curDir = dirIterNext(&it)) != NULL){
 
-			/* remove white space & null terminate string of directory name */
-			formatDirectory(curDir);
+			/* remove white space & null terminate string of directory name,
+			   on a copy as the entry may lie in the read-only mapping */
+			entryName(curDir, name);
 
-			/* show volume ID in the initial run */
-			if(initial){
-				printf("VOL_ID: %s\n", getVolumeID(h));
-				initial = false;
-			}
+			printDirEntry(name, it.longName, curDir->DIR_Attr, curDir->DIR_FileSize);
+		}
 
-			/* Exit if current directory address is zero */
-			if(curDir->DIR_Name[0] == ADDR_ZERO){
-				if(curDir) {
-					free(curDir);
-				}
-           	 	break;
-        	}
+		dirIterFree(&it);
+	}
 
-			/* current directory is a DIRECTORY */
-			if((curDir->DIR_Attr & ATTR_DIRECTORY) == ATTR_DIRECTORY && curDir->DIR_Name[0] != FREE_DIR && 
-					curDir->DIR_Name[0] != KANJI_DIR && checkName(curDir->DIR_Name)){
-			            
-				char *dirName = curDir->DIR_Name;
+	/* Print Amount of bytes free on the first run */
+	if(firstRun) {
+		printf("----Bytes Free: %lu \n", getFreeSpace(h)); 
+		printf("----DONE\n");
+	}
 
-				if(curDir->DIR_Attr == ATTR_DIRECTORY || curDir->DIR_FileSize == ADDR_ZERO){
-					printf("<%s>\t\t%u\n",dirName, curDir->DIR_FileSize);
-				}
-				else{
-					//special types of files
-					printf("%s\t\t%u\n", curDir->DIR_Name ,curDir->DIR_FileSize);
-				}
-			}
-			/* current directory is a FILE */
-			else if ((curDir->DIR_Attr & ATTR_ARCHIVE) == ATTR_ARCHIVE && curDir->DIR_Name[0] != FREE_DIR && 
-						curDir->DIR_Name[0] != KANJI_DIR && checkName(curDir->DIR_Name)) {
+}
 
-				if (curDir->DIR_Attr == ATTR_ARCHIVE){
-                    printf("%s\t\t%u\n", curDir->DIR_Name ,curDir->DIR_FileSize);
-                }
-				
-				//support for valid file types with attributes not equal to ATTR_ARCHIVE
-				else if(curDir[i].DIR_Attr != ADDR_ZERO && curDir[i].DIR_Attr != ATTR_READ_ONLY && 
-							curDir[i].DIR_Attr != ATTR_HIDDEN && curDir[i].DIR_Attr != ATTR_SYSTEM && 
-							curDir[i].DIR_Attr != ATTR_VOLUME_ID && curDir[i].DIR_Attr != ATTR_DIRECTORY && 
-							curDir[i].DIR_Attr != INV_DIR && curDir[i].DIR_Attr != INV_ARCHIVE){
+void printDirEntry(const char * name, const char * longName, uint8_t attr, uint32_t fileSize){
 
-						printf("%s\t\t%u\n",curDir->DIR_Name, curDir->DIR_FileSize);
+	/* the checks apply to the short name, the long name is shown */
+	const char * shown = (longName != NULL && longName[0] != NULL_TERM) ? longName : name;
 
-				}
+	/* current directory is a DIRECTORY */
+	if((attr & ATTR_DIRECTORY) == ATTR_DIRECTORY && name[0] != FREE_DIR && 
+			name[0] != KANJI_DIR && checkName(name)){
+	            
+		const char *dirName = shown;
+
+		if(attr == ATTR_DIRECTORY || fileSize == ADDR_ZERO){
+			printf("<%s>\t\t%u\n",dirName, fileSize);
+		}
+		else{
+			//special types of files
+			printf("%s\t\t%u\n", shown ,fileSize);
+		}
+	}
+	/* current directory is a FILE */
+	else if ((attr & ATTR_ARCHIVE) == ATTR_ARCHIVE && name[0] != FREE_DIR && 
+				name[0] != KANJI_DIR && checkName(name)) {
+
+		if (attr == ATTR_ARCHIVE){
+                printf("%s\t\t%u\n", shown ,fileSize);
             }
+		
+		//support for valid file types with attributes not equal to ATTR_ARCHIVE
+		else if(attr != ADDR_ZERO && attr != ATTR_READ_ONLY && 
+					attr != ATTR_HIDDEN && attr != ATTR_SYSTEM && 
+					attr != ATTR_VOLUME_ID && attr != ATTR_DIRECTORY && 
+					attr != INV_DIR && attr != INV_ARCHIVE){
 
-			/* below is not needed for our implementation, but added for extra file name support */
-			/* Special Cases: Long Name */
-			else if ((curDir[i].DIR_Name[0] != FREE_DIR) && checkName(curDir->DIR_Name) && 
-            			(curDir[i].DIR_Attr == ATTR_READ_ONLY || curDir[i].DIR_Attr == ATTR_DIRECTORY || 
-				 		 curDir[i].DIR_Attr == ATTR_ARCHIVE || curDir[i].DIR_Attr == ATTR_HIDDEN || curDir->DIR_Attr == V_ARCHIVE)){ 
-				
-				printf("%s\t\t%u\n",curDir->DIR_Name, curDir->DIR_FileSize);
+				printf("%s\t\t%u\n",shown, fileSize);
 
-			}
-			/* Extraneous valid special cases */
-			else if(curDir[i].DIR_Attr != ADDR_ZERO && curDir[i].DIR_Attr != ATTR_READ_ONLY && 
-					curDir[i].DIR_Attr != ATTR_HIDDEN && curDir[i].DIR_Attr != ATTR_SYSTEM &&
-					curDir[i].DIR_Attr != ATTR_VOLUME_ID && curDir[i].DIR_Attr != ATTR_DIRECTORY && 
-					curDir[i].DIR_Attr != INV_DIR && curDir[i].DIR_Attr != INV_ARCHIVE && checkName(curDir->DIR_Name)){
-				
-				printf("%s\t\t%u\n",curDir->DIR_Name, curDir->DIR_FileSize);
+		}
+        }
 
-			}
+	/* below is not needed for our implementation, but added for extra file name support */
+	/* Special Cases: Long Name */
+	else if ((name[0] != FREE_DIR) && checkName(name) && 
+        			(attr == ATTR_READ_ONLY || attr == ATTR_DIRECTORY || 
+		 		 attr == ATTR_ARCHIVE || attr == ATTR_HIDDEN || attr == V_ARCHIVE)){ 
+		
+		printf("%s\t\t%u\n",shown, fileSize);
 
-			/* deallocate current directory */
-			if(curDir != NULL) free(curDir);
-    	}
+	}
+	/* Extraneous valid special cases */
+	else if(attr != ADDR_ZERO && attr != ATTR_READ_ONLY && 
+			attr != ATTR_HIDDEN && attr != ATTR_SYSTEM &&
+			attr != ATTR_VOLUME_ID && attr != ATTR_DIRECTORY && 
+			attr != INV_DIR && attr != INV_ARCHIVE && checkName(name)){
+		
+		printf("%s\t\t%u\n",shown, fileSize);
 
-		/* Search File allocation table for next cluster chain, if exists */
-		uint32_t nextClus = getNextClus(h,curDirClus);
+	}
+}
 
-		/* Recursively move on to the next cluster */
-		if (nextClus < EOC) {
-			doDir(h, nextClus,DODIR_NONFIRSTRUN);
-		}
+char * nameArg(char * buffer){
 
-		/* Print Amount of bytes free on the first run */
-		if(firstRun) {
-			printf("----Bytes Free: %lu \n", getFreeSpace(h)); 
-			printf("----DONE\n");
-		}
+	char * arg = buffer + strcspn(buffer, SPACE_CHAR);
+	arg += strspn(arg, SPACE_CHAR);
 
+	size_t len = strlen(arg);
+	while(len > 0 && arg[len - 1] == ' ') arg[--len] = NULL_TERM;
+
+	return (len > 0) ? arg : NULL;
+}
+
+/* Looks up name in the directory starting at dirClus, in the sidecar
+   when one is attached, or else in the hashed index with the directory
+   indexed on its first visit */
+static int findEntry(fat32Head *h, uint32_t dirClus, const char * name, fat32IndexEnt * ent,
+		const fat32Extent ** ext, uint32_t * numExt){
+
+	if(h->sidecar != NULL) return sidecarLookup(h, dirClus, name, ent, ext, numExt);
+	return dirLookup(h, dirClus, name, ent);
+}
+
+int changeDir(fat32Head *h, uint32_t curDirClus, const char * name, uint32_t * newClus){
+
+	/* cd "." stays, except at the root which has no "." entry */
+	if(strcmp(name, DOT) == 0){
+		*newClus = curDirClus;
+		return curDirClus != h->bs->BPB_RootClus;
+	}
+
+	fat32IndexEnt ent;
+	if(!findEntry(h, curDirClus, name, &ent, NULL, NULL) || ent.attr != ATTR_DIRECTORY){
+		return 0;
 	}
 
+	/* cd "..", a zero cluster in ".." means the root directory */
+	if(strcmp(name, DOTDOT) == 0 && ent.firstClus == ADDR_ZERO){
+		*newClus = ROOT_DIR_CLUS_NUM;
+		return 1;
+	}
+
+	/* FOUND DIRECTORY MATCH, 	
+	   move to directory stored in the directory */ 
+	*newClus = ent.firstClus;
+	return 1;
+}
+
+int resolvePath(fat32Head *h, const char * path, fat32IndexEnt * ent){
+
+	char comp[LFN_NAME_SZ];
+
+	memset(ent, 0, sizeof(*ent));
+	ent->firstClus = h->bs->BPB_RootClus;
+	ent->attr = ATTR_DIRECTORY;
+
+	for(;;){
+		path += strspn(path, "/");
+
+		size_t len = strcspn(path, "/");
+		if(len == 0) return 1;
+		if(len >= sizeof(comp) || !(ent->attr & ATTR_DIRECTORY)) return 0;
+
+		memcpy(comp, path, len);
+		comp[len] = NULL_TERM;
+		path += len;
+
+		if(!findEntry(h, ent->firstClus, comp, ent, NULL, NULL)) return 0;
+
+		/* a zero cluster in ".." means the root directory */
+		if((ent->attr & ATTR_DIRECTORY) && ent->firstClus == ADDR_ZERO){
+			ent->firstClus = h->bs->BPB_RootClus;
+		}
+	}
 }
 
 uint32_t doCD(fat32Head *h, uint32_t curDirClus, char buffer[BUF_SIZE]){
 
-	bool isRoot = false;
 	char preFmtBuf[BUF_SIZE];
 	
 	strcpy(preFmtBuf, buffer);
+	runCD(h, &curDirClus, preFmtBuf);
 
-	/* token out the argument file name from the buffer */
-	char* arg = strtok(preFmtBuf, SPACE_CHAR);
-	arg = strtok(NULL, SPACE_CHAR);
+	return curDirClus;
+}
 
-	/* to use as root directory check */
-	isRoot = (curDirClus == h->bs->BPB_RootClus);
+int getFile(fat32Head *h, uint32_t curDirClus, const char * name, const char * dest, uint32_t * fileSize,
+		char * digest){
 
-	/* no directory specified */
-	if(arg == NULL){
-		printf("Error: folder not found\n");
-		return curDirClus;
+	fat32IndexEnt ent;
+	const fat32Extent * ext = NULL;
+	uint32_t numExt = 0;
+	fat32Hash hs;
+	fat32Hash * hsp = NULL;
+
+	if(!findEntry(h, curDirClus, name, &ent, &ext, &numExt) || ent.attr == ATTR_DIRECTORY){
+		return GET_NOT_FOUND;
 	}
 
-	/* Get first data location of cluster */
-	uint32_t firstSecOfClus = getFirstSectorOfClus(h,curDirClus);
+	/*open output file to read/write,
+	  creating file if file DNE*/
+	int outFD = open(dest, O_CREAT|O_RDWR|O_TRUNC, FILE_PERMISSION);  
 
-	int i,j;
-	for(i=0; i < h->bs->BPB_SecPerClus; i+= h->bs->BPB_BytesPerSec){
-		
-		for(j=0; j< h->bs->BPB_BytesPerSec; j+=sizeof(fat32Dir)){
-			/* read each sector for directory */
-			fat32Dir * dir;
-			dir = readDir(fileDesc,h,firstSecOfClus+i,j);
-
-			/* Exit if current directory address is zero */
-			if(dir->DIR_Name[0] == ADDR_ZERO){
-				if(dir) {
-					free(dir);
-				}
-				break;
-			}
+	if(outFD == -1){
+		return GET_OPEN_ERR;
+	}
 
-			/* remove white space & null terminate string of directory name */
-			formatDirectory(dir);
+	/* the digest is taken from the data as it is copied */
+	if(digest != NULL && hashAlgo() != HASH_NONE){
+		hashInit(&hs, hashAlgo());
+		hsp = &hs;
+	}
 
-			if(dir->DIR_Attr == ATTR_DIRECTORY){
-				
-				/* cd "." */
-				if(strcmp(arg, DOT) == 0){
-					//current directory
-					if(!isRoot){
-						free(dir);
-						return curDirClus;
-					}
-					else{
-						printf("Error: Folder not found.\n");
-						free(dir);
-						return curDirClus;
-					}
-					
-					
-				}
-				/* cd ".." */
-				else if(strcmp(dir->DIR_Name, DOTDOT ) == 0 && strcmp(dir->DIR_Name,arg) == 0){
-					if(!isRoot){
-						/*previous directory*/
-
-						if(dir->DIR_FstClusLO == ADDR_ZERO && dir->DIR_FstClusHI == ADDR_ZERO){
-							free(dir);
-							return ROOT_DIR_CLUS_NUM;
-						}
-
-						/* move to directory stored in ".." */
-						uint32_t newClus = ADDR_ZERO;
-						newClus = newClus | dir->DIR_FstClusHI << HEX_TEN;
-						newClus = newClus | dir->DIR_FstClusLO;
-						free(dir);
-
-						return newClus;
-					}
-					else{
-						printf("Error: Folder not found.\n");
-						return curDirClus;
-					}
-				}
-				else if(strcmp(dir->DIR_Name, arg) == 0)
-				{
-					/* FOUND DIRECTORY MATCH, 	
-					move to directory stored in the directory */ 
-					uint32_t newClus = ADDR_ZERO;
-					newClus = newClus | dir->DIR_FstClusHI << 16;
-					newClus = newClus | dir->DIR_FstClusLO;
-					free(dir);
-					
-					return newClus;
-				}
-							
-			}
-			free(dir);
+	/* first use allocates the transfer buffer */
+	if(xferBuf == NULL) xferInit(xferSize());
 
-		}
+	/* the sidecar holds the extents, the FAT is not read */
+	int res = (h->sidecar != NULL) ? writeExtentsHash(h, ext, numExt, outFD, ent.fileSize, hsp) :
+			writeFileHash(h, ent.firstClus, outFD, ent.fileSize, xferBuf, xferBufSz, hsp);
+
+	if(res != 0){
+		int err = errno;
+		close(outFD);
+		errno = err;
+		return GET_WRITE_ERR;
 	}
 
-	/* Fetch next cluster */
-	uint32_t nextClus = getNextClus(h,curDirClus);
+	/* a chain shorter than the file leaves the output short, nothing is written past the data */
+	struct stat st;
+	*fileSize = (fstat(outFD, &st) == 0 && (uint64_t) st.st_size < ent.fileSize) ? (uint32_t) st.st_size : ent.fileSize;
+	close(outFD);
+
+	if(hsp != NULL) hashFinal(hsp, digest);
+	else if(digest != NULL) digest[0] = NULL_TERM;
+
+	return (*fileSize < ent.fileSize) ? GET_SHORT : GET_OK;
+}
+
+int doDownload(fat32Head *h, uint32_t curDirClus, char buffer[BUF_SIZE]){
 
-	if (nextClus < EOC) {
-		nextClus = doCD(h, nextClus,buffer);
-		return nextClus;
+	/* acquire GET file name argument, the rest of the line */
+	char* arg = nameArg(buffer);
+	uint32_t fileSize;
+	char digest[HASH_HEX_SZ];
+
+	/* no file specified */
+	if(arg == NULL){
+		printf("Error: File not found\n");
+		return -1;
 	}
-	
-	return curDirClus;
 
+	/* the destination file keeps the name as typed */
+	switch(getFile(h, curDirClus, arg, arg, &fileSize, digest)){
+	case GET_NOT_FOUND:
+		printf("Error: File not found\n");
+		return -1;
+	case GET_OPEN_ERR:
+		perror("Out file descriptor error");
+		return -1;
+	case GET_WRITE_ERR:
+		perror("writefile write error");
+		return -1;
+	}
+
+	/* one line of a manifest, as sha256sum prints it */
+	if(digest[0] != NULL_TERM) printf("%s  %s\n", digest, arg);
+
+	printf("\nDone.\n");
+	return 0;
 }
 
-void doDownload(fat32Head *h, uint32_t curDirClus, char buffer[BUF_SIZE]){
+void doRecursiveGet(fat32Head *h, uint32_t curDirClus, char buffer[BUF_SIZE]){
 
-	/* acquire GET file name argument */
+	/* acquire RGET destination argument */
 	char* arg = strtok(buffer, SPACE_CHAR);
 	arg = strtok(NULL, SPACE_CHAR);
 
-	/* no directory specified */
+	/* no destination specified */
 	if(arg == NULL){
+		printf("Error: no destination folder\n");
+		return;
+	}
+
+	extractTree(h, curDirClus, arg);
+
+	printf("\nDone.\n");
+}
+
+void doFree(fat32Head *h){
+
+	const fat32FreeMap * map = freeMapRescan(h);
+	uint32_t fsiFree = h->fsi->FSI_Free_Count;
+
+	printf("Free clusters: %u of %u (%lu bytes), FAT scanned in %.3f s (%s)\n", map->freeCount, map->numClus,
+			(uint64_t) map->freeCount * h->bytesPerClus, map->secs, map->engine);
+
+	/* cross-check against the count kept in FSInfo */
+	if(fsiFree == FREE_CLUS_UNKNOWN){
+		printf("FSInfo free count: unknown\n");
+	}
+	else if(fsiFree == map->freeCount){
+		printf("FSInfo free count: %u, matches\n", fsiFree);
+	}
+	else{
+		printf("FSInfo free count: %u, differs from the FAT by %ld clusters\n", fsiFree,
+				(long) fsiFree - (long) map->freeCount);
+	}
+
+	/* the next free hint should point at a free cluster */
+	uint32_t hint = h->fsi->FSI_Nxt_Free;
+	if(hint != FREE_CLUS_UNKNOWN && hint >= ROOT_DIR_CLUS_NUM && hint < map->numClus + ROOT_DIR_CLUS_NUM &&
+			!FREE_MAP_TEST(map, hint)){
+		printf("FSInfo next free hint: cluster %u is in use\n", hint);
+	}
+}
+
+void doCheck(fat32Head *h){
+
+	fat32Check res;
+	uint32_t problems = checkVolume(h, &res);
+
+	if(res.badClus > 0) printf("Bad clusters: %u\n", res.badClus);
+
+	if(problems == 0){
+		printf("No problems found, checked in %.3f s\n", res.secs);
+	}
+	else{
+		printf("%u problems found (%u cross-links, %u loops, %u broken chains, %u size mismatches, "
+				"%u lost clusters, %u FAT copies differ, %u FSInfo), checked in %.3f s\n", problems,
+				res.crossLinks, res.loops, res.badChains, res.sizeErrors, res.lostClus, res.mirrorErrors,
+				res.fsiErrors, res.secs);
+	}
+}
+
+void doUndelete(fat32Head *h, char buffer[BUF_SIZE]){
+
+	/* acquire optional UNDELETE destination argument */
+	char* arg = strtok(buffer, SPACE_CHAR);
+	arg = strtok(NULL, SPACE_CHAR);
+
+	fat32Undel * u = undeleteScan(h, extractThreads());
+	uint32_t i;
+
+	/* one line per deleted entry: status, size, first cluster, path */
+	for(i = 0; i < u->numEnts; i++){
+		const undelEnt * ent = &u->ents[i];
+
+		printf("%-11s %10u %10u  %s%s%s\n", undeleteStatusName(ent->status), ent->fileSize, ent->firstClus,
+				ent->path, (ent->attr & ATTR_DIRECTORY) ? "/" : "",
+				ent->sig == UNDEL_SIG_MATCH ? "  (signature matches)" :
+				ent->sig == UNDEL_SIG_MISMATCH ? "  (signature differs)" : "");
+	}
+
+	printf("%u deleted entries: %u contiguous, %u fragmented, %u empty, %u overwritten\n", u->numEnts,
+			u->counts[UNDEL_CONTIG], u->counts[UNDEL_FRAG], u->counts[UNDEL_EMPTY], u->counts[UNDEL_OVERWRITTEN]);
+	printf("%u directory clusters scanned (%lu bytes read) in %.3f s (%d threads)\n", u->numDirClus, u->bytesRead,
+			u->secs, u->numThreads);
+
+	if(arg != NULL){
+		int n = undeleteExtract(h, u, arg);
+		if(n >= 0) printf("%d files recovered to %s\n", n, arg);
+	}
+
+	/* what no deleted entry accounts for may still hold whole files */
+	if(arg != NULL && strlen(arg) + sizeof(UNDEL_CARVE_DIR) < PATH_MAX){
+		char carveDir[PATH_MAX];
+		uint8_t * mask = undeleteUnclaimed(h, u);
+		fat32Carve * c = carveScan(h, mask, extractThreads());
+
+		snprintf(carveDir, sizeof(carveDir), "%s/%s", arg, UNDEL_CARVE_DIR);
+		if(c->numObjs > 0){
+			int n = carveExtract(h, c, carveDir);
+			if(n >= 0) printf("%d files carved from unclaimed free clusters to %s\n", n, carveDir);
+		}
+		carveFree(c);
+		free(mask);
+	}
+
+	undeleteFree(u);
+}
+
+void doCarve(fat32Head *h, char buffer[BUF_SIZE]){
+
+	/* acquire optional CARVE destination argument */
+	char* arg = strtok(buffer, SPACE_CHAR);
+	arg = strtok(NULL, SPACE_CHAR);
+
+	fat32Carve * c = carveScan(h, NULL, extractThreads());
+	uint32_t i, t;
+
+	/* one line per file: byte offset in the volume, length, type */
+	for(i = 0; i < c->numObjs; i++){
+		printf("%12" PRIu64 " %12" PRIu64 "  %s\n", c->objs[i].offset, c->objs[i].len, carveTypeName(c->objs[i].type));
+	}
+
+	printf("%u files found (", c->numObjs);
+	for(t = 0; t < CARVE_NUM_TYPES; t++) printf("%s%u %s", t ? ", " : "", c->counts[t], carveTypeName(t));
+	printf("), %u headers without an end\n", c->dropped);
+
+	double mbPerSec = c->secs > 0 ? c->bytesScanned / (double) M_UNIT / c->secs : 0;
+	printf("%" PRIu64 " bytes scanned in %.3f s (%.1f MB/s, %d threads)\n", c->bytesScanned, c->secs, mbPerSec,
+			c->numThreads);
+
+	if(arg != NULL){
+		int n = carveExtract(h, c, arg);
+		if(n >= 0) printf("%d files written to %s\n", n, arg);
+	}
+
+	carveFree(c);
+}
+
+hashManifest * hashPath(fat32Head *h, uint32_t curDirClus, const char * name, int algo){
+
+	fat32IndexEnt ent;
+	const fat32Extent * ext = NULL;
+	uint32_t numExt = 0, dirClus = curDirClus;
+	struct timespec start, end;
+
+	/* a directory is hashed on the extraction threads */
+	if(name == NULL || strcmp(name, DOT) == 0 || changeDir(h, curDirClus, name, &dirClus)){
+		return hashTree(h, dirClus, algo);
+	}
+
+	if(!findEntry(h, curDirClus, name, &ent, &ext, &numExt) || ent.attr == ATTR_DIRECTORY){
+		return NULL;
+	}
+
+	hashManifest * m = manifestNew(algo);
+	fat32Hash hs;
+	char digest[HASH_HEX_SZ];
+	int res;
+
+	if(xferBuf == NULL) xferInit(xferSize());
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	hashInit(&hs, algo);
+	res = (h->sidecar != NULL) ? writeExtentsHash(h, ext, numExt, -1, ent.fileSize, &hs) :
+			writeFileHash(h, ent.firstClus, -1, ent.fileSize, xferBuf, xferBufSz, &hs);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if(res != 0){
+		m->numErrors++;
+	}
+	else{
+		hashFinal(&hs, digest);
+		manifestAdd(m, name, ent.fileSize, digest);
+		m->numBytes = ent.fileSize;
+	}
+	m->numThreads = 1;
+	m->secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / NSEC_PER_SEC;
+	return m;
+}
+
+int doHash(fat32Head *h, uint32_t curDirClus, char buffer[BUF_SIZE]){
+
+	/* the argument is the rest of the line, long names hold spaces */
+	char * arg = nameArg(buffer);
+	int algo = (hashAlgo() != HASH_NONE) ? hashAlgo() : HASH_SHA256;
+
+	hashManifest * m = hashPath(h, curDirClus, arg, algo);
+
+	if(m == NULL){
 		printf("Error: File not found\n");
+		return -1;
+	}
+
+	/* the manifest first, in the format sha256sum -c and b3sum -c read */
+	manifestPrint(stdout, m);
+
+	double mbPerSec = m->secs > 0 ? m->numBytes / (double) M_UNIT / m->secs : 0;
+	printf("%" PRIu64 " files, %" PRIu64 " bytes hashed in %.3f s (%.1f MB/s, %d threads, %s on %s)\n", m->numEnts,
+			m->numBytes, m->secs, mbPerSec, m->numThreads, hashAlgoName(algo), hashEngine(algo));
+
+	int res = 0;
+	if(m->numErrors > 0){
+		printf("%" PRIu64 " files could not be read\n", m->numErrors);
+		res = -1;
+	}
+
+	manifestFree(m);
+	return res;
+}
+
+/* Prints the report of d: cluster totals, contents shared between
+   images, the most repeated clusters and the largest groups of
+   identical files */
+static void printDedup(fat32Dedup * d){
+
+	char path[PATH_MAX];
+	uint64_t bytesRead = 0, i, k;
+	int t;
+
+	for(t = 0; t < d->numImages; t++){
+		const dedupImage * img = &d->images[t];
+		printf("%s: %" PRIu64 " files, %" PRIu64 " clusters, %" PRIu64 " bytes read in %.3f s\n", img->name,
+				img->numFiles, img->numClus, img->bytesRead, img->secs);
+		bytesRead += img->bytesRead;
+	}
+
+	uint64_t dupClus = d->numClus - d->distinct;
+	printf("%" PRIu64 " clusters, %" PRIu64 " distinct, %" PRIu64 " duplicates (%" PRIu64 " bytes, %.1f%%)\n",
+			d->numClus, d->distinct, dupClus, d->dupBytes, d->numClus ? 100.0 * dupClus / d->numClus : 0);
+
+	if(d->numImages > 1){
+		printf("%" PRIu64 " distinct contents in more than one image\n", d->sharedDistinct);
+		for(t = 0; t < d->numImages; t++){
+			printf("  %s: %" PRIu64 " only here, %" PRIu64 " shared\n", d->images[t].name, d->images[t].onlyHere,
+					d->images[t].shared);
+		}
+	}
+
+	/* one line per content: copies, fingerprint, images holding it */
+	if(d->numTop > 0) printf("Most repeated clusters:\n");
+	for(t = 0; t < d->numTop; t++){
+		int zeros = 0, j;
+		printf("  %10u  %016" PRIx64 "  images", d->top[t].count, d->top[t].fp);
+		for(j = 0; j < d->numImages; j++){
+			if(!(d->top[t].images & ((uint32_t) 1 << j))) continue;
+			printf(" %d", j);
+			zeros |= d->top[t].fp == d->images[j].zeroFp;
+		}
+		printf("%s\n", zeros ? "  (zeros)" : "");
+	}
+
+	/* the groups wasting the most space first, each copy by image and path */
+	printf("%" PRIu64 " groups of identical files, %" PRIu64 " copies, %" PRIu64 " bytes in copies\n", d->numGroups,
+			d->dupFiles, d->wastedBytes);
+	for(i = 0; i < d->numGroups && i < DEDUP_REPORT_MAX; i++){
+		const dedupGroup * g = &d->groups[i];
+		printf("  %u files of %u bytes, %" PRIu64 " bytes in copies\n", g->numFiles, d->files[g->first].fileSize,
+				g->wasted);
+
+		for(k = g->first; k < g->first + g->numFiles; k++){
+			const dedupFile * f = &d->files[k];
+			if(catalogPath(d->images[f->image].cat, f->catIdx, path, sizeof(path)) != 0) continue;
+			printf("    %s:%s\n", d->images[f->image].name, path);
+		}
+	}
+	if(d->numGroups > DEDUP_REPORT_MAX) printf("  ... %" PRIu64 " more groups\n", d->numGroups - DEDUP_REPORT_MAX);
+
+	double mbPerSec = d->secs > 0 ? bytesRead / (double) M_UNIT / d->secs : 0;
+	printf("%" PRIu64 " bytes fingerprinted in %.3f s (%.1f MB/s, %d threads, %" PRIu64 " spills)\n", bytesRead,
+			d->secs, mbPerSec, d->numThreads, d->table.numSpills);
+}
+
+int doDedup(fat32Head *h, char buffer[BUF_SIZE]){
+
+	/* acquire the optional DEDUP image arguments */
+	char* arg = strtok(buffer, SPACE_CHAR);
+	int res = 0;
+
+	fat32Dedup * d = dedupNew(extractThreads());
+	dedupAdd(d, h, DEDUP_CURRENT);
+
+	while((arg = strtok(NULL, SPACE_CHAR)) != NULL){
+
+		if(d->numImages == DEDUP_MAX_IMAGES){
+			printf("Error: At most %d images\n", DEDUP_MAX_IMAGES);
+			res = -1;
+			break;
+		}
+
+		int fd = open(arg, O_RDONLY);
+		const char * err = (fd == -1) ? strerror(errno) : verifyVolume(fd);
+
+		if(err != NULL){
+			printf("Error: %s: %s\n", arg, err);
+			if(fd != -1) close(fd);
+			res = -1;
+			continue;
+		}
+
+		/* the other volumes are only needed while they are fingerprinted */
+		fat32Head * other = createHead(fd, h->map != NULL ? HEAD_MMAP : 0);
+		if(dedupAdd(d, other, arg) == DEDUP_CLUS_SIZE){
+			printf("Error: %s: clusters of %u bytes, not %u\n", arg, other->bytesPerClus, d->bytesPerClus);
+			res = -1;
+		}
+		cleanupHead(other);
+		close(fd);
+	}
+
+	dedupFinish(d);
+	printDedup(d);
+	dedupFree(d);
+	return res;
+}
+
+/* Prints the error of a PUT, MKDIR or RM that failed on name and
+   returns -1 */
+static int writeError(int res, const char * name){
+
+	switch(res){
+	case WRITE_NOT_FOUND: printf("Error: %s not found\n", name); break;
+	case WRITE_EXISTS: printf("Error: %s already exists\n", name); break;
+	case WRITE_BAD_NAME: printf("Error: %s is not a valid name\n", name); break;
+	case WRITE_NO_SPACE: printf("Error: Not enough free space for %s\n", name); break;
+	case WRITE_TOO_LARGE: printf("Error: %s is larger than 4 GB\n", name); break;
+	case WRITE_DIR_FULL: printf("Error: Directory is full\n"); break;
+	case WRITE_NOT_EMPTY: printf("Error: %s is not empty\n", name); break;
+	default: printf("Error: %s: %s\n", name, strerror(errno)); break;
+	}
+	return -1;
+}
+
+/* Prints the FAT writes of the last command */
+static void printFatWrites(fat32Head *h){
+
+	const fat32Writer * w = writerGet(h);
+
+	if(w == NULL) return;
+	printf("FAT: %u sectors in %u writes to each of %u FATs, %u clusters free\n", w->fatSectors, w->fatWrites,
+			(h->bs->BPB_ExtFlags & FAT_MIRROR_DISABLED) ? 1 : h->bs->BPB_NumFATs, w->freeCount);
+}
+
+int doPut(fat32Head *h, uint32_t curDirClus, char buffer[BUF_SIZE]){
+
+	/* the argument is the rest of the line, local names hold spaces */
+	char * arg = nameArg(buffer);
+	uint32_t fileSize = 0;
+
+	if(arg == NULL){
+		printf("Error: file not found\n");
+		return -1;
+	}
+
+	/* the file keeps its local name, without the folders */
+	const char * name = strrchr(arg, '/');
+	name = (name != NULL) ? name + 1 : arg;
+
+	int res = putFile(h, curDirClus, arg, name, &fileSize);
+	if(res != WRITE_OK) return writeError(res, res == WRITE_NOT_FOUND ? arg : name);
+
+	printf("%u bytes written to %s\n", fileSize, name);
+	printFatWrites(h);
+	printf("\nDone.\n");
+	return 0;
+}
+
+int doMkdir(fat32Head *h, uint32_t curDirClus, char buffer[BUF_SIZE]){
+
+	char * arg = nameArg(buffer);
+
+	if(arg == NULL){
+		printf("Error: no folder name\n");
+		return -1;
+	}
+
+	int res = makeDir(h, curDirClus, arg);
+	if(res != WRITE_OK) return writeError(res, arg);
+
+	printFatWrites(h);
+	return 0;
+}
+
+int doRemove(fat32Head *h, uint32_t curDirClus, char buffer[BUF_SIZE]){
+
+	char * arg = nameArg(buffer);
+
+	if(arg == NULL){
+		printf("Error: file not found\n");
+		return -1;
+	}
+
+	int res = removeEntry(h, curDirClus, arg);
+	if(res != WRITE_OK) return writeError(res, arg);
+
+	printFatWrites(h);
+	return 0;
+}
+
+void doCatalog(fat32Head *h, char buffer[BUF_SIZE]){
+
+	/* acquire optional CATALOG output file argument */
+	char* arg = strtok(buffer, SPACE_CHAR);
+	arg = strtok(NULL, SPACE_CHAR);
+
+	FILE * out = NULL;
+	if(arg != NULL && (out = fopen(arg, "w")) == NULL){
+		perror("catalog output file error");
 		return;
 	}
 
-	size_t check;
-	fat32Dir * dir = h->dir;
-	uint32_t firstSecOfClus = getFirstSectorOfClus(h,curDirClus);
+	fat32Catalog * cat = walkTree(h, h->bs->BPB_RootClus, extractThreads());
+
+	/* one line per entry: path, size, attributes, first cluster */
+	if(out != NULL){
+		char path[PATH_MAX];
+		uint32_t i;
+
+		for(i = CATALOG_ROOT + 1; i < cat->numEnts; i++){
+			catalogEnt * ent = catalogGet(cat, i);
+			if(catalogPath(cat, i, path, sizeof(path)) != 0) continue;
+
+			fprintf(out, "%s%s\t%u\t0x%02X\t%u\n", path, (ent->attr & ATTR_DIRECTORY) ? "/" : "",
+					ent->fileSize, ent->attr, ent->firstClus);
+		}
+		fclose(out);
+	}
+
+	printf("%u entries (%u directories, %lu bytes in files) in %.3f s\n",
+			cat->numEnts - 1, cat->numDirs, cat->numBytes, cat->secs);
 
-	/* set seek to first sector of cluster */
-	check = lseek(fileDesc, firstSecOfClus, SEEK_SET); 
-	    if(check == SEEK_ERR){
-		perror("doDownload seek error");
+	catalogFree(cat);
+}
+
+int writeAll(int outFD, const void * buf, size_t len){
+
+	const char * pos = (const char*) buf;
+
+	while(len > 0){
+		ssize_t written = write(outFD, pos, len);
+
+		if(written == -1){
+			if(errno == EINTR) continue;
+			return -1;
+		}
+		pos += written;
+		len -= written;
+	}
+	return 0;
+}
+
+void xferInit(size_t bytes){
+
+	if(bytes < XFER_MIN_SZ) bytes = XFER_MIN_SZ;
+	if(bytes > XFER_MAX_SZ) bytes = XFER_MAX_SZ;
+
+	free(xferBuf);
+	xferBuf = NULL;
+
+	/* aligned to a page so it also suits O_DIRECT style transfers */
+	if(posix_memalign((void**) &xferBuf, XFER_ALIGN, bytes) != 0){
+		printf("xferInit: could not allocate a %zu byte transfer buffer\n", bytes);
 		exit(EXIT_FAILURE);
-	}   
-	
-	int i;
-	for(i=0; i < h->bs->BPB_BytesPerSec; i+=sizeof(fat32Dir)){
+	}
+	xferBufSz = bytes;
+}
 
-		/* read in current directory */
-		check = read(fileDesc, dir, sizeof(fat32Dir));
-		if( check < SINGLE_READ){
-			perror("doDownload read error");
-			exit(EXIT_FAILURE);
+void xferSetMode(int mode){
+
+	if(mode < XFER_COPY_RANGE || mode > XFER_ASYNC) mode = XFER_READ_WRITE;
+	xferMode = mode;
+}
+
+/* Copies up to len bytes at offset of the volume to outFD inside the
+   kernel, with copy_file_range or sendfile. If the kernel or the file
+   systems do not support the current mode, falls back to the next one
+   for the rest of the session. Returns the number of bytes copied,
+   the caller copies whatever is left through the transfer buffer. */
+static uint64_t copyKernel(fat32Head *h, int outFD, off_t offset, uint64_t len){
+
+	uint64_t done = 0;
+	int mode;
+
+	while(done < len && (mode = __atomic_load_n(&xferMode, __ATOMIC_RELAXED)) < XFER_READ_WRITE){
+
+		size_t chunk = (len - done < XFER_KERNEL_MAX) ? len - done : XFER_KERNEL_MAX;
+		off_t inOff = offset + done;
+		ssize_t copied;
+
+		if(mode == XFER_COPY_RANGE){
+			copied = copy_file_range(h->fd, &inOff, outFD, NULL, chunk, 0);
+		}
+		else{
+			copied = sendfile(outFD, h->fd, &inOff, chunk);
 		}
 
-		/* process file name */
-		formatDirectory(dir); 
+		if(copied > 0){
+			done += copied;
+		}
+		/* end of the volume, the buffered path reports the short read */
+		else if(copied == 0){
+			break;
+		}
+		/* downgrade once, even if several extracting threads fail at the same time */
+		else if(errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP){
+			__atomic_compare_exchange_n(&xferMode, &mode, mode + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+		}
+		/* anything else is reported by the buffered path */
+		else if(errno != EINTR){
+			break;
+		}
+	}
 
-		if(dir->DIR_Attr != ATTR_DIRECTORY){
-			
-			if(strcmp(dir->DIR_Name, arg) == 0)
-			{
-				/* FOUND FILE MATCH */
-				
-				/* get file cluster number */
-				uint32_t newClus = ADDR_ZERO;
-				newClus = newClus | dir->DIR_FstClusHI << HEX_TEN;
-				newClus = newClus | dir->DIR_FstClusLO;
-				
-				/*  file cluster number found, download the file */
+	return done;
+}
+
+size_t xferSize(void){
 
-				//destination file name			
-				char * dest = arg; 
+	return xferBufSz ? xferBufSz : XFER_DEFAULT_SZ;
+}
 
-				/*open output file to read/write,
-				  creating file if file DNE*/
-				int outFD = open(dest, O_CREAT|O_RDWR|O_TRUNC, FILE_PERMISSION);  
+/* Hints the kernel that len bytes at offset of the volume are read
+   next, so the device fetches them while earlier data is copied */
+static void xferHint(fat32Head *h, uint64_t offset, uint64_t len){
 
-				if(outFD == -1){
-					perror("Out file descriptor error");
-					exit(EXIT_FAILURE);
-				}
+	if(h->map == NULL){
+		posix_fadvise(h->fd, offset, len, POSIX_FADV_WILLNEED);
+		return;
+	}
 
-				writeFile(h,newClus,outFD,dir->DIR_FileSize);
+	/* madvise needs a page aligned start inside the mapping */
+	uint64_t page = (uint64_t) sysconf(_SC_PAGESIZE);
+	uint64_t start = offset / page * page;
 
-				close(outFD);
+	if(offset + len > h->mapLen) return;
+	madvise(h->map + start, len + (offset - start), MADV_WILLNEED);
+}
 
-				printf("\nDone.\n");
-				return;
-			}					 
+/* Extent source struct,
+   the extents of one file in chain order, resolved ahead of the copy
+   so that the clusters coming up are prefetched */
+struct xferSrc_struct {
+	fat32Head * head;
+	fat32ExtentIter * it; //chain to follow, if ext is NULL
+	const fat32Extent * ext; //extents resolved already, or NULL
+	uint32_t numExt;
+	uint32_t nextExt; //next entry of ext
+	uint64_t aheadOff[XFER_AHEAD_EXTS]; //volume offsets of the runs resolved and not yet copied
+	uint64_t aheadLen[XFER_AHEAD_EXTS]; //their lengths, cut at the end of the file
+	uint32_t aheadHead;
+	uint32_t numAhead;
+	uint64_t aheadBytes; //bytes of the runs ahead
+	uint64_t runOff; //volume offset of the rest of the extent being split
+	uint64_t runLeft; //bytes left of that extent
+	uint64_t hintOff; //range waiting to be hinted, nearby runs are merged into it
+	uint64_t hintEnd;
+	uint64_t left; //file bytes not yet resolved
+};
+typedef struct xferSrc_struct xferSrc;
+
+static void srcInit(xferSrc * src, fat32Head *h, fat32ExtentIter * it, const fat32Extent * ext, uint32_t numExt,
+		uint32_t fileSize){
+
+	src->head = h;
+	src->it = it;
+	src->ext = ext;
+	src->numExt = numExt;
+	src->nextExt = 0;
+	src->aheadHead = 0;
+	src->numAhead = 0;
+	src->aheadBytes = 0;
+	src->runOff = 0;
+	src->runLeft = 0;
+	src->hintOff = 0;
+	src->hintEnd = 0;
+	src->left = fileSize;
+}
+
+/* Adds the run at offset to the range waiting to be hinted. Runs
+   within XFER_HINT_GAP of the range are merged into it, so that a
+   fragmented file costs one hint per XFER_HINT_MIN bytes rather than
+   one per run. flush hints whatever is waiting. */
+static void srcHint(xferSrc * src, uint64_t offset, uint64_t len, int flush){
+
+	if(len > 0){
+		if(src->hintEnd > src->hintOff && offset >= src->hintOff && offset <= src->hintEnd + XFER_HINT_GAP){
+			if(offset + len > src->hintEnd) src->hintEnd = offset + len;
+		}
+		else{
+			if(src->hintEnd > src->hintOff) xferHint(src->head, src->hintOff, src->hintEnd - src->hintOff);
+			src->hintOff = offset;
+			src->hintEnd = offset + len;
 		}
 	}
-	printf("Error: File not found\n");
 
+	if(src->hintEnd > src->hintOff && (flush || src->hintEnd - src->hintOff >= XFER_HINT_MIN)){
+		xferHint(src->head, src->hintOff, src->hintEnd - src->hintOff);
+		src->hintOff = src->hintEnd = 0;
+	}
 }
 
-void writeFile(fat32Head *h, uint32_t clusNum, int outFD, int fileSize){
+/* Resolves runs until XFER_AHEAD_SZ bytes or XFER_AHEAD_EXTS runs
+   are ahead of the copy, hinting them to the kernel. Extents longer
+   than XFER_HINT_MAX are cut, so a long file is prefetched a window
+   at a time and not all at once. */
+static void srcFill(xferSrc * src){
 
-	/* Stop writing File if end of data is reached */  		
-	if(fileSize < 0) return;
+	int last = 0;
 
-	size_t error;	
-	uint32_t bytesPerClus = h->bs->BPB_SecPerClus * h->bs->BPB_BytesPerSec; /* cluster size in bytes */
-	uint32_t firstSecOfClus = getFirstSectorOfClus(h,clusNum);
-	
-	/* byte array to write memory, allocated to cluster size */
-	uint32_t * str = malloc(bytesPerClus); 
-						
-	if(str == NULL){
-		perror("writeFile malloc error");
-		exit(EXIT_FAILURE);
-	}	
-					
-	/* seek to the data portion of cluster */
-	error = lseek(fileDesc, (off_t)firstSecOfClus, SEEK_SET);
+	while(src->numAhead < XFER_AHEAD_EXTS && src->aheadBytes < XFER_AHEAD_SZ){
 
-	if( error == -1 ){
-		perror("writefile seek");
-		exit(EXIT_FAILURE);
+		if(src->runLeft == 0){
+			fat32Extent e;
+
+			if(src->left == 0){
+				last = 1;
+				break;
+			}
+			if(src->ext != NULL){
+				if(src->nextExt == src->numExt){
+					last = 1;
+					break;
+				}
+				e = src->ext[src->nextExt++];
+			}
+			else if(!nextExtent(src->head, src->it, &e)){
+				last = 1;
+				break;
+			}
+
+			src->runOff = getFirstSectorOfClus(src->head, e.startClus);
+			src->runLeft = (uint64_t) e.numClus * src->head->bytesPerClus;
+			if(src->runLeft > src->left) src->runLeft = src->left;
+			src->left -= src->runLeft;
+		}
+
+		uint64_t len = src->runLeft < XFER_HINT_MAX ? src->runLeft : XFER_HINT_MAX;
+
+		uint32_t i = (src->aheadHead + src->numAhead) % XFER_AHEAD_EXTS;
+		src->aheadOff[i] = src->runOff;
+		src->aheadLen[i] = len;
+		src->numAhead++;
+		src->aheadBytes += len;
+		src->runOff += len;
+		src->runLeft -= len;
+
+		srcHint(src, src->aheadOff[i], len, 0);
 	}
-					
-	/* last cluster, only write remaining data, 
-	   instead of the whole cluster */
-	if(fileSize <= bytesPerClus){
 
-		/* read in current cluster, only the remaining bytes
-		   Instead of passing whole cluster size as the size, pass 
-		   in the remaining data in the last cluster as the size */
-		error = read(fileDesc,(void*)str, fileSize);
+	/* nothing more will be merged once the whole file is resolved */
+	if(last) srcHint(src, 0, 0, 1);
+}
+
+/* Stores the volume offset and length of the next run of the file,
+   and resolves further ahead. Returns 1 if there was a run, 0 at the
+   end of the file or of its chain. */
+static int srcNext(xferSrc * src, uint64_t * offset, uint64_t * len){
 
-		if(error == -1){
-			perror("writefile read error");
-			exit(EXIT_FAILURE);
+	srcFill(src);
+	if(src->numAhead == 0) return 0;
+
+	*offset = src->aheadOff[src->aheadHead];
+	*len = src->aheadLen[src->aheadHead];
+	src->aheadHead = (src->aheadHead + 1) % XFER_AHEAD_EXTS;
+	src->numAhead--;
+	src->aheadBytes -= *len;
+
+	/* the runs after this one are prefetched while it is copied */
+	srcFill(src);
+	return 1;
+}
+
+/* Writes len bytes at offset of the volume to outFD, feeding them
+   to hs unless it is NULL. outFD -1 only hashes. Returns 0, or -1
+   with errno set if the volume could not be read or the output failed. */
+static int copyExtent(fat32Head *h, uint64_t offset, uint64_t len, int outFD, char * buf, size_t bufSz, fat32Hash * hs){
+
+	/* move the run kernel to kernel when possible, a digest needs the data here */
+	if(hs == NULL){
+		uint64_t copied = copyKernel(h, outFD, offset, len);
+		offset += copied;
+		len -= copied;
+	}
+
+	/* one read per transfer buffer worth of the run */
+	while(len > 0){
+
+		size_t chunk = (len < bufSz) ? len : bufSz;
+
+		/* a mapped volume is written straight from the mapping */
+		const void * src = mapView(h, offset, chunk);
+
+		if(src == NULL){
+			if(tryReadVolume(h, buf, chunk, offset) != 0) return -1;
+			src = buf;
 		}
 
-		//write current cluster with size of remaining bytes	
-		error = write(outFD, (void*)str, fileSize); 							
+		if(hs != NULL) hashUpdate(hs, src, chunk);
+		if(outFD != -1 && writeAll(outFD, src, chunk) != 0) return -1;
 
-		if(error == -1){
-			perror("writefile write error");
-			exit(EXIT_FAILURE);
+		offset += chunk;
+		len -= chunk;
+	}
+
+	return 0;
+}
+
+/* Read pipeline struct,
+   buffers passed from the reading thread to the writing one */
+struct xferPipe_struct {
+	xferSrc * src;
+	char * bufs[XFER_PIPE_BUFS];
+	uint64_t lens[XFER_PIPE_BUFS]; //bytes in each filled buffer
+	size_t bufSz; //size of each buffer
+	uint32_t head; //next buffer to write
+	uint32_t filled; //buffers read and not yet written
+	int done; //set by the reader after the last buffer
+	int stop; //set by the writer if the output failed
+	int readErr; //errno of a failed volume read, 0 if none
+	pthread_mutex_t lock;
+	pthread_cond_t cond; //signalled whenever filled, done or stop change
+};
+typedef struct xferPipe_struct xferPipe;
+
+/* Reading side of the pipeline, fills the free buffers in turn */
+static void * pipeReader(void * arg){
+
+	xferPipe * p = (xferPipe*) arg;
+	fat32Head * h = p->src->head;
+	uint64_t runOff = 0, runLeft = 0;
+	uint32_t tail = 0;
+	int readErr = 0;
+
+	for(;;){
+		pthread_mutex_lock(&p->lock);
+		while(p->filled == XFER_PIPE_BUFS && !p->stop) pthread_cond_wait(&p->cond, &p->lock);
+		int stop = p->stop;
+		pthread_mutex_unlock(&p->lock);
+
+		if(stop) break;
+
+		/* one buffer takes as many runs as fit */
+		uint64_t len = 0;
+		while(len < p->bufSz){
+			if(runLeft == 0 && !srcNext(p->src, &runOff, &runLeft)) break;
+
+			uint64_t n = (runLeft < p->bufSz - len) ? runLeft : p->bufSz - len;
+			if(tryReadVolume(h, p->bufs[tail] + len, n, runOff) != 0){
+				readErr = errno;
+				break;
+			}
+			runOff += n;
+			runLeft -= n;
+			len += n;
 		}
 
-		//deallocate byte array
-		free(str);
+		/* a failed read ends the file like its last buffer */
+		int last = len < p->bufSz || readErr != 0;
 
-		return;
+		pthread_mutex_lock(&p->lock);
+		if(len > 0){
+			p->lens[tail] = len;
+			p->filled++;
+		}
+		if(last){
+			p->readErr = readErr;
+			p->done = 1;
+		}
+		pthread_cond_signal(&p->cond);
+		pthread_mutex_unlock(&p->lock);
 
+		if(last) break;
+		tail = (tail + 1) % XFER_PIPE_BUFS;
 	}
 
-	/* Not Last Cluster, so read data in the entire current cluster */ 
-    error = read(fileDesc,(void*)str, bytesPerClus);
+	return NULL;
+}
 
-	if(error == -1){
-		perror("writefile read error");
+/* Copies the file of src to outFD with a thread reading ahead into
+   XFER_PIPE_BUFS parts of buf while the calling thread hashes and
+   writes the parts already read. Adds the bytes written to *copied.
+   Returns 0, or -1 with errno set if the volume could not be read or
+   the output failed. */
+static int copyPipelined(xferSrc * src, int outFD, char * buf, size_t bufSz, uint64_t * copied, fat32Hash * hs){
+
+	xferPipe p;
+	pthread_t reader;
+	uint32_t i;
+	int res = 0, err = 0;
+
+	memset(&p, 0, sizeof(p));
+	p.src = src;
+	p.bufSz = bufSz / XFER_PIPE_BUFS / XFER_ALIGN * XFER_ALIGN;
+	for(i = 0; i < XFER_PIPE_BUFS; i++) p.bufs[i] = buf + i * p.bufSz;
+	pthread_mutex_init(&p.lock, NULL);
+	pthread_cond_init(&p.cond, NULL);
+
+	if(pthread_create(&reader, NULL, pipeReader, &p) != 0){
+		perror("copyPipelined thread error");
 		exit(EXIT_FAILURE);
-	} 
+	}
 
-	/* write data in the current cluster */ 
-	error = write(outFD, (void*)str, bytesPerClus); 
+	for(;;){
+		pthread_mutex_lock(&p.lock);
+		while(p.filled == 0 && !p.done) pthread_cond_wait(&p.cond, &p.lock);
+		uint32_t filled = p.filled;
+		i = p.head;
+		pthread_mutex_unlock(&p.lock);
 
+		if(filled == 0) break;
 
-	if(error == -1){
-		perror("writefile write error");
-		exit(EXIT_FAILURE);
+		if(hs != NULL) hashUpdate(hs, p.bufs[i], p.lens[i]);
+
+		int failed = (outFD != -1) ? writeAll(outFD, p.bufs[i], p.lens[i]) : 0;
+		if(failed){
+			err = errno;
+			res = -1;
+		}
+		else{
+			*copied += p.lens[i];
+		}
+
+		pthread_mutex_lock(&p.lock);
+		p.head = (i + 1) % XFER_PIPE_BUFS;
+		p.filled--;
+		if(failed) p.stop = 1;
+		pthread_cond_signal(&p.cond);
+		pthread_mutex_unlock(&p.lock);
+
+		if(failed) break;
 	}
 
-	//deallocate byte array					
-	free(str);
+	pthread_join(reader, NULL);
+	pthread_mutex_destroy(&p.lock);
+	pthread_cond_destroy(&p.cond);
 
-	/* Fetch next cluster */
-	uint32_t nextClus = getNextClus(h,clusNum);
+	if(res == 0 && p.readErr != 0){
+		err = p.readErr;
+		res = -1;
+	}
+	errno = err;
+	return res;
+}
 
-	/* Recursively write the file again for the next cluster */
-	if (nextClus < EOC) { 	
-		writeFile(h, nextClus, outFD, fileSize-bytesPerClus);
+/* Returns the position of outFD if file data should be copied
+   through the asynchronous engine, or -1. The engine reads from the
+   volume file, not a mapping, and writes at offsets of the output.
+   With outFD -1 nothing is written and the position is 0. */
+static off_t asyncBase(fat32Head *h, int outFD){
+
+	if(__atomic_load_n(&xferMode, __ATOMIC_RELAXED) != XFER_ASYNC || h->map != NULL) return -1;
+	return (outFD != -1) ? lseek(outFD, 0, SEEK_CUR) : 0;
+}
+
+/* Copies the file of src to outFD, starting at position base,
+   through the calling thread's asynchronous engine. buf is cut into
+   one slot per request in flight; a slot is read from the volume,
+   then written out from the same buffer, so reads of later slots
+   overlap the writes of earlier ones. Reads may complete in any
+   order, so hs takes the slots in file order, and a slot is reused
+   once it is written and hashed. Adds the bytes written to *copied.
+   Returns 0, or -1 with errno set. */
+static int copyAsync(xferSrc * src, int outFD, off_t base, char * buf, size_t bufSz, uint64_t * copied,
+		fat32Hash * hs){
+
+	fat32Head * h = src->head;
+	fat32Aio * aio = aioThread();
+	uint32_t slots = aio->depth;
+	uint32_t freeSlots[AIO_MAX_DEPTH];
+	uint64_t slotOff[AIO_MAX_DEPTH]; //file offset of each slot
+	uint64_t slotLen[AIO_MAX_DEPTH];
+	uint8_t slotBusy[AIO_MAX_DEPTH];
+	uint8_t slotRead[AIO_MAX_DEPTH]; //read completed, write submitted
+	uint8_t slotWritten[AIO_MAX_DEPTH];
+	uint8_t slotHashed[AIO_MAX_DEPTH];
+	uint64_t volOff = 0, runLeft = 0, issued = 0, hashed = 0;
+	uint32_t numFree, i;
+	int err = 0, chainEnd = 0;
+
+	/* every slot holds at least one aligned block */
+	if(slots > bufSz / XFER_ALIGN) slots = bufSz / XFER_ALIGN;
+	size_t slotSz = bufSz / slots / XFER_ALIGN * XFER_ALIGN;
+
+	for(i = 0; i < slots; i++){
+		freeSlots[i] = i;
+		slotBusy[i] = 0;
 	}
-			
+	numFree = slots;
+
+	for(;;){
+
+		/* keep every free slot reading the next piece of the file */
+		while(err == 0 && numFree > 0 && !chainEnd){
+
+			if(runLeft == 0 && !srcNext(src, &volOff, &runLeft)){
+				chainEnd = 1;
+				break;
+			}
+
+			uint64_t len = runLeft < slotSz ? runLeft : slotSz;
+
+			uint32_t s = freeSlots[--numFree];
+			slotOff[s] = issued;
+			slotLen[s] = len;
+			slotBusy[s] = 1;
+			slotRead[s] = slotWritten[s] = slotHashed[s] = 0;
+			aioSubmit(aio, s, h->fd, 0, buf + s * slotSz, len, volOff);
+
+			volOff += len;
+			runLeft -= len;
+			issued += len;
+		}
+
+		if(numFree == slots) break;
+
+		uint32_t s = aioWait(aio);
+		fat32AioReq * req = &aio->reqs[s];
+
+		/* a short read is the end of the volume, as in readVolume */
+		if(req->err != 0 || req->done != slotLen[s]){
+			if(err == 0) err = req->err != 0 ? req->err : EIO;
+			slotRead[s] = slotWritten[s] = 1;
+		}
+		else if(!slotRead[s]){
+			slotRead[s] = 1;
+			if(outFD != -1 && err == 0) aioSubmit(aio, s, outFD, 1, buf + s * slotSz, slotLen[s], base + slotOff[s]);
+			else slotWritten[s] = 1;
+		}
+		else{
+			slotWritten[s] = 1;
+		}
+
+		/* hash every slot read that continues the data hashed so far */
+		int more = (hs != NULL);
+		while(more && err == 0){
+			more = 0;
+			for(i = 0; i < slots; i++){
+				if(slotBusy[i] && slotRead[i] && !slotHashed[i] && slotOff[i] == hashed){
+					hashUpdate(hs, buf + i * slotSz, slotLen[i]);
+					hashed += slotLen[i];
+					slotHashed[i] = 1;
+					more = 1;
+				}
+			}
+		}
+
+		for(i = 0; i < slots; i++){
+			if(slotBusy[i] && slotWritten[i] && (slotHashed[i] || hs == NULL || err != 0)){
+				slotBusy[i] = 0;
+				freeSlots[numFree++] = i;
+			}
+		}
+	}
+
+	if(err != 0){
+		errno = err;
+		return -1;
+	}
+
+	/* leave the output where sequential writes would have */
+	if(outFD != -1) lseek(outFD, base + issued, SEEK_SET);
+	*copied += issued;
+	return 0;
 }
 
-uint32_t getNextClus(fat32Head *h, uint32_t clusNum){
-	
-	uint32_t fatOffset = clusNum * OFFSET_MULTIPLIER;
-	uint32_t thisFatSecNum  = h->bs->BPB_RsvdSecCnt +  (fatOffset / h->bs->BPB_BytesPerSec);
-	uint32_t thisFatEntOffset = fatOffset % h->bs->BPB_BytesPerSec;
+/* Copies the file of src, fileSize bytes long, to outFD in the
+   current transfer mode, feeding the data to hs unless it is NULL.
+   Returns 0, or -1 with errno set if the volume could not be read or
+   the output failed. */
+static int copyFile(xferSrc * src, int outFD, uint32_t fileSize, char * buf, size_t bufSz, fat32Hash * hs){
+
+	fat32Head * h = src->head;
+	uint64_t copied = 0, offset, len;
+	off_t base = asyncBase(h, outFD);
+	int mode = __atomic_load_n(&xferMode, __ATOMIC_RELAXED);
+	int res = 0;
+
+	if(base != -1){
+		res = copyAsync(src, outFD, base, buf, bufSz, &copied, hs);
+	}
+	/* a read/write copy of more than one buffer reads ahead on a second thread,
+	   as does a hashed copy, whose data cannot stay in the kernel */
+	else if((mode == XFER_READ_WRITE || hs != NULL) && h->map == NULL && fileSize > bufSz){
+		res = copyPipelined(src, outFD, buf, bufSz, &copied, hs);
+	}
+	else{
+		while(srcNext(src, &offset, &len)){
+			if(copyExtent(h, offset, len, outFD, buf, bufSz, hs) != 0){
+				res = -1;
+				break;
+			}
+			copied += len;
+		}
+	}
+
+	if(res != 0) return -1;
+
+	if(copied < fileSize){
+		fprintf(stderr, "Warning: cluster chain ended %u bytes before the end of the file\n", (uint32_t) (fileSize - copied));
+	}
+	return 0;
+}
+
+int writeFile(fat32Head *h, uint32_t clusNum, int outFD, uint32_t fileSize){
+
+	/* first use allocates the transfer buffer */
+	if(xferBuf == NULL) xferInit(xferSize());
 
-	uint32_t * buffer = readFromOffset(fileDesc,h, thisFatSecNum, thisFatEntOffset);
-			
-	uint32_t nextClus = buffer[0];
-	nextClus = nextClus & CLUSENT_AND_OPERATOR;
-	nextClus = nextClus & FETCH_AND_OPERATOR;
-	nextClus = nextClus | (buffer[0] & CLUSENT_AND_OPERATOR);
+	return writeFileHash(h, clusNum, outFD, fileSize, xferBuf, xferBufSz, NULL);
+}
+
+int writeFileBuf(fat32Head *h, uint32_t clusNum, int outFD, uint32_t fileSize, char * buf, size_t bufSz){
+
+	return writeFileHash(h, clusNum, outFD, fileSize, buf, bufSz, NULL);
+}
+
+int writeFileHash(fat32Head *h, uint32_t clusNum, int outFD, uint32_t fileSize, char * buf, size_t bufSz,
+		fat32Hash * hs){
+
+	/* nothing to write for an empty file */  		
+	if(fileSize == 0) return 0;
+
+	uint32_t bytesPerClus = h->bs->BPB_SecPerClus * h->bs->BPB_BytesPerSec; /* cluster size in bytes */
+	uint32_t numClus = (fileSize + (uint64_t) bytesPerClus - 1) / bytesPerClus;
+
+	/* walk the chain one run of consecutive clusters at a time */
+	fat32ExtentIter it;
+	xferSrc src;
+	extentIterInit(h, &it, clusNum, numClus);
+	srcInit(&src, h, &it, NULL, 0, fileSize);
+
+	return copyFile(&src, outFD, fileSize, buf, bufSz, hs);
+}
+
+int writeExtents(fat32Head *h, const fat32Extent * ext, uint32_t numExt, int outFD, uint32_t fileSize){
+
+	return writeExtentsHash(h, ext, numExt, outFD, fileSize, NULL);
+}
+
+int writeExtentsHash(fat32Head *h, const fat32Extent * ext, uint32_t numExt, int outFD, uint32_t fileSize,
+		fat32Hash * hs){
+
+	xferSrc src;
 
-	if(buffer!= NULL) free(buffer);
+	/* first use allocates the transfer buffer */
+	if(xferBuf == NULL) xferInit(xferSize());
 
-	return nextClus;
+	srcInit(&src, h, NULL, ext, numExt, fileSize);
+	return copyFile(&src, outFD, fileSize, xferBuf, xferBufSz, hs);
 }
 
-uint32_t getFirstSectorOfClus(fat32Head *h, uint32_t clusterNumber){
+uint32_t getNextClus(fat32Head *h, uint32_t clusNum){
 	
-	uint32_t rootDirSectors = ((h->bs->BPB_RootEntCnt * INT_32) + (h->bs->BPB_BytesPerSec - 1)) / h->bs->BPB_BytesPerSec;
-	uint32_t firstDataSector = h->bs->BPB_RsvdSecCnt + (h->bs->BPB_NumFATs * h->bs->BPB_FATSz32) + rootDirSectors;
-	uint32_t firstSectorOfCluster = ((clusterNumber - 2) * h->bs->BPB_SecPerClus) + firstDataSector;
+	/* FAT entries are served from the head's FAT cache,
+	   so following a chain does not touch the volume */
+	return fatEntry(h, clusNum);
+}
+
+uint64_t getFirstSectorOfClus(fat32Head *h, uint32_t clusterNumber){
 	
-	return firstSectorOfCluster * h->bs->BPB_BytesPerSec;
+	/* the data region offset is worked out once by createHead,
+	   the result is a 64-bit byte address so volumes over 4 GiB work */
+	return clusOffset(h, clusterNumber);
 }
 
 void formatDirectory(fat32Dir* dir)
@@ -684,6 +1854,19 @@ void formatDirectory(fat32Dir* dir)
 
 }
 
+void entryName(const fat32Dir * dir, char name[FMT_NAME_LENGTH]){
+
+	/* format a padded copy, formatDirectory may write past DIR_Name */
+	struct { fat32Dir d; char pad[FMT_NAME_LENGTH]; } fmt;
+
+	memset(&fmt, 0, sizeof(fmt));
+	fmt.d = *dir;
+	formatDirectory(&fmt.d);
+
+	strncpy(name, fmt.d.DIR_Name, FMT_NAME_LENGTH - 1);
+	name[FMT_NAME_LENGTH - 1] = NULL_TERM;
+}
+
 void removeSpace(char* source, char* dest){
 	 do {
         while (isspace(*dest)) {
@@ -709,21 +1892,17 @@ void addDot(char* source, char* dest){
 uint64_t getFreeSpace(fat32Head * h){
 
 	uint32_t numFreeClus = h->fsi->FSI_Free_Count;
-	uint64_t freeSecBytes = 0;
 
-	if(numFreeClus == FREE_CLUS_UNKNOWN){
-		printf("error: free count unknown\n");
-		return freeSecBytes;
-	}
-	
-	else{
-		uint64_t totFreeSec = (uint64_t) numFreeClus* (uint64_t)h->bs->BPB_SecPerClus;
-		freeSecBytes =  totFreeSec * (uint64_t) h->bs->BPB_BytesPerSec;
-		return freeSecBytes;
+	/* FSInfo does not know, count the free entries of the FAT */
+	if(numFreeClus == FREE_CLUS_UNKNOWN || numFreeClus > dataClusters(h)){
+		numFreeClus = freeMapGet(h)->freeCount;
 	}
+
+	uint64_t totFreeSec = (uint64_t) numFreeClus* (uint64_t)h->bs->BPB_SecPerClus;
+	return totFreeSec * (uint64_t) h->bs->BPB_BytesPerSec;
 }
 
-int checkName(char s[])
+int checkName(const char s[])
 {
     unsigned char cur;
 
@@ -732,5 +1911,12 @@ int checkName(char s[])
     return *s == '\0'; 
 }
 
+int localNameOk(const char s[]){
+
+	/* a name of dots only would climb out of the folder or stay in it */
+	if(s[0] == NULL_TERM || strchr(s, '/') != NULL) return 0;
+	return s[strspn(s, DOT)] != NULL_TERM;
+}
+
 
 
@@ -13,6 +13,9 @@
 #define SHELL_H
 
 #include "fat32.h"
+#include "extent.h"
+#include "dirindex.h"
+#include "hash.h"
 
 #define BUF_SIZE 256
 #define BYTE_IN_BITS 8
@@ -49,17 +52,73 @@
 #define SINGLE_READ 1
 #define FILE_PERMISSION 0644
 
+#define MB_BYTES (1 << 20)
+#define XFER_MIN_SZ MB_BYTES
+#define XFER_MAX_SZ (16 * MB_BYTES)
+#define XFER_DEFAULT_SZ (4 * MB_BYTES)
+#define XFER_ALIGN 4096
+#define XFER_KERNEL_MAX (1 << 30)
+#define XFER_AHEAD_SZ (8 * MB_BYTES) //file data resolved and prefetched ahead of the copy
+#define XFER_AHEAD_EXTS 64 //runs resolved ahead at most
+#define XFER_HINT_MAX (2 * MB_BYTES) //longest run hinted at once, longer extents are cut
+#define XFER_HINT_MIN (256 << 10) //hints of nearby runs are merged up to this size
+#define XFER_HINT_GAP (64 << 10) //largest gap between runs merged into one hint
+#define XFER_PIPE_BUFS 3 //parts of the transfer buffer in a read/write pipeline
+
+/* GET copy modes, in fallback order */
+#define XFER_COPY_RANGE 0
+#define XFER_SENDFILE 1
+#define XFER_READ_WRITE 2
+#define XFER_ASYNC 3 //queued reads and writes through aio.h, no fallback needed
+
 #define OFFSET_MULTIPLIER 4
 
 #define NULL_TERM '\0'
+#define FMT_NAME_LENGTH 16
 #define EXT_DIST 4
 #define VALID_ASCII_START 33
 #define VALID_ASCII_END 126
 
+/* getFile results */
+#define GET_OK 0
+#define GET_NOT_FOUND -1
+#define GET_OPEN_ERR -2
+#define GET_WRITE_ERR -3
+#define GET_SHORT -4
+
+/* Shell command struct,
+   one entry of the command table. Both handlers get the raw command
+   line and return 0 on success, -1 on failure. */
+struct shellCmd_struct {
+	const char * name; //command word, matched as a prefix ignoring case
+	int (*run)(fat32Head *h, uint32_t *curDirClus, char *line); //prints text
+	int (*json)(fat32Head *h, uint32_t *curDirClus, char *line); //prints one JSON line, NULL if none
+};
+typedef struct shellCmd_struct shellCmd;
+
 /* Manages the main shell loop. Supports commands INFO,
    DIR, CD and GET. The shell loop ends only when EOF signal 
-   (CTRL + D) is received. */
-void shellLoop(int fd);
+   (CTRL + D) is received. flags are passed on to createHead. */
+void shellLoop(int fd, int flags);
+
+/* Runs a batch of commands against one opened volume without
+   prompts: the numCmds lines in cmds first, then every line of the
+   file at scriptPath, if not NULL ("-" reads stdin). Blank lines and
+   lines starting with '#' are skipped. With json set, each command
+   prints one JSON object on a line of its own. Returns the number of
+   commands that failed, or -1 if the volume or script could not be
+   opened. */
+int shellBatch(int fd, int flags, char ** cmds, int numCmds, const char * scriptPath, int json);
+
+/* Runs one command line, updating *curDirClus on CD, and prints its
+   text output, or its JSON line if json is set. Returns 0 on success,
+   -1 on failure or an unknown command. */
+int runCommand(fat32Head *h, uint32_t *curDirClus, char line[BUF_SIZE], int json);
+
+/* Returns the argument of a command line: everything after the
+   command word, without leading and trailing spaces, or NULL if
+   there is none. Cuts trailing spaces off buffer. */
+char * nameArg(char * buffer);
 
 /* Prints Device information, Geometry information and FS Info
    information for the inserted volume */
@@ -72,35 +131,174 @@ char * getVolumeID(fat32Head *h);
    contained in the current folder */ 
 void doDir(fat32Head *h, uint32_t curDirClus, int firstRun);
 
+/* Prints one line of the dir listing for an entry with the formatted
+   short name, attribute byte and size given, if the entry is listed.
+   The entry is shown under longName unless it is NULL or empty. */
+void printDirEntry(const char * name, const char * longName, uint8_t attr, uint32_t fileSize);
+
 /* Performs and manages the cd command. Switches to the directory 
    specified in the shell's command line, if the directory exists
    in the shell's current directory. */
 uint32_t doCD(fat32Head *h, uint32_t curDirClus, char buffer[BUF_SIZE]);
 
+/* Finds the directory name in the directory starting at curDirClus
+   and stores its first cluster in *newClus. Returns 1 if found, 0
+   otherwise. */
+int changeDir(fat32Head *h, uint32_t curDirClus, const char * name, uint32_t * newClus);
+
+/* Finds the file or directory at path, a '/' separated path from the
+   root whose components match long or short names ignoring case, and
+   stores its fields in ent. Returns 1 if found, 0 otherwise. */
+int resolvePath(fat32Head *h, const char * path, fat32IndexEnt * ent);
+
+/* Finds the file name in the directory starting at curDirClus and
+   copies it to the local file dest, storing the bytes written in
+   *fileSize. If digest is not NULL, it gets the digest of the data
+   copied in the algorithm selected with hashSetAlgo, or an empty
+   string if none is. Returns GET_OK, GET_SHORT if the cluster chain
+   ended before the file did, GET_NOT_FOUND, or GET_OPEN_ERR or
+   GET_WRITE_ERR with errno set. */
+int getFile(fat32Head *h, uint32_t curDirClus, const char * name, const char * dest, uint32_t * fileSize,
+		char * digest);
+
 /* Performs and manages the get command. Finds the matching file in the current
    directory with the file name specified from the command line, and downloads 
    that file to an output file of the same name in the user's current path in 
-   their terminal. Uses helper recursive function writeFile to complete the download. */
-void doDownload(fat32Head *h, uint32_t curDirClus, char buffer[BUF_SIZE]);
-
-/* Recursive read and write to output file for every cluster.
-   When last cluster is reached, it writes using the remaining
-   data in that last cluster instead of the size of the cluster.  */
-void writeFile(fat32Head *h, uint32_t clusNum, int outFD, int fileSize);
-
-/* Calculates the next cluster of the FAT, by calculating the offset, this sector 
-   number in the FAT, this fat ent offset.  */
+   their terminal. Uses helper function writeFile to complete the download.
+   Returns 0 on success, -1 on failure. */
+int doDownload(fat32Head *h, uint32_t curDirClus, char buffer[BUF_SIZE]);
+
+/* Allocates the transfer buffer used by GET, bytes long and
+   clamped to XFER_MIN_SZ..XFER_MAX_SZ. Replaces any previous buffer. */
+void xferInit(size_t bytes);
+
+/* Returns the configured transfer buffer size in bytes */
+size_t xferSize(void);
+
+/* Selects how GET copies file data: XFER_COPY_RANGE (the default),
+   XFER_SENDFILE, XFER_READ_WRITE or XFER_ASYNC. Kernel copy modes
+   fall back to the next mode when the kernel does not support them. */
+void xferSetMode(int mode);
+
+/* Performs and manages the rget command. Extracts the whole tree below
+   the current directory into the local directory named in the command
+   line, copying files on a pool of worker threads. */
+void doRecursiveGet(fat32Head *h, uint32_t curDirClus, char buffer[BUF_SIZE]);
+
+/* Performs and manages the free command. Scans the whole FAT for free
+   clusters and prints their count, cross-checked against FSInfo. */
+void doFree(fat32Head *h);
+
+/* Performs and manages the check command. Follows every chain of
+   the volume once and prints cross-links, loops, lost clusters, size
+   mismatches and differing FAT copies, then a summary. */
+void doCheck(fat32Head *h);
+
+/* Performs and manages the catalog command. Walks the whole volume on
+   several threads and prints the number of entries found. With a file
+   name on the command line, writes one line per entry to that file. */
+void doCatalog(fat32Head *h, char buffer[BUF_SIZE]);
+
+/* Performs and manages the undelete command. Lists the deleted
+   entries of the whole volume and whether their data is still there.
+   With a folder name on the command line, recovers them into it and
+   carves the free clusters no entry was given into a subfolder. */
+void doUndelete(fat32Head *h, char buffer[BUF_SIZE]);
+
+/* Performs and manages the carve command. Scans the whole data region
+   for files by their headers and footers and lists them by offset.
+   With a folder name on the command line, writes them into it. */
+void doCarve(fat32Head *h, char buffer[BUF_SIZE]);
+
+/* Hashes the file or directory name in the directory starting at
+   curDirClus in algo, reading the volume only. A directory, the
+   current one if name is NULL, is hashed with everything below it
+   on the extraction threads. Returns the malloc'd manifest, or NULL
+   if name was not found. Free with manifestFree. */
+hashManifest * hashPath(fat32Head *h, uint32_t curDirClus, const char * name, int algo);
+
+/* Performs and manages the hash command. Prints the manifest of the
+   file or directory named on the command line, or of the current
+   directory, in the algorithm selected with -H (SHA-256 by default),
+   then the throughput. Returns 0 on success, -1 on failure. */
+int doHash(fat32Head *h, uint32_t curDirClus, char buffer[BUF_SIZE]);
+
+/* Performs and manages the dedup command. Fingerprints every cluster
+   of every file of the volume, and of each image named on the command
+   line, then prints duplicate clusters and identical files across
+   them. Returns 0 on success, -1 if an image could not be opened. */
+int doDedup(fat32Head *h, char buffer[BUF_SIZE]);
+
+/* Performs and manages the put command. Copies the local file named
+   on the command line into the current directory under its own name,
+   replacing a file of that name. Returns 0 on success, -1 on failure. */
+int doPut(fat32Head *h, uint32_t curDirClus, char buffer[BUF_SIZE]);
+
+/* Performs and manages the mkdir command. Creates the empty folder
+   named on the command line in the current directory. Returns 0 on
+   success, -1 on failure. */
+int doMkdir(fat32Head *h, uint32_t curDirClus, char buffer[BUF_SIZE]);
+
+/* Performs and manages the rm command. Removes the file or empty
+   folder named on the command line from the current directory.
+   Returns 0 on success, -1 on failure. */
+int doRemove(fat32Head *h, uint32_t curDirClus, char buffer[BUF_SIZE]);
+
+/* Reads the file whose chain starts at clusNum and writes fileSize
+   bytes of it to the output file. The chain is walked one extent at
+   a time. Each run of consecutive clusters is copied kernel to kernel
+   with copy_file_range or sendfile, or else read and written with one
+   read per transfer buffer, on a second thread reading ahead of the
+   writes for files larger than the buffer. The runs coming up are
+   resolved ahead and hinted to the kernel, so the device fetches them
+   while the current one is copied. The last cluster is only written
+   up to the remaining data instead of the size of the cluster.
+   Returns 0, or -1 with errno set if writing to outFD failed. */
+int writeFile(fat32Head *h, uint32_t clusNum, int outFD, uint32_t fileSize);
+
+/* Same as writeFile, but reads through the caller's transfer buffer
+   buf of bufSz bytes instead of the shared one, so that several
+   threads can extract files at the same time. */
+int writeFileBuf(fat32Head *h, uint32_t clusNum, int outFD, uint32_t fileSize, char * buf, size_t bufSz);
+
+/* Same as writeFileBuf, but also feeds the file data to hs, unless
+   it is NULL, as it streams through the transfer buffer, so that the
+   digest costs no second read. A hashed copy never stays inside the
+   kernel and reads ahead on a second thread instead. With outFD -1
+   the file is only hashed. */
+int writeFileHash(fat32Head *h, uint32_t clusNum, int outFD, uint32_t fileSize, char * buf, size_t bufSz,
+		fat32Hash * hs);
+
+/* Writes len bytes of buf to outFD, retrying on partial writes.
+   Returns 0, or -1 with errno set if the output failed. */
+int writeAll(int outFD, const void * buf, size_t len);
+
+/* Same as writeFile, but copies the numExt extents in ext, which
+   were resolved beforehand, instead of following the chain in the FAT */
+int writeExtents(fat32Head *h, const fat32Extent * ext, uint32_t numExt, int outFD, uint32_t fileSize);
+
+/* Same as writeExtents, but also feeds the file data to hs as
+   writeFileHash does */
+int writeExtentsHash(fat32Head *h, const fat32Extent * ext, uint32_t numExt, int outFD, uint32_t fileSize,
+		fat32Hash * hs);
+
+/* Returns the next cluster in the chain after clusNum, looked up
+   in the FAT cache held by the head.  */
 uint32_t getNextClus(fat32Head *h, uint32_t clusNum);
 
 /* Calculates the location of the first cluster of the FAT, using math and 
-   variables given by the FAT32 white paper.  */
-uint32_t getFirstSectorOfClus(fat32Head *h, uint32_t clusterNumber);
+   variables given by the FAT32 white paper. Returns a 64-bit byte offset. */
+uint64_t getFirstSectorOfClus(fat32Head *h, uint32_t clusterNumber);
 
 /* remove white spaces in directory and file names,
    formats file name extensions periods (e.g., .txt), 
    and adds null terminate string of directory name. */
 void formatDirectory(fat32Dir* dir);
 
+/* Stores the name of dir as formatDirectory would format it in
+   <name>, without modifying dir */
+void entryName(const fat32Dir * dir, char name[FMT_NAME_LENGTH]);
+
 /* Removes Spaces from the string <source>, and
    stores the result in the string <dest> */
 void removeSpace(char* source, char* dest);
@@ -109,15 +307,20 @@ void removeSpace(char* source, char* dest);
    <source>, and stores the result in the string <dest> */
 void addDot(char* source, char* dest);
 
-/* Calculates the total space (in bytes) free in the volume. */
+/* Calculates the total space (in bytes) free in the volume. Uses the
+   FSInfo free count, or scans the FAT when FSInfo does not know it. */
 uint64_t getFreeSpace(fat32Head * h);
 
 /* Checks directory/file name to ensure the name is valid.
    A name is valid if the name contains alphabets, numbers, or
    is any standard keyboard character in ASCII */
-int checkName( char s[] );
+int checkName(const char s[]);
+
+/* Returns 1 if name s from the volume is safe as one component of a
+   local path: not empty, without '/', and not made only of dots. */
+int localNameOk(const char s[]);
 
 /* File descriptor to the opened volume */
-int fileDesc;
+extern int fileDesc;
 
 #endif
@@ -0,0 +1,444 @@
+/**********************************************************************
+  Module: sidecar.c
+  Author: Junseok Lee
+
+ Builds, validates and maps the persistent sidecar catalog of a
+ volume and answers directory listings and lookups from it.
+
+**********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "sidecar.h"
+#include "shell.h"
+#include "walk.h"
+#include "extract.h"
+
+/* multiplier of the cluster hash (Knuth) */
+#define SIDECAR_CLUS_HASH 2654435761u
+
+/* Path of the sidecar file, empty while the sidecar is disabled */
+static char sidecarPath[PATH_MAX] = "";
+
+/* Rounds off up to the next multiple of SIDECAR_ALIGN */
+static uint64_t alignUp(uint64_t off){
+	return (off + SIDECAR_ALIGN - 1) & ~(uint64_t) (SIDECAR_ALIGN - 1);
+}
+
+/* Updates the CRC32 crc with len bytes of buf */
+static uint32_t crc32(uint32_t crc, const void * buf, size_t len){
+
+	const unsigned char * p = (const unsigned char*) buf;
+	int k;
+
+	crc = ~crc;
+	while(len--){
+		crc ^= *p++;
+		for(k = 0; k < BYTE_IN_BITS; k++){
+			crc = (crc >> 1) ^ (CRC32_POLY & (0 - (crc & 1)));
+		}
+	}
+	return ~crc;
+}
+
+/* Fills the fields of key that identify the opened image */
+static void imageKey(fat32Head *h, sidecarHeader * key){
+
+	struct stat st;
+
+	if(fstat(h->fd, &st) == -1){
+		perror("sidecar stat error");
+		exit(EXIT_FAILURE);
+	}
+
+	memset(key, 0, sizeof(sidecarHeader));
+	memcpy(key->magic, SIDECAR_MAGIC, SIDECAR_MAGIC_LEN);
+	key->version = SIDECAR_VERSION;
+	key->volID = h->bs->BS_VolID;
+	key->checksum = crc32(crc32(0, h->bs, sizeof(fat32BS)), h->fsi, sizeof(FSInfo));
+	key->imageSize = st.st_size;
+	key->imageMtime = (int64_t) st.st_mtim.tv_sec * (int64_t) NSEC_PER_SEC + st.st_mtim.tv_nsec;
+}
+
+/* Returns 1 if count elements of elemSz bytes at off lie inside a
+   mapping of mapLen bytes */
+static int sectionValid(uint64_t off, uint64_t count, uint64_t elemSz, uint64_t mapLen){
+	return off % SIDECAR_ALIGN == 0 && off <= mapLen && count <= (mapLen - off) / elemSz;
+}
+
+/* Maps the sidecar file and checks it against key. Returns NULL if the
+   file is missing, was written for another image or is damaged. */
+static fat32Sidecar * sidecarMap(const sidecarHeader * key){
+
+	struct stat st;
+	int fd = open(sidecarPath, O_RDONLY);
+
+	if(fd == -1) return NULL;
+
+	if(fstat(fd, &st) == -1 || (uint64_t) st.st_size < sizeof(sidecarHeader)){
+		close(fd);
+		return NULL;
+	}
+
+	unsigned char * map = (unsigned char*) mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if(map == MAP_FAILED) return NULL;
+
+	const sidecarHeader * hdr = (const sidecarHeader*) map;
+	uint64_t len = st.st_size;
+
+	/* every field of the key must match, then every section must fit */
+	if(memcmp(hdr->magic, key->magic, SIDECAR_MAGIC_LEN) != 0 || hdr->version != key->version ||
+			hdr->volID != key->volID || hdr->checksum != key->checksum ||
+			hdr->imageSize != key->imageSize || hdr->imageMtime != key->imageMtime ||
+			hdr->numEnts == 0 || hdr->numBuckets == 0 || (hdr->numBuckets & (hdr->numBuckets - 1)) != 0 ||
+			!sectionValid(hdr->entsOff, hdr->numEnts, sizeof(sidecarEnt), len) ||
+			!sectionValid(hdr->extentsOff, hdr->numExtents, sizeof(fat32Extent), len) ||
+			!sectionValid(hdr->nameBucketsOff, hdr->numBuckets, sizeof(uint32_t), len) ||
+			!sectionValid(hdr->shortBucketsOff, hdr->numBuckets, sizeof(uint32_t), len) ||
+			!sectionValid(hdr->clusBucketsOff, hdr->numBuckets, sizeof(uint32_t), len) ||
+			!sectionValid(hdr->namesOff, hdr->namesLen, 1, len) ||
+			hdr->namesLen == 0 || map[hdr->namesOff + hdr->namesLen - 1] != NULL_TERM ||
+			hdr->volLabel[SIDECAR_LABEL_LEN - 1] != NULL_TERM){
+		munmap(map, len);
+		return NULL;
+	}
+
+	fat32Sidecar * sc = (fat32Sidecar*) malloc(sizeof(fat32Sidecar));
+	if(sc == NULL){
+		perror("sidecar malloc error");
+		exit(EXIT_FAILURE);
+	}
+
+	sc->map = map;
+	sc->mapLen = len;
+	sc->hdr = hdr;
+	sc->ents = (const sidecarEnt*) (map + hdr->entsOff);
+	sc->extents = (const fat32Extent*) (map + hdr->extentsOff);
+	sc->nameBuckets = (const uint32_t*) (map + hdr->nameBucketsOff);
+	sc->shortBuckets = (const uint32_t*) (map + hdr->shortBucketsOff);
+	sc->clusBuckets = (const uint32_t*) (map + hdr->clusBucketsOff);
+	sc->names = (const char*) (map + hdr->namesOff);
+	return sc;
+}
+
+/* Writes len bytes of buf at offset off of the sidecar file.
+   Returns 0 on a write error. */
+static int writeSection(FILE * out, uint64_t off, const void * buf, size_t len){
+	return fseeko(out, off, SEEK_SET) == 0 && fwrite(buf, 1, len, out) == len;
+}
+
+/* Walks the whole volume, resolves the extents of every file and
+   writes the sidecar file. The file is written under a temporary
+   name and renamed, so a reader never maps a partial file. */
+static void sidecarBuild(fat32Head *h, const sidecarHeader * key){
+
+	fat32Catalog * cat = walkTree(h, h->bs->BPB_RootClus, extractThreads());
+	uint32_t n = cat->numEnts;
+	uint32_t i, numBuckets = 1;
+	uint64_t namesLen = 0;
+
+	sidecarEnt * ents = (sidecarEnt*) calloc(n, sizeof(sidecarEnt));
+	if(ents == NULL){
+		perror("sidecar malloc error");
+		exit(EXIT_FAILURE);
+	}
+
+	for(i = 0; i < n; i++){
+		catalogEnt * c = catalogGet(cat, i);
+		namesLen += strlen(c->name) + 1;
+		if(c->shortName != c->name) namesLen += strlen(c->shortName) + 1;
+	}
+	if(namesLen > UINT32_MAX){
+		printf("Error: too many names for the sidecar\n");
+		free(ents);
+		catalogFree(cat);
+		return;
+	}
+
+	char * names = (char*) malloc(namesLen);
+	fat32Extent * extents = NULL;
+	uint32_t numExtents = 0, capExtents = 0;
+	uint64_t namePos = 0;
+
+	while(numBuckets < n * 2) numBuckets *= 2;
+
+	uint32_t * nameBuckets = (uint32_t*) malloc(numBuckets * sizeof(uint32_t));
+	uint32_t * shortBuckets = (uint32_t*) malloc(numBuckets * sizeof(uint32_t));
+	uint32_t * clusBuckets = (uint32_t*) malloc(numBuckets * sizeof(uint32_t));
+	if(names == NULL || nameBuckets == NULL || shortBuckets == NULL || clusBuckets == NULL){
+		perror("sidecar malloc error");
+		exit(EXIT_FAILURE);
+	}
+	memset(nameBuckets, 0xFF, numBuckets * sizeof(uint32_t));
+	memset(shortBuckets, 0xFF, numBuckets * sizeof(uint32_t));
+	memset(clusBuckets, 0xFF, numBuckets * sizeof(uint32_t));
+
+	for(i = 0; i < n; i++){
+		catalogEnt * c = catalogGet(cat, i);
+		size_t nameLen = strlen(c->name) + 1;
+
+		memcpy(names + namePos, c->name, nameLen);
+		ents[i].nameOff = namePos;
+		ents[i].shortOff = namePos;
+		namePos += nameLen;
+
+		if(c->shortName != c->name){
+			nameLen = strlen(c->shortName) + 1;
+			memcpy(names + namePos, c->shortName, nameLen);
+			ents[i].shortOff = namePos;
+			namePos += nameLen;
+		}
+
+		ents[i].parent = c->parent;
+		ents[i].firstClus = c->firstClus;
+		ents[i].fileSize = c->fileSize;
+		ents[i].nameNext = SIDECAR_NO_ENT;
+		ents[i].shortNext = SIDECAR_NO_ENT;
+		ents[i].clusNext = SIDECAR_NO_ENT;
+		ents[i].attr = c->attr;
+
+		/* the walker appends the children of a directory together */
+		if(i != CATALOG_ROOT){
+			if(ents[c->parent].count++ == 0) ents[c->parent].first = i;
+		}
+
+		/* files keep the extents of their chain, cut at the file size */
+		if(!(c->attr & ATTR_DIRECTORY) && c->fileSize > 0){
+			fat32ExtentIter it;
+			fat32Extent ext;
+
+			ents[i].first = numExtents;
+			extentIterInit(h, &it, c->firstClus, (c->fileSize + (uint64_t) h->bytesPerClus - 1) / h->bytesPerClus);
+
+			while(nextExtent(h, &it, &ext)){
+				if(numExtents == capExtents){
+					capExtents = capExtents ? capExtents * 2 : EXT_LIST_INIT_CAP;
+					extents = (fat32Extent*) realloc(extents, capExtents * sizeof(fat32Extent));
+					if(extents == NULL){
+						perror("sidecar realloc error");
+						exit(EXIT_FAILURE);
+					}
+				}
+				extents[numExtents++] = ext;
+				ents[i].count++;
+			}
+		}
+	}
+
+	/* chains are built back to front, so the first entry with a
+	   name is found first, as with dirLookup */
+	for(i = n - 1; i > CATALOG_ROOT; i--){
+		uint32_t b = nameHash(ents[i].parent, names + ents[i].nameOff) & (numBuckets - 1);
+		ents[i].nameNext = nameBuckets[b];
+		nameBuckets[b] = i;
+
+		if(ents[i].shortOff != ents[i].nameOff){
+			b = nameHash(ents[i].parent, names + ents[i].shortOff) & (numBuckets - 1);
+			ents[i].shortNext = shortBuckets[b];
+			shortBuckets[b] = i;
+		}
+	}
+
+	/* a directory cluster reached twice is only walked once, the
+	   entry holding its children goes in front of the others */
+	int withChildren;
+	for(withChildren = 0; withChildren <= 1; withChildren++){
+		for(i = n; i-- > 0; ){
+			if(!(ents[i].attr & ATTR_DIRECTORY) || (ents[i].count > 0) != withChildren) continue;
+
+			uint32_t b = (ents[i].firstClus * SIDECAR_CLUS_HASH) & (numBuckets - 1);
+			ents[i].clusNext = clusBuckets[b];
+			clusBuckets[b] = i;
+		}
+	}
+
+	/* sections follow the header in this order */
+	sidecarHeader hdr = *key;
+	hdr.numEnts = n;
+	hdr.numExtents = numExtents;
+	hdr.numBuckets = numBuckets;
+	hdr.entsOff = alignUp(sizeof(sidecarHeader));
+	hdr.extentsOff = alignUp(hdr.entsOff + (uint64_t) n * sizeof(sidecarEnt));
+	hdr.nameBucketsOff = alignUp(hdr.extentsOff + (uint64_t) numExtents * sizeof(fat32Extent));
+	hdr.shortBucketsOff = hdr.nameBucketsOff + (uint64_t) numBuckets * sizeof(uint32_t);
+	hdr.clusBucketsOff = hdr.shortBucketsOff + (uint64_t) numBuckets * sizeof(uint32_t);
+	hdr.namesOff = hdr.clusBucketsOff + (uint64_t) numBuckets * sizeof(uint32_t);
+	hdr.namesLen = namesLen;
+	strncpy(hdr.volLabel, getVolumeID(h), SIDECAR_LABEL_LEN - 1);
+
+	char tmpPath[PATH_MAX + sizeof(SIDECAR_TMP_SUFFIX)];
+	snprintf(tmpPath, sizeof(tmpPath), "%s%s", sidecarPath, SIDECAR_TMP_SUFFIX);
+
+	FILE * out = fopen(tmpPath, "w");
+
+	if(out == NULL){
+		perror("sidecar file error");
+	}
+	else if(!writeSection(out, 0, &hdr, sizeof(hdr)) ||
+			!writeSection(out, hdr.entsOff, ents, (size_t) n * sizeof(sidecarEnt)) ||
+			!writeSection(out, hdr.extentsOff, extents, (size_t) numExtents * sizeof(fat32Extent)) ||
+			!writeSection(out, hdr.nameBucketsOff, nameBuckets, (size_t) numBuckets * sizeof(uint32_t)) ||
+			!writeSection(out, hdr.shortBucketsOff, shortBuckets, (size_t) numBuckets * sizeof(uint32_t)) ||
+			!writeSection(out, hdr.clusBucketsOff, clusBuckets, (size_t) numBuckets * sizeof(uint32_t)) ||
+			!writeSection(out, hdr.namesOff, names, namesLen) ||
+			fclose(out) != 0){
+		perror("sidecar write error");
+		unlink(tmpPath);
+	}
+	else if(rename(tmpPath, sidecarPath) == -1){
+		perror("sidecar rename error");
+		unlink(tmpPath);
+	}
+	else{
+		printf("Sidecar: indexed %u entries, %u extents in %.3f s\n", n - 1, numExtents, cat->secs);
+	}
+
+	free(ents);
+	free(names);
+	free(extents);
+	free(nameBuckets);
+	free(shortBuckets);
+	free(clusBuckets);
+	catalogFree(cat);
+}
+
+/* Returns the entry index of the directory starting at dirClus */
+static uint32_t findDir(const fat32Sidecar * sc, uint32_t dirClus){
+
+	uint32_t i = sc->clusBuckets[(dirClus * SIDECAR_CLUS_HASH) & (sc->hdr->numBuckets - 1)];
+
+	while(i < sc->hdr->numEnts){
+		if(sc->ents[i].firstClus == dirClus && (sc->ents[i].attr & ATTR_DIRECTORY)) return i;
+		i = sc->ents[i].clusNext;
+	}
+	return SIDECAR_NO_ENT;
+}
+
+/* Returns the name at offset off of the name pool, empty if the
+   offset is damaged */
+static const char * poolName(const fat32Sidecar * sc, uint32_t off){
+	return (off < sc->hdr->namesLen) ? sc->names + off : "";
+}
+
+void sidecarSetPath(const char * imagePath){
+
+	if(snprintf(sidecarPath, sizeof(sidecarPath), "%s%s", imagePath, SIDECAR_SUFFIX) >= (int) sizeof(sidecarPath)){
+		printf("Error: sidecar path too long\n");
+		sidecarPath[0] = NULL_TERM;
+	}
+}
+
+void sidecarOpen(fat32Head *h){
+
+	sidecarHeader key;
+
+	if(sidecarPath[0] == NULL_TERM || h->sidecar != NULL) return;
+
+	imageKey(h, &key);
+
+	if((h->sidecar = sidecarMap(&key)) == NULL){
+		sidecarBuild(h, &key);
+		h->sidecar = sidecarMap(&key);
+	}
+}
+
+void sidecarClose(fat32Head *h){
+
+	if(h->sidecar == NULL) return;
+
+	munmap(h->sidecar->map, h->sidecar->mapLen);
+	free(h->sidecar);
+	h->sidecar = NULL;
+}
+
+int sidecarDir(fat32Head *h, uint32_t dirClus){
+
+	const fat32Sidecar * sc = h->sidecar;
+	uint32_t d = findDir(sc, dirClus);
+	uint32_t i;
+
+	if(d == SIDECAR_NO_ENT) return 0;
+
+	/* only subdirectories hold "." and ".." entries */
+	if(d != CATALOG_ROOT){
+		printDirEntry(DOT, NULL, ATTR_DIRECTORY, 0);
+		printDirEntry(DOTDOT, NULL, ATTR_DIRECTORY, 0);
+	}
+
+	const sidecarEnt * dir = &sc->ents[d];
+	for(i = dir->first; i - dir->first < dir->count && i < sc->hdr->numEnts; i++){
+		printDirEntry(poolName(sc, sc->ents[i].shortOff), poolName(sc, sc->ents[i].nameOff),
+				sc->ents[i].attr, sc->ents[i].fileSize);
+	}
+
+	return 1;
+}
+
+int sidecarLookup(fat32Head *h, uint32_t dirClus, const char * name, fat32IndexEnt * ent,
+		const fat32Extent ** ext, uint32_t * numExt){
+
+	const fat32Sidecar * sc = h->sidecar;
+	uint32_t d = findDir(sc, dirClus);
+	uint32_t i;
+
+	if(d == SIDECAR_NO_ENT) return 0;
+
+	memset(ent, 0, sizeof(fat32IndexEnt));
+	ent->next = DIR_INDEX_NO_ENT;
+
+	/* "." and ".." are not stored, they name d and its parent */
+	if(strcmp(name, DOT) == 0 || strcmp(name, DOTDOT) == 0){
+		if(d == CATALOG_ROOT) return 0;
+
+		i = (strcmp(name, DOT) == 0) ? d : sc->ents[d].parent;
+		if(i >= sc->hdr->numEnts) return 0;
+
+		ent->firstClus = sc->ents[i].firstClus;
+		ent->attr = ATTR_DIRECTORY;
+		return 1;
+	}
+
+	uint32_t b = nameHash(d, name) & (sc->hdr->numBuckets - 1);
+	i = sc->nameBuckets[b];
+
+	while(i < sc->hdr->numEnts){
+		if(sc->ents[i].parent == d && strcasecmp(poolName(sc, sc->ents[i].nameOff), name) == 0) break;
+		i = sc->ents[i].nameNext;
+	}
+
+	/* not a long name, try the short names */
+	if(i >= sc->hdr->numEnts){
+		i = sc->shortBuckets[b];
+
+		while(i < sc->hdr->numEnts){
+			if(sc->ents[i].parent == d && strcasecmp(poolName(sc, sc->ents[i].shortOff), name) == 0) break;
+			i = sc->ents[i].shortNext;
+		}
+	}
+
+	if(i >= sc->hdr->numEnts) return 0;
+
+	const sidecarEnt * found = &sc->ents[i];
+	ent->firstClus = found->firstClus;
+	ent->fileSize = found->fileSize;
+	ent->attr = found->attr;
+
+	if(ext != NULL){
+		int inRange = !(found->attr & ATTR_DIRECTORY) && found->first <= sc->hdr->numExtents &&
+				found->count <= sc->hdr->numExtents - found->first;
+
+		*ext = inRange ? sc->extents + found->first : NULL;
+		*numExt = inRange ? found->count : 0;
+	}
+
+	return 1;
+}
@@ -0,0 +1,117 @@
+/**********************************************************************
+  Module: sidecar.h
+  Author: Junseok Lee
+
+  Purpose: Persistent catalog of a volume, kept in a sidecar file
+  next to the image. The file is written after the first full walk
+  of the volume and mapped on later runs, so that DIR, CD and GET
+  are answered from the table of paths, attributes, sizes and
+  extents without reading the FAT or directory clusters. The file
+  is keyed on the volume ID, a checksum of the boot sector and
+  FSInfo sector and the size and modification time of the image,
+  and is rebuilt whenever any of them changes.
+
+**********************************************************************/
+#ifndef SIDECAR_H
+#define SIDECAR_H
+
+#include "fat32.h"
+#include "extent.h"
+#include "dirindex.h"
+
+/* sidecar constants */
+#define SIDECAR_MAGIC "FAT32IDX"
+#define SIDECAR_MAGIC_LEN 8
+#define SIDECAR_VERSION 2
+#define SIDECAR_SUFFIX ".idx"
+#define SIDECAR_TMP_SUFFIX ".tmp"
+#define SIDECAR_NO_ENT 0xFFFFFFFF
+#define SIDECAR_ALIGN 8
+#define SIDECAR_LABEL_LEN 16
+#define CRC32_POLY 0xEDB88320u
+
+/* Sidecar header struct,
+   first bytes of the sidecar file. Section offsets are in bytes
+   from the start of the file and aligned to SIDECAR_ALIGN. */
+struct sidecarHeader_struct {
+	char magic[SIDECAR_MAGIC_LEN]; //SIDECAR_MAGIC
+	uint32_t version; //SIDECAR_VERSION
+	uint32_t volID; //BS_VolID of the volume
+	uint32_t checksum; //CRC32 of the boot sector and FSInfo sector
+	uint32_t numEnts; //number of entries, entry 0 is the root directory
+	uint64_t imageSize; //size of the image in bytes
+	int64_t imageMtime; //modification time of the image in nanoseconds
+	uint32_t numExtents; //number of extents of all files
+	uint32_t numBuckets; //size of every lookup table, power of two
+	uint64_t entsOff; //sidecarEnt table
+	uint64_t extentsOff; //fat32Extent table
+	uint64_t nameBucketsOff; //lookup by (parent, name)
+	uint64_t shortBucketsOff; //lookup by (parent, short name)
+	uint64_t clusBucketsOff; //lookup of directories by first cluster
+	uint64_t namesOff; //pool of null terminated names
+	uint64_t namesLen;
+	char volLabel[SIDECAR_LABEL_LEN]; //name of the first root directory entry
+};
+typedef struct sidecarHeader_struct sidecarHeader;
+
+/* Sidecar entry struct,
+   one file or directory. The children of a directory are stored
+   next to each other, in the order of the directory. */
+struct sidecarEnt_struct {
+	uint32_t nameOff; //offset of the long name, or of the short name if there is none
+	uint32_t shortOff; //offset of the formatted short name
+	uint32_t parent; //entry index of the parent directory
+	uint32_t firstClus; //first cluster of the file or directory
+	uint32_t fileSize; //size of the file in bytes
+	uint32_t first; //files: first extent, directories: first child
+	uint32_t count; //files: number of extents, directories: number of children
+	uint32_t nameNext; //next entry in the same name bucket
+	uint32_t shortNext; //next entry in the same short name bucket
+	uint32_t clusNext; //next directory in the same cluster bucket
+	uint8_t attr; //attribute byte of the entry
+	uint8_t pad[3];
+};
+typedef struct sidecarEnt_struct sidecarEnt;
+
+/* Sidecar struct,
+   a mapped sidecar file and views of its sections */
+struct fat32Sidecar_struct {
+	unsigned char * map;
+	uint64_t mapLen;
+	const sidecarHeader * hdr;
+	const sidecarEnt * ents;
+	const fat32Extent * extents;
+	const uint32_t * nameBuckets;
+	const uint32_t * shortBuckets;
+	const uint32_t * clusBuckets;
+	const char * names;
+};
+typedef struct fat32Sidecar_struct fat32Sidecar;
+
+/* Enables the sidecar for the image at imagePath. The sidecar
+   file is imagePath followed by SIDECAR_SUFFIX. */
+void sidecarSetPath(const char * imagePath);
+
+/* Maps the sidecar file of the volume opened in h and attaches it
+   to the head. A missing or stale sidecar is rebuilt from a full
+   walk of the volume first. Does nothing unless sidecarSetPath
+   was called. */
+void sidecarOpen(fat32Head *h);
+
+/* Unmaps the sidecar attached to h, if any */
+void sidecarClose(fat32Head *h);
+
+/* Prints the listing of the directory starting at dirClus from the
+   sidecar, in the format of doDir. Returns 0 if the directory is
+   not in the sidecar. */
+int sidecarDir(fat32Head *h, uint32_t dirClus);
+
+/* Finds name, a long or short name matched ignoring case, in the
+   directory starting at dirClus and stores its
+   fields in ent, like dirLookup. If ext is not NULL, also stores the
+   extents of a file in *ext and their number in *numExt. Returns 1
+   if the name was found, 0 otherwise. */
+int sidecarLookup(fat32Head *h, uint32_t dirClus, const char * name, fat32IndexEnt * ent,
+		const fat32Extent ** ext, uint32_t * numExt);
+
+#endif
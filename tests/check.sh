@@ -0,0 +1,84 @@
+#!/bin/sh
+# make check: reads files stored past the 4 GiB mark of a sparse FAT32
+# image back through GET in every transfer mode, mapped, as JSON and
+# through RGET, and compares them with the copies mksparse wrote. Then
+# writes to a copy of the image with PUT, MKDIR and RM.
+# Usage: tests/check.sh [fat32 binary] [mksparse binary]
+
+fat32=$(realpath "${1:-./fat32}")
+mksparse=$(realpath "${2:-tests/mksparse}")
+dir=$(mktemp -d "${TMPDIR:-/tmp}/fat32check.XXXXXX") || exit 1
+trap 'rm -rf "$dir"' EXIT
+failed=0
+
+fail(){
+	echo "FAIL: $*"
+	failed=1
+}
+
+"$mksparse" "$dir/sparse.img" "$dir/expect" || exit 1
+img="$dir/sparse.img"
+
+# GET of every file, in each transfer mode and through the mapping
+for opts in "" "-x read" "-x sendfile" "-x uring" "-m"; do
+	rm -rf "$dir/out" && mkdir "$dir/out" && cd "$dir/out" || exit 1
+	"$fat32" $opts -c "get CROSS.BIN" -c "get TAIL.BIN" -c "cd FAR" -c "get INNER.BIN" "$img" > log 2>&1
+	for f in CROSS.BIN TAIL.BIN INNER.BIN; do
+		exp=$f
+		[ "$f" = INNER.BIN ] && exp=FAR__INNER.BIN
+		cmp -s "$f" "$dir/expect/$exp" || fail "get $f ${opts:-(default)}"
+	done
+done
+
+# the JSON get reports the whole file
+cd "$dir/out" || exit 1
+"$fat32" -J -c "get TAIL.BIN" "$img" | grep -q '"ok":true,"dest":"TAIL.BIN","size":2098152' || fail "JSON get TAIL.BIN"
+
+# RGET walks FAR, a directory past 4 GiB
+rm -rf "$dir/tree" && mkdir "$dir/tree" && cd "$dir/tree" || exit 1
+"$fat32" -c "rget ." "$img" > log 2>&1
+cmp -s CROSS.BIN "$dir/expect/CROSS.BIN" || fail "rget CROSS.BIN"
+cmp -s TAIL.BIN "$dir/expect/TAIL.BIN" || fail "rget TAIL.BIN"
+cmp -s FAR/INNER.BIN "$dir/expect/FAR__INNER.BIN" || fail "rget FAR/INNER.BIN"
+
+# the image is consistent, so nothing read above is blamed on it
+"$fat32" -c "check" "$img" | grep -q "No problems found" || fail "check"
+
+# PUT, MKDIR and RM on a copy of the image, which CHECK must find
+# consistent after every step
+wimg="$dir/write.img"
+cp --sparse=always "$img" "$wimg" || exit 1
+mkdir "$dir/src" "$dir/src2" || exit 1
+head -c 300000 /dev/urandom > "$dir/src/NEW.BIN"
+head -c 70000 /dev/urandom > "$dir/src2/NEW.BIN"
+head -c 9000 /dev/urandom > "$dir/src/a long name.txt"
+
+# runs the commands given after the label on the copy, then CHECK
+writeStep(){
+	label=$1
+	shift
+	"$fat32" "$@" "$wimg" > "$dir/write.log" 2>&1
+	"$fat32" -c "check" "$wimg" | grep -q "No problems found" || fail "check after $label"
+}
+
+writeStep "put" -c "put $dir/src/NEW.BIN"
+writeStep "mkdir" -c "mkdir SUB"
+writeStep "put into SUB" -c "cd SUB" -c "put $dir/src/a long name.txt"
+writeStep "replace" -c "put $dir/src2/NEW.BIN"
+
+rm -rf "$dir/wout" && mkdir "$dir/wout" && cd "$dir/wout" || exit 1
+"$fat32" -c "get NEW.BIN" -c "cd SUB" -c "get a long name.txt" "$wimg" > log 2>&1
+cmp -s NEW.BIN "$dir/src2/NEW.BIN" || fail "get of the replaced NEW.BIN"
+cmp -s "a long name.txt" "$dir/src/a long name.txt" || fail "get of the file put into SUB"
+
+writeStep "rm" -c "cd SUB" -c "rm a long name.txt"
+writeStep "rmdir" -c "rm SUB"
+
+rm -rf "$dir/wout" && mkdir "$dir/wout" && cd "$dir/wout" || exit 1
+"$fat32" -c "get NEW.BIN" -c "get TAIL.BIN" "$wimg" > log 2>&1
+cmp -s NEW.BIN "$dir/src2/NEW.BIN" || fail "get NEW.BIN after rm"
+cmp -s TAIL.BIN "$dir/expect/TAIL.BIN" || fail "get TAIL.BIN after the writes"
+"$fat32" -c "dir" "$wimg" | grep -q SUB && fail "SUB still listed after rm"
+
+[ $failed -eq 0 ] && echo "All checks passed."
+exit $failed
@@ -0,0 +1,222 @@
+/**********************************************************************
+  Module: mksparse.c
+  Author: Junseok Lee
+
+ Builds the sparse FAT32 image make check reads from. The volume is
+ larger than 4 GiB and only its metadata and a few files are written,
+ so it takes a few MB on disk. The files lie where 32-bit offsets
+ would break:
+
+   CROSS.BIN      starts 1 MiB below the 4 GiB mark and ends past it
+   TAIL.BIN       the last clusters of the volume, in two runs, the
+                  later run first
+   FAR/INNER.BIN  a directory and its file past 4 GiB
+
+ A copy of every file is written under the expect folder, with '/'
+ in the path replaced by "__".
+
+ Usage: mksparse <image> <expect folder>
+
+**********************************************************************/
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../fat32.h"
+
+#define SPARSE_BPS 512
+#define SPARSE_SPC 8
+#define SPARSE_RSVD 32
+#define SPARSE_FATS 2
+#define SPARSE_SECS 10485760 //5 GiB
+#define SPARSE_MARK (4ULL << 30)
+#define SPARSE_MEDIA 0xF8
+#define SPARSE_EOC 0x0FFFFFFF
+#define SPARSE_PERMS 0644
+
+/* Sparse file struct,
+   one file of the image and where its clusters are */
+struct sparseFile_struct {
+	const char * expect; //name of its copy under the expect folder
+	uint32_t size;
+	uint32_t runStart[2]; //runs of its chain, in chain order
+	uint32_t runLen[2];
+	uint32_t seed;
+};
+typedef struct sparseFile_struct sparseFile;
+
+static int imgFD;
+static uint32_t fatSecs, dataSec, numClus;
+static uint32_t * fat;
+
+static void writeAt(const void * buf, size_t len, uint64_t offset){
+
+	if(pwrite(imgFD, buf, len, (off_t) offset) != (ssize_t) len){
+		perror("mksparse write error");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static uint64_t clusOff(uint32_t clus){
+
+	return ((uint64_t) dataSec + (uint64_t) (clus - ROOT_DIR_CLUS_NUM) * SPARSE_SPC) * SPARSE_BPS;
+}
+
+/* Fills buf with len bytes of the data of the file seeded with seed,
+   starting at offset, a pattern no two clusters share */
+static void fillData(char * buf, size_t len, uint64_t offset, uint32_t seed){
+
+	size_t i;
+
+	for(i = 0; i < len; i++){
+		uint64_t x = ((offset + i) / 8 + 1) * 0x9E3779B97F4A7C15ULL ^ seed;
+		x ^= x >> 29;
+		buf[i] = (char) (x >> (((offset + i) % 8) * 8));
+	}
+}
+
+static void setEntry(fat32Dir * dir, const char name[DIR_NAME_LENGTH], uint8_t attr, uint32_t clus, uint32_t size){
+
+	memset(dir, 0, sizeof(*dir));
+	memcpy(dir->DIR_Name, name, DIR_NAME_LENGTH);
+	dir->DIR_Attr = attr;
+	dir->DIR_FstClusHI = (uint16_t) (clus >> 16);
+	dir->DIR_FstClusLO = (uint16_t) clus;
+	dir->DIR_FileSize = size;
+}
+
+/* Writes the data of f into its clusters and the image, chains them
+   and writes its copy to expect/f->expect */
+static void addFile(const sparseFile * f, const char * expect){
+
+	uint32_t clusSz = SPARSE_BPS * SPARSE_SPC, r, c, prev = 0;
+	uint64_t done = 0;
+	char * buf = (char*) malloc(clusSz);
+	char path[4096];
+
+	snprintf(path, sizeof(path), "%s/%s", expect, f->expect);
+	int outFD = open(path, O_CREAT | O_WRONLY | O_TRUNC, SPARSE_PERMS);
+	if(buf == NULL || outFD == -1){
+		perror("mksparse expect error");
+		exit(EXIT_FAILURE);
+	}
+
+	for(r = 0; r < 2; r++){
+		for(c = f->runStart[r]; c < f->runStart[r] + f->runLen[r]; c++){
+			uint32_t len = (f->size - done < clusSz) ? (uint32_t) (f->size - done) : clusSz;
+
+			memset(buf, 0, clusSz);
+			fillData(buf, len, done, f->seed);
+			writeAt(buf, clusSz, clusOff(c));
+			if(write(outFD, buf, len) != (ssize_t) len){
+				perror("mksparse expect error");
+				exit(EXIT_FAILURE);
+			}
+
+			if(prev != 0) fat[prev] = c;
+			prev = c;
+			done += len;
+		}
+	}
+	fat[prev] = SPARSE_EOC;
+
+	close(outFD);
+	free(buf);
+}
+
+int main(int argc, char *argv[]){
+
+	if(argc != 3){
+		printf("Usage: %s <image> <expect folder>\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	imgFD = open(argv[1], O_CREAT | O_RDWR | O_TRUNC, SPARSE_PERMS);
+	if(imgFD == -1 || ftruncate(imgFD, (off_t) SPARSE_SECS * SPARSE_BPS) != 0 || mkdir(argv[2], 0755) != 0){
+		perror("mksparse error");
+		exit(EXIT_FAILURE);
+	}
+
+	/* the FAT covers every cluster the rest of the volume holds */
+	fatSecs = ((SPARSE_SECS - SPARSE_RSVD) / SPARSE_SPC + ROOT_DIR_CLUS_NUM) * FAT_ENT_SZ / SPARSE_BPS + 1;
+	dataSec = SPARSE_RSVD + SPARSE_FATS * fatSecs;
+	numClus = (SPARSE_SECS - dataSec) / SPARSE_SPC;
+	fat = (uint32_t*) calloc((size_t) fatSecs * SPARSE_BPS / FAT_ENT_SZ, FAT_ENT_SZ);
+	if(fat == NULL){
+		perror("mksparse malloc error");
+		exit(EXIT_FAILURE);
+	}
+
+	uint32_t last = numClus + 1;
+	uint32_t markClus = (uint32_t) ((SPARSE_MARK / SPARSE_BPS - dataSec) / SPARSE_SPC) + ROOT_DIR_CLUS_NUM;
+	uint32_t farDir = last - 1000;
+
+	sparseFile files[] = {
+		{ "CROSS.BIN", (3 << 20) - 7, { markClus - 256, 0 }, { 768, 0 }, 1 },
+		{ "TAIL.BIN", (2 << 20) + 1000, { last - 256, last - 600 }, { 257, 256 }, 2 },
+		{ "FAR__INNER.BIN", 5000, { last - 900, 0 }, { 2, 0 }, 3 },
+	};
+
+	fat[0] = 0x0FFFFF00 | SPARSE_MEDIA;
+	fat[1] = SPARSE_EOC;
+	fat[ROOT_DIR_CLUS_NUM] = SPARSE_EOC;
+	fat[farDir] = SPARSE_EOC;
+	for(size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) addFile(&files[i], argv[2]);
+
+	/* the root and FAR, each one cluster */
+	fat32Dir root[4], far[3];
+	setEntry(&root[0], "SPARSE     ", ATTR_VOLUME_ID, 0, 0);
+	setEntry(&root[1], "CROSS   BIN", ATTR_ARCHIVE, files[0].runStart[0], files[0].size);
+	setEntry(&root[2], "TAIL    BIN", ATTR_ARCHIVE, files[1].runStart[0], files[1].size);
+	setEntry(&root[3], "FAR        ", ATTR_DIRECTORY, farDir, 0);
+	setEntry(&far[0], ".          ", ATTR_DIRECTORY, farDir, 0);
+	setEntry(&far[1], "..         ", ATTR_DIRECTORY, 0, 0);
+	setEntry(&far[2], "INNER   BIN", ATTR_ARCHIVE, files[2].runStart[0], files[2].size);
+	writeAt(root, sizeof(root), clusOff(ROOT_DIR_CLUS_NUM));
+	writeAt(far, sizeof(far), clusOff(farDir));
+
+	uint32_t used = 0;
+	for(uint32_t c = ROOT_DIR_CLUS_NUM; c <= last; c++) used += fat[c] != 0;
+	for(uint32_t k = 0; k < SPARSE_FATS; k++){
+		writeAt(fat, (size_t) fatSecs * SPARSE_BPS, ((uint64_t) SPARSE_RSVD + (uint64_t) k * fatSecs) * SPARSE_BPS);
+	}
+
+	fat32BS bs;
+	memset(&bs, 0, sizeof(bs));
+	memcpy(bs.BS_jmpBoot, "\xEB\x58\x90", sizeof(bs.BS_jmpBoot));
+	memcpy(bs.BS_OEMName, "MKSPARSE", BS_OEMName_LENGTH);
+	bs.BPB_BytesPerSec = SPARSE_BPS;
+	bs.BPB_SecPerClus = SPARSE_SPC;
+	bs.BPB_RsvdSecCnt = SPARSE_RSVD;
+	bs.BPB_NumFATs = SPARSE_FATS;
+	bs.BPB_Media = SPARSE_MEDIA;
+	bs.BPB_TotSec32 = SPARSE_SECS;
+	bs.BPB_FATSz32 = fatSecs;
+	bs.BPB_RootClus = ROOT_DIR_CLUS_NUM;
+	bs.BPB_FSInfo = 1;
+	bs.BPB_BkBootSec = 6;
+	bs.BS_BootSig = BS_Ext_BOOT_SIG;
+	memcpy(bs.BS_VolLab, "SPARSE     ", BS_VolLab_LENGTH);
+	memcpy(bs.BS_FilSysType, "FAT32   ", BS_FilSysType_LENGTH);
+	bs.BS_SigA = BS_SIG_A_VAL;
+	bs.BS_SigB = BS_SIG_B_VAL;
+	writeAt(&bs, sizeof(bs), 0);
+	writeAt(&bs, sizeof(bs), (uint64_t) bs.BPB_BkBootSec * SPARSE_BPS);
+
+	FSInfo fsi;
+	memset(&fsi, 0, sizeof(fsi));
+	fsi.FSI_LeadSig = FSI_LEADSIG;
+	fsi.FSI_StrucSig = 0x61417272;
+	fsi.FSI_Free_Count = numClus - used;
+	fsi.FSI_Nxt_Free = ROOT_DIR_CLUS_NUM + 1;
+	fsi.FSI_TrailSig = FSI_TRAILSIG;
+	writeAt(&fsi, sizeof(fsi), SPARSE_BPS);
+
+	close(imgFD);
+	free(fat);
+	return 0;
+}
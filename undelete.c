@@ -0,0 +1,680 @@
+/**********************************************************************
+  Module: undelete.c
+  Author: Junseok Lee
+
+ Recovery of deleted files, built on the catalog walk, the free map
+ and ranged reads of the directory clusters.
+
+**********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "undelete.h"
+#include "shell.h"
+#include "walk.h"
+#include "freemap.h"
+#include "extract.h"
+
+#define BIT_TEST(bits, c) (((bits)[(c) / FREE_ENTS_PER_BYTE] >> ((c) % FREE_ENTS_PER_BYTE)) & 1)
+#define BIT_SET(bits, c) ((bits)[(c) / FREE_ENTS_PER_BYTE] |= 1 << ((c) % FREE_ENTS_PER_BYTE))
+
+/* Directory cluster struct,
+   one cluster to read and the catalog entry of its directory */
+struct undelDirClus_struct {
+	uint32_t clus;
+	uint32_t dirIdx;
+};
+typedef struct undelDirClus_struct undelDirClus;
+
+/* Signature struct,
+   the first bytes of files with a given extension */
+struct undelSig_struct {
+	const char * ext;
+	uint8_t offset; //position of the magic bytes in the file
+	uint8_t len;
+	const char * magic;
+};
+typedef struct undelSig_struct undelSig;
+
+static const undelSig sigs[] = {
+	{ "JPG", 0, 3, "\xFF\xD8\xFF" },
+	{ "JPEG", 0, 3, "\xFF\xD8\xFF" },
+	{ "PNG", 0, 4, "\x89PNG" },
+	{ "GIF", 0, 4, "GIF8" },
+	{ "PDF", 0, 4, "%PDF" },
+	{ "ZIP", 0, 4, "PK\x03\x04" },
+	{ "DOCX", 0, 4, "PK\x03\x04" },
+	{ "XLSX", 0, 4, "PK\x03\x04" },
+	{ "PPTX", 0, 4, "PK\x03\x04" },
+	{ "MP4", 4, 4, "ftyp" },
+	{ "MOV", 4, 4, "ftyp" },
+	{ "BMP", 0, 2, "BM" },
+	{ "GZ", 0, 2, "\x1F\x8B" },
+};
+
+/* first characters tried for a deleted short name, after the long name's */
+static const char firstChars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_$%'-@~`!(){}^#&";
+
+static const char * statusNames[] = { "empty", "contiguous", "fragmented", "overwritten" };
+
+/* Scan worker struct,
+   one range of directory clusters and the entries found in it */
+struct undelWorker_struct {
+	fat32Head * head;
+	fat32Catalog * cat;
+	const undelDirClus * clus; //clusters of the range, sorted
+	uint32_t numClus;
+	fat32Undel list; //deleted entries found, only ents and numEnts are used
+	uint64_t bytesRead;
+};
+typedef struct undelWorker_struct undelWorker;
+
+/* Appends an entry to list, growing it as needed */
+static undelEnt * addEnt(fat32Undel * list){
+
+	if(list->numEnts == list->cap){
+		list->cap = list->cap ? list->cap * 2 : UNDEL_ENTS_INIT;
+		list->ents = (undelEnt*) realloc(list->ents, list->cap * sizeof(undelEnt));
+		if(list->ents == NULL){
+			perror("undelete malloc error");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	undelEnt * ent = &list->ents[list->numEnts++];
+	memset(ent, 0, sizeof(*ent));
+	return ent;
+}
+
+/* Recovers the name of the short entry dir. The numSlots long name
+   slots in front of it, in the order they are stored, give the long
+   name. If the entry is deleted its first character was overwritten
+   by the deletion mark, the checksum in the slots tells which one it
+   was. Stores the long name or the short name in name. */
+static void recoverName(const fat32Dir * dir, int deleted, const fat32LongDir ** slots, uint32_t numSlots,
+		char name[LFN_NAME_SZ]){
+
+	uint16_t chars[LFN_MAX_SLOTS * LFN_SLOT_CHARS];
+	char shortName[DIR_NAME_LENGTH];
+	uint32_t i, k = 0;
+
+	memcpy(shortName, dir->DIR_Name, DIR_NAME_LENGTH);
+	name[0] = NULL_TERM;
+
+	/* only the slots next to the entry with the same checksum belong
+	   to it, the rest are left over from older entries */
+	while(k < numSlots && slots[numSlots - 1 - k]->LDIR_Chksum == slots[numSlots - 1]->LDIR_Chksum) k++;
+
+	if(k > 0){
+		/* the slot next to the entry holds the first characters */
+		for(i = 0; i < k; i++){
+			const fat32LongDir * slot = slots[numSlots - 1 - i];
+			uint16_t * c = chars + i * LFN_SLOT_CHARS;
+
+			memcpy(c, slot->LDIR_Name1, sizeof(slot->LDIR_Name1));
+			c += sizeof(slot->LDIR_Name1) / sizeof(uint16_t);
+			memcpy(c, slot->LDIR_Name2, sizeof(slot->LDIR_Name2));
+			c += sizeof(slot->LDIR_Name2) / sizeof(uint16_t);
+			memcpy(c, slot->LDIR_Name3, sizeof(slot->LDIR_Name3));
+		}
+		lfnDecode(chars, (size_t) k * LFN_SLOT_CHARS, name);
+	}
+
+	/* the checksum fixes the lost character, try the long name's first */
+	int found = !deleted;
+	if(k > 0){
+		uint8_t sum = slots[numSlots - 1]->LDIR_Chksum;
+
+		if(deleted) shortName[0] = toupper((unsigned char) name[0]);
+		found = (!deleted || name[0] != NULL_TERM) && shortNameChecksum(shortName) == sum;
+
+		for(i = 0; deleted && !found && firstChars[i] != NULL_TERM; i++){
+			shortName[0] = firstChars[i];
+			found = shortNameChecksum(shortName) == sum;
+		}
+		if(!found) name[0] = NULL_TERM;
+	}
+	if(!found && deleted) shortName[0] = '_';
+
+	if(name[0] == NULL_TERM){
+		fat32Dir fixed = *dir;
+		memcpy(fixed.DIR_Name, shortName, DIR_NAME_LENGTH);
+		entryName(&fixed, name);
+	}
+}
+
+/* Adds the short entry dir, found in directory cluster clus, to list
+   under parentPath */
+static void addDeleted(fat32Undel * list, const fat32Dir * dir, int deleted, uint32_t clus,
+		const char * parentPath, const fat32LongDir ** slots, uint32_t numSlots){
+
+	char name[LFN_NAME_SZ];
+	char path[PATH_MAX];
+
+	if((dir->DIR_Attr & ~ATTR_VALID_MASK) || (dir->DIR_Attr & ATTR_VOLUME_ID)) return;
+
+	recoverName(dir, deleted, slots, numSlots, name);
+
+	if(strcmp(name, DOT) == 0 || strcmp(name, DOTDOT) == 0 || strchr(name, '/') != NULL) return;
+
+	/* short names made of garbage are not entries */
+	if(numSlots == 0 && !checkName(name)) return;
+
+	if(snprintf(path, sizeof(path), "%s/%s", parentPath, name) >= (int) sizeof(path)) return;
+
+	undelEnt * ent = addEnt(list);
+	if((ent->path = strdup(path)) == NULL){
+		perror("undelete malloc error");
+		exit(EXIT_FAILURE);
+	}
+	ent->firstClus = ((uint32_t) dir->DIR_FstClusHI << HEX_TEN) | dir->DIR_FstClusLO;
+	ent->fileSize = (dir->DIR_Attr & ATTR_DIRECTORY) ? 0 : dir->DIR_FileSize;
+	ent->dirClus = clus;
+	ent->attr = dir->DIR_Attr;
+}
+
+/* Collects the deleted entries of one directory cluster held in buf,
+   and with live set the other entries too, for the clusters of a
+   deleted directory. Returns 1 if the cluster holds the end of
+   directory mark. Long names are only recovered within the cluster,
+   an entry whose slots start in the cluster before gets its short
+   name. */
+static int parseClus(fat32Head *h, fat32Undel * list, const unsigned char * buf, uint32_t clus,
+		const char * parentPath, int live){
+
+	const fat32LongDir * slots[LFN_MAX_SLOTS];
+	uint32_t numSlots = 0;
+	int slotsDeleted = 0;
+	uint32_t i, numEnts = h->bytesPerClus / sizeof(fat32Dir);
+
+	for(i = 0; i < numEnts; i++){
+
+		const fat32Dir * dir = (const fat32Dir*) (buf + i * sizeof(fat32Dir));
+		unsigned char first = (unsigned char) dir->DIR_Name[0];
+		int deleted = (first == FREE_DIR);
+
+		if(first == ADDR_ZERO) return 1;
+
+		if((!deleted && !live) || first == '.'){
+			numSlots = 0;
+			continue;
+		}
+
+		/* the slots of one name are all deleted or all live */
+		if(deleted != slotsDeleted) numSlots = 0;
+		slotsDeleted = deleted;
+
+		if(dir->DIR_Attr == INV_DIR){
+			/* keep the last LFN_MAX_SLOTS slots of a longer run */
+			if(numSlots == LFN_MAX_SLOTS){
+				memmove(slots, slots + 1, (LFN_MAX_SLOTS - 1) * sizeof(slots[0]));
+				numSlots--;
+			}
+			slots[numSlots++] = (const fat32LongDir*) dir;
+			continue;
+		}
+
+		addDeleted(list, dir, deleted, clus, parentPath, slots, numSlots);
+		numSlots = 0;
+	}
+	return 0;
+}
+
+/* Scan worker thread, reads its range of directory clusters in
+   runs of nearby clusters and parses each cluster */
+static void * scanWorker(void * arg){
+
+	undelWorker * w = (undelWorker*) arg;
+	fat32Head * h = w->head;
+	uint32_t bpc = h->bytesPerClus;
+	uint32_t maxClus = UNDEL_READ_MAX / bpc;
+	uint32_t gapClus = UNDEL_READ_GAP / bpc;
+	unsigned char * buf = NULL;
+	char parentPath[PATH_MAX];
+	uint32_t pathIdx = CATALOG_NO_ENT;
+	uint32_t i, j, k;
+
+	if(maxClus < 1) maxClus = 1;
+
+	if(h->map == NULL && posix_memalign((void**) &buf, XFER_ALIGN, (size_t) maxClus * bpc) != 0){
+		perror("undeleteScan malloc error");
+		exit(EXIT_FAILURE);
+	}
+
+	for(i = 0; i < w->numClus; i = j){
+
+		/* the run ends at a wide gap or at the size of one read */
+		uint32_t first = w->clus[i].clus;
+		for(j = i + 1; j < w->numClus; j++){
+			if(w->clus[j].clus - w->clus[j - 1].clus > gapClus + 1 || w->clus[j].clus - first >= maxClus) break;
+		}
+
+		uint64_t len = (uint64_t) (w->clus[j - 1].clus - first + 1) * bpc;
+		const unsigned char * run = (const unsigned char*) mapView(h, clusOffset(h, first), len);
+		if(run == NULL){
+			readVolume(h, buf, len, clusOffset(h, first));
+			run = buf;
+		}
+		w->bytesRead += len;
+
+		for(k = i; k < j; k++){
+			if(w->clus[k].dirIdx != pathIdx){
+				pathIdx = w->clus[k].dirIdx;
+				if(pathIdx == CATALOG_ROOT) parentPath[0] = NULL_TERM;
+				else if(catalogPath(w->cat, pathIdx, parentPath, sizeof(parentPath)) != 0) strcpy(parentPath, "/(path too long)");
+			}
+			parseClus(h, &w->list, run + (uint64_t) (w->clus[k].clus - first) * bpc, w->clus[k].clus, parentPath, 0);
+		}
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static int compareDirClus(const void * a, const void * b){
+
+	uint32_t x = ((const undelDirClus*) a)->clus;
+	uint32_t y = ((const undelDirClus*) b)->clus;
+	return (x > y) - (x < y);
+}
+
+/* Returns the malloc'd, sorted list of every cluster of every directory
+   in cat, marking them in seen. Stores the count in *numClus. */
+static undelDirClus * dirClusters(fat32Head *h, fat32Catalog * cat, uint8_t * seen, uint32_t lastClus,
+		uint32_t * numClus){
+
+	uint32_t cap = UNDEL_ENTS_INIT, n = 0, i;
+	undelDirClus * list = (undelDirClus*) malloc(cap * sizeof(undelDirClus));
+
+	if(list == NULL){
+		perror("undeleteScan malloc error");
+		exit(EXIT_FAILURE);
+	}
+
+	for(i = CATALOG_ROOT; i < cat->numEnts; i++){
+
+		catalogEnt * ent = catalogGet(cat, i);
+		uint32_t clus = (i == CATALOG_ROOT) ? h->bs->BPB_RootClus : ent->firstClus;
+
+		if(i != CATALOG_ROOT && !(ent->attr & ATTR_DIRECTORY)) continue;
+
+		/* the seen bits also end chains that loop or cross */
+		while(clus >= ROOT_DIR_CLUS_NUM && clus <= lastClus && !BIT_TEST(seen, clus)){
+			BIT_SET(seen, clus);
+
+			if(n == cap){
+				cap *= 2;
+				list = (undelDirClus*) realloc(list, cap * sizeof(undelDirClus));
+				if(list == NULL){
+					perror("undeleteScan malloc error");
+					exit(EXIT_FAILURE);
+				}
+			}
+			list[n].clus = clus;
+			list[n].dirIdx = i;
+			n++;
+
+			clus = getNextClus(h, clus);
+		}
+	}
+
+	qsort(list, n, sizeof(undelDirClus), compareDirClus);
+	*numClus = n;
+	return list;
+}
+
+/* Checks the first bytes of a recovered file against the signature
+   of its extension */
+static uint8_t checkSignature(fat32Head *h, const undelEnt * ent){
+
+	unsigned char head[UNDEL_SIG_MAX * 2];
+	const char * ext = strrchr(ent->path, '.');
+	size_t i;
+
+	if(ext == NULL || ent->ext == NULL) return UNDEL_SIG_NONE;
+
+	for(i = 0; i < sizeof(sigs) / sizeof(sigs[0]); i++){
+
+		const undelSig * s = &sigs[i];
+		if(strcasecmp(ext + 1, s->ext) != 0) continue;
+
+		if((uint32_t) s->offset + s->len > ent->fileSize) return UNDEL_SIG_MISMATCH;
+
+		readVolume(h, head, s->offset + s->len, clusOffset(h, ent->ext[0].startClus));
+		return memcmp(head + s->offset, s->magic, s->len) == 0 ? UNDEL_SIG_MATCH : UNDEL_SIG_MISMATCH;
+	}
+	return UNDEL_SIG_NONE;
+}
+
+/* Guesses the clusters of the deleted file ent: the clusters from the
+   first one on that are free and not claimed by another deleted file,
+   skipping at most UNDEL_MAX_SKIP clusters in use. Claims the clusters
+   found and sets the status of ent. */
+static void guessClusters(fat32Head *h, const fat32FreeMap * map, uint8_t * claimed, uint32_t lastClus,
+		undelEnt * ent){
+
+	uint32_t need = (uint32_t) (((uint64_t) ent->fileSize + h->bytesPerClus - 1) / h->bytesPerClus);
+	uint32_t clus = ent->firstClus, skipped = 0, numExt = 0, cap = 0, i;
+	fat32Extent * ext = NULL;
+
+	if(need == 0){
+		ent->status = UNDEL_EMPTY;
+		return;
+	}
+
+	ent->status = UNDEL_OVERWRITTEN;
+	if(clus < ROOT_DIR_CLUS_NUM || clus > lastClus || !FREE_MAP_TEST(map, clus) || BIT_TEST(claimed, clus)) return;
+
+	while(need > 0){
+
+		if(clus > lastClus){
+			free(ext);
+			return;
+		}
+
+		if(!FREE_MAP_TEST(map, clus) || BIT_TEST(claimed, clus)){
+			if(++skipped > UNDEL_MAX_SKIP){
+				free(ext);
+				return;
+			}
+			clus++;
+			continue;
+		}
+
+		if(numExt > 0 && ext[numExt - 1].startClus + ext[numExt - 1].numClus == clus){
+			ext[numExt - 1].numClus++;
+		}
+		else{
+			if(numExt == cap){
+				cap = cap ? cap * 2 : 4;
+				ext = (fat32Extent*) realloc(ext, cap * sizeof(fat32Extent));
+				if(ext == NULL){
+					perror("undeleteScan malloc error");
+					exit(EXIT_FAILURE);
+				}
+			}
+			ext[numExt].startClus = clus;
+			ext[numExt].numClus = 1;
+			numExt++;
+		}
+		need--;
+		clus++;
+	}
+
+	for(i = 0; i < numExt; i++){
+		for(clus = ext[i].startClus; clus < ext[i].startClus + ext[i].numClus; clus++) BIT_SET(claimed, clus);
+	}
+
+	ent->ext = ext;
+	ent->numExt = numExt;
+	ent->status = (skipped == 0) ? UNDEL_CONTIG : UNDEL_FRAG;
+}
+
+/* Searches the deleted directory u->ents[i] if its first cluster is
+   still free and starts with its "." entry. Follows the free
+   clusters after it, up to the end of directory mark, and adds their
+   deleted and live entries to u. */
+static void searchDeletedDir(fat32Head *h, fat32Undel * u, uint32_t i, const fat32FreeMap * map,
+		uint8_t * claimed, uint8_t * seen, uint32_t lastClus, unsigned char * buf){
+
+	uint32_t clus = u->ents[i].firstClus, numClus = 0;
+	const fat32Dir * dot = (const fat32Dir*) buf;
+	char parentPath[PATH_MAX];
+
+	u->ents[i].status = UNDEL_OVERWRITTEN;
+	if(clus < ROOT_DIR_CLUS_NUM || clus > lastClus || !FREE_MAP_TEST(map, clus) || BIT_TEST(seen, clus)) return;
+
+	readVolume(h, buf, h->bytesPerClus, clusOffset(h, clus));
+	if(memcmp(dot->DIR_Name, ".          ", DIR_NAME_LENGTH) != 0 || !(dot->DIR_Attr & ATTR_DIRECTORY) ||
+			(((uint32_t) dot->DIR_FstClusHI << HEX_TEN) | dot->DIR_FstClusLO) != clus){
+		return;
+	}
+
+	u->ents[i].status = UNDEL_CONTIG;
+	strcpy(parentPath, u->ents[i].path);
+
+	for(;;){
+		BIT_SET(seen, clus);
+		BIT_SET(claimed, clus);
+		numClus++;
+		u->numDirClus++;
+		u->bytesRead += h->bytesPerClus;
+
+		/* the files of a deleted directory are not marked deleted
+		   themselves, they are lost with it all the same */
+		int end = parseClus(h, u, buf, clus, parentPath, 1);
+
+		if(end || numClus == UNDEL_DIR_MAX_CLUS) break;
+
+		clus++;
+		if(clus > lastClus || !FREE_MAP_TEST(map, clus) || BIT_TEST(seen, clus)) break;
+		readVolume(h, buf, h->bytesPerClus, clusOffset(h, clus));
+	}
+
+	u->ents[i].ext = (fat32Extent*) malloc(sizeof(fat32Extent));
+	if(u->ents[i].ext == NULL){
+		perror("undeleteScan malloc error");
+		exit(EXIT_FAILURE);
+	}
+	u->ents[i].ext->startClus = u->ents[i].firstClus;
+	u->ents[i].ext->numClus = numClus;
+	u->ents[i].numExt = 1;
+}
+
+fat32Undel * undeleteScan(fat32Head *h, int numThreads){
+
+	struct timespec start, end;
+	pthread_t threads[RGET_MAX_THREADS];
+	undelWorker workers[RGET_MAX_THREADS];
+	uint32_t numClus, i;
+	int t;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	const fat32FreeMap * map = freeMapRescan(h);
+	uint32_t lastClus = map->numClus + ROOT_DIR_CLUS_NUM - 1;
+	if(lastClus >= h->fatNumEnts) lastClus = h->fatNumEnts - 1;
+
+	fat32Undel * u = (fat32Undel*) calloc(1, sizeof(fat32Undel));
+	uint8_t * seen = (uint8_t*) calloc(lastClus / FREE_ENTS_PER_BYTE + 1, 1);
+	uint8_t * claimed = (uint8_t*) calloc(lastClus / FREE_ENTS_PER_BYTE + 1, 1);
+	unsigned char * buf = (unsigned char*) malloc(h->bytesPerClus);
+	if(u == NULL || seen == NULL || claimed == NULL || buf == NULL){
+		perror("undeleteScan malloc error");
+		exit(EXIT_FAILURE);
+	}
+	u->claimed = claimed;
+	u->lastClus = lastClus;
+
+	fat32Catalog * cat = walkTree(h, h->bs->BPB_RootClus, numThreads);
+	undelDirClus * dirClus = dirClusters(h, cat, seen, lastClus, &numClus);
+
+	if(numThreads < 1) numThreads = 1;
+	if(numThreads > RGET_MAX_THREADS) numThreads = RGET_MAX_THREADS;
+	if((uint32_t) numThreads > numClus) numThreads = numClus > 0 ? (int) numClus : 1;
+
+	/* equal shares of the sorted clusters, so each thread reads
+	   one range of the volume front to back */
+	for(t = 0; t < numThreads; t++){
+		uint32_t lo = (uint32_t) ((uint64_t) numClus * t / numThreads);
+		uint32_t hi = (uint32_t) ((uint64_t) numClus * (t + 1) / numThreads);
+
+		memset(&workers[t], 0, sizeof(workers[t]));
+		workers[t].head = h;
+		workers[t].cat = cat;
+		workers[t].clus = dirClus + lo;
+		workers[t].numClus = hi - lo;
+
+		if(pthread_create(&threads[t], NULL, scanWorker, &workers[t]) != 0){
+			perror("undeleteScan thread error");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* entries stay in cluster order, the order they are claimed in */
+	for(t = 0; t < numThreads; t++){
+		pthread_join(threads[t], NULL);
+
+		for(i = 0; i < workers[t].list.numEnts; i++) *addEnt(u) = workers[t].list.ents[i];
+		free(workers[t].list.ents);
+		u->bytesRead += workers[t].bytesRead;
+	}
+	u->numDirClus = numClus;
+	u->numThreads = numThreads;
+
+	/* entries found in deleted directories are appended as the
+	   directories are searched, and searched in turn */
+	for(i = 0; i < u->numEnts; i++){
+		if(u->ents[i].attr & ATTR_DIRECTORY){
+			searchDeletedDir(h, u, i, map, claimed, seen, lastClus, buf);
+		}
+		else{
+			guessClusters(h, map, claimed, lastClus, &u->ents[i]);
+			u->ents[i].sig = checkSignature(h, &u->ents[i]);
+		}
+		u->counts[u->ents[i].status]++;
+	}
+
+	catalogFree(cat);
+	free(dirClus);
+	free(seen);
+	free(buf);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	u->secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / NSEC_PER_SEC;
+	return u;
+}
+
+/* Returns 1 if every component of path, which starts with '/', is
+   safe as a local name. Parent paths come from the live tree, whose
+   names are not checked when it is walked. */
+static int safePath(const char * path){
+
+	char comp[PATH_MAX];
+
+	while(*path == '/'){
+		size_t len = strcspn(path + 1, "/");
+		if(len >= sizeof(comp)) return 0;
+
+		memcpy(comp, path + 1, len);
+		comp[len] = NULL_TERM;
+		if(!localNameOk(comp)) return 0;
+		path += len + 1;
+	}
+	return *path == NULL_TERM;
+}
+
+/* Creates every directory of path below dest, path starting with '/' */
+static int makeParents(const char * dest, const char * path){
+
+	char local[PATH_MAX];
+	char * p;
+
+	if(snprintf(local, sizeof(local), "%s%s", dest, path) >= (int) sizeof(local)) return -1;
+
+	for(p = local + strlen(dest) + 1; (p = strchr(p, '/')) != NULL; p++){
+		*p = NULL_TERM;
+		if(mkdir(local, DIR_PERMISSION) == -1 && errno != EEXIST) return -1;
+		*p = '/';
+	}
+	return 0;
+}
+
+int undeleteExtract(fat32Head *h, const fat32Undel * u, const char * dest){
+
+	char local[PATH_MAX];
+	uint32_t i;
+	int numFiles = 0;
+
+	if(mkdir(dest, DIR_PERMISSION) == -1 && errno != EEXIST){
+		perror("undeleteExtract mkdir error");
+		return -1;
+	}
+
+	for(i = 0; i < u->numEnts; i++){
+
+		const undelEnt * ent = &u->ents[i];
+
+		if(ent->status == UNDEL_OVERWRITTEN) continue;
+		if(!safePath(ent->path)){
+			fprintf(stderr, "%s: unsafe name in the path, skipped\n", ent->path);
+			continue;
+		}
+		if(snprintf(local, sizeof(local), "%s%s", dest, ent->path) >= (int) sizeof(local) ||
+				makeParents(dest, ent->path) != 0){
+			fprintf(stderr, "%s: could not create its directory\n", ent->path);
+			continue;
+		}
+
+		if(ent->attr & ATTR_DIRECTORY){
+			if(mkdir(local, DIR_PERMISSION) == -1 && errno != EEXIST) fprintf(stderr, "%s: %s\n", local, strerror(errno));
+			continue;
+		}
+
+		/* the same name deleted twice, keep both */
+		int outFD = open(local, O_CREAT|O_EXCL|O_WRONLY, FILE_PERMISSION);
+		if(outFD == -1 && errno == EEXIST){
+			size_t len = strlen(local);
+			snprintf(local + len, sizeof(local) - len, "~%u", ent->firstClus);
+			outFD = open(local, O_CREAT|O_EXCL|O_WRONLY, FILE_PERMISSION);
+		}
+		if(outFD == -1){
+			fprintf(stderr, "%s: %s\n", local, strerror(errno));
+			continue;
+		}
+
+		if(ent->numExt > 0 && writeExtents(h, ent->ext, ent->numExt, outFD, ent->fileSize) != 0){
+			fprintf(stderr, "%s: %s\n", local, strerror(errno));
+		}
+		else{
+			numFiles++;
+		}
+		close(outFD);
+	}
+	return numFiles;
+}
+
+uint8_t * undeleteUnclaimed(fat32Head *h, const fat32Undel * u){
+
+	const fat32FreeMap * map = freeMapGet(h);
+	uint32_t numBytes = u->lastClus / FREE_ENTS_PER_BYTE + 1, b;
+	uint8_t * mask = (uint8_t*) malloc(numBytes);
+
+	if(mask == NULL){
+		perror("undeleteUnclaimed malloc error");
+		exit(EXIT_FAILURE);
+	}
+
+	/* the last byte may hold bits past the last cluster, never set in the free map */
+	for(b = 0; b < numBytes; b++) mask[b] = map->bits[b] & ~u->claimed[b];
+	return mask;
+}
+
+const char * undeleteStatusName(uint8_t status){
+
+	return status <= UNDEL_OVERWRITTEN ? statusNames[status] : "unknown";
+}
+
+void undeleteFree(fat32Undel * u){
+
+	uint32_t i;
+
+	if(u == NULL) return;
+
+	for(i = 0; i < u->numEnts; i++){
+		free(u->ents[i].path);
+		free(u->ents[i].ext);
+	}
+	free(u->ents);
+	free(u->claimed);
+	free(u);
+}
@@ -0,0 +1,96 @@
+/**********************************************************************
+  Module: undelete.h
+  Author: Junseok Lee
+
+  Purpose: Finds deleted files and directories and recovers what is
+  left of them. Every directory cluster of the volume is read, in
+  large sequential reads split over several threads by cluster
+  range, and the entries marked deleted are collected along with the
+  long names left in their slots. The FAT no longer knows the chain
+  of a deleted file, so its clusters are guessed from the free map:
+  the clusters from the first one on, skipping a bounded number of
+  allocated clusters that other files took in between. A file whose
+  first cluster is in use again is reported as overwritten.
+
+**********************************************************************/
+#ifndef UNDELETE_H
+#define UNDELETE_H
+
+#include "fat32.h"
+#include "extent.h"
+
+/* undelete constants */
+#define UNDEL_READ_MAX (4 << 20) //longest read of directory clusters
+#define UNDEL_READ_GAP (64 << 10) //clusters this close are read together
+#define UNDEL_MAX_SKIP 256 //allocated clusters skipped looking for the rest of a file
+#define UNDEL_DIR_MAX_CLUS 64 //clusters followed in a deleted directory
+#define UNDEL_ENTS_INIT 256
+#define UNDEL_SIG_MAX 8 //longest signature checked
+#define UNDEL_CARVE_DIR "carved" //subfolder for files carved from the unclaimed free clusters
+
+/* recovery status of a deleted entry */
+#define UNDEL_EMPTY 0 //no data, nothing to recover
+#define UNDEL_CONTIG 1 //clusters all free and in a row
+#define UNDEL_FRAG 2 //clusters free, with allocated clusters skipped
+#define UNDEL_OVERWRITTEN 3 //clusters taken by other files
+
+/* signature check of the first bytes */
+#define UNDEL_SIG_NONE 0 //no known signature for the extension
+#define UNDEL_SIG_MATCH 1
+#define UNDEL_SIG_MISMATCH 2
+
+/* Deleted entry struct,
+   one deleted file or directory and the clusters guessed for it */
+struct undelEnt_struct {
+	char * path; //path made of the recovered names, starting with '/'
+	uint32_t firstClus;
+	uint32_t fileSize;
+	uint32_t dirClus; //directory cluster holding the entry
+	uint8_t attr;
+	uint8_t status; //UNDEL_EMPTY ...
+	uint8_t sig; //UNDEL_SIG_NONE ...
+	fat32Extent * ext; //clusters to recover, NULL unless the status is contiguous or fragmented
+	uint32_t numExt;
+};
+typedef struct undelEnt_struct undelEnt;
+
+/* Undelete result struct,
+   every deleted entry found by undeleteScan */
+struct fat32Undel_struct {
+	undelEnt * ents;
+	uint32_t numEnts;
+	uint32_t cap;
+	uint32_t counts[UNDEL_OVERWRITTEN + 1]; //entries of each status
+	uint8_t * claimed; //bit c set if cluster c was given to a deleted entry
+	uint32_t lastClus; //last data cluster of the volume
+	uint32_t numDirClus; //directory clusters read
+	uint64_t bytesRead;
+	int numThreads;
+	double secs; //time the scan took
+};
+typedef struct fat32Undel_struct fat32Undel;
+
+/* Reads every directory cluster of the volume on numThreads threads
+   and returns the malloc'd list of deleted entries, with the
+   clusters of each guessed from a fresh scan of the FAT. Deleted
+   directories whose clusters are still free are searched as well.
+   Free with undeleteFree. */
+fat32Undel * undeleteScan(fat32Head *h, int numThreads);
+
+/* Copies every recoverable entry of u below the local directory
+   dest, recreating the paths. A name that exists already gets the
+   first cluster appended. Returns the number of files written, or
+   -1 if dest could not be created. */
+int undeleteExtract(fat32Head *h, const fat32Undel * u, const char * dest);
+
+/* Returns a malloc'd bitmap, one bit per cluster, of the free
+   clusters that no entry of u was given, for carving what is left */
+uint8_t * undeleteUnclaimed(fat32Head *h, const fat32Undel * u);
+
+/* Returns the name of a recovery status, for reports */
+const char * undeleteStatusName(uint8_t status);
+
+/* Deallocates the result of undeleteScan */
+void undeleteFree(fat32Undel * u);
+
+#endif
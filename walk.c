@@ -0,0 +1,518 @@
+/**********************************************************************
+  Module: walk.c
+  Author: Junseok Lee
+
+ Parallel directory tree walker built on per-thread work-stealing
+ deques, producing a catalog of every entry in the tree.
+
+**********************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include "walk.h"
+#include "shell.h"
+#include "dirindex.h"
+#include "extract.h"
+
+/* Deque struct,
+   Chase-Lev work-stealing deque of directory tasks. The owning
+   thread pushes and takes at the bottom, other threads steal from
+   the top. A task packs the directory cluster in the high 32 bits
+   and the catalog index of the directory in the low 32 bits. */
+struct walkDeque_struct {
+	int64_t top;
+	int64_t bottom;
+	uint64_t tasks[WALK_DEQUE_SZ];
+};
+typedef struct walkDeque_struct walkDeque;
+
+/* Walk struct,
+   state shared by all walker threads */
+struct walkCtx_struct {
+	fat32Head * head;
+	fat32Catalog * cat;
+	walkDeque ** deques; //one deque per thread
+	int numThreads;
+	uint8_t * visited; //bitmap of directory clusters already queued
+	int64_t pending; //tasks queued or being walked
+	pthread_mutex_t lock; //guards appending to the catalog
+};
+typedef struct walkCtx_struct walkCtx;
+
+/* Walker struct,
+   state private to one walker thread */
+struct walkWorker_struct {
+	walkCtx * ctx;
+	int id;
+	unsigned int seed; //picks steal victims
+	catalogArena * arenas; //names allocated by this thread
+	catalogEnt * ents; //entries of the directory being walked
+	uint32_t capEnts;
+};
+typedef struct walkWorker_struct walkWorker;
+
+/* Pushes a task at the bottom of the owner's deque.
+   Returns 0 if the deque is full. */
+static int dequePush(walkDeque * d, uint64_t task){
+
+	int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+	int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+
+	if(b - t >= WALK_DEQUE_SZ) return 0;
+
+	__atomic_store_n(&d->tasks[b % WALK_DEQUE_SZ], task, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+/* Takes the most recently pushed task from the owner's deque.
+   Returns 0 if the deque is empty. */
+static int dequeTake(walkDeque * d, uint64_t * task){
+
+	int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+	__atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int64_t t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+	int found = 1;
+
+	if(t <= b){
+		*task = __atomic_load_n(&d->tasks[b % WALK_DEQUE_SZ], __ATOMIC_RELAXED);
+
+		/* last task, race the thieves for it */
+		if(t == b){
+			if(!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)){
+				found = 0;
+			}
+			__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+		}
+	}
+	else{
+		found = 0;
+		__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+	}
+	return found;
+}
+
+/* Steals the oldest task from another thread's deque.
+   Returns 0 if the deque is empty or the steal lost a race. */
+static int dequeSteal(walkDeque * d, uint64_t * task){
+
+	int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+
+	if(t >= b) return 0;
+
+	*task = __atomic_load_n(&d->tasks[t % WALK_DEQUE_SZ], __ATOMIC_RELAXED);
+	return __atomic_compare_exchange_n(&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+/* Marks directory cluster clusNum as visited.
+   Returns 1 if it had not been visited before. */
+static int markVisited(walkCtx * ctx, uint32_t clusNum){
+
+	uint8_t bit = 1 << (clusNum % BYTE_IN_BITS);
+	uint8_t old = __atomic_fetch_or(&ctx->visited[clusNum / BYTE_IN_BITS], bit, __ATOMIC_RELAXED);
+
+	return (old & bit) == 0;
+}
+
+/* Copies name into the thread's name arena */
+static const char * arenaName(walkWorker * w, const char * name){
+
+	size_t len = strlen(name) + 1;
+
+	if(w->arenas == NULL || w->arenas->used + len > WALK_ARENA_SZ){
+		catalogArena * arena = (catalogArena*) malloc(sizeof(catalogArena));
+		if(arena == NULL || (arena->buf = (char*) malloc(WALK_ARENA_SZ)) == NULL){
+			perror("arenaName malloc error");
+			exit(EXIT_FAILURE);
+		}
+		arena->used = 0;
+		arena->next = w->arenas;
+		w->arenas = arena;
+	}
+
+	char * dest = w->arenas->buf + w->arenas->used;
+	memcpy(dest, name, len);
+	w->arenas->used += len;
+	return dest;
+}
+
+/* Appends numEnts entries to the catalog and returns the
+   index of the first one */
+static uint32_t catalogAppend(walkCtx * ctx, catalogEnt * ents, uint32_t numEnts){
+
+	fat32Catalog * cat = ctx->cat;
+	uint32_t i;
+
+	pthread_mutex_lock(&ctx->lock);
+
+	uint32_t first = cat->numEnts;
+	if((uint64_t) first + numEnts > (uint64_t) WALK_CHUNK_ENTS * WALK_MAX_CHUNKS){
+		printf("walkTree: catalog is full\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for(i = 0; i < numEnts; i++){
+		uint32_t idx = first + i;
+		catalogEnt ** chunk = &cat->chunks[idx / WALK_CHUNK_ENTS];
+
+		if(*chunk == NULL){
+			*chunk = (catalogEnt*) malloc(WALK_CHUNK_ENTS * sizeof(catalogEnt));
+			if(*chunk == NULL){
+				perror("catalogAppend malloc error");
+				exit(EXIT_FAILURE);
+			}
+		}
+		(*chunk)[idx % WALK_CHUNK_ENTS] = ents[i];
+
+		if(ents[i].attr & ATTR_DIRECTORY) cat->numDirs++;
+		else cat->numBytes += ents[i].fileSize;
+	}
+	cat->numEnts += numEnts;
+
+	pthread_mutex_unlock(&ctx->lock);
+	return first;
+}
+
+/* Queues the directory at dirClus, whose catalog index is dirIdx, on
+   the worker's deque. A full deque walks the directory right away. */
+static void walkDirectory(walkWorker * w, uint32_t dirClus, uint32_t dirIdx);
+
+static void queueDirectory(walkWorker * w, uint32_t dirClus, uint32_t dirIdx){
+
+	walkCtx * ctx = w->ctx;
+
+	__atomic_add_fetch(&ctx->pending, 1, __ATOMIC_SEQ_CST);
+
+	if(!dequePush(ctx->deques[w->id], ((uint64_t) dirClus << INT_32) | dirIdx)){
+		walkDirectory(w, dirClus, dirIdx);
+		__atomic_sub_fetch(&ctx->pending, 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+/* Parses every cluster of one directory, adds its entries to the
+   catalog and queues its subdirectories */
+static void walkDirectory(walkWorker * w, uint32_t dirClus, uint32_t dirIdx){
+
+	walkCtx * ctx = w->ctx;
+	fat32DirIter it;
+	const fat32Dir * dir;
+	char name[FMT_NAME_LENGTH];
+	uint32_t numEnts = 0, i;
+
+	dirIterInit(ctx->head, &it, dirClus);
+
+	while((dir = dirIterNext(&it)) != NULL){
+
+		/* skip deleted, long name and volume label entries */
+		if((unsigned char) dir->DIR_Name[0] == FREE_DIR || dir->DIR_Attr == INV_DIR ||
+				(dir->DIR_Attr & ATTR_VOLUME_ID)){
+			continue;
+		}
+
+		entryName(dir, name);
+
+		if(name[0] == NULL_TERM || strcmp(name, DOT) == 0 || strcmp(name, DOTDOT) == 0){
+			continue;
+		}
+
+		if(numEnts == w->capEnts){
+			w->capEnts = w->capEnts ? w->capEnts * 2 : WALK_DIR_ENTS_INIT;
+			w->ents = (catalogEnt*) realloc(w->ents, w->capEnts * sizeof(catalogEnt));
+			if(w->ents == NULL){
+				perror("walkDirectory realloc error");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		catalogEnt * ent = &w->ents[numEnts++];
+		ent->shortName = arenaName(w, name);
+		ent->name = (it.longName[0] != NULL_TERM) ? arenaName(w, it.longName) : ent->shortName;
+		ent->parent = dirIdx;
+		ent->firstClus = ((uint32_t) dir->DIR_FstClusHI << HEX_TEN) | dir->DIR_FstClusLO;
+		ent->fileSize = dir->DIR_FileSize;
+		ent->hashNext = CATALOG_NO_ENT;
+		ent->shortNext = CATALOG_NO_ENT;
+		ent->attr = dir->DIR_Attr;
+	}
+
+	dirIterFree(&it);
+
+	if(numEnts == 0) return;
+
+	uint32_t first = catalogAppend(ctx, w->ents, numEnts);
+
+	/* w->ents is reused when a full deque walks a subdirectory inline,
+	   so the entries are read back from the catalog */
+	for(i = 0; i < numEnts; i++){
+		catalogEnt * ent = catalogGet(ctx->cat, first + i);
+
+		if((ent->attr & ATTR_DIRECTORY) && ent->firstClus >= ROOT_DIR_CLUS_NUM &&
+				ent->firstClus <= ctx->head->lastClus && markVisited(ctx, ent->firstClus)){
+			queueDirectory(w, ent->firstClus, first + i);
+		}
+	}
+}
+
+/* Walker thread, walks its own tasks and steals when it runs out */
+static void * walkWorkerRun(void * arg){
+
+	walkWorker * w = (walkWorker*) arg;
+	walkCtx * ctx = w->ctx;
+	uint64_t task;
+
+	for(;;){
+		int found = dequeTake(ctx->deques[w->id], &task);
+
+		/* steal from a random victim, then try every other thread once */
+		if(!found && ctx->numThreads > 1){
+			int victim = rand_r(&w->seed) % ctx->numThreads;
+			int i;
+			for(i = 0; i < ctx->numThreads && !found; i++){
+				int v = (victim + i) % ctx->numThreads;
+				if(v != w->id) found = dequeSteal(ctx->deques[v], &task);
+			}
+		}
+
+		if(found){
+			walkDirectory(w, (uint32_t) (task >> INT_32), (uint32_t) task);
+			__atomic_sub_fetch(&ctx->pending, 1, __ATOMIC_SEQ_CST);
+		}
+		else if(__atomic_load_n(&ctx->pending, __ATOMIC_SEQ_CST) == 0){
+			break;
+		}
+		else{
+			sched_yield();
+		}
+	}
+
+	return NULL;
+}
+
+/* Builds the (parent, name) lookup table over the whole catalog */
+static void buildLookup(fat32Catalog * cat){
+
+	uint32_t i;
+
+	cat->numBuckets = 1;
+	while(cat->numBuckets < cat->numEnts * 2) cat->numBuckets *= 2;
+
+	cat->buckets = (uint32_t*) malloc(cat->numBuckets * sizeof(uint32_t));
+	cat->shortBuckets = (uint32_t*) malloc(cat->numBuckets * sizeof(uint32_t));
+	if(cat->buckets == NULL || cat->shortBuckets == NULL){
+		perror("buildLookup malloc error");
+		exit(EXIT_FAILURE);
+	}
+	memset(cat->buckets, 0xFF, cat->numBuckets * sizeof(uint32_t));
+	memset(cat->shortBuckets, 0xFF, cat->numBuckets * sizeof(uint32_t));
+
+	/* the root entry has no name and is never looked up. Chains are
+	   built back to front, so the first entry with a name is found first. */
+	for(i = cat->numEnts - 1; i > CATALOG_ROOT; i--){
+		catalogEnt * ent = catalogGet(cat, i);
+		uint32_t bucket = nameHash(ent->parent, ent->name) & (cat->numBuckets - 1);
+		ent->hashNext = cat->buckets[bucket];
+		cat->buckets[bucket] = i;
+
+		if(ent->shortName != ent->name){
+			bucket = nameHash(ent->parent, ent->shortName) & (cat->numBuckets - 1);
+			ent->shortNext = cat->shortBuckets[bucket];
+			cat->shortBuckets[bucket] = i;
+		}
+	}
+}
+
+fat32Catalog * walkTree(fat32Head *h, uint32_t rootClus, int numThreads){
+
+	walkCtx ctx;
+	walkWorker workers[RGET_MAX_THREADS];
+	pthread_t threads[RGET_MAX_THREADS];
+	struct timespec start, end;
+	int i;
+
+	if(numThreads < 1) numThreads = 1;
+	if(numThreads > RGET_MAX_THREADS) numThreads = RGET_MAX_THREADS;
+
+	fat32Catalog * cat = (fat32Catalog*) calloc(1, sizeof(fat32Catalog));
+	if(cat == NULL || (cat->chunks = (catalogEnt**) calloc(WALK_MAX_CHUNKS, sizeof(catalogEnt*))) == NULL){
+		perror("walkTree malloc error");
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.head = h;
+	ctx.cat = cat;
+	ctx.numThreads = numThreads;
+	ctx.visited = (uint8_t*) calloc(h->fatNumEnts / BYTE_IN_BITS + 1, 1);
+	ctx.deques = (walkDeque**) calloc(numThreads, sizeof(walkDeque*));
+	if(ctx.visited == NULL || ctx.deques == NULL){
+		perror("walkTree malloc error");
+		exit(EXIT_FAILURE);
+	}
+	pthread_mutex_init(&ctx.lock, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for(i = 0; i < numThreads; i++){
+		ctx.deques[i] = (walkDeque*) calloc(1, sizeof(walkDeque));
+		if(ctx.deques[i] == NULL){
+			perror("walkTree malloc error");
+			exit(EXIT_FAILURE);
+		}
+		memset(&workers[i], 0, sizeof(walkWorker));
+		workers[i].ctx = &ctx;
+		workers[i].id = i;
+		workers[i].seed = i + 1;
+	}
+
+	/* the walked directory is catalog entry CATALOG_ROOT */
+	catalogEnt root;
+	memset(&root, 0, sizeof(root));
+	root.name = "";
+	root.shortName = root.name;
+	root.parent = CATALOG_ROOT;
+	root.firstClus = rootClus;
+	root.hashNext = CATALOG_NO_ENT;
+	root.shortNext = CATALOG_NO_ENT;
+	root.attr = ATTR_DIRECTORY;
+	catalogAppend(&ctx, &root, 1);
+	cat->numDirs = 0; //the walked directory itself is not counted
+
+	if(rootClus < h->fatNumEnts) markVisited(&ctx, rootClus);
+	queueDirectory(&workers[0], rootClus, CATALOG_ROOT);
+
+	for(i = 0; i < numThreads; i++){
+		if(pthread_create(&threads[i], NULL, walkWorkerRun, &workers[i]) != 0){
+			perror("walkTree thread error");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for(i = 0; i < numThreads; i++){
+		pthread_join(threads[i], NULL);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	cat->secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / NSEC_PER_SEC;
+
+	/* hand the name arenas over to the catalog */
+	for(i = 0; i < numThreads; i++){
+		catalogArena * arena = workers[i].arenas;
+		while(arena != NULL){
+			catalogArena * next = arena->next;
+			arena->next = cat->arenas;
+			cat->arenas = arena;
+			arena = next;
+		}
+		free(workers[i].ents);
+		free(ctx.deques[i]);
+	}
+
+	buildLookup(cat);
+
+	pthread_mutex_destroy(&ctx.lock);
+	free(ctx.deques);
+	free(ctx.visited);
+	return cat;
+}
+
+catalogEnt * catalogGet(fat32Catalog * cat, uint32_t i){
+
+	return &cat->chunks[i / WALK_CHUNK_ENTS][i % WALK_CHUNK_ENTS];
+}
+
+int catalogPath(fat32Catalog * cat, uint32_t i, char * buf, size_t len){
+
+	size_t pos = len;
+
+	if(len < 2) return -1;
+	buf[--pos] = NULL_TERM;
+
+	/* build the path backwards from the entry up to the root */
+	while(i != CATALOG_ROOT){
+		catalogEnt * ent = catalogGet(cat, i);
+		size_t nameLen = strlen(ent->name);
+
+		if(nameLen + 1 > pos) return -1;
+		pos -= nameLen;
+		memcpy(buf + pos, ent->name, nameLen);
+		buf[--pos] = '/';
+		i = ent->parent;
+	}
+
+	if(pos == len - 1) buf[--pos] = '/';
+
+	memmove(buf, buf + pos, len - pos);
+	return 0;
+}
+
+uint32_t catalogLookup(fat32Catalog * cat, const char * path){
+
+	char comp[LFN_NAME_SZ];
+	uint32_t cur = CATALOG_ROOT;
+
+	while(*path){
+
+		/* next path component */
+		while(*path == '/') path++;
+		if(*path == NULL_TERM) break;
+
+		size_t n = strcspn(path, "/");
+		if(n >= sizeof(comp)) return CATALOG_NO_ENT;
+		memcpy(comp, path, n);
+		comp[n] = NULL_TERM;
+		path += n;
+
+		uint32_t bucket = nameHash(cur, comp) & (cat->numBuckets - 1);
+		uint32_t i = cat->buckets[bucket];
+
+		while(i != CATALOG_NO_ENT){
+			catalogEnt * ent = catalogGet(cat, i);
+			if(ent->parent == cur && strcasecmp(ent->name, comp) == 0) break;
+			i = ent->hashNext;
+		}
+
+		/* not a long name, try the short names */
+		if(i == CATALOG_NO_ENT){
+			i = cat->shortBuckets[bucket];
+
+			while(i != CATALOG_NO_ENT){
+				catalogEnt * ent = catalogGet(cat, i);
+				if(ent->parent == cur && strcasecmp(ent->shortName, comp) == 0) break;
+				i = ent->shortNext;
+			}
+		}
+
+		if(i == CATALOG_NO_ENT) return CATALOG_NO_ENT;
+		cur = i;
+	}
+
+	return cur;
+}
+
+void catalogFree(fat32Catalog * cat){
+
+	uint32_t i;
+
+	if(cat == NULL) return;
+
+	for(i = 0; i < WALK_MAX_CHUNKS && cat->chunks[i] != NULL; i++){
+		free(cat->chunks[i]);
+	}
+	while(cat->arenas != NULL){
+		catalogArena * next = cat->arenas->next;
+		free(cat->arenas->buf);
+		free(cat->arenas);
+		cat->arenas = next;
+	}
+	free(cat->chunks);
+	free(cat->buckets);
+	free(cat->shortBuckets);
+	free(cat);
+}
@@ -0,0 +1,86 @@
+/**********************************************************************
+  Module: walk.h
+  Author: Junseok Lee
+
+  Purpose: Parallel directory tree walker. Every directory found
+  becomes a task on a work-stealing deque, worker threads parse
+  directory clusters concurrently and the entries are collected in
+  a catalog that maps paths to directory entries.
+
+**********************************************************************/
+#ifndef WALK_H
+#define WALK_H
+
+#include "fat32.h"
+
+/* walker constants */
+#define WALK_DEQUE_SZ (1 << 16)
+#define WALK_CHUNK_ENTS (1 << 16)
+#define WALK_MAX_CHUNKS (1 << 16)
+#define WALK_ARENA_SZ (1 << 20)
+#define WALK_DIR_ENTS_INIT 1024
+#define CATALOG_ROOT 0
+#define CATALOG_NO_ENT 0xFFFFFFFF
+
+/* Catalog entry struct,
+   one file or directory of the walked tree */
+struct catalogEnt_struct {
+	const char * name; //long name, or the formatted short name if there is none
+	const char * shortName; //formatted short name, same as name if there is no long name
+	uint32_t parent; //catalog index of the parent directory
+	uint32_t firstClus; //first cluster of the file or directory
+	uint32_t fileSize; //size of the file in bytes
+	uint32_t hashNext; //next entry in the same lookup bucket, by name
+	uint32_t shortNext; //next entry in the same lookup bucket, by short name
+	uint8_t attr; //attribute byte of the entry
+};
+typedef struct catalogEnt_struct catalogEnt;
+
+/* Name arena struct,
+   a block of names owned by one walker thread */
+struct catalogArena_struct {
+	char * buf;
+	size_t used;
+	struct catalogArena_struct * next;
+};
+typedef struct catalogArena_struct catalogArena;
+
+/* Catalog struct,
+   every entry of a walked tree. Entry CATALOG_ROOT is the directory
+   the walk started from, every other entry names its parent. */
+struct fat32Catalog_struct {
+	catalogEnt ** chunks; //entries, WALK_CHUNK_ENTS per chunk
+	uint32_t numEnts;
+	catalogArena * arenas; //name storage of all walker threads
+	uint32_t * buckets; //lookup by (parent, name), built after the walk
+	uint32_t * shortBuckets; //lookup by (parent, short name)
+	uint32_t numBuckets;
+	uint64_t numBytes; //total size of all files
+	uint32_t numDirs;
+	double secs; //time the walk took
+};
+typedef struct fat32Catalog_struct fat32Catalog;
+
+/* Walks the whole tree below the directory starting at rootClus on
+   numThreads threads and returns the malloc'd catalog of its entries.
+   Every directory cluster chain is parsed once, so directory loops
+   do not make the walk run forever. */
+fat32Catalog * walkTree(fat32Head *h, uint32_t rootClus, int numThreads);
+
+/* Returns catalog entry i */
+catalogEnt * catalogGet(fat32Catalog * cat, uint32_t i);
+
+/* Stores the path of catalog entry i, made of long names, relative to the walked
+   directory and starting with '/', in buf. Returns -1 if the path
+   does not fit in len bytes, 0 otherwise. */
+int catalogPath(fat32Catalog * cat, uint32_t i, char * buf, size_t len);
+
+/* Returns the catalog index of the entry at path, a '/' separated
+   path relative to the walked directory, or CATALOG_NO_ENT. Each
+   component matches either name of an entry, ignoring case. */
+uint32_t catalogLookup(fat32Catalog * cat, const char * path);
+
+/* Deallocates a catalog and all its entries and names */
+void catalogFree(fat32Catalog * cat);
+
+#endif